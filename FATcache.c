@@ -0,0 +1,318 @@
+/* Block cache for reading images
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "FATcache.h"
+#include "FATheaders.h"
+#include "FATpack.h"
+#include "FATcodec.h"
+#include "utils.h"
+
+/* Create a cache of capacity blocks of block_size bytes. Caller must free with fatFreeCache */
+FATcache * fatCreateCache(FILE * disk, uint32_t block_size, uint32_t capacity, uint32_t readahead) {
+    FATcache * cache = xmalloc(sizeof(FATcache));
+    if( capacity < 1 ) capacity = 1;
+    if( readahead > capacity ) readahead = capacity; //never evict what is being read ahead
+
+    cache->disk = disk;
+    cache->volume = NULL;
+    cache->volume_size = 0;
+    cache->pack = NULL;
+    cache->pack_base = 0;
+    cache->image_end = UINT64_MAX;
+    cache->block_size = block_size;
+    cache->capacity = capacity;
+    cache->readahead = readahead;
+    cache->data = xmalloc((size_t) capacity * block_size);
+    cache->blocks = xmalloc(capacity * sizeof(FATcacheblock));
+
+    cache->num_buckets = 1;
+    while( cache->num_buckets < capacity * 2 ) cache->num_buckets *= 2;
+    cache->buckets = xmalloc(cache->num_buckets * sizeof(int32_t));
+    memset(cache->buckets, 0xFF, cache->num_buckets * sizeof(int32_t)); //all -1
+
+    uint32_t i;
+    for( i = 0; i < capacity; i++) { //all blocks start unused, in lru order
+        cache->blocks[i].valid = 0;
+        cache->blocks[i].prev = (int32_t) i - 1;
+        cache->blocks[i].next = i + 1 < capacity ? (int32_t) i + 1 : -1;
+        cache->blocks[i].hash_next = -1;
+    }
+    cache->lru_head = 0;
+    cache->lru_tail = capacity - 1;
+
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->readahead_blocks = 0;
+    cache->reads = 0;
+
+    return cache;
+}
+
+/* Create a sector sized cache, sized by FATCACHE_BLOCKS and FATCACHE_READAHEAD if they are set */
+FATcache * fatCreateDefaultCache(FILE * disk, FATboot * boot) {
+    return fatCreateCache(disk, boot->bytes_per_sector,
+                          envNumber("FATCACHE_BLOCKS", FAT_CACHE_DEFAULT_BLOCKS),
+                          envNumber("FATCACHE_READAHEAD", FAT_CACHE_DEFAULT_READAHEAD));
+}
+
+/* Create a cache like fatCreateDefaultCache that reads the size bytes of a mapped volume
+ * instead of a file, so walkers written against the cache run over a shared mapping
+ * Offsets are relative to volume. Such a cache cannot be written through */
+FATcache * fatCreateMappedCache(const uint8_t * volume, size_t size, FATboot * boot) {
+    FATcache * cache = fatCreateDefaultCache(NULL, boot);
+    cache->volume = volume;
+    cache->volume_size = size;
+    cache->image_end = size;
+    return cache;
+}
+
+/* Have a mapped cache over a container's mapping fill it from pack before copying from it
+ * base is the offset of the volume in the image. A NULL pack leaves the cache as it is */
+void fatCacheSetPack(FATcache * cache, FATpack * pack, uint64_t base) {
+    cache->pack = pack;
+    cache->pack_base = base;
+}
+
+/* Bucket of a block number */
+static uint32_t bucket_of(FATcache * cache, uint32_t block) {
+    return (block * 2654435761u) & (cache->num_buckets - 1);
+}
+
+/* Index of the cached block, -1 if it is not cached */
+static int32_t find_block(FATcache * cache, uint32_t block) {
+    int32_t i = cache->buckets[bucket_of(cache, block)];
+    while( i >= 0 && cache->blocks[i].block != block ) i = cache->blocks[i].hash_next;
+    return i;
+}
+
+/* Unlink a block from the lru list */
+static void lru_remove(FATcache * cache, int32_t i) {
+    FATcacheblock * b = &cache->blocks[i];
+    if( b->prev >= 0 ) cache->blocks[b->prev].next = b->next;
+    else cache->lru_head = b->next;
+    if( b->next >= 0 ) cache->blocks[b->next].prev = b->prev;
+    else cache->lru_tail = b->prev;
+}
+
+/* Put a block at the most recently used end */
+static void lru_touch(FATcache * cache, int32_t i) {
+    if( cache->lru_head == i ) return;
+    lru_remove(cache, i);
+    cache->blocks[i].prev = -1;
+    cache->blocks[i].next = cache->lru_head;
+    if( cache->lru_head >= 0 ) cache->blocks[cache->lru_head].prev = i;
+    cache->lru_head = i;
+    if( cache->lru_tail < 0 ) cache->lru_tail = i;
+}
+
+/* Take the least recently used block for a new block number, dropping what it held */
+static int32_t claim_block(FATcache * cache, uint32_t block) {
+    int32_t i = cache->lru_tail;
+    FATcacheblock * b = &cache->blocks[i];
+
+    if( b->valid ) { //unlink from its hash chain
+        int32_t * link = &cache->buckets[bucket_of(cache, b->block)];
+        while( *link != i ) link = &cache->blocks[*link].hash_next;
+        *link = b->hash_next;
+    }
+
+    b->block = block;
+    b->valid = 1;
+    uint32_t bucket = bucket_of(cache, block);
+    b->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+
+    lru_touch(cache, i);
+    return i;
+}
+
+/* Read count blocks starting at block with one read and cache them. Parts past the end of the image
+ * are cached as zero, read ahead may reach there, but fatCacheRead refuses to hand them out */
+static void load_run(FATcache * cache, uint32_t block, uint32_t count) {
+    uint8_t * buff = xmalloc((size_t) count * cache->block_size);
+    size_t offset = (size_t) block * cache->block_size;
+    size_t got;
+
+    if( cache->volume ) { //straight from the mapping, pages come in as they are touched
+        got = offset < cache->volume_size ? cache->volume_size - offset : 0;
+        if( got > (size_t) count * cache->block_size ) got = (size_t) count * cache->block_size;
+        if( cache->pack ) fatPackFill(cache->pack, cache->pack_base + offset, got);
+        memcpy(buff, cache->volume + offset, got);
+    } else {
+        xfseek(cache->disk, (long) offset, SEEK_SET);
+        got = fread(buff, 1, (size_t) count * cache->block_size, cache->disk);
+        STATS_ADD(seeks, 1);
+        STATS_ADD(reads, 1);
+    }
+    if( got < (size_t) count * cache->block_size ) {
+        memset(buff + got, 0, (size_t) count * cache->block_size - got);
+        if( offset + got < cache->image_end ) cache->image_end = offset + got;
+    }
+    cache->reads++;
+    STATS_ADD(read_bytes, got);
+
+    uint32_t i;
+    for( i = 0; i < count; i++) {
+        int32_t index = claim_block(cache, block + i);
+        memcpy(cache->data + (size_t) index * cache->block_size, buff + (size_t) i * cache->block_size, cache->block_size);
+    }
+    xfree(buff);
+}
+
+/* Pointer to a cached block, reading it and following missing blocks up to last if needed */
+static uint8_t * get_block(FATcache * cache, uint32_t block, uint32_t last) {
+    int32_t i = find_block(cache, block);
+    if( i >= 0 ) {
+        cache->hits++;
+        STATS_ADD(cache_hits, 1);
+        lru_touch(cache, i);
+        return cache->data + (size_t) i * cache->block_size;
+    }
+
+    cache->misses++;
+    STATS_ADD(cache_misses, 1);
+    uint32_t count = 1; //read the whole missing run with one read
+    while( block + count <= last && count < cache->capacity && find_block(cache, block + count) < 0 ) count++;
+    load_run(cache, block, count);
+
+    return cache->data + (size_t) find_block(cache, block) * cache->block_size;
+}
+
+/* Copy size bytes at offset in the image to buff, reading missing blocks
+ * Aborts if the image ends before offset + size */
+void fatCacheRead(FATcache * cache, uint32_t offset, void * buff, uint32_t size) {
+    if( !size ) return;
+    uint32_t last = (offset + size - 1) / cache->block_size;
+    uint8_t * out = buff;
+    uint64_t end = (uint64_t) offset + size;
+    uint32_t start = offset;
+
+    while( size > 0 ) {
+        uint32_t block = offset / cache->block_size;
+        uint32_t in_block = offset % cache->block_size;
+        uint32_t piece = cache->block_size - in_block < size ? cache->block_size - in_block : size;
+
+        memcpy(out, get_block(cache, block, last) + in_block, piece);
+        out += piece;
+        offset += piece;
+        size -= piece;
+    }
+
+    if( end > cache->image_end ) { //known once the blocks were loaded
+        fprintf(stderr, "FATAL: Read of bytes %u to %llu is past the end of the image at %llu, the image is short\n",
+               start, (unsigned long long) end, (unsigned long long) cache->image_end);
+        abort();
+    }
+}
+
+/* Make sure size bytes at offset are cached, missing blocks are read in runs */
+void fatCachePrefetch(FATcache * cache, uint32_t offset, uint32_t size) {
+    if( !size ) return;
+    uint32_t block = offset / cache->block_size;
+    uint32_t last = (offset + size - 1) / cache->block_size;
+    if( last - block >= cache->capacity ) last = block + cache->capacity - 1; //would evict itself
+
+    while( block <= last ) {
+        if( find_block(cache, block) >= 0 ) {
+            block++;
+            continue;
+        }
+        uint32_t count = 1;
+        while( block + count <= last && find_block(cache, block + count) < 0 ) count++;
+        load_run(cache, block, count);
+        cache->readahead_blocks += count;
+        block += count;
+    }
+}
+
+/* Write size bytes at offset through to the image, updating cached blocks */
+void fatCacheWrite(FATcache * cache, uint32_t offset, const void * buff, uint32_t size) {
+    assert(cache->disk);
+    xfseek(cache->disk, offset, SEEK_SET);
+    xfwrite((void *) buff, 1, size, cache->disk);
+
+    if( cache->image_end != UINT64_MAX && (uint64_t) offset + size > cache->image_end ) cache->image_end = (uint64_t) offset + size; //image grew
+
+    const uint8_t * in = buff;
+    while( size > 0 ) {
+        uint32_t block = offset / cache->block_size;
+        uint32_t in_block = offset % cache->block_size;
+        uint32_t piece = cache->block_size - in_block < size ? cache->block_size - in_block : size;
+
+        int32_t i = find_block(cache, block);
+        if( i >= 0 ) memcpy(cache->data + (size_t) i * cache->block_size + in_block, in, piece);
+        in += piece;
+        offset += piece;
+        size -= piece;
+    }
+}
+
+/* Count the free clusters of the first fat, read through the cache */
+uint32_t fatCacheCountFree(FATcache * cache, FATboot * boot) {
+    uint32_t end = fatGetNumClusters(boot) + 2;
+    uint32_t size = FAT_ENTRY_OFFSET(12, end) + 2; //last entry may use the byte after its offset
+    uint8_t * fat = xmalloc(size);
+
+    fatCachePrefetch(cache, fatGetFatStart(boot, 0), size);
+    fatCacheRead(cache, fatGetFatStart(boot, 0), fat, size);
+    uint32_t count = fat12CountFree(fat, 2, end); //ignore reserved 2
+    STATS_ADD(fat_lookups, end - 2);
+
+    xfree(fat);
+    return count;
+}
+
+/* Get the value of a fat entry through the cache */
+uint16_t fatCacheGetFatEntry(FATcache * cache, FATboot * boot, uint16_t index) {
+    uint8_t entry[2];
+    STATS_ADD(fat_lookups, 1);
+    fatCacheRead(cache, fatGetFatStart(boot, 0) + FAT_ENTRY_OFFSET(12, index), entry, 2);
+
+    return fat12DecodeBytes(entry, index);
+}
+
+/* Called when a walk reaches cluster. If it is not cached and the chain continues
+ * contiguously from it, the run is read at once up to the read-ahead window */
+void fatCacheChainAhead(FATcache * cache, FATboot * boot, uint16_t cluster) {
+    uint32_t location = fatGetDataspaceLocation(boot, cluster);
+    if( find_block(cache, location / cache->block_size) >= 0 ) return; //already read ahead
+
+    uint32_t cluster_size = fatGetClusterSize(boot);
+    uint32_t window = cache->readahead * cache->block_size / cluster_size; //in clusters
+    uint32_t last = fatGetNumClusters(boot) + 1;
+    uint32_t run = 1;
+    while( run < window && cluster + run <= last && fatCacheGetFatEntry(cache, boot, cluster + run - 1) == cluster + run ) run++;
+
+    if( run > 1 ) fatCachePrefetch(cache, location, run * cluster_size);
+}
+
+/* Copy one whole cluster into buff, reading ahead on contiguous chains */
+void fatCacheReadCluster(FATcache * cache, FATboot * boot, uint16_t cluster, void * buff) {
+    fatCacheChainAhead(cache, boot, cluster);
+    fatCacheRead(cache, fatGetDataspaceLocation(boot, cluster), buff, fatGetClusterSize(boot));
+}
+
+/* Print hit and miss counters to stream */
+void fatPrintCacheStats(FATcache * cache, FILE * stream) {
+    uint64_t lookups = cache->hits + cache->misses;
+    fprintf(stream, "Cache: %u blocks of %u bytes, read-ahead %u blocks\n",
+            cache->capacity, cache->block_size, cache->readahead);
+    fprintf(stream, "Cache hits: %llu misses: %llu (%.1f%% hit) read-ahead blocks: %llu image reads: %llu\n",
+            (unsigned long long) cache->hits, (unsigned long long) cache->misses,
+            lookups ? 100.0 * cache->hits / lookups : 0.0,
+            (unsigned long long) cache->readahead_blocks, (unsigned long long) cache->reads);
+}
+
+/* Free the cache */
+void fatFreeCache(FATcache * cache) {
+    xfree(cache->data);
+    xfree(cache->blocks);
+    xfree(cache->buckets);
+    xfree(cache);
+}
@@ -0,0 +1,99 @@
+/* Block cache for reading images
+ * A fixed number of block sized buffers kept in least recently used order.
+ * Blocks that are missing are read in runs with one read, and cluster chains
+ * that are laid out contiguously are read ahead by a configurable window.
+ */
+
+#ifndef _FATCACHE_H
+#define _FATCACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "FATheaders.h"
+#include "FATpack.h"
+
+/* Blocks kept when FATCACHE_BLOCKS is not set */
+#define FAT_CACHE_DEFAULT_BLOCKS 256
+
+/* Blocks read ahead on contiguous chains when FATCACHE_READAHEAD is not set */
+#define FAT_CACHE_DEFAULT_READAHEAD 16
+
+/* One cached block, linked into the lru list and a hash chain by index */
+typedef struct FATcacheblock{
+    uint32_t block; //block number in the image
+    int valid;
+    int32_t prev; //lru neighbours, -1 at the ends
+    int32_t next;
+    int32_t hash_next; //next block in the same bucket, -1 at the end
+}FATcacheblock;
+
+/* Cache over one open image, or over one volume of a mapped image */
+typedef struct FATcache{
+    FILE * disk; //NULL when reading a mapping
+    const uint8_t * volume; //mapped volume blocks are copied from, NULL when reading disk
+    size_t volume_size;
+    FATpack * pack; //container filling the mapping, NULL for plain images
+    uint64_t pack_base; //offset of volume in the container's image
+    uint64_t image_end; //bytes the image holds, known once a read comes up short
+    uint32_t block_size;
+    uint32_t capacity; //number of blocks
+    uint32_t readahead; //blocks read ahead on contiguous chains
+    uint8_t * data; //capacity * block_size bytes
+    FATcacheblock * blocks;
+    int32_t * buckets;
+    uint32_t num_buckets; //power of two
+    int32_t lru_head; //most recently used
+    int32_t lru_tail; //next to be evicted
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead_blocks; //blocks loaded before they were asked for
+    uint64_t reads; //reads issued to the image
+}FATcache;
+
+
+/* Create a cache of capacity blocks of block_size bytes. Caller must free with fatFreeCache */
+FATcache * fatCreateCache(FILE * disk, uint32_t block_size, uint32_t capacity, uint32_t readahead);
+
+/* Create a sector sized cache, sized by FATCACHE_BLOCKS and FATCACHE_READAHEAD if they are set */
+FATcache * fatCreateDefaultCache(FILE * disk, FATboot * boot);
+
+/* Create a cache like fatCreateDefaultCache that reads the size bytes of a mapped volume
+ * instead of a file, so walkers written against the cache run over a shared mapping
+ * Offsets are relative to volume. Such a cache cannot be written through */
+FATcache * fatCreateMappedCache(const uint8_t * volume, size_t size, FATboot * boot);
+
+/* Have a mapped cache over a container's mapping fill it from pack before copying from it
+ * base is the offset of the volume in the image. A NULL pack leaves the cache as it is */
+void fatCacheSetPack(FATcache * cache, FATpack * pack, uint64_t base);
+
+/* Copy size bytes at offset in the image to buff, reading missing blocks
+ * Aborts if the image ends before offset + size */
+void fatCacheRead(FATcache * cache, uint32_t offset, void * buff, uint32_t size);
+
+/* Make sure size bytes at offset are cached, missing blocks are read in runs */
+void fatCachePrefetch(FATcache * cache, uint32_t offset, uint32_t size);
+
+/* Write size bytes at offset through to the image, updating cached blocks */
+void fatCacheWrite(FATcache * cache, uint32_t offset, const void * buff, uint32_t size);
+
+/* Count the free clusters of the first fat, read through the cache */
+uint32_t fatCacheCountFree(FATcache * cache, FATboot * boot);
+
+/* Get the value of a fat entry through the cache */
+uint16_t fatCacheGetFatEntry(FATcache * cache, FATboot * boot, uint16_t index);
+
+/* Called when a walk reaches cluster. If it is not cached and the chain continues
+ * contiguously from it, the run is read at once up to the read-ahead window */
+void fatCacheChainAhead(FATcache * cache, FATboot * boot, uint16_t cluster);
+
+/* Copy one whole cluster into buff, reading ahead on contiguous chains */
+void fatCacheReadCluster(FATcache * cache, FATboot * boot, uint16_t cluster, void * buff);
+
+/* Print hit and miss counters to stream */
+void fatPrintCacheStats(FATcache * cache, FILE * stream);
+
+/* Free the cache */
+void fatFreeCache(FATcache * cache);
+
+#endif
@@ -0,0 +1,156 @@
+/* Encoding and decoding of FAT entries
+ * One set of functions per entry width, generated at compile time so the width is a
+ * constant in every loop. FAT12 entries are handled in pairs: two entries share a
+ * 3 byte group and come out of one 24 bit load with shifts and masks, no branches.
+ * Range functions take entry indexes [first, end) into a buffer holding the whole FAT.
+ */
+
+#ifndef _FATCODEC_H
+#define _FATCODEC_H
+
+#include <stdint.h>
+
+/* Byte offset of an entry in a FAT of the given width */
+#define FAT_ENTRY_OFFSET(width, index) ((uint32_t) (index) * (width) / 8)
+
+
+/* Value of the FAT12 entry whose bytes start at entry, only the parity of index is used */
+static inline uint32_t fat12DecodeBytes(const uint8_t * entry, uint32_t index) {
+    uint32_t bits = entry[0] | entry[1] << 8;
+    return (bits >> ((index & 1) << 2)) & 0xFFF; //odd entries sit one nibble up
+}
+
+/* Store value in the FAT12 entry whose bytes start at entry, keeping the neighbour's nibble */
+static inline void fat12EncodeBytes(uint8_t * entry, uint32_t index, uint32_t value) {
+    uint32_t shift = (index & 1) << 2;
+    uint32_t mask = 0xFFF << shift;
+    uint32_t bits = entry[0] | entry[1] << 8;
+    bits = (bits & ~mask) | ((value << shift) & mask);
+    entry[0] = bits;
+    entry[1] = bits >> 8;
+}
+
+/* Both entries of the 3 byte group starting at an even entry */
+static inline void fat12DecodePair(const uint8_t * group, uint32_t * even, uint32_t * odd) {
+    uint32_t bits = group[0] | group[1] << 8 | group[2] << 16;
+    *even = bits & 0xFFF;
+    *odd = bits >> 12;
+}
+
+/* Store both entries of the 3 byte group starting at an even entry */
+static inline void fat12EncodePair(uint8_t * group, uint32_t even, uint32_t odd) {
+    uint32_t bits = (even & 0xFFF) | (odd & 0xFFF) << 12;
+    group[0] = bits;
+    group[1] = bits >> 8;
+    group[2] = bits >> 16;
+}
+
+/* FAT16 and FAT32 entries are whole little endian words, the top 4 bits of FAT32 are reserved and kept */
+#define FAT_CODEC_WORDS(width, mask) \
+static inline uint32_t fat##width##DecodeBytes(const uint8_t * entry, uint32_t index) { \
+    (void) index; \
+    uint32_t bits = 0; \
+    int i; \
+    for( i = 0; i < (width) / 8; i++) bits |= (uint32_t) entry[i] << (i * 8); \
+    return bits & (mask); \
+} \
+\
+static inline void fat##width##EncodeBytes(uint8_t * entry, uint32_t index, uint32_t value) { \
+    (void) index; \
+    uint32_t bits = value & (mask); \
+    if( (width) == 32 ) bits |= (uint32_t) (entry[3] & 0xF0) << 24; /* reserved bits */ \
+    int i; \
+    for( i = 0; i < (width) / 8; i++) entry[i] = bits >> (i * 8); \
+} \
+\
+static inline void fat##width##DecodePair(const uint8_t * group, uint32_t * even, uint32_t * odd) { \
+    *even = fat##width##DecodeBytes(group, 0); \
+    *odd = fat##width##DecodeBytes(group + (width) / 8, 1); \
+} \
+\
+static inline void fat##width##EncodePair(uint8_t * group, uint32_t even, uint32_t odd) { \
+    fat##width##EncodeBytes(group, 0, even); \
+    fat##width##EncodeBytes(group + (width) / 8, 1, odd); \
+}
+
+FAT_CODEC_WORDS(16, 0xFFFF)
+FAT_CODEC_WORDS(32, 0x0FFFFFFF)
+
+
+/* Whole FAT operations for one width, unaligned ends are done one entry at a time and the rest in pairs */
+#define FAT_CODEC_RANGES(width) \
+static inline uint32_t fat##width##Decode(const uint8_t * fat, uint32_t index) { \
+    return fat##width##DecodeBytes(fat + FAT_ENTRY_OFFSET(width, index), index); \
+} \
+\
+static inline void fat##width##Encode(uint8_t * fat, uint32_t index, uint32_t value) { \
+    fat##width##EncodeBytes(fat + FAT_ENTRY_OFFSET(width, index), index, value); \
+} \
+\
+/* Decode entries [first, end) into out */ \
+static inline void fat##width##DecodeRange(const uint8_t * fat, uint32_t first, uint32_t end, uint32_t * out) { \
+    uint32_t i = first; \
+    if( (i & 1) && i < end ) *out++ = fat##width##Decode(fat, i++); \
+    for( ; i + 1 < end; i += 2, out += 2) fat##width##DecodePair(fat + FAT_ENTRY_OFFSET(width, i), out, out + 1); \
+    if( i < end ) *out = fat##width##Decode(fat, i); \
+} \
+\
+/* Encode values into entries [first, end) */ \
+static inline void fat##width##EncodeRange(uint8_t * fat, uint32_t first, uint32_t end, const uint32_t * values) { \
+    uint32_t i = first; \
+    if( (i & 1) && i < end ) fat##width##Encode(fat, i++, *values++); \
+    for( ; i + 1 < end; i += 2, values += 2) fat##width##EncodePair(fat + FAT_ENTRY_OFFSET(width, i), values[0], values[1]); \
+    if( i < end ) fat##width##Encode(fat, i, *values); \
+} \
+\
+/* First free entry in [first, end), end if there is none */ \
+static inline uint32_t fat##width##FindFree(const uint8_t * fat, uint32_t first, uint32_t end) { \
+    uint32_t i = first; \
+    uint32_t even, odd; \
+    if( (i & 1) && i < end ) { \
+        if( !fat##width##Decode(fat, i) ) return i; \
+        i++; \
+    } \
+    for( ; i + 1 < end; i += 2) { \
+        fat##width##DecodePair(fat + FAT_ENTRY_OFFSET(width, i), &even, &odd); \
+        if( !even || !odd ) return even ? i + 1 : i; \
+    } \
+    if( i < end && !fat##width##Decode(fat, i) ) return i; \
+    return end; \
+} \
+\
+/* First used entry in [first, end), end if there is none */ \
+static inline uint32_t fat##width##FindUsed(const uint8_t * fat, uint32_t first, uint32_t end) { \
+    uint32_t i = first; \
+    uint32_t even, odd; \
+    if( (i & 1) && i < end ) { \
+        if( fat##width##Decode(fat, i) ) return i; \
+        i++; \
+    } \
+    for( ; i + 1 < end; i += 2) { \
+        fat##width##DecodePair(fat + FAT_ENTRY_OFFSET(width, i), &even, &odd); \
+        if( even | odd ) return even ? i : i + 1; \
+    } \
+    if( i < end && fat##width##Decode(fat, i) ) return i; \
+    return end; \
+} \
+\
+/* Number of free entries in [first, end) */ \
+static inline uint32_t fat##width##CountFree(const uint8_t * fat, uint32_t first, uint32_t end) { \
+    uint32_t i = first; \
+    uint32_t count = 0; \
+    uint32_t even, odd; \
+    if( (i & 1) && i < end ) count += !fat##width##Decode(fat, i++); \
+    for( ; i + 1 < end; i += 2) { \
+        fat##width##DecodePair(fat + FAT_ENTRY_OFFSET(width, i), &even, &odd); \
+        count += !even + !odd; \
+    } \
+    if( i < end ) count += !fat##width##Decode(fat, i); \
+    return count; \
+}
+
+FAT_CODEC_RANGES(12)
+FAT_CODEC_RANGES(16)
+FAT_CODEC_RANGES(32)
+
+#endif
@@ -0,0 +1,251 @@
+/* In memory directories
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "FATdir.h"
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "utils.h"
+
+/* Read a whole directory into memory, first_cluster 0 is the root directory
+ * Caller must free with fatFreeDirectory */
+FATdirbuff * fatLoadDirectory(FILE * disk, FATboot * boot, FATtable * table, uint16_t first_cluster) {
+    FATdirbuff * dir = xmalloc(sizeof(FATdirbuff));
+    dir->first_cluster = first_cluster;
+
+    if( first_cluster == 0 ) { //root is a fixed region
+        dir->clusters = NULL;
+        dir->num_clusters = 0;
+        dir->num_entries = boot->max_root_entries;
+        dir->data = xmalloc(dir->num_entries * FAT_DIRECTORY_SIZE);
+        xfseek(disk, fatGetRootStart(boot), SEEK_SET);
+        xfread(dir->data, FAT_DIRECTORY_SIZE, dir->num_entries, disk);
+        return dir;
+    }
+
+    dir->num_clusters = fatChainLength(table, first_cluster);
+    dir->clusters = xmalloc(dir->num_clusters * sizeof(uint16_t));
+    dir->num_entries = dir->num_clusters * fatGetClusterSize(boot) / FAT_DIRECTORY_SIZE;
+    dir->data = xmalloc(dir->num_clusters * fatGetClusterSize(boot));
+
+    uint32_t i;
+    uint16_t cluster = first_cluster;
+    for( i = 0; i < dir->num_clusters; i++) {
+        dir->clusters[i] = cluster;
+        cluster = fatTableGet(table, cluster);
+    }
+
+    i = 0;
+    while( i < dir->num_clusters ) { //one read per contiguous run
+        uint16_t run = fatChainRun(table, dir->clusters[i], dir->num_clusters - i);
+        fatReadClusters(disk, boot, dir->clusters[i], run, dir->data + i * fatGetClusterSize(boot));
+        i += run;
+    }
+
+    return dir;
+}
+
+/* Write a whole directory back to disk */
+void fatWriteDirectory(FILE * disk, FATboot * boot, FATdirbuff * dir) {
+    if( dir->first_cluster == 0 ) {
+        xfseek(disk, fatGetRootStart(boot), SEEK_SET);
+        xfwrite(dir->data, FAT_DIRECTORY_SIZE, dir->num_entries, disk);
+        return;
+    }
+
+    uint32_t i = 0;
+    while( i < dir->num_clusters ) {
+        uint32_t run = 1;
+        while( i + run < dir->num_clusters && dir->clusters[i + run] == dir->clusters[i] + run ) run++;
+        fatWriteClusters(disk, boot, dir->clusters[i], run, dir->data + i * fatGetClusterSize(boot));
+        i += run;
+    }
+}
+
+/* Free a loaded directory */
+void fatFreeDirectory(FATdirbuff * dir) {
+    if( dir->clusters ) xfree(dir->clusters);
+    xfree(dir->data);
+    xfree(dir);
+}
+
+/* Get pointer to the raw entry at index */
+uint8_t * fatDirectoryEntry(FATdirbuff * dir, uint32_t index) {
+    return dir->data + index * FAT_DIRECTORY_SIZE;
+}
+
+/* Returns 1 if entry is a regular file or subdirectory that walkers should visit, 0 otherwise */
+int fatIsVisibleEntry(FATdirectory * entry) {
+    return entry->filename[0] != FAT_ENTRY_END
+           && entry->filename[0] != FAT_ENTRY_DELETED
+           && entry->filename[0] != '.'
+           && entry->attributes != FAT_ATTR_LFN
+           && !(entry->attributes & FAT_ATTR_VOLUME);
+}
+
+/* Find a visible entry by name, returns its index or -1 if not found */
+int fatFindEntry(FATdirbuff * dir, FATdircompare * name) {
+    uint32_t i;
+    FATdirectory entry;
+    for( i = 0; i < dir->num_entries; i++) {
+        uint8_t * raw = fatDirectoryEntry(dir, i);
+        if( raw[0] == FAT_ENTRY_END ) break;
+        fatUnpackDirectory(&entry, raw);
+        if( fatIsVisibleEntry(&entry) && fatCompareEntries(&entry, name) == 0 ) return i;
+    }
+    return -1;
+}
+
+/* Find first unused entry at or after start, returns its index or -1 if the directory is full */
+int fatFindFreeEntry(FATdirbuff * dir, uint32_t start) {
+    uint32_t i;
+    for( i = start; i < dir->num_entries; i++) {
+        uint8_t first = fatDirectoryEntry(dir, i)[0];
+        if( first == FAT_ENTRY_END || first == FAT_ENTRY_DELETED ) return i;
+    }
+    return -1;
+}
+
+/* Count unused entries in the directory */
+uint32_t fatCountFreeEntries(FATdirbuff * dir) {
+    uint32_t count = 0;
+    uint32_t i;
+    for( i = 0; i < dir->num_entries; i++) {
+        uint8_t first = fatDirectoryEntry(dir, i)[0];
+        if( first == FAT_ENTRY_END || first == FAT_ENTRY_DELETED ) count++;
+    }
+    return count;
+}
+
+/* Append an allocated chain starting at first to the end of a subdirectory, new entries are zeroed
+ * The chain is linked in the table, the directory must be written back afterwards */
+void fatGrowDirectory(FATdirbuff * dir, FATboot * boot, FATtable * table, uint16_t first) {
+    uint32_t added = fatChainLength(table, first);
+    uint32_t cluster_size = fatGetClusterSize(boot);
+
+    dir->clusters = xrealloc(dir->clusters, (dir->num_clusters + added) * sizeof(uint16_t));
+    dir->data = xrealloc(dir->data, (dir->num_clusters + added) * cluster_size);
+    memset(dir->data + dir->num_clusters * cluster_size, 0, added * cluster_size);
+
+    fatTableSet(table, dir->clusters[dir->num_clusters - 1], first);
+
+    uint32_t i;
+    uint16_t cluster = first;
+    for( i = 0; i < added; i++) {
+        dir->clusters[dir->num_clusters + i] = cluster;
+        cluster = fatTableGet(table, cluster);
+    }
+
+    dir->num_clusters += added;
+    dir->num_entries = dir->num_clusters * cluster_size / FAT_DIRECTORY_SIZE;
+}
+
+/* Grow a subdirectory by at least clusters zeroed clusters, or by FATDIR_GROW if that is more and
+ * the free map holds it beyond reserved clusters. The new clusters come from the free run right
+ * after the chain when it is big enough so the directory stays one run, written in one go
+ * Returns the number of clusters added, 0 if there is no room */
+uint32_t fatExtendDirectory(FATdirbuff * dir, FATboot * boot, FATtable * table, FATfreemap * map, uint32_t clusters, uint32_t reserved) {
+    if( dir->first_cluster == 0 ) return 0; //root directory cannot grow
+
+    uint32_t grow = envNumber("FATDIR_GROW", FAT_DIR_GROW_CLUSTERS);
+    if( grow > clusters && grow + reserved <= map->free_clusters ) clusters = grow;
+
+    uint16_t added = fatAllocAfter(map, table, dir->clusters[dir->num_clusters - 1], clusters);
+    if( !added ) return 0;
+    fatGrowDirectory(dir, boot, table, added);
+    return clusters;
+}
+
+/* Clusters for a new directory holding entries (with . and ..), at least FATDIR_PRESIZE */
+uint32_t fatDirectoryClusters(FATboot * boot, uint32_t entries) {
+    uint32_t cluster_size = fatGetClusterSize(boot);
+    uint32_t clusters = (entries * FAT_DIRECTORY_SIZE + cluster_size - 1) / cluster_size;
+    uint32_t presize = envNumber("FATDIR_PRESIZE", FAT_DIR_PRESIZE_CLUSTERS);
+    return clusters > presize ? clusters : presize;
+}
+
+/* Put an entry in the first unused slot, growing a subdirectory with fatExtendDirectory
+ * if it is full. Returns the slot index or -1 if there is no room */
+int fatInsertEntry(FATdirbuff * dir, FATboot * boot, FATtable * table, FATfreemap * map, FATdirectory * entry) {
+    int index = fatFindFreeEntry(dir, 0);
+
+    if( index < 0 ) {
+        index = dir->num_entries;
+        if( !fatExtendDirectory(dir, boot, table, map, 1, 0) ) return -1;
+    }
+
+    fatPackDirectory(entry, fatDirectoryEntry(dir, index));
+    return index;
+}
+
+/* Mark the entry at index as deleted */
+void fatDeleteEntry(FATdirbuff * dir, uint32_t index) {
+    fatDirectoryEntry(dir, index)[0] = FAT_ENTRY_DELETED;
+}
+
+/* Resolve an absolute path like /SUB/DIR to a directory cluster. "" or "/" is root (0)
+ * Returns 0 on success with cluster set, -1 if a component is missing or not a directory */
+int fatResolveDirectory(FILE * disk, FATboot * boot, FATtable * table, const char * path, uint16_t * cluster) {
+    char component[FILENAME_MAX];
+    uint16_t curr = 0;
+
+    while( *path ) {
+        while( *path == '/' ) path++;
+        if( !*path ) break;
+
+        int length = 0;
+        while( path[length] && path[length] != '/' ) length++;
+        if( length >= FILENAME_MAX ) return -1;
+        memcpy(component, path, length);
+        component[length] = 0;
+        path += length;
+
+        FATdircompare name;
+        if( fatParseName(component, &name) ) return -1;
+
+        FATdirbuff * dir = fatLoadDirectory(disk, boot, table, curr);
+        int index = fatFindEntry(dir, &name);
+        FATdirectory entry;
+        if( index >= 0 ) fatUnpackDirectory(&entry, fatDirectoryEntry(dir, index));
+        fatFreeDirectory(dir);
+
+        if( index < 0 || !(entry.attributes & FAT_ATTR_DIRECTORY) || entry.first_logical_cluster < 2 ) return -1;
+        curr = entry.first_logical_cluster;
+    }
+
+    *cluster = curr;
+    return 0;
+}
+
+/* Fill a new directory entry with name, attributes and current time */
+void fatInitEntry(FATdirectory * entry, FATdircompare * name, uint8_t attributes, time_t when) {
+    memset(entry, 0, sizeof(FATdirectory));
+    memcpy(entry->filename, name->filename, sizeof(entry->filename));
+    memcpy(entry->extention, name->extention, sizeof(entry->extention));
+    entry->attributes = attributes;
+    fatSetEntryTime(entry, when);
+}
+
+/* Build the cluster image of a new empty subdirectory with . and .. entries
+ * buff must hold clusters * cluster size bytes */
+void fatInitDirectoryClusters(FATboot * boot, uint8_t * buff, uint32_t clusters, uint16_t self, uint16_t parent, time_t when) {
+    memset(buff, 0, clusters * fatGetClusterSize(boot)); //zeroed entries mark end of directory
+
+    FATdircompare dot;
+    memset(&dot, 0x20, sizeof(FATdircompare));
+    dot.filename[0] = '.';
+
+    FATdirectory entry;
+    fatInitEntry(&entry, &dot, FAT_ATTR_DIRECTORY, when);
+    entry.first_logical_cluster = self;
+    fatPackDirectory(&entry, buff);
+
+    dot.filename[1] = '.';
+    fatInitEntry(&entry, &dot, FAT_ATTR_DIRECTORY, when);
+    entry.first_logical_cluster = parent; //0 when parent is root
+    fatPackDirectory(&entry, buff + FAT_DIRECTORY_SIZE);
+}
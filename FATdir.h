@@ -0,0 +1,84 @@
+/* In memory directories. A directory is read in whole (root region or
+ * every cluster of its chain) so it can be searched and modified without
+ * seeking per entry, then written back with one write per contiguous run.
+ */
+
+#ifndef _FATDIR_H
+#define _FATDIR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+
+#define FAT_DIR_GROW_CLUSTERS 4 //a full directory grows by this many unless FATDIR_GROW is set
+#define FAT_DIR_PRESIZE_CLUSTERS 1 //a new directory gets at least this many unless FATDIR_PRESIZE is set
+
+/* Raw entries of a directory and where they live on disk */
+typedef struct FATdirbuff{
+    uint16_t first_cluster; //0 for root directory
+    uint16_t * clusters; //chain of the directory, NULL for root
+    uint32_t num_clusters;
+    uint8_t * data; //raw packed entries
+    uint32_t num_entries; //capacity in entries
+}FATdirbuff;
+
+
+/* Read a whole directory into memory, first_cluster 0 is the root directory
+ * Caller must free with fatFreeDirectory */
+FATdirbuff * fatLoadDirectory(FILE * disk, FATboot * boot, FATtable * table, uint16_t first_cluster);
+
+/* Write a whole directory back to disk */
+void fatWriteDirectory(FILE * disk, FATboot * boot, FATdirbuff * dir);
+
+/* Free a loaded directory */
+void fatFreeDirectory(FATdirbuff * dir);
+
+/* Get pointer to the raw entry at index */
+uint8_t * fatDirectoryEntry(FATdirbuff * dir, uint32_t index);
+
+/* Returns 1 if entry is a regular file or subdirectory that walkers should visit, 0 otherwise */
+int fatIsVisibleEntry(FATdirectory * entry);
+
+/* Find a visible entry by name, returns its index or -1 if not found */
+int fatFindEntry(FATdirbuff * dir, FATdircompare * name);
+
+/* Find first unused entry at or after start, returns its index or -1 if the directory is full */
+int fatFindFreeEntry(FATdirbuff * dir, uint32_t start);
+
+/* Count unused entries in the directory */
+uint32_t fatCountFreeEntries(FATdirbuff * dir);
+
+/* Append an allocated chain starting at first to the end of a subdirectory, new entries are zeroed
+ * The chain is linked in the table, the directory must be written back afterwards */
+void fatGrowDirectory(FATdirbuff * dir, FATboot * boot, FATtable * table, uint16_t first);
+
+/* Grow a subdirectory by at least clusters zeroed clusters, or by FATDIR_GROW if that is more and
+ * the free map holds it beyond reserved clusters. The new clusters come from the free run right
+ * after the chain when it is big enough so the directory stays one run, written in one go
+ * Returns the number of clusters added, 0 if there is no room */
+uint32_t fatExtendDirectory(FATdirbuff * dir, FATboot * boot, FATtable * table, FATfreemap * map, uint32_t clusters, uint32_t reserved);
+
+/* Clusters for a new directory holding entries (with . and ..), at least FATDIR_PRESIZE */
+uint32_t fatDirectoryClusters(FATboot * boot, uint32_t entries);
+
+/* Put an entry in the first unused slot, growing a subdirectory with fatExtendDirectory
+ * if it is full. Returns the slot index or -1 if there is no room */
+int fatInsertEntry(FATdirbuff * dir, FATboot * boot, FATtable * table, FATfreemap * map, FATdirectory * entry);
+
+/* Mark the entry at index as deleted */
+void fatDeleteEntry(FATdirbuff * dir, uint32_t index);
+
+/* Resolve an absolute path like /SUB/DIR to a directory cluster. "" or "/" is root (0)
+ * Returns 0 on success with cluster set, -1 if a component is missing or not a directory */
+int fatResolveDirectory(FILE * disk, FATboot * boot, FATtable * table, const char * path, uint16_t * cluster);
+
+/* Fill a new directory entry with name, attributes and current time */
+void fatInitEntry(FATdirectory * entry, FATdircompare * name, uint8_t attributes, time_t when);
+
+/* Build the cluster image of a new empty subdirectory with . and .. entries
+ * buff must hold clusters * cluster size bytes */
+void fatInitDirectoryClusters(FATboot * boot, uint8_t * buff, uint32_t clusters, uint16_t self, uint16_t parent, time_t when);
+
+#endif
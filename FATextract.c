@@ -0,0 +1,232 @@
+/* Bulk extraction of files from an image
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "FATextract.h"
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATio.h"
+#include "utils.h"
+
+/* Start an empty extraction with num_threads writers, 0 for the default. Free with fatFreeExtract */
+FATextract * fatCreateExtract(FATboot * boot, uint32_t num_threads) {
+    FATextract * extract = xmalloc(sizeof(FATextract));
+    memset(extract, 0, sizeof(FATextract));
+    extract->boot = boot;
+    extract->num_threads = num_threads ? num_threads : FAT_EXTRACT_DEFAULT_THREADS;
+    extract->capacity = 16;
+    extract->files = xmalloc(extract->capacity * sizeof(FATextractfile *));
+    extract->queue = xmalloc(FAT_EXTRACT_QUEUE * sizeof(FATextractpiece *));
+    pthread_mutex_init(&extract->lock, NULL);
+    pthread_cond_init(&extract->not_empty, NULL);
+    pthread_cond_init(&extract->not_full, NULL);
+    return extract;
+}
+
+/* Add a file of size bytes held by extents to be written to host_path. Extents are taken
+ * over and freed with the extraction. Returns the file, valid until fatFreeExtract */
+FATextractfile * fatExtractAdd(FATextract * extract, const char * host_path, FATextent * extents, int num_extents, uint32_t size) {
+    FATextractfile * file = xmalloc(sizeof(FATextractfile));
+    file->host_path = xmalloc(strlen(host_path) + 1);
+    strcpy(file->host_path, host_path);
+    file->extents = extents;
+    file->num_extents = num_extents;
+    file->size = size;
+    file->fd = -1;
+    file->failed = 0;
+    file->pending = 0;
+    pthread_mutex_init(&file->lock, NULL);
+
+    uint64_t held = 0;
+    int e;
+    for( e = 0; e < num_extents; e++) held += (uint64_t) extents[e].length * fatGetClusterSize(extract->boot);
+    file->available = held < size ? held : size;
+
+    if( extract->num_files == extract->capacity ) {
+        extract->capacity *= 2;
+        extract->files = xrealloc(extract->files, extract->capacity * sizeof(FATextractfile *));
+    }
+    extract->files[extract->num_files++] = file;
+    return file;
+}
+
+/* Add a file by the chain starting at first_cluster, like fatExtractAdd */
+FATextractfile * fatExtractAddChain(FATextract * extract, FATtable * table, const char * host_path, uint16_t first_cluster, uint32_t size) {
+    uint32_t cluster_size = fatGetClusterSize(extract->boot);
+    int num_extents = 0;
+    FATextent * extents = NULL;
+    if( size && first_cluster > 1 ) extents = fatChainExtents(table, first_cluster, (size + cluster_size - 1) / cluster_size, &num_extents);
+    return fatExtractAdd(extract, host_path, extents, num_extents, size);
+}
+
+/* Hand a piece to the writers, waiting while the queue is full */
+static void push_piece(FATextract * extract, FATextractpiece * piece) {
+    pthread_mutex_lock(&extract->lock);
+    while( extract->count == FAT_EXTRACT_QUEUE ) pthread_cond_wait(&extract->not_full, &extract->lock);
+    extract->queue[(extract->head + extract->count) % FAT_EXTRACT_QUEUE] = piece;
+    extract->count++;
+    pthread_cond_signal(&extract->not_empty);
+    pthread_mutex_unlock(&extract->lock);
+}
+
+/* Take the next piece, NULL once the queue is closed and empty */
+static FATextractpiece * pop_piece(FATextract * extract) {
+    pthread_mutex_lock(&extract->lock);
+    while( !extract->count && !extract->closed ) pthread_cond_wait(&extract->not_empty, &extract->lock);
+    FATextractpiece * piece = NULL;
+    if( extract->count ) {
+        piece = extract->queue[extract->head];
+        extract->head = (extract->head + 1) % FAT_EXTRACT_QUEUE;
+        extract->count--;
+        pthread_cond_signal(&extract->not_full);
+    }
+    pthread_mutex_unlock(&extract->lock);
+    return piece;
+}
+
+/* Writer thread, creates host files on their first piece and closes them after their last */
+static void * writer(void * arg) {
+    FATextract * extract = arg;
+    FATextractpiece * piece;
+    while( (piece = pop_piece(extract)) ) {
+        FATextractfile * file = piece->file;
+
+        pthread_mutex_lock(&file->lock);
+        if( file->fd < 0 && !file->failed ) {
+            file->fd = open(file->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if( file->fd < 0 ) {
+                perror("Failed to open output file for result");
+                printf("Name given %s\n", file->host_path);
+                file->failed = 1;
+            }
+        }
+        pthread_mutex_unlock(&file->lock);
+
+        if( !file->failed && piece->size ) {
+            xpwrite(file->fd, piece->buff, piece->size, piece->offset);
+            __atomic_fetch_add(&extract->bytes, piece->size, __ATOMIC_RELAXED);
+        }
+        if( piece->buff ) xfree(piece->buff);
+        xfree(piece);
+
+        if( __atomic_sub_fetch(&file->pending, 1, __ATOMIC_ACQ_REL) == 0 ) { //last piece of the file
+            if( file->failed ) {
+                __atomic_fetch_add(&extract->failed, 1, __ATOMIC_RELAXED);
+            } else {
+                close(file->fd);
+                __atomic_fetch_add(&extract->written, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Pieces the reader will produce for a file, an empty file still gets one to be created */
+static uint32_t count_pieces(FATextract * extract, FATextractfile * file) {
+    uint32_t cluster_size = fatGetClusterSize(extract->boot);
+    uint32_t left = file->available;
+    uint32_t pieces = 0;
+    int e;
+    for( e = 0; e < file->num_extents && left; e++) {
+        uint32_t bytes = file->extents[e].length * cluster_size;
+        if( bytes > left ) bytes = left;
+        pieces += (bytes + FAT_IO_MAX_REQUEST - 1) / FAT_IO_MAX_REQUEST;
+        left -= bytes;
+    }
+    return pieces ? pieces : 1;
+}
+
+/* Pass a finished read to the writers */
+static void complete_one(FATextract * extract, FATio * io) {
+    FATiocompletion done;
+    fatIoSubmit(io);
+    if( fatIoComplete(io, &done) ) push_piece(extract, done.tag);
+}
+
+/* Read every file added through io and write them out. Returns the number of files written */
+uint32_t fatRunExtract(FATextract * extract, FATio * io) {
+    uint32_t cluster_size = fatGetClusterSize(extract->boot);
+    extract->closed = 0;
+
+    pthread_t * threads = xmalloc(extract->num_threads * sizeof(pthread_t));
+    uint32_t t;
+    for( t = 0; t < extract->num_threads; t++) {
+        if( pthread_create(&threads[t], NULL, writer, extract) ) {
+            perror("FATAL: Creating thread failed: ");
+            abort();
+        }
+    }
+
+    /* Reader stage, queues every run of every file and passes reads on as they finish */
+    uint32_t f;
+    for( f = 0; f < extract->num_files; f++) {
+        FATextractfile * file = extract->files[f];
+        file->pending = count_pieces(extract, file); //set before any piece can complete
+
+        uint32_t done = 0;
+        int e;
+        for( e = 0; e < file->num_extents && done < file->available; e++) {
+            uint32_t extent_bytes = file->extents[e].length * cluster_size;
+            uint32_t offset;
+            for( offset = 0; offset < extent_bytes && done < file->available; offset += FAT_IO_MAX_REQUEST) {
+                uint32_t to_read = extent_bytes - offset < FAT_IO_MAX_REQUEST ? extent_bytes - offset : FAT_IO_MAX_REQUEST;
+                if( to_read > file->available - done ) to_read = file->available - done;
+
+                FATextractpiece * piece = xmalloc(sizeof(FATextractpiece));
+                piece->file = file;
+                piece->buff = xmalloc(to_read);
+                piece->size = to_read;
+                piece->offset = done;
+
+                if( !fatIoSpace(io) ) complete_one(extract, io); //make room by finishing one
+                fatIoQueueRead(io, piece->buff, to_read, fatGetDataspaceLocation(extract->boot, file->extents[e].start) + offset, piece);
+                done += to_read;
+            }
+        }
+
+        if( !done ) { //nothing to read, the writers only create it
+            FATextractpiece * piece = xmalloc(sizeof(FATextractpiece));
+            piece->file = file;
+            piece->buff = NULL;
+            piece->size = 0;
+            piece->offset = 0;
+            push_piece(extract, piece);
+        }
+    }
+    fatIoSubmit(io);
+    while( io->in_flight ) complete_one(extract, io);
+
+    pthread_mutex_lock(&extract->lock);
+    extract->closed = 1;
+    pthread_cond_broadcast(&extract->not_empty);
+    pthread_mutex_unlock(&extract->lock);
+    for( t = 0; t < extract->num_threads; t++) pthread_join(threads[t], NULL);
+    xfree(threads);
+
+    return extract->written;
+}
+
+/* Free an extraction and its files */
+void fatFreeExtract(FATextract * extract) {
+    uint32_t f;
+    for( f = 0; f < extract->num_files; f++) {
+        FATextractfile * file = extract->files[f];
+        pthread_mutex_destroy(&file->lock);
+        xfree(file->host_path);
+        if( file->extents ) xfree(file->extents);
+        xfree(file);
+    }
+    xfree(extract->files);
+    xfree(extract->queue);
+    pthread_mutex_destroy(&extract->lock);
+    pthread_cond_destroy(&extract->not_empty);
+    pthread_cond_destroy(&extract->not_full);
+    xfree(extract);
+}
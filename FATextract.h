@@ -0,0 +1,84 @@
+/* Bulk extraction of files from an image
+ * Files are added with the runs of clusters holding them, then one reader stage queues
+ * reads of every run through a FATio engine while a pool of writer threads creates the
+ * host files and writes each piece with pwrite as soon as it arrives. A bounded queue
+ * joins the two, so at most FAT_EXTRACT_QUEUE pieces plus the reads in flight are held
+ * in memory however many files are extracted.
+ */
+
+#ifndef _FATEXTRACT_H
+#define _FATEXTRACT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATio.h"
+
+/* Writer threads when no count is given */
+#define FAT_EXTRACT_DEFAULT_THREADS 4
+
+/* Pieces waiting for a writer, each at most FAT_IO_MAX_REQUEST bytes */
+#define FAT_EXTRACT_QUEUE 64
+
+/* One file to extract */
+typedef struct FATextractfile{
+    char * host_path;
+    FATextent * extents; //clusters holding the file, in order
+    int num_extents;
+    uint32_t size; //bytes of the file
+    uint32_t available; //bytes the extents hold, less than size if the chain was cut short
+    int fd; //-1 until the first piece arrives
+    int failed; //host file could not be created
+    uint32_t pending; //pieces not yet written
+    pthread_mutex_t lock; //guards opening
+}FATextractfile;
+
+/* Piece of a file read from the image */
+typedef struct FATextractpiece{
+    FATextractfile * file;
+    void * buff;
+    uint32_t size;
+    uint32_t offset; //in the file
+}FATextractpiece;
+
+/* Files to extract and the queue between the stages */
+typedef struct FATextract{
+    FATboot * boot;
+    FATextractfile ** files;
+    uint32_t num_files;
+    uint32_t capacity;
+    uint32_t num_threads;
+
+    FATextractpiece ** queue; //ring of FAT_EXTRACT_QUEUE pieces
+    uint32_t head;
+    uint32_t count;
+    int closed; //no more pieces will be pushed
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    uint32_t written; //files completed
+    uint32_t failed; //files that could not be created
+    uint64_t bytes; //bytes written
+}FATextract;
+
+
+/* Start an empty extraction with num_threads writers, 0 for the default. Free with fatFreeExtract */
+FATextract * fatCreateExtract(FATboot * boot, uint32_t num_threads);
+
+/* Add a file of size bytes held by extents to be written to host_path. Extents are taken
+ * over and freed with the extraction. Returns the file, valid until fatFreeExtract */
+FATextractfile * fatExtractAdd(FATextract * extract, const char * host_path, FATextent * extents, int num_extents, uint32_t size);
+
+/* Add a file by the chain starting at first_cluster, like fatExtractAdd */
+FATextractfile * fatExtractAddChain(FATextract * extract, FATtable * table, const char * host_path, uint16_t first_cluster, uint32_t size);
+
+/* Read every file added through io and write them out. Returns the number of files written */
+uint32_t fatRunExtract(FATextract * extract, FATio * io);
+
+/* Free an extraction and its files */
+void fatFreeExtract(FATextract * extract);
+
+#endif
@@ -4,8 +4,12 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <time.h>
 
 #include "FATheaders.h"
+#include "FATcodec.h"
 #include "utils.h"
 
 /* Reads in 32bit little endian from buff */
@@ -50,8 +54,8 @@ void fatUnpackBoot(FATboot * boot, uint8_t * buff) {
     boot->boot_signature = buff[38];
     for(i=0; i<4; i++) boot->volume_id[i] = buff[39+i];
     for(i=0; i<11; i++) boot->volume_label[i] = buff[43+i];
-    for(i=0; i<8; i++) boot->volume_label[i] = buff[54+i];
-    for(i=0; i<2; i++) boot->ignore3[i] = buff[54+i];
+    for(i=0; i<8; i++) boot->file_system_type[i] = buff[54+i];
+    for(i=0; i<2; i++) boot->ignore3[i] = buff[62+i];
 }
 
 /* Packs the struct for writting to file */
@@ -72,13 +76,14 @@ void fatPackBoot(FATboot * boot, uint8_t * buff) {
     buff[38] = boot->boot_signature;
     for(i=0; i<4; i++) buff[39+i] = boot->volume_id[i];
     for(i=0; i<11; i++) buff[43+i] = boot->volume_label[i];
-    for(i=0; i<8; i++) buff[54+i] = boot->volume_label[i];
-    for(i=0; i<2; i++) buff[54+i] = boot->ignore3[i];
+    for(i=0; i<8; i++) buff[54+i] = boot->file_system_type[i];
+    for(i=0; i<2; i++) buff[62+i] = boot->ignore3[i];
 }
 
 /* Unpacks struct from file input */
 void fatUnpackDirectory(FATdirectory * dir, uint8_t * buff) {
     int i;
+    STATS_ADD(entries_decoded, 1);
     for(i=0; i<8; i++) dir->filename[i] = buff[i];
     for(i=0; i<3; i++) dir->extention[i] = buff[i+8];
     dir->attributes = buff[11];
@@ -115,6 +120,7 @@ void fatPackDirectory(FATdirectory * dir, uint8_t * buff) {
 /* Get information from disk for boot sector. Caller must free boot struct. */
 FATboot * fatGetBootInfo(FILE * disk) {
     uint8_t buff[sizeof(FATboot)];
+    int phase = statsPhase(STATS_PHASE_BOOT);
 
     xfseek(disk,0,SEEK_SET);
     xfread(buff,sizeof(FATboot), 1, disk);
@@ -122,6 +128,7 @@ FATboot * fatGetBootInfo(FILE * disk) {
     FATboot * boot = xmalloc(sizeof(FATboot));
     fatUnpackBoot(boot,buff);
 
+    statsPhase(phase);
     return boot;
 }
 
@@ -142,25 +149,159 @@ int fatCompareEntries(FATdirectory * entry, FATdircompare * expected) {
 
 /* Gets the offset in bytes of the root directory(not in sectors!) */
 uint32_t fatGetRootStart(FATboot * boot) {
-    return boot->bytes_per_sector*FAT_ROOT_OFFSET;
+    return fatGetFatStart(boot, boot->num_fats);
+}
+
+/* Gets the number of sectors used by the root directory */
+uint32_t fatGetRootSectors(FATboot * boot) {
+    return (boot->max_root_entries * FAT_DIRECTORY_SIZE + boot->bytes_per_sector - 1) / boot->bytes_per_sector;
 }
 
 /* Gets the offset in bytes of the dataspace (not in sectors!) */
 uint32_t fatGetDataspaceLocation(FATboot * boot, uint16_t index) {
-    return boot->bytes_per_sector * (index + FAT_DATASPACE_OFFSET - 2);
+    return fatGetRootStart(boot) + fatGetRootSectors(boot) * boot->bytes_per_sector + (index - 2) * fatGetClusterSize(boot);
+}
+
+/* Gets the offset in bytes of a copy of the fat, copies start at 0 */
+uint32_t fatGetFatStart(FATboot * boot, int copy) {
+    return boot->bytes_per_sector * (boot->reserved_sectors + copy * boot->sectors_per_fat);
+}
+
+/* Gets the size of a cluster in bytes */
+uint32_t fatGetClusterSize(FATboot * boot) {
+    return boot->bytes_per_sector * boot->sectors_per_cluster;
+}
+
+/* Gets the number of data clusters, valid cluster indexes are 2 to this + 1 */
+uint32_t fatGetNumClusters(FATboot * boot) {
+    uint32_t data_start = boot->reserved_sectors + boot->num_fats * boot->sectors_per_fat + fatGetRootSectors(boot);
+    return (boot->total_sectors - data_start) / boot->sectors_per_cluster;
+}
+
+/* Read count consecutive clusters starting at index into buff with one read */
+void fatReadClusters(FILE * disk, FATboot * boot, uint16_t index, uint16_t count, void * buff) {
+    xfseek(disk, fatGetDataspaceLocation(boot, index), SEEK_SET);
+    xfread(buff, fatGetClusterSize(boot), count, disk);
+}
+
+/* Write count consecutive clusters starting at index from buff with one write */
+void fatWriteClusters(FILE * disk, FATboot * boot, uint16_t index, uint16_t count, void * buff) {
+    xfseek(disk, fatGetDataspaceLocation(boot, index), SEEK_SET);
+    xfwrite(buff, fatGetClusterSize(boot), count, disk);
+}
+
+/* Create a writer buffering up to capacity clusters. Caller must free with fatFreeWriter */
+FATwriter * fatCreateWriter(FATboot * boot, uint32_t capacity) {
+    FATwriter * writer = xmalloc(sizeof(FATwriter));
+    writer->cluster_size = fatGetClusterSize(boot);
+    writer->capacity = capacity;
+    writer->count = 0;
+    writer->start = 0;
+    writer->buff = xmalloc(capacity * writer->cluster_size);
+    return writer;
+}
+
+/* Get the buffer slot for cluster, flushing first if cluster does not continue the buffered run
+ * Slot must be completely filled by the caller */
+uint8_t * fatWriterSlot(FILE * disk, FATboot * boot, FATwriter * writer, uint16_t cluster) {
+    if( writer->count && (writer->count == writer->capacity || cluster != writer->start + writer->count) ) {
+        fatWriterFlush(disk, boot, writer);
+    }
+    if( !writer->count ) writer->start = cluster;
+    return writer->buff + (writer->count++) * writer->cluster_size;
+}
+
+/* Write out any buffered clusters */
+void fatWriterFlush(FILE * disk, FATboot * boot, FATwriter * writer) {
+    if( !writer->count ) return;
+    fatWriteClusters(disk, boot, writer->start, writer->count, writer->buff);
+    writer->count = 0;
+}
+
+/* Flush and free a writer */
+void fatFreeWriter(FILE * disk, FATboot * boot, FATwriter * writer) {
+    fatWriterFlush(disk, boot, writer);
+    xfree(writer->buff);
+    xfree(writer);
+}
+
+/* Convert a name like "file.txt" into padded upper case 8.3 form
+ * Returns 0 on success, -1 if the name cannot be stored as 8.3 */
+int fatParseName(const char * name, FATdircompare * out) {
+    int i = 0;
+    int j;
+
+    memset(out->filename, 0x20, sizeof(out->filename)); //pad with 0x20
+    memset(out->extention, 0x20, sizeof(out->extention));
+
+    for( j = 0; name[i] && name[i] != '.'; i++, j++) {
+        if( j >= 8 || !isalnum((unsigned char) name[i]) ) return -1;
+        out->filename[j] = toupper((unsigned char) name[i]);
+    }
+    if( j == 0 ) return -1;
+
+    if( name[i] == '.' ) i++;
+    for( j = 0; name[i]; i++, j++) {
+        if( j >= 3 || !isalnum((unsigned char) name[i]) ) return -1;
+        out->extention[j] = toupper((unsigned char) name[i]);
+    }
+
+    return 0;
+}
+
+/* Format the 8.3 name of an entry as "NAME.EXT" without padding, out must hold 13 bytes */
+void fatFormatName(FATdirectory * entry, char * out) {
+    int i;
+    int length = 0;
+
+    for( i = 0; i < 8 && entry->filename[i] != 0x20; i++) out[length++] = entry->filename[i];
+    if( entry->extention[0] != 0x20 ) {
+        out[length++] = '.';
+        for( i = 0; i < 3 && entry->extention[i] != 0x20; i++) out[length++] = entry->extention[i];
+    }
+    out[length] = 0;
+}
+
+/* Set creation and modified date/time of an entry from a linux time */
+void fatSetEntryTime(FATdirectory * dir, time_t when) {
+    struct tm * local = localtime(&when);
+
+    dir->creation_date = (local->tm_year - 80) << 9; //DOS years start at 1980 not 1900
+    dir->creation_date |= (local->tm_mon + 1) << 5; //DOS months from 1-12, not 0 -11
+    dir->creation_date |= local->tm_mday;
+    dir->creation_time = local->tm_hour << 11;
+    dir->creation_time |= local->tm_min << 5;
+    dir->creation_time |= local->tm_sec / 2; //two second resolution
+    dir->modified_date = dir->creation_date;
+    dir->modified_time = dir->creation_time;
+    dir->last_access_date = dir->creation_date;
+}
+
+/* Get the modified date/time of an entry as a linux time */
+time_t fatGetEntryTime(FATdirectory * dir) {
+    struct tm local;
+    memset(&local, 0, sizeof(local));
+
+    local.tm_year = ((dir->modified_date & 0xFE00) >> 9) + 80;
+    local.tm_mon = ((dir->modified_date & 0x01E0) >> 5) - 1;
+    local.tm_mday = dir->modified_date & 0x001F;
+    local.tm_hour = (dir->modified_time & 0xF800) >> 11;
+    local.tm_min = (dir->modified_time & 0x07E0) >> 5;
+    local.tm_sec = (dir->modified_time & 0x001F) * 2;
+    local.tm_isdst = -1;
+
+    if( !local.tm_mday ) return 0; //no date stored
+    return mktime(&local);
 }
 
 /* Get the value of a entyr in the fat table */
 uint16_t fatGetFatEntry(FILE * disk, FATboot * boot, uint16_t index) { //get value of fat entry
     uint8_t entry[2];
-    xfseek(disk, boot->bytes_per_sector + (index  * 12)/8, SEEK_SET);
+    STATS_ADD(fat_lookups, 1);
+    xfseek(disk, fatGetFatStart(boot, 0) + FAT_ENTRY_OFFSET(12, index), SEEK_SET);
     xfread(entry,2,1,disk);
 
-    if( index /2 * 2 == index ) { //even need to read two bytes
-        return entry[0] + ((entry[1] & 0x0F) <<8);
-    } else { //odd part remains
-        return ((entry[0] & 0xF0) >>4) + (entry[1] <<4);
-    }
+    return fat12DecodeBytes(entry, index);
 }
 
 /* Set the value of a fat entry in the fat table */
@@ -168,121 +309,94 @@ void fatPutFatEntry(FILE * disk, FATboot * boot, uint16_t index, uint16_t value)
 
     uint8_t fat[2];
 
-    xfseek(disk, boot->bytes_per_sector + ((index*12)/8), SEEK_SET);
+    xfseek(disk, fatGetFatStart(boot, 0) + FAT_ENTRY_OFFSET(12, index), SEEK_SET);
     xfread(fat,1,2,disk);
 
-    if( index /2 * 2 == index ) {
-        fat[0] = value & 0x00FF;
-        fat[1] = (fat[1] & 0xF0) | ((value & 0x0F00 ) >>8);
-    } else { //odd case
-        fat[0] = (fat[0] & 0x0F) | (value & 0x000F) << 4;
-        fat[1] = (value & 0x0FF0) >>4;
-    }
+    fat12EncodeBytes(fat, index, value); //other nibble is kept
 
-    xfseek(disk, boot->bytes_per_sector + ((index*12)/8), SEEK_SET); //go back to write over
+    xfseek(disk, fatGetFatStart(boot, 0) + FAT_ENTRY_OFFSET(12, index), SEEK_SET); //go back to write over
     xfwrite(fat,1,2,disk);
 }
 
+/* Read the first fat with one read, enough bytes for every cluster entry. Caller must free
+ * end is set to one past the last entry */
+static uint8_t * read_fat(FILE * disk, FATboot * boot, uint32_t * end) {
+    *end = fatGetNumClusters(boot) + 2;
+    uint32_t size = FAT_ENTRY_OFFSET(12, *end) + 2; //last entry may use the byte after its offset
+    uint8_t * fat = xmalloc(size);
+
+    xfseek(disk, fatGetFatStart(boot, 0), SEEK_SET);
+    xfread(fat, 1, size, disk);
+    return fat;
+}
+
 
 /* Get free space of dataspace of disk in bytes */
 uint32_t fatGetFreeSpace(FILE * disk, FATboot * boot) {
 
-    uint8_t fat[2]; //read in fat entries
-
-    xfseek(disk, boot->bytes_per_sector*1 + 3, SEEK_SET); //ignore reserved 2(3bytes)
-    int count = 0;
-
-
-    int i; //need to read odd ammounts per time
-    for(i=2; i < boot->total_sectors - FAT_DATASPACE_OFFSET + 2; i++) {
-        uint16_t fat_value;
-        if( i /2 * 2 == i ) { //even need to read two bytes
-            xfread(fat,1,2,disk);
-            fat_value = fat[0] + ((fat[1] & 0x0F) <<8);
-        } else { //odd part remains
-            fat[0] = fat[1]; //odd swap and  read in one byte
-            xfread(fat+1,1,1,disk);
-            fat_value = ((fat[0] & 0xF0) >>4) + (fat[1] <<4);
-        }
-        if(!fat_value) {
-            count++;
-        }
-    }
+    int phase = statsPhase(STATS_PHASE_FAT);
+    uint32_t end;
+    uint8_t * fat = read_fat(disk, boot, &end);
 
+    uint32_t count = fat12CountFree(fat, 2, end); //ignore reserved 2
+    STATS_ADD(fat_lookups, end - 2);
+
+    xfree(fat);
+    statsPhase(phase);
     return count;
 }
 
 /* Returns the index of a free fat entry or 0 if none */
 uint16_t fatGetFreeFatEntry(FILE * disk, FATboot * boot) {
 
-    uint8_t fat[2]; //read in fat entries
-
-    xfseek(disk, boot->bytes_per_sector*1 + 3, SEEK_SET); //ignore reserved 2(3bytes)
-
-    int i; //need to read odd ammounts per time
-    for(i=2; i < boot->total_sectors - FAT_DATASPACE_OFFSET + 2; i++) {
-        uint16_t fat_value;
-        if( i /2 * 2 == i ) { //even need to read two bytes
-            xfread(fat,1,2,disk);
-            fat_value = fat[0] + ((fat[1] & 0x0F) <<8);
-        } else { //odd part remains
-            fat[0] = fat[1]; //odd swap and  read in one byte
-            xfread(fat+1,1,1,disk);
-            fat_value = ((fat[0] & 0xF0) >>4) + (fat[1] <<4);
-        }
-        if(!fat_value) {
-            return i;
-        }
-    }
-    return 0;
+    int phase = statsPhase(STATS_PHASE_FAT);
+    uint32_t end;
+    uint8_t * fat = read_fat(disk, boot, &end);
+
+    uint32_t free_entry = fat12FindFree(fat, 2, end); //ignore reserved 2
+    STATS_ADD(fat_lookups, (free_entry < end ? free_entry + 1 : end) - 2);
+
+    xfree(fat);
+    statsPhase(phase);
+    return free_entry < end ? free_entry : 0;
 }
 
 
 /* Copy a file into the fat table, does not create directory reference */
 uint16_t fatPutFile(FILE * disk, FATboot * boot, FILE * in_file, uint32_t size) {
 
-    uint8_t fat[2]; //read in fat entries
+    uint32_t cluster_size = fatGetClusterSize(boot);
+    uint8_t * buff = xmalloc(cluster_size); //for copying file
+    int phase = statsPhase(STATS_PHASE_COPY);
 
-    uint8_t * buff = xmalloc(boot->bytes_per_sector); //for copying file
-
-    xfseek(disk, boot->bytes_per_sector*1 + 3, SEEK_SET); //ignore reserved 2
+    uint32_t end;
+    uint8_t * fat = read_fat(disk, boot, &end); //free clusters are found in memory, links are written as they are made
 
     uint32_t file_copied = 0;
     //need to copy whole size
 
-    int i;
+    uint32_t i = 2; //ignore reserved 2
 
     uint16_t prev_chunk = 0;
     uint16_t first_chunk = 0;
 
-    for(i=2; i <= boot->total_sectors - FAT_DATASPACE_OFFSET + 2 && file_copied < size; i++) {
-        uint16_t fat_value;
-        if( i /2 * 2 == i ) { //even need to read two bytes
-            xfread(fat,1,2,disk);
-            fat_value = fat[0] + ((fat[1] & 0x0F) <<8);
-
-
-        } else { //odd part remains
-            fat[0] = fat[1]; //odd swap and  read in one byte
-            xfread(fat+1,1,1,disk);
-            fat_value = ((fat[0] & 0xF0) >>4) + (fat[1] <<4);
-        }
-
-        if(!fat_value) {
-            uint32_t to_read = file_copied + 512 <= size ? 512 : size - file_copied;
-
-            xfseek(disk, fatGetDataspaceLocation(boot,i),SEEK_SET); //go to place
-            file_copied += xfread(buff,1,to_read,in_file);
-            xfwrite(buff,1,to_read,disk);
-            if( prev_chunk != 0) fatPutFatEntry(disk,boot,prev_chunk,i);
-            if( first_chunk == 0) first_chunk = i;
-            prev_chunk = i;
-        }
-
+    while( file_copied < size && (i = fat12FindFree(fat, i, end)) < end ) {
+        uint32_t to_read = file_copied + cluster_size <= size ? cluster_size : size - file_copied;
+
+        xfseek(disk, fatGetDataspaceLocation(boot,i),SEEK_SET); //go to place
+        file_copied += xfread(buff,1,to_read,in_file);
+        STATS_ADD(clusters_followed, 1);
+        xfwrite(buff,1,to_read,disk);
+        if( prev_chunk != 0) fatPutFatEntry(disk,boot,prev_chunk,i);
+        if( first_chunk == 0) first_chunk = i;
+        prev_chunk = i;
+        i++;
     }
     fatPutFatEntry(disk,boot,prev_chunk,0xFF8);
 
+    xfree(fat);
     xfree(buff);
+    statsPhase(phase);
     return first_chunk;
 
 }
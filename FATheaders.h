@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 /* Offset definitions for FAT 12 file system. Cannot easily determine 
  * these from boot but can be different on other fats */
@@ -17,6 +18,16 @@
 #define FAT_DATASPACE_OFFSET 33
 #define FAT_ROOT_OFFSET 19
 
+/* First byte of a directory entry name */
+#define FAT_ENTRY_END 0x00
+#define FAT_ENTRY_DELETED 0xE5
+
+/* Directory entry attribute bits */
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LFN 0x0F
+
 /* Exhaustive but not complete struct of FAT12 boot fields
  * Ignored field are read in, so struct can be written to disk easily */
 typedef struct FATboot{
@@ -65,6 +76,16 @@ typedef struct FATdircompare{
 }FATdircompare;
 
 
+/* Collects data for consecutive clusters so a run is written to disk with one write */
+typedef struct FATwriter{
+    uint8_t * buff;
+    uint16_t start; //first cluster in buffer
+    uint32_t count; //clusters in buffer
+    uint32_t capacity; //max clusters in buffer
+    uint32_t cluster_size;
+}FATwriter;
+
+
 /* NOTE: Due to struct packing, structs in memory may not be formated the same as disk, 
  * therefore it is recommended to use the helper functions for packing unpacking structs. */
 
@@ -90,9 +111,53 @@ int fatCompareEntries(FATdirectory * entry, FATdircompare * expected);
 /* Gets the offset in bytes of the root directory(not in sectors!) */
 uint32_t fatGetRootStart(FATboot * boot);
 
+/* Gets the number of sectors used by the root directory */
+uint32_t fatGetRootSectors(FATboot * boot);
+
 /* Gets the offset in bytes of the dataspace (not in sectors!) */
 uint32_t fatGetDataspaceLocation(FATboot * boot, uint16_t index);
 
+/* Gets the offset in bytes of a copy of the fat, copies start at 0 */
+uint32_t fatGetFatStart(FATboot * boot, int copy);
+
+/* Gets the size of a cluster in bytes */
+uint32_t fatGetClusterSize(FATboot * boot);
+
+/* Gets the number of data clusters, valid cluster indexes are 2 to this + 1 */
+uint32_t fatGetNumClusters(FATboot * boot);
+
+/* Read count consecutive clusters starting at index into buff with one read */
+void fatReadClusters(FILE * disk, FATboot * boot, uint16_t index, uint16_t count, void * buff);
+
+/* Write count consecutive clusters starting at index from buff with one write */
+void fatWriteClusters(FILE * disk, FATboot * boot, uint16_t index, uint16_t count, void * buff);
+
+/* Create a writer buffering up to capacity clusters. Caller must free with fatFreeWriter */
+FATwriter * fatCreateWriter(FATboot * boot, uint32_t capacity);
+
+/* Get the buffer slot for cluster, flushing first if cluster does not continue the buffered run
+ * Slot must be completely filled by the caller */
+uint8_t * fatWriterSlot(FILE * disk, FATboot * boot, FATwriter * writer, uint16_t cluster);
+
+/* Write out any buffered clusters */
+void fatWriterFlush(FILE * disk, FATboot * boot, FATwriter * writer);
+
+/* Flush and free a writer */
+void fatFreeWriter(FILE * disk, FATboot * boot, FATwriter * writer);
+
+/* Convert a name like "file.txt" into padded upper case 8.3 form
+ * Returns 0 on success, -1 if the name cannot be stored as 8.3 */
+int fatParseName(const char * name, FATdircompare * out);
+
+/* Format the 8.3 name of an entry as "NAME.EXT" without padding, out must hold 13 bytes */
+void fatFormatName(FATdirectory * entry, char * out);
+
+/* Set creation and modified date/time of an entry from a linux time */
+void fatSetEntryTime(FATdirectory * dir, time_t when);
+
+/* Get the modified date/time of an entry as a linux time */
+time_t fatGetEntryTime(FATdirectory * dir);
+
 /* Get the value of a entry in the fat table */
 uint16_t fatGetFatEntry(FILE * disk, FATboot * boot, uint16_t index);
 
@@ -0,0 +1,251 @@
+/* Bulk import of host files and directory trees into an image
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "FATimport.h"
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "ADTlinkedlist.h"
+#include "utils.h"
+
+/* Create a node for one host file or directory, not recursing
+ * Returns NULL with a message if the host path cannot be used */
+FATimportnode * fatImportNode(const char * host_path, const char * name) {
+    struct stat stats;
+    if( stat(host_path, &stats) ) {
+        perror("Warning: Failed to get stats on input file");
+        printf("Skipping %s\n", host_path);
+        return NULL;
+    }
+
+    if( !S_ISDIR(stats.st_mode) && !S_ISREG(stats.st_mode) ) {
+        printf("Warning: Skipping %s, not a regular file or directory\n", host_path);
+        return NULL;
+    }
+
+    FATimportnode * node = xmalloc(sizeof(FATimportnode));
+    memset(&node->name, 0x20, sizeof(FATdircompare)); //unnamed nodes are only used as containers
+    if( name && fatParseName(name, &node->name) ) {
+        printf("Warning: Skipping %s, name is not a valid 8.3 name\n", host_path);
+        xfree(node);
+        return NULL;
+    }
+
+    node->host_path = xmalloc(strlen(host_path) + 1);
+    strcpy(node->host_path, host_path);
+    node->is_directory = S_ISDIR(stats.st_mode);
+    node->size = node->is_directory ? 0 : stats.st_size;
+    node->mtime = stats.st_mtim.tv_sec;
+    node->clusters = 0;
+    node->first_cluster = 0;
+    adtInitiateLinkedList(&node->children);
+
+    return node;
+}
+
+/* Create an empty directory node that has no host directory behind it */
+FATimportnode * fatImportDirectory(FATdircompare * name, time_t mtime) {
+    FATimportnode * node = xmalloc(sizeof(FATimportnode));
+    memcpy(&node->name, name, sizeof(FATdircompare));
+    node->host_path = NULL;
+    node->is_directory = 1;
+    node->size = 0;
+    node->mtime = mtime;
+    node->clusters = 0;
+    node->first_cluster = 0;
+    adtInitiateLinkedList(&node->children);
+    return node;
+}
+
+/* Find a child of a directory node by name, returns NULL if not found */
+FATimportnode * fatImportFindChild(FATimportnode * dir, FATdircompare * name) {
+    ADTlinkednode * link;
+    for( link = dir->children.head; link; link = link->next) {
+        FATimportnode * child = link->val;
+        if( !memcmp(&child->name, name, sizeof(FATdircompare)) ) return child;
+    }
+    return NULL;
+}
+
+/* Add child to a directory node, returns -1 if the name is already used in that directory */
+int fatImportAddChild(FATimportnode * dir, FATimportnode * child) {
+    if( fatImportFindChild(dir, &child->name) ) return -1;
+
+    ADTlinkednode * node = xmalloc(sizeof(ADTlinkednode));
+    adtInitiateLinkedNode(node, child);
+    adtAddEndLinkedNode(&dir->children, node);
+    return 0;
+}
+
+/* Scan a host path recursively into import nodes. Names that cannot be
+ * stored as 8.3 or collide inside a directory, and symbolic links below host_path, are skipped with a warning
+ * Returns NULL if the host path cannot be read */
+FATimportnode * fatImportScan(const char * host_path, const char * name) {
+    FATimportnode * node = fatImportNode(host_path, name);
+    if( !node || !node->is_directory ) return node;
+
+    DIR * host_dir = opendir(host_path);
+    if( !host_dir ) {
+        perror("Warning: Failed to open directory");
+        printf("Skipping %s\n", host_path);
+        fatFreeImportNode(node);
+        return NULL;
+    }
+
+    int path_length = strlen(host_path);
+    struct dirent * host_entry;
+    while( (host_entry = readdir(host_dir)) ) {
+        if( !strcmp(host_entry->d_name, ".") || !strcmp(host_entry->d_name, "..") ) continue;
+
+        char * child_path = xmalloc(path_length + 1 + strlen(host_entry->d_name) + 1); //room for / and name
+        strcpy(child_path, host_path);
+        child_path[path_length] = '/';
+        strcpy(child_path + path_length + 1, host_entry->d_name);
+
+        struct stat link_stats;
+        if( !lstat(child_path, &link_stats) && S_ISLNK(link_stats.st_mode) ) { //a link back up would recurse forever
+            printf("Warning: Skipping %s, symbolic links are not followed\n", child_path);
+            xfree(child_path);
+            continue;
+        }
+
+        FATimportnode * child = fatImportScan(child_path, host_entry->d_name);
+        if( child && fatImportAddChild(node, child) ) {
+            printf("Warning: Skipping %s, same 8.3 name already used in directory\n", child_path);
+            fatFreeImportNode(child);
+        }
+        xfree(child_path);
+    }
+    closedir(host_dir);
+
+    return node;
+}
+
+/* Compute clusters needed by node and all below it, directories are sized to hold all
+ * their children plus . and .. so they never need to be expanded */
+uint32_t fatImportCount(FATboot * boot, FATimportnode * node) {
+    uint32_t cluster_size = fatGetClusterSize(boot);
+
+    if( !node->is_directory ) {
+        node->clusters = (node->size + cluster_size - 1) / cluster_size;
+        return node->clusters;
+    }
+
+    node->clusters = fatDirectoryClusters(boot, node->children.num + 2); //. and ..
+
+    uint32_t total = node->clusters;
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) {
+        total += fatImportCount(boot, link->val);
+    }
+    return total;
+}
+
+/* Count node and every file and directory below it */
+uint32_t fatImportEntries(FATimportnode * node) {
+    uint32_t total = 1;
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) {
+        total += fatImportEntries(link->val);
+    }
+    return total;
+}
+
+/* Allocate clusters for node and all below it from the free map, in write order
+ * Returns 0 on success, -1 if space ran out */
+int fatImportAllocate(FATfreemap * map, FATtable * table, FATimportnode * node) {
+    if( node->clusters ) {
+        node->first_cluster = fatAllocChain(map, table, node->clusters);
+        if( !node->first_cluster ) return -1;
+    }
+
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) {
+        if( fatImportAllocate(map, table, link->val) ) return -1;
+    }
+    return 0;
+}
+
+/* Fill the directory entry that references node */
+void fatImportEntry(FATimportnode * node, FATdirectory * entry) {
+    fatInitEntry(entry, &node->name, node->is_directory ? FAT_ATTR_DIRECTORY : FAT_ATTR_ARCHIVE, node->mtime);
+    entry->first_logical_cluster = node->first_cluster;
+    entry->file_size = node->size;
+}
+
+/* Copy a host file into its allocated chain */
+static void write_file(FILE * disk, FATboot * boot, FATtable * table, FATwriter * writer, FATimportnode * node) {
+    FILE * in_file = fopen(node->host_path, "r");
+    if( !in_file ) {
+        perror("Aborting: Opening input file failed");
+        printf("File was %s\n", node->host_path);
+        exit(3); //clusters are already allocated, stop before the fat is written
+    }
+
+    uint32_t cluster_size = fatGetClusterSize(boot);
+    uint32_t remaining = node->size;
+    uint16_t cluster = node->first_cluster;
+
+    while( remaining > 0 ) {
+        uint32_t to_read = remaining < cluster_size ? remaining : cluster_size;
+        uint8_t * slot = fatWriterSlot(disk, boot, writer, cluster);
+        xfread(slot, 1, to_read, in_file);
+        if( to_read < cluster_size ) memset(slot + to_read, 0, cluster_size - to_read);
+        remaining -= to_read;
+        cluster = fatTableGet(table, cluster);
+    }
+
+    fclose(in_file);
+}
+
+/* Write data of node and everything below it through the writer. parent is the
+ * cluster of the directory holding node (0 for root) */
+void fatImportWrite(FILE * disk, FATboot * boot, FATtable * table, FATwriter * writer, FATimportnode * node, uint16_t parent) {
+    if( !node->is_directory ) {
+        write_file(disk, boot, table, writer, node);
+        return;
+    }
+
+    uint32_t cluster_size = fatGetClusterSize(boot);
+    uint8_t * image = xmalloc(node->clusters * cluster_size);
+    fatInitDirectoryClusters(boot, image, node->clusters, node->first_cluster, parent, node->mtime);
+
+    uint32_t index = 2; //after . and ..
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next, index++) {
+        FATdirectory entry;
+        fatImportEntry(link->val, &entry);
+        fatPackDirectory(&entry, image + index * FAT_DIRECTORY_SIZE);
+    }
+
+    uint32_t i;
+    uint16_t cluster = node->first_cluster;
+    for( i = 0; i < node->clusters; i++) {
+        memcpy(fatWriterSlot(disk, boot, writer, cluster), image + i * cluster_size, cluster_size);
+        cluster = fatTableGet(table, cluster);
+    }
+    xfree(image);
+
+    for( link = node->children.head; link; link = link->next) {
+        fatImportWrite(disk, boot, table, writer, link->val, node->first_cluster);
+    }
+}
+
+/* Free node and everything below it */
+void fatFreeImportNode(FATimportnode * node) {
+    while( node->children.num > 0 ) {
+        ADTlinkednode * link = adtPopLinkedNode(&node->children, 0);
+        fatFreeImportNode(link->val);
+        xfree(link);
+    }
+    if( node->host_path ) xfree(node->host_path);
+    xfree(node);
+}
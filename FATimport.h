@@ -0,0 +1,72 @@
+/* Bulk import of host files and directory trees into an image
+ *
+ * Import happens in three passes: the host tree is scanned into import nodes,
+ * every cluster needed (file data and presized directories) is allocated from
+ * one free map, then all clusters are written in allocation order so contiguous
+ * runs go to disk through one writer.
+ */
+
+#ifndef _FATIMPORT_H
+#define _FATIMPORT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "ADTlinkedlist.h"
+
+/* One host file or directory to put into the image */
+typedef struct FATimportnode{
+    char * host_path;
+    FATdircompare name;
+    int is_directory;
+    uint32_t size; //file size in bytes, 0 for directories
+    time_t mtime;
+    ADTlinkedlist children; //FATimportnode values, directories only
+    uint32_t clusters; //clusters needed
+    uint16_t first_cluster; //set by fatImportAllocate
+}FATimportnode;
+
+
+/* Create a node for one host file or directory, not recursing
+ * Returns NULL with a message if the host path cannot be used */
+FATimportnode * fatImportNode(const char * host_path, const char * name);
+
+/* Create an empty directory node that has no host directory behind it */
+FATimportnode * fatImportDirectory(FATdircompare * name, time_t mtime);
+
+/* Find a child of a directory node by name, returns NULL if not found */
+FATimportnode * fatImportFindChild(FATimportnode * dir, FATdircompare * name);
+
+/* Scan a host path recursively into import nodes. Names that cannot be
+ * stored as 8.3 or collide inside a directory, and symbolic links below host_path, are skipped with a warning
+ * Returns NULL if the host path cannot be read */
+FATimportnode * fatImportScan(const char * host_path, const char * name);
+
+/* Add child to a directory node, returns -1 if the name is already used in that directory */
+int fatImportAddChild(FATimportnode * dir, FATimportnode * child);
+
+/* Compute clusters needed by node and all below it, directories are sized to hold all
+ * their children plus . and .. so they never need to be expanded */
+uint32_t fatImportCount(FATboot * boot, FATimportnode * node);
+
+/* Count node and every file and directory below it */
+uint32_t fatImportEntries(FATimportnode * node);
+
+/* Allocate clusters for node and all below it from the free map, in write order
+ * Returns 0 on success, -1 if space ran out */
+int fatImportAllocate(FATfreemap * map, FATtable * table, FATimportnode * node);
+
+/* Write data of node and everything below it through the writer. parent is the
+ * cluster of the directory holding node (0 for root) */
+void fatImportWrite(FILE * disk, FATboot * boot, FATtable * table, FATwriter * writer, FATimportnode * node, uint16_t parent);
+
+/* Fill the directory entry that references node */
+void fatImportEntry(FATimportnode * node, FATdirectory * entry);
+
+/* Free node and everything below it */
+void fatFreeImportNode(FATimportnode * node);
+
+#endif
@@ -0,0 +1,243 @@
+/* Hash index of a loaded directory
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "FATindex.h"
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATlfn.h"
+#include "utils.h"
+
+/* Hash of a folded long name, FNV-1a */
+static uint32_t long_hash(const char * name) {
+    uint32_t hash = 2166136261u;
+    for( ; *name; name++) hash = (hash ^ (uint8_t) *name) * 16777619u;
+    return hash;
+}
+
+/* Copy name into out upper casing ASCII letters, out must hold FAT_LFN_NAME_SIZE bytes
+ * Returns 0, or -1 if the name is too long to be a long name */
+static int fold_name(const char * name, char * out) {
+    size_t length = strlen(name);
+    if( length >= FAT_LFN_NAME_SIZE ) return -1;
+    size_t i;
+    for( i = 0; i <= length; i++) out[i] = toupper((uint8_t) name[i]);
+    return 0;
+}
+
+/* Slot of a folded long name in the table, either holding it or the empty slot where it goes */
+static uint32_t long_slot(FATdirindex * index, const char * folded) {
+    uint32_t mask = index->long_capacity - 1;
+    uint32_t at = long_hash(folded) & mask;
+    while( index->long_names[at] && strcmp(index->names + index->long_names[at], folded) ) at = (at + 1) & mask;
+    return at;
+}
+
+/* Make the long name table hold at least num names at most half full */
+static void long_reserve(FATdirindex * index, uint32_t num) {
+    if( num * 2 <= index->long_capacity ) return;
+
+    uint32_t old_capacity = index->long_capacity;
+    uint32_t * old_names = index->long_names;
+    uint32_t * old_slots = index->long_slots;
+
+    while( index->long_capacity < num * 2 ) index->long_capacity *= 2;
+    index->long_names = xmalloc(index->long_capacity * sizeof(uint32_t));
+    index->long_slots = xmalloc(index->long_capacity * sizeof(uint32_t));
+    memset(index->long_names, 0, index->long_capacity * sizeof(uint32_t));
+
+    uint32_t i;
+    for( i = 0; i < old_capacity; i++) {
+        if( !old_names[i] ) continue;
+        uint32_t at = long_slot(index, index->names + old_names[i]);
+        index->long_names[at] = old_names[i];
+        index->long_slots[at] = old_slots[i];
+    }
+    xfree(old_names);
+    xfree(old_slots);
+}
+
+/* Add a long name for the short entry at slot */
+static void long_add(FATdirindex * index, const char * name, uint32_t slot) {
+    char folded[FAT_LFN_NAME_SIZE];
+    if( fold_name(name, folded) ) return;
+
+    long_reserve(index, index->long_num + 1);
+    uint32_t at = long_slot(index, folded);
+    if( index->long_names[at] ) { //same name again, the first one stays visible
+        if( index->long_slots[at] == FAT_NO_SLOT ) index->long_slots[at] = slot;
+        return;
+    }
+
+    size_t length = strlen(folded) + 1;
+    while( index->names_size + length > index->names_capacity ) {
+        index->names_capacity *= 2;
+        index->names = xrealloc(index->names, index->names_capacity);
+    }
+    memcpy(index->names + index->names_size, folded, length);
+    index->long_names[at] = index->names_size;
+    index->long_slots[at] = slot;
+    index->names_size += length;
+    index->long_num++;
+}
+
+/* Mark slot as unused, joining it to the last run if they touch. Slots must come in order */
+static void free_add(FATdirindex * index, uint32_t slot) {
+    if( index->num_free ) {
+        FATfreerun * last = &index->free[index->num_free - 1];
+        if( last->start + last->length == slot ) {
+            last->length++;
+            return;
+        }
+    }
+    if( index->num_free == index->free_capacity ) {
+        index->free_capacity *= 2;
+        index->free = xrealloc(index->free, index->free_capacity * sizeof(FATfreerun));
+    }
+    index->free[index->num_free].start = slot;
+    index->free[index->num_free].length = 1;
+    index->num_free++;
+}
+
+/* Index every entry of a loaded directory. Free with fatFreeIndex */
+void fatIndexDirectory(FATdirindex * index, FATdirbuff * dir) {
+    index->dir = dir;
+    fatInitNameSet(&index->shorts, dir->num_entries);
+    index->long_capacity = 16;
+    index->long_names = xmalloc(index->long_capacity * sizeof(uint32_t));
+    index->long_slots = xmalloc(index->long_capacity * sizeof(uint32_t));
+    memset(index->long_names, 0, index->long_capacity * sizeof(uint32_t));
+    index->long_num = 0;
+    index->names_capacity = 256;
+    index->names = xmalloc(index->names_capacity);
+    index->names_size = 1; //offset 0 marks an empty slot
+    index->free_capacity = 16;
+    index->free = xmalloc(index->free_capacity * sizeof(FATfreerun));
+    index->num_free = 0;
+
+    FATlfnbuff lfn;
+    char long_name[FAT_LFN_NAME_SIZE];
+    FATdirectory entry;
+    fatLfnReset(&lfn);
+
+    uint32_t i;
+    for( i = 0; i < dir->num_entries; i++) {
+        uint8_t * raw = fatDirectoryEntry(dir, i);
+        if( raw[0] == FAT_ENTRY_END ) break;
+        if( raw[0] == FAT_ENTRY_DELETED ) {
+            fatLfnReset(&lfn);
+            free_add(index, i);
+            continue;
+        }
+        if( fatLfnAdd(&lfn, raw) ) continue;
+
+        size_t length = fatLfnTake(&lfn, raw, long_name);
+        fatUnpackDirectory(&entry, raw);
+        int visible = fatIsVisibleEntry(&entry);
+        fatNameSetAdd(&index->shorts, raw, visible ? i : FAT_NO_SLOT); //hidden names still count for collisions
+        if( visible && length ) long_add(index, long_name, i);
+    }
+
+    for( ; i < dir->num_entries; i++) free_add(index, i); //everything after the end marker
+}
+
+/* Find a visible entry whose short name or long name matches name, ignoring case
+ * Returns the index of its short entry or -1 if not found */
+int fatIndexFind(FATdirindex * index, const char * name) {
+    FATdircompare short_name;
+    if( !fatParseName(name, &short_name) ) {
+        int found = fatNameSetFind(&index->shorts, (uint8_t *) &short_name);
+        if( found >= 0 ) return found;
+    }
+
+    char folded[FAT_LFN_NAME_SIZE];
+    if( !index->long_num || fold_name(name, folded) ) return -1;
+    uint32_t at = long_slot(index, folded);
+    return index->long_names[at] && index->long_slots[at] != FAT_NO_SLOT ? (int) index->long_slots[at] : -1;
+}
+
+/* Put an entry and, unless long_name is NULL, its long name in the first run of unused
+ * slots that holds them, growing a subdirectory from the free map if there is none
+ * entry must hold the short name. Returns the index of the short entry or -1 if there is no room */
+int fatIndexInsert(FATdirindex * index, FATboot * boot, FATtable * table, FATfreemap * map, const char * long_name, FATdirectory * entry) {
+    FATdirbuff * dir = index->dir;
+    uint32_t num_lfn = long_name ? fatLfnEntries(long_name) : 0;
+    uint32_t needed = num_lfn + 1;
+
+    uint32_t r;
+    for( r = 0; r < index->num_free && index->free[r].length < needed; r++);
+
+    if( r == index->num_free ) { //unused slots at the end carry on into the new clusters
+        FATfreerun * last = index->num_free ? &index->free[index->num_free - 1] : NULL;
+        uint32_t have = last && last->start + last->length == dir->num_entries ? last->length : 0;
+        uint32_t per_cluster = fatGetClusterSize(boot) / FAT_DIRECTORY_SIZE;
+        uint32_t old_entries = dir->num_entries;
+        if( !fatExtendDirectory(dir, boot, table, map, (needed - have + per_cluster - 1) / per_cluster, 0) ) return -1;
+
+        if( !have ) free_add(index, old_entries);
+        r = index->num_free - 1;
+        index->free[r].length = dir->num_entries - index->free[r].start;
+    }
+
+    uint32_t start = index->free[r].start;
+    index->free[r].start += needed;
+    index->free[r].length -= needed;
+    if( !index->free[r].length ) {
+        memmove(index->free + r, index->free + r + 1, (index->num_free - r - 1) * sizeof(FATfreerun));
+        index->num_free--;
+    }
+
+    if( long_name ) fatLfnPack(long_name, (uint8_t *) entry->filename, fatDirectoryEntry(dir, start));
+    fatPackDirectory(entry, fatDirectoryEntry(dir, start + num_lfn));
+
+    fatNameSetAdd(&index->shorts, (uint8_t *) entry->filename, start + num_lfn);
+    if( long_name ) long_add(index, long_name, start + num_lfn);
+    return start + num_lfn;
+}
+
+/* Load and index the directory reached from the root through num path components, each found
+ * by short or long name. Returns the directory with index filled in, or NULL if a component is
+ * missing or not a directory. Free with fatFreeIndex and fatFreeDirectory */
+FATdirbuff * fatIndexPath(FILE * disk, FATboot * boot, FATtable * table, char ** components, int num, FATdirindex * index) {
+    FATdirbuff * dir = fatLoadDirectory(disk, boot, table, 0);
+    fatIndexDirectory(index, dir);
+
+    int i;
+    for( i = 0; i < num; i++) {
+        int found = fatIndexFind(index, components[i]);
+        FATdirectory entry;
+        if( found >= 0 ) fatUnpackDirectory(&entry, fatDirectoryEntry(dir, found));
+
+        fatFreeIndex(index);
+        fatFreeDirectory(dir);
+        if( found < 0 || !(entry.attributes & FAT_ATTR_DIRECTORY) ) return NULL;
+
+        dir = fatLoadDirectory(disk, boot, table, entry.first_logical_cluster);
+        fatIndexDirectory(index, dir);
+    }
+    return dir;
+}
+
+/* Split a path on / into its components, in place. components must hold strlen(path) / 2 + 1
+ * pointers. Returns how many there are */
+int fatSplitPath(char * path, char ** components) {
+    int num = 0;
+    char * save = NULL;
+    char * part;
+    for( part = strtok_r(path, "/", &save); part; part = strtok_r(NULL, "/", &save)) components[num++] = part;
+    return num;
+}
+
+/* Free the index, the directory is left alone */
+void fatFreeIndex(FATdirindex * index) {
+    fatFreeNameSet(&index->shorts);
+    xfree(index->long_names);
+    xfree(index->long_slots);
+    xfree(index->names);
+    xfree(index->free);
+}
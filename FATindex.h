@@ -0,0 +1,65 @@
+/* Hash index of a loaded directory
+ * Built in one pass over a directory so finding an entry by name, checking for a
+ * duplicate and picking slots for a new entry do not scan the directory again.
+ * Short names are kept packed as on disk, long names folded to upper case, and
+ * unused slots as runs in directory order so a long name finds room in one step.
+ */
+
+#ifndef _FATINDEX_H
+#define _FATINDEX_H
+
+#include <stdint.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATlfn.h"
+
+/* Run of unused slots in a directory */
+typedef struct FATfreerun{
+    uint32_t start;
+    uint32_t length;
+}FATfreerun;
+
+/* Index of one directory, valid while only changed through fatIndexInsert */
+typedef struct FATdirindex{
+    FATdirbuff * dir;
+    FATnameset shorts; //packed short names of every entry
+    uint32_t * long_names; //offset of the folded long name in names, 0 if empty
+    uint32_t * long_slots; //index of the short entry, FAT_NO_SLOT once removed
+    uint32_t long_capacity; //power of two
+    uint32_t long_num;
+    char * names; //folded long names, starting after an unused byte
+    uint32_t names_size;
+    uint32_t names_capacity;
+    FATfreerun * free; //unused slots lowest first
+    uint32_t num_free;
+    uint32_t free_capacity;
+}FATdirindex;
+
+
+/* Index every entry of a loaded directory. Free with fatFreeIndex */
+void fatIndexDirectory(FATdirindex * index, FATdirbuff * dir);
+
+/* Find a visible entry whose short name or long name matches name, ignoring case
+ * Returns the index of its short entry or -1 if not found */
+int fatIndexFind(FATdirindex * index, const char * name);
+
+/* Put an entry and, unless long_name is NULL, its long name in the first run of unused
+ * slots that holds them, growing a subdirectory from the free map if there is none
+ * entry must hold the short name. Returns the index of the short entry or -1 if there is no room */
+int fatIndexInsert(FATdirindex * index, FATboot * boot, FATtable * table, FATfreemap * map, const char * long_name, FATdirectory * entry);
+
+/* Load and index the directory reached from the root through num path components, each found
+ * by short or long name. Returns the directory with index filled in, or NULL if a component is
+ * missing or not a directory. Free with fatFreeIndex and fatFreeDirectory */
+FATdirbuff * fatIndexPath(FILE * disk, FATboot * boot, FATtable * table, char ** components, int num, FATdirindex * index);
+
+/* Split a path on / into its components, in place. components must hold strlen(path) / 2 + 1
+ * pointers. Returns how many there are */
+int fatSplitPath(char * path, char ** components);
+
+/* Free the index, the directory is left alone */
+void fatFreeIndex(FATdirindex * index);
+
+#endif
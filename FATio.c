@@ -0,0 +1,343 @@
+/* Queued image reads and writes
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "FATio.h"
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "utils.h"
+
+/* No liburing, the two system calls are made directly */
+static int uring_setup(unsigned entries, struct io_uring_params * params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+/* Map the rings of a new io_uring. Returns 0 or -1 if io_uring cannot be used */
+static int open_uring(FATio * io) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    io->ring_fd = uring_setup(io->depth, &params);
+    if( io->ring_fd < 0 ) return -1;
+
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if( params.features & IORING_FEAT_SINGLE_MMAP ) { //both rings share one mapping
+        if( io->cq_ring_size > io->sq_ring_size ) io->sq_ring_size = io->cq_ring_size;
+        io->cq_ring_size = 0;
+    }
+
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+    if( io->sq_ring == MAP_FAILED ) {
+        close(io->ring_fd);
+        return -1;
+    }
+
+    if( io->cq_ring_size ) {
+        io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+        if( io->cq_ring == MAP_FAILED ) {
+            munmap(io->sq_ring, io->sq_ring_size);
+            close(io->ring_fd);
+            return -1;
+        }
+    } else {
+        io->cq_ring = io->sq_ring;
+    }
+
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+    if( io->sqes == MAP_FAILED ) {
+        if( io->cq_ring_size ) munmap(io->cq_ring, io->cq_ring_size);
+        munmap(io->sq_ring, io->sq_ring_size);
+        close(io->ring_fd);
+        return -1;
+    }
+
+    uint8_t * sq = io->sq_ring;
+    uint8_t * cq = io->cq_ring;
+    io->sq_head = (unsigned *) (sq + params.sq_off.head);
+    io->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    io->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned *) (sq + params.sq_off.array);
+    io->cq_head = (unsigned *) (cq + params.cq_off.head);
+    io->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    io->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    io->cqes = cq + params.cq_off.cqes;
+
+    if( params.sq_entries < io->depth ) io->depth = params.sq_entries;
+    return 0;
+}
+
+/* Create an engine over fd keeping up to depth requests in flight. Caller must free with fatCloseIo */
+FATio * fatOpenIo(int fd, uint32_t depth) {
+    FATio * io = xmalloc(sizeof(FATio));
+    memset(io, 0, sizeof(FATio));
+    io->fd = fd;
+    io->depth = depth ? depth : FAT_IO_DEFAULT_DEPTH;
+
+    const char * engine = getenv("FATIO_ENGINE");
+    io->uring = fd >= 0 && !(engine && !strcmp(engine, "sync")) && open_uring(io) == 0;
+
+    io->slots = xmalloc(io->depth * sizeof(FATiorequest));
+    uint32_t i;
+    for( i = 0; i < io->depth; i++) io->slots[i].next = i + 1 < io->depth ? (int) i + 1 : -1;
+    io->free_slot = 0;
+    io->queue_head = -1;
+    io->queue_tail = -1;
+
+    return io;
+}
+
+/* Create an engine over an image stream, like fatOpenIo when it has a file descriptor
+ * and reading and writing through stdio otherwise. Caller must free with fatCloseIo */
+FATio * fatOpenImageIo(FILE * disk, uint32_t depth) {
+    int fd = fileno(disk);
+    if( fd >= 0 ) return fatOpenIo(fd, depth);
+
+    FATio * io = fatOpenIo(-1, depth); //no descriptor, so no io_uring
+    io->stream = disk;
+    return io;
+}
+
+/* Name of the engine in use */
+const char * fatIoEngineName(FATio * io) {
+    if( io->stream ) return "stdio";
+    return io->uring ? "io_uring" : "pread";
+}
+
+/* Number of requests that can still be queued */
+uint32_t fatIoSpace(FATio * io) {
+    return io->depth - io->in_flight;
+}
+
+/* Finish a request with blocking calls, aborting on errors like the x wrappers */
+static void finish_sync(FATio * io, FATiorequest * request, uint32_t done) {
+    if( io->stream ) {
+        xfseek(io->stream, request->offset + done, SEEK_SET);
+        if( request->is_write ) xfwrite((uint8_t *) request->buff + done, 1, request->size - done, io->stream);
+        else xfread((uint8_t *) request->buff + done, 1, request->size - done, io->stream);
+    } else if( request->is_write ) {
+        xpwrite(io->fd, (uint8_t *) request->buff + done, request->size - done, request->offset + done);
+    } else {
+        xpread(io->fd, (uint8_t *) request->buff + done, request->size - done, request->offset + done);
+    }
+}
+
+/* Put the request in slot on the submission ring, to be sent by fatIoSubmit */
+static void push_request(FATio * io, int slot) {
+    FATiorequest * request = &io->slots[slot];
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe * sqe = (struct io_uring_sqe *) io->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = io->fd;
+    sqe->addr = (uint64_t) (uintptr_t) request->buff;
+    sqe->len = request->size;
+    sqe->off = request->offset;
+    sqe->user_data = slot;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE); //entry visible before tail moves
+    io->unsubmitted++;
+}
+
+/* Take a free slot and fill it */
+static void queue_request(FATio * io, void * buff, uint32_t size, uint64_t offset, void * tag, int is_write) {
+    if( io->free_slot < 0 ) {
+        printf("FATAL: io queue is full\n");
+        abort();
+    }
+    int slot = io->free_slot;
+    FATiorequest * request = &io->slots[slot];
+    io->free_slot = request->next;
+
+    request->buff = buff;
+    request->size = size;
+    request->offset = offset;
+    request->tag = tag;
+    request->is_write = is_write;
+    request->next = -1;
+    io->in_flight++;
+    STATS_ADD(queued_io, 1);
+
+    if( !io->uring ) { //keep order, completed one by one on wait
+        if( io->queue_tail >= 0 ) io->slots[io->queue_tail].next = slot;
+        else io->queue_head = slot;
+        io->queue_tail = slot;
+        return;
+    }
+
+    push_request(io, slot);
+}
+
+/* Queue a read of size bytes at offset into buff. There must be space */
+void fatIoQueueRead(FATio * io, void * buff, uint32_t size, uint64_t offset, void * tag) {
+    queue_request(io, buff, size, offset, tag, 0);
+}
+
+/* Queue a write of size bytes from buff at offset. There must be space */
+void fatIoQueueWrite(FATio * io, void * buff, uint32_t size, uint64_t offset, void * tag) {
+    queue_request(io, buff, size, offset, tag, 1);
+}
+
+/* Hand queued requests to the kernel */
+void fatIoSubmit(FATio * io) {
+    while( io->uring && io->unsubmitted > 0 ) {
+        int ret = uring_enter(io->ring_fd, io->unsubmitted, 0, 0);
+        io->submits++;
+        if( ret < 0 ) {
+            if( errno == EINTR || errno == EAGAIN || errno == EBUSY ) continue;
+            perror("FATAL: io_uring submit failed:");
+            abort();
+        }
+        io->unsubmitted -= ret;
+    }
+}
+
+/* Return a slot to the free list and fill in the completion */
+static void release_slot(FATio * io, int slot, FATiocompletion * done) {
+    FATiorequest * request = &io->slots[slot];
+    done->buff = request->buff;
+    done->size = request->size;
+    done->offset = request->offset;
+    done->tag = request->tag;
+
+    request->next = io->free_slot;
+    io->free_slot = slot;
+    io->in_flight--;
+}
+
+/* Wait for the next finished request. Returns 0 if nothing is in flight, 1 otherwise */
+int fatIoComplete(FATio * io, FATiocompletion * done) {
+    if( io->in_flight == 0 ) return 0;
+
+    if( !io->uring ) {
+        int slot = io->queue_head;
+        io->queue_head = io->slots[slot].next;
+        if( io->queue_head < 0 ) io->queue_tail = -1;
+        finish_sync(io, &io->slots[slot], 0);
+        release_slot(io, slot, done);
+        return 1;
+    }
+
+    int slot;
+    int32_t res;
+    while( 1 ) {
+        fatIoSubmit(io);
+
+        unsigned head = *io->cq_head;
+        while( head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE) ) { //nothing finished yet
+            int ret = uring_enter(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+            io->submits++;
+            if( ret < 0 && errno != EINTR && errno != EAGAIN ) {
+                perror("FATAL: io_uring wait failed:");
+                abort();
+            }
+        }
+
+        struct io_uring_cqe * cqe = (struct io_uring_cqe *) io->cqes + (head & *io->cq_mask);
+        slot = cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if( res != -EAGAIN ) break;
+        push_request(io, slot); //the kernel could not take it now, its sqe was consumed so there is room
+    }
+
+    FATiorequest * request = &io->slots[slot];
+    if( res > 0 && request->is_write ) {
+        STATS_ADD(writes, 1);
+        STATS_ADD(write_bytes, res);
+    } else if( res > 0 ) {
+        STATS_ADD(reads, 1);
+        STATS_ADD(read_bytes, res);
+    }
+    if( res == -EINVAL || res == -EOPNOTSUPP ) { //kernel without read and write ops
+        finish_sync(io, request, 0);
+    } else if( res < 0 ) {
+        errno = -res;
+        perror("FATAL: Queued io failed:");
+        abort();
+    } else if( (uint32_t) res < request->size ) { //short, finish the rest in place
+        finish_sync(io, request, res);
+    }
+
+    release_slot(io, slot, done);
+    return 1;
+}
+
+/* Free the engine, waiting for anything still in flight */
+void fatCloseIo(FATio * io) {
+    FATiocompletion done;
+    while( fatIoComplete(io, &done) );
+
+    if( io->uring ) {
+        munmap(io->sqes, io->sqes_size);
+        if( io->cq_ring_size ) munmap(io->cq_ring, io->cq_ring_size);
+        munmap(io->sq_ring, io->sq_ring_size);
+        close(io->ring_fd);
+    }
+    xfree(io->slots);
+    xfree(io);
+}
+
+/* Read a whole directory like fatLoadDirectory, with every contiguous run of its chain queued at once
+ * Waits for everything in flight, so the engine must not hold other requests */
+FATdirbuff * fatIoLoadDirectory(FATio * io, FATboot * boot, FATtable * table, uint16_t first_cluster) {
+    FATdirbuff * dir = xmalloc(sizeof(FATdirbuff));
+    dir->first_cluster = first_cluster;
+    FATiocompletion done;
+
+    if( first_cluster == 0 ) { //root is a fixed region
+        dir->clusters = NULL;
+        dir->num_clusters = 0;
+        dir->num_entries = boot->max_root_entries;
+        dir->data = xmalloc(dir->num_entries * FAT_DIRECTORY_SIZE);
+        if( !fatIoSpace(io) ) fatIoComplete(io, &done);
+        fatIoQueueRead(io, dir->data, dir->num_entries * FAT_DIRECTORY_SIZE, fatGetRootStart(boot), NULL);
+        while( fatIoComplete(io, &done) );
+        return dir;
+    }
+
+    uint32_t cluster_size = fatGetClusterSize(boot);
+    dir->num_clusters = fatChainLength(table, first_cluster);
+    dir->clusters = xmalloc(dir->num_clusters * sizeof(uint16_t));
+    dir->num_entries = dir->num_clusters * cluster_size / FAT_DIRECTORY_SIZE;
+    dir->data = xmalloc(dir->num_clusters * cluster_size);
+
+    uint32_t i;
+    uint16_t cluster = first_cluster;
+    for( i = 0; i < dir->num_clusters; i++) {
+        dir->clusters[i] = cluster;
+        cluster = fatTableGet(table, cluster);
+    }
+
+    i = 0;
+    while( i < dir->num_clusters ) { //data lands in place, completions only free up room
+        uint16_t run = fatChainRun(table, dir->clusters[i], dir->num_clusters - i);
+        if( !fatIoSpace(io) ) {
+            fatIoSubmit(io);
+            fatIoComplete(io, &done);
+        }
+        fatIoQueueRead(io, dir->data + i * cluster_size, run * cluster_size, fatGetDataspaceLocation(boot, dir->clusters[i]), NULL);
+        i += run;
+    }
+    fatIoSubmit(io);
+    while( fatIoComplete(io, &done) );
+
+    return dir;
+}
@@ -0,0 +1,109 @@
+/* Queued image reads and writes
+ * Requests are queued and then completed in whatever order the kernel finishes
+ * them. Uses io_uring when the kernel offers it and falls back to pread and pwrite,
+ * one request at a time, otherwise. Setting FATIO_ENGINE=sync forces the fallback.
+ * Streams without a file descriptor, such as overlays, go through stdio one at a time.
+ * Every request completes in full or the program aborts, like the x wrappers.
+ */
+
+#ifndef _FATIO_H
+#define _FATIO_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+
+/* Requests in flight when no depth is given */
+#define FAT_IO_DEFAULT_DEPTH 32
+
+/* Largest single request, longer extents are split */
+#define FAT_IO_MAX_REQUEST (64 * 1024)
+
+/* One queued request */
+typedef struct FATiorequest{
+    void * buff;
+    uint32_t size;
+    uint64_t offset;
+    void * tag; //caller value handed back on completion
+    int is_write;
+    int next; //next free or next queued slot, -1 at the end
+}FATiorequest;
+
+/* Finished request */
+typedef struct FATiocompletion{
+    void * buff;
+    uint32_t size;
+    uint64_t offset;
+    void * tag;
+}FATiocompletion;
+
+/* Engine over one file descriptor */
+typedef struct FATio{
+    int fd;
+    FILE * stream; //set when there is no file descriptor
+    int uring; //1 if io_uring is used
+    uint32_t depth;
+    FATiorequest * slots;
+    int free_slot; //head of free slots
+    int queue_head; //queued and not yet completed, sync engine only
+    int queue_tail;
+    uint32_t in_flight; //queued or submitted, not completed
+    uint32_t unsubmitted; //queued since last submit, io_uring only
+
+    /* io_uring state */
+    int ring_fd;
+    void * sq_ring;
+    size_t sq_ring_size;
+    void * cq_ring;
+    size_t cq_ring_size;
+    void * sqes;
+    size_t sqes_size;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    void * cqes;
+
+    uint64_t submits; //system calls made to submit or wait
+}FATio;
+
+
+/* Create an engine over fd keeping up to depth requests in flight. Caller must free with fatCloseIo */
+FATio * fatOpenIo(int fd, uint32_t depth);
+
+/* Create an engine over an image stream, like fatOpenIo when it has a file descriptor
+ * and reading and writing through stdio otherwise. Caller must free with fatCloseIo */
+FATio * fatOpenImageIo(FILE * disk, uint32_t depth);
+
+/* Name of the engine in use */
+const char * fatIoEngineName(FATio * io);
+
+/* Number of requests that can still be queued */
+uint32_t fatIoSpace(FATio * io);
+
+/* Queue a read of size bytes at offset into buff. There must be space */
+void fatIoQueueRead(FATio * io, void * buff, uint32_t size, uint64_t offset, void * tag);
+
+/* Queue a write of size bytes from buff at offset. There must be space */
+void fatIoQueueWrite(FATio * io, void * buff, uint32_t size, uint64_t offset, void * tag);
+
+/* Hand queued requests to the kernel */
+void fatIoSubmit(FATio * io);
+
+/* Wait for the next finished request. Returns 0 if nothing is in flight, 1 otherwise */
+int fatIoComplete(FATio * io, FATiocompletion * done);
+
+/* Free the engine, waiting for anything still in flight */
+void fatCloseIo(FATio * io);
+
+/* Read a whole directory like fatLoadDirectory, with every contiguous run of its chain queued at once
+ * Waits for everything in flight, so the engine must not hold other requests */
+FATdirbuff * fatIoLoadDirectory(FATio * io, FATboot * boot, FATtable * table, uint16_t first_cluster);
+
+#endif
@@ -0,0 +1,333 @@
+/* Long file names (VFAT)
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "FATlfn.h"
+#include "FATheaders.h"
+#include "FATdir.h"
+#include "utils.h"
+
+/* Byte offsets of the 13 characters inside an LFN entry */
+static const uint8_t char_offsets[FAT_LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+/* Checksum of an 11 byte short name stored in its LFN entries */
+uint8_t fatLfnChecksum(const uint8_t * short_name) {
+    uint8_t sum = 0;
+    int i;
+    for( i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+    return sum;
+}
+
+/* Forget any fragments gathered */
+void fatLfnReset(FATlfnbuff * lfn) {
+    lfn->pending = 0;
+    lfn->next = 0;
+    lfn->count = 0;
+}
+
+/* Feed the next raw entry of a directory. Returns 1 if it was an LFN entry and was
+ * consumed, 0 if it is a short entry to look at with fatLfnTake */
+int fatLfnAdd(FATlfnbuff * lfn, const uint8_t * raw) {
+    if( raw[11] != FAT_ATTR_LFN ) return 0;
+
+    uint8_t sequence = raw[0] & 0x1F;
+    if( raw[0] == FAT_ENTRY_DELETED || !sequence || sequence > FAT_LFN_MAX_ENTRIES ) {
+        fatLfnReset(lfn);
+        return 1;
+    }
+
+    if( raw[0] & FAT_LFN_LAST ) { //first stored fragment starts a new name
+        lfn->pending = 1;
+        lfn->count = sequence;
+        lfn->checksum = raw[13];
+    } else if( !lfn->pending || sequence != lfn->next || raw[13] != lfn->checksum ) {
+        fatLfnReset(lfn); //out of order or from another name
+        return 1;
+    }
+
+    uint16_t * chars = lfn->chars + (sequence - 1) * FAT_LFN_CHARS;
+    int i;
+    for( i = 0; i < FAT_LFN_CHARS; i++) chars[i] = raw[char_offsets[i]] | raw[char_offsets[i] + 1] << 8;
+    lfn->next = sequence - 1;
+    return 1;
+}
+
+/* Append one code point to out as UTF-8, returns bytes written */
+static size_t put_utf8(char * out, uint32_t code) {
+    if( code < 0x80 ) {
+        out[0] = code;
+        return 1;
+    } else if( code < 0x800 ) {
+        out[0] = 0xC0 | code >> 6;
+        out[1] = 0x80 | (code & 0x3F);
+        return 2;
+    } else if( code < 0x10000 ) {
+        out[0] = 0xE0 | code >> 12;
+        out[1] = 0x80 | ((code >> 6) & 0x3F);
+        out[2] = 0x80 | (code & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | code >> 18;
+    out[1] = 0x80 | ((code >> 12) & 0x3F);
+    out[2] = 0x80 | ((code >> 6) & 0x3F);
+    out[3] = 0x80 | (code & 0x3F);
+    return 4;
+}
+
+/* Long name of the short entry raw into name (FAT_LFN_NAME_SIZE bytes) from the fragments
+ * gathered before it. Returns its length, 0 if it has no valid long name. Resets the buffer */
+size_t fatLfnTake(FATlfnbuff * lfn, const uint8_t * raw, char * name) {
+    int complete = lfn->pending && lfn->next == 0 && lfn->checksum == fatLfnChecksum(raw);
+    uint32_t num_chars = lfn->count * FAT_LFN_CHARS;
+    fatLfnReset(lfn);
+    if( !complete ) return 0;
+
+    size_t length = 0;
+    uint32_t i;
+    for( i = 0; i < num_chars && length + 4 < FAT_LFN_NAME_SIZE; i++) {
+        uint32_t code = lfn->chars[i];
+        if( code == 0x0000 || code == 0xFFFF ) break; //terminator and padding
+
+        if( code >= 0xD800 && code < 0xDC00 && i + 1 < num_chars
+                && lfn->chars[i + 1] >= 0xDC00 && lfn->chars[i + 1] < 0xE000 ) { //surrogate pair
+            code = 0x10000 + ((code - 0xD800) << 10) + (lfn->chars[i + 1] - 0xDC00);
+            i++;
+        }
+        length += put_utf8(name + length, code);
+    }
+    name[length] = 0;
+    return length;
+}
+
+/* Long name of the short entry at index of dir into name (FAT_LFN_NAME_SIZE bytes), read from
+ * the LFN entries just before it. Returns its length, 0 if it has none */
+size_t fatLfnFind(FATdirbuff * dir, uint32_t index, char * name) {
+    uint32_t first = index; //back to the fragment stored first
+    while( first > 0 && index - first < FAT_LFN_MAX_ENTRIES ) {
+        uint8_t * raw = fatDirectoryEntry(dir, first - 1);
+        if( raw[11] != FAT_ATTR_LFN || raw[0] == FAT_ENTRY_DELETED ) break;
+        first--;
+        if( raw[0] & FAT_LFN_LAST ) break;
+    }
+
+    FATlfnbuff lfn;
+    fatLfnReset(&lfn);
+    for( ; first < index; first++) fatLfnAdd(&lfn, fatDirectoryEntry(dir, first));
+    return fatLfnTake(&lfn, fatDirectoryEntry(dir, index), name);
+}
+
+/* Decode name into UCS-2 units, returns how many or -1 if it is not valid for a long name
+ * units must hold FAT_LFN_MAX, or is NULL to only count */
+static int to_units(const char * name, uint16_t * units) {
+    const uint8_t * in = (const uint8_t *) name;
+    int num = 0;
+    int visible = 0; //something other than dots and spaces
+
+    while( *in ) {
+        uint32_t code;
+        int extra;
+        if( *in < 0x80 ) {
+            code = *in;
+            extra = 0;
+        } else if( (*in & 0xE0) == 0xC0 ) {
+            code = *in & 0x1F;
+            extra = 1;
+        } else if( (*in & 0xF0) == 0xE0 ) {
+            code = *in & 0x0F;
+            extra = 2;
+        } else if( (*in & 0xF8) == 0xF0 ) {
+            code = *in & 0x07;
+            extra = 3;
+        } else {
+            return -1;
+        }
+        in++;
+        for( ; extra > 0; extra--, in++) {
+            if( (*in & 0xC0) != 0x80 ) return -1;
+            code = code << 6 | (*in & 0x3F);
+        }
+
+        if( code < 0x20 || (code < 0x80 && strchr("\"*/:<>?\\|", code)) ) return -1;
+        if( code != '.' && code != ' ' ) visible = 1;
+
+        int needed = code >= 0x10000 ? 2 : 1;
+        if( num + needed > FAT_LFN_MAX ) return -1;
+        if( units && needed == 2 ) {
+            units[num] = 0xD800 + ((code - 0x10000) >> 10);
+            units[num + 1] = 0xDC00 + ((code - 0x10000) & 0x3FF);
+        } else if( units ) {
+            units[num] = code;
+        }
+        num += needed;
+    }
+
+    return num && visible ? num : -1;
+}
+
+/* Number of LFN entries a name needs, 0 if it cannot be stored as a long name */
+int fatLfnEntries(const char * name) {
+    int num = to_units(name, NULL);
+    return num < 0 ? 0 : (num + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+}
+
+/* Pack the LFN entries of name for the short name in disk order into out
+ * out must hold fatLfnEntries(name) entries */
+void fatLfnPack(const char * name, const uint8_t * short_name, uint8_t * out) {
+    uint16_t units[FAT_LFN_MAX];
+    int num = to_units(name, units);
+    int count = (num + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+    uint8_t checksum = fatLfnChecksum(short_name);
+
+    int sequence;
+    for( sequence = count; sequence >= 1; sequence--, out += FAT_DIRECTORY_SIZE) {
+        memset(out, 0, FAT_DIRECTORY_SIZE);
+        out[0] = sequence | (sequence == count ? FAT_LFN_LAST : 0);
+        out[11] = FAT_ATTR_LFN;
+        out[13] = checksum;
+
+        int i;
+        for( i = 0; i < FAT_LFN_CHARS; i++) {
+            int at = (sequence - 1) * FAT_LFN_CHARS + i;
+            uint16_t unit = at < num ? units[at] : at == num ? 0x0000 : 0xFFFF; //null after the name, then padding
+            out[char_offsets[i]] = unit & 0xFF;
+            out[char_offsets[i] + 1] = unit >> 8;
+        }
+    }
+}
+
+/* Slot of a short name in the set, either holding it or the empty slot where it goes */
+static uint32_t name_slot(FATnameset * set, const uint8_t * short_name) {
+    uint32_t hash = 2166136261u; //FNV-1a
+    int i;
+    for( i = 0; i < 11; i++) hash = (hash ^ short_name[i]) * 16777619u;
+
+    uint32_t slot = hash & (set->capacity - 1);
+    while( set->used[slot] && memcmp(set->names[slot], short_name, 11) ) slot = (slot + 1) & (set->capacity - 1);
+    return slot;
+}
+
+/* Start an empty set with room for about num names. Free with fatFreeNameSet */
+void fatInitNameSet(FATnameset * set, uint32_t num) {
+    set->capacity = 64;
+    while( set->capacity < num * 2 ) set->capacity *= 2; //at most half full
+    set->names = xmalloc(set->capacity * 11);
+    set->slots = xmalloc(set->capacity * sizeof(uint32_t));
+    set->used = xmalloc(set->capacity);
+    memset(set->used, 0, set->capacity);
+    set->num = 0;
+}
+
+/* Returns 1 if the set holds the 11 byte short name */
+int fatNameSetHas(FATnameset * set, const uint8_t * short_name) {
+    return set->used[name_slot(set, short_name)];
+}
+
+/* Returns the slot of the visible entry with the 11 byte short name or -1 if there is none */
+int fatNameSetFind(FATnameset * set, const uint8_t * short_name) {
+    uint32_t at = name_slot(set, short_name);
+    return set->used[at] && set->slots[at] != FAT_NO_SLOT ? (int) set->slots[at] : -1;
+}
+
+/* Add an 11 byte short name to the set, or give a name already there the slot */
+void fatNameSetAdd(FATnameset * set, const uint8_t * short_name, uint32_t slot) {
+    if( (set->num + 1) * 2 > set->capacity ) { //keep probes short by rehashing into double the room
+        FATnameset bigger;
+        fatInitNameSet(&bigger, set->capacity);
+
+        uint32_t i;
+        for( i = 0; i < set->capacity; i++) {
+            if( set->used[i] ) fatNameSetAdd(&bigger, set->names[i], set->slots[i]);
+        }
+        fatFreeNameSet(set);
+        *set = bigger;
+    }
+
+    uint32_t at = name_slot(set, short_name);
+    if( set->used[at] ) {
+        if( set->slots[at] == FAT_NO_SLOT ) set->slots[at] = slot;
+        return;
+    }
+    memcpy(set->names[at], short_name, 11);
+    set->slots[at] = slot;
+    set->used[at] = 1;
+    set->num++;
+}
+
+/* Free the set */
+void fatFreeNameSet(FATnameset * set) {
+    xfree(set->names);
+    xfree(set->slots);
+    xfree(set->used);
+}
+
+/* Copy the characters of a long name part that may go in a short name, upper cased and with
+ * anything else as _, dots and spaces dropped. Returns how many were put in out */
+static int basis_part(const char * start, const char * end, uint8_t * out, int max) {
+    int length = 0;
+    const uint8_t * in = (const uint8_t *) start;
+    while( in < (const uint8_t *) end && length < max ) {
+        if( *in == '.' || *in == ' ' ) {
+            in++;
+            continue;
+        }
+        if( *in >= 0x80 ) { //one _ for the whole UTF-8 sequence
+            in++;
+            while( in < (const uint8_t *) end && (*in & 0xC0) == 0x80 ) in++;
+            out[length++] = '_';
+            continue;
+        }
+        out[length++] = isalnum(*in) || strchr("$%'-_@~`!(){}^#&", *in) ? toupper(*in) : '_';
+        in++;
+    }
+    return length;
+}
+
+/* Generate the short name for a long name, NAME~N.EXT with the lowest N not in the set
+ * Returns 0 on success, -1 if every tail is taken */
+int fatMakeShortName(const char * name, FATnameset * set, FATdircompare * out) {
+    const char * end = name + strlen(name);
+    const char * dot = strrchr(name, '.');
+    if( dot == name ) dot = NULL; //leading dot is part of the name
+
+    uint8_t basis[8];
+    int basis_length = basis_part(name, dot ? dot : end, basis, 8);
+    if( !basis_length ) basis[basis_length++] = '_';
+
+    memset(out, 0x20, sizeof(FATdircompare));
+    if( dot ) basis_part(dot + 1, end, out->extention, 3);
+
+    uint32_t tail;
+    for( tail = 1; tail <= 999999; tail++) {
+        char digits[8];
+        int tail_length = snprintf(digits, sizeof(digits), "~%u", tail);
+        int keep = basis_length < 8 - tail_length ? basis_length : 8 - tail_length;
+
+        memset(out->filename, 0x20, sizeof(out->filename));
+        memcpy(out->filename, basis, keep);
+        memcpy(out->filename + keep, digits, tail_length);
+
+        if( !fatNameSetHas(set, (uint8_t *) out) ) {
+            fatNameSetAdd(set, (uint8_t *) out, FAT_NO_SLOT);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Mark the short entry at index and the LFN entries that belong to it as deleted */
+void fatDeleteLongEntry(FATdirbuff * dir, uint32_t index) {
+    uint8_t checksum = fatLfnChecksum(fatDirectoryEntry(dir, index));
+    fatDeleteEntry(dir, index);
+
+    while( index-- > 0 ) {
+        uint8_t * raw = fatDirectoryEntry(dir, index);
+        if( raw[11] != FAT_ATTR_LFN || raw[0] == FAT_ENTRY_DELETED || raw[13] != checksum ) break;
+        int last = raw[0] & FAT_LFN_LAST;
+        raw[0] = FAT_ENTRY_DELETED;
+        if( last ) break;
+    }
+}
@@ -0,0 +1,96 @@
+/* Long file names (VFAT)
+ * A long name is kept in LFN entries just before its short entry, last fragment first,
+ * 13 UCS-2 characters per entry, each carrying a checksum of the short name. Walkers
+ * feed entries into one scratch buffer per directory, and the name is only put
+ * together once its short entry shows up and the sequence and checksum agree.
+ * Names are handed out and taken in as UTF-8.
+ */
+
+#ifndef _FATLFN_H
+#define _FATLFN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FATheaders.h"
+#include "FATdir.h"
+
+#define FAT_LFN_MAX 255 //characters in a long name
+#define FAT_LFN_CHARS 13 //characters per LFN entry
+#define FAT_LFN_MAX_ENTRIES 20
+#define FAT_LFN_LAST 0x40 //flag on the sequence number of the last fragment, stored first
+
+/* Bytes needed for a UTF-8 long name with its null */
+#define FAT_LFN_NAME_SIZE (FAT_LFN_MAX * 3 + 1)
+
+/* Fragments of the long name being read */
+typedef struct FATlfnbuff{
+    uint16_t chars[FAT_LFN_MAX_ENTRIES * FAT_LFN_CHARS];
+    uint8_t checksum; //short name checksum every fragment must carry
+    uint8_t count; //fragments in the name
+    uint8_t next; //sequence number expected next, 0 once all fragments are in
+    uint8_t pending; //1 while a name is being gathered
+}FATlfnbuff;
+
+/* Marks a name in a set that has no visible entry behind it */
+#define FAT_NO_SLOT 0xFFFFFFFF
+
+/* Set of the short names used in one directory with the slot of each visible entry
+ * Open addressing on the 11 name bytes. Names are never taken out, a removed entry only loses its slot */
+typedef struct FATnameset{
+    uint8_t (*names)[11];
+    uint32_t * slots; //index of the entry, FAT_NO_SLOT if none
+    uint8_t * used;
+    uint32_t capacity; //power of two
+    uint32_t num;
+}FATnameset;
+
+
+/* Checksum of an 11 byte short name stored in its LFN entries */
+uint8_t fatLfnChecksum(const uint8_t * short_name);
+
+/* Forget any fragments gathered */
+void fatLfnReset(FATlfnbuff * lfn);
+
+/* Feed the next raw entry of a directory. Returns 1 if it was an LFN entry and was
+ * consumed, 0 if it is a short entry to look at with fatLfnTake */
+int fatLfnAdd(FATlfnbuff * lfn, const uint8_t * raw);
+
+/* Long name of the short entry raw into name (FAT_LFN_NAME_SIZE bytes) from the fragments
+ * gathered before it. Returns its length, 0 if it has no valid long name. Resets the buffer */
+size_t fatLfnTake(FATlfnbuff * lfn, const uint8_t * raw, char * name);
+
+/* Long name of the short entry at index of dir into name (FAT_LFN_NAME_SIZE bytes), read from
+ * the LFN entries just before it. Returns its length, 0 if it has none */
+size_t fatLfnFind(FATdirbuff * dir, uint32_t index, char * name);
+
+/* Number of LFN entries a name needs, 0 if it cannot be stored as a long name */
+int fatLfnEntries(const char * name);
+
+/* Pack the LFN entries of name for the short name in disk order into out
+ * out must hold fatLfnEntries(name) entries */
+void fatLfnPack(const char * name, const uint8_t * short_name, uint8_t * out);
+
+/* Start an empty set with room for about num names. Free with fatFreeNameSet */
+void fatInitNameSet(FATnameset * set, uint32_t num);
+
+/* Returns 1 if the set holds the 11 byte short name */
+int fatNameSetHas(FATnameset * set, const uint8_t * short_name);
+
+/* Returns the slot of the visible entry with the 11 byte short name or -1 if there is none */
+int fatNameSetFind(FATnameset * set, const uint8_t * short_name);
+
+/* Add an 11 byte short name to the set, or give a name already there the slot */
+void fatNameSetAdd(FATnameset * set, const uint8_t * short_name, uint32_t slot);
+
+/* Free the set */
+void fatFreeNameSet(FATnameset * set);
+
+/* Generate the short name for a long name, NAME~N.EXT with the lowest N not in the set
+ * Returns 0 on success, -1 if every tail is taken */
+int fatMakeShortName(const char * name, FATnameset * set, FATdircompare * out);
+
+/* Mark the short entry at index and the LFN entries that belong to it as deleted */
+void fatDeleteLongEntry(FATdirbuff * dir, uint32_t index);
+
+#endif
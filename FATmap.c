@@ -0,0 +1,383 @@
+/* Read only memory mapped images
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FATmap.h"
+#include "FATpartition.h"
+#include "FAToverlay.h"
+#include "FATpack.h"
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATlfn.h"
+#include "ADTlinkedlist.h"
+#include "utils.h"
+
+/* Directory waiting to be walked */
+typedef struct walk_dir {
+    uint16_t cluster;
+    char * path; //path, including own name
+} walk_dir;
+
+/* Read a whole overlay into private memory standing in for a mapping of its image */
+static uint8_t * map_overlay(const char * name, size_t * size) {
+    FAToverlay * overlay = fatOpenOverlay(name, 0);
+    if( !overlay ) return NULL;
+    if( overlay->header.base_size < FAT_BOOT_SIZE ) {
+        printf("Disk %s is too small\n", name);
+        fatCloseOverlay(overlay);
+        return NULL;
+    }
+
+    size_t length = overlay->header.base_size;
+    uint8_t * data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( data == MAP_FAILED ) {
+        perror("Mapping disk failed:");
+        fatCloseOverlay(overlay);
+        return NULL;
+    }
+    fatOverlayRead(overlay, data, length, 0);
+    fatCloseOverlay(overlay);
+    mprotect(data, length, PROT_READ); //read only like any other image
+    *size = length;
+    return data;
+}
+
+/* Reserve a mapping for a container, chunks are inflated into it as they are touched */
+static uint8_t * map_pack(const char * name, size_t * size, FATpack ** pack) {
+    *pack = fatOpenPack(name);
+    if( !*pack ) return NULL;
+    uint8_t * data = (*pack)->header.image_size < FAT_BOOT_SIZE ? NULL : fatMapPack(*pack);
+    if( !data ) {
+        printf("Disk %s is too small\n", name);
+        fatClosePack(*pack);
+        return NULL;
+    }
+    *size = (*pack)->header.image_size;
+    return data;
+}
+
+/* Map a whole file read only, pack is set for containers. Returns NULL with a message if it cannot be mapped */
+static uint8_t * map_file(const char * name, size_t * size, FATpack ** pack) {
+    *pack = NULL;
+    if( fatIsPack(name) ) return map_pack(name, size, pack);
+    if( fatIsOverlay(name) ) return map_overlay(name, size);
+
+    int fd = open(name, O_RDONLY);
+    if( fd < 0 ) {
+        perror("Opening disk failed:");
+        printf("Name given %s\n", name);
+        return NULL;
+    }
+
+    struct stat stats;
+    if( fstat(fd, &stats) || stats.st_size < FAT_BOOT_SIZE ) {
+        printf("Disk %s is too small\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    void * data = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); //mapping keeps the file
+    if( data == MAP_FAILED ) {
+        perror("Mapping disk failed:");
+        return NULL;
+    }
+    *size = stats.st_size;
+    return data;
+}
+
+/* Undo map_file */
+static void unmap_file(uint8_t * data, size_t size, FATpack * pack) {
+    if( pack ) fatClosePack(pack); //owns the mapping
+    else munmap(data, size);
+}
+
+/* Make size bytes at at in the mapping of image hold the image, a no op unless it is a container */
+static void fill(FATmapped * image, const uint8_t * at, uint64_t size) {
+    if( image->pack ) fatPackFill(image->pack, at - image->data, size);
+}
+
+/* Partition table loader for containers */
+static void load_pack(void * arg, uint64_t offset, uint32_t size) {
+    fatPackFill(arg, offset, size);
+}
+
+/* Fill image for the volume of size bytes at base in the mapping
+ * Returns 0, or -1 if it does not hold a FAT12 volume */
+static int open_volume(FATmapped * image, uint8_t * data, size_t size, uint32_t base, size_t volume_size, int partition, FATpack * pack) {
+    image->data = data;
+    image->pack = pack;
+    image->size = size;
+    image->volume = data + base;
+    image->volume_size = volume_size;
+    image->base = base;
+    image->partition = partition;
+    if( volume_size < FAT_BOOT_SIZE ) return -1;
+    fill(image, image->volume, FAT_BOOT_SIZE);
+    int phase = statsPhase(STATS_PHASE_BOOT);
+    fatUnpackBoot(&image->boot, image->volume);
+    statsPhase(phase);
+
+    FATboot * boot = &image->boot;
+    if( !boot->bytes_per_sector || !boot->sectors_per_cluster || !boot->num_fats
+            || fatGetDataspaceLocation(boot, 2) > image->volume_size ) {
+        return -1;
+    }
+    fill(image, image->volume, fatGetDataspaceLocation(boot, 2)); //fats and root directory
+
+    image->table.fat = image->volume + fatGetFatStart(boot, 0);
+    image->table.size = boot->sectors_per_fat * boot->bytes_per_sector;
+    image->table.bytes_per_sector = boot->bytes_per_sector;
+    image->table.num_entries = fatGetNumClusters(boot) + 2;
+    if( image->table.num_entries > image->table.size * 2 / 3 ) image->table.num_entries = image->table.size * 2 / 3;
+    while( image->table.num_entries > 2 && fatGetDataspaceLocation(boot, image->table.num_entries) > image->volume_size ) {
+        image->table.num_entries--; //truncated image, ignore clusters past the end
+    }
+    image->table.dirty = NULL;
+    image->table.present = NULL; //whole fat is mapped
+
+    return 0;
+}
+
+/* Map an image read only. Returns NULL with a message if it cannot be mapped or is not FAT12 */
+FATmapped * fatMapImage(const char * name) {
+    size_t size;
+    FATpack * pack;
+    uint8_t * data = map_file(name, &size, &pack);
+    if( !data ) return NULL;
+
+    FATmapped * image = xmalloc(sizeof(FATmapped));
+    if( open_volume(image, data, size, 0, size, 0, pack) ) {
+        printf("Disk %s does not hold a FAT12 volume\n", name);
+        fatUnmapImage(image);
+        return NULL;
+    }
+    return image;
+}
+
+/* Unmap an image */
+void fatUnmapImage(FATmapped * image) {
+    unmap_file(image->data, image->size, image->pack);
+    xfree(image);
+}
+
+/* Map an image read only and open every FAT12 volume in it: the image itself or, if it has
+ * an MBR, each of its partitions. Partitions without a FAT12 volume are skipped with a message
+ * Returns an array of num volumes sharing one mapping, or NULL with a message if there are none
+ * Free with fatUnmapVolumes */
+FATmapped * fatMapVolumes(const char * name, int * num) {
+    size_t size;
+    FATpack * pack;
+    uint8_t * data = map_file(name, &size, &pack);
+    if( !data ) return NULL;
+
+    FATpartition parts[FAT_MBR_MAX_PARTITIONS];
+    int num_parts = fatReadPartitions(data, size, parts, pack ? load_pack : NULL, pack);
+    FATmapped * volumes = xmalloc((num_parts ? num_parts : 1) * sizeof(FATmapped));
+    *num = 0;
+
+    if( !num_parts ) { //bare volume
+        if( !open_volume(&volumes[0], data, size, 0, size, 0, pack) ) *num = 1;
+    }
+
+    int i;
+    for( i = 0; i < num_parts; i++) {
+        if( pack && parts[i].size >= FAT_BOOT_SIZE ) fatPackFill(pack, parts[i].base, FAT_BOOT_SIZE);
+        if( parts[i].size >= FAT_BOOT_SIZE && fatIsBootSector(data + parts[i].base)
+                && !open_volume(&volumes[*num], data, size, parts[i].base, parts[i].size, parts[i].number, pack) ) {
+            (*num)++;
+        } else {
+            printf("Partition %d (type 0x%02X) of %s does not hold a FAT12 volume, skipped\n", parts[i].number, parts[i].type, name);
+        }
+    }
+
+    if( !*num ) {
+        printf("Disk %s does not hold a FAT12 volume\n", name);
+        unmap_file(data, size, pack);
+        xfree(volumes);
+        return NULL;
+    }
+    return volumes;
+}
+
+/* Unmap the volumes of an image */
+void fatUnmapVolumes(FATmapped * volumes, int num) {
+    if( num > 0 ) unmap_file(volumes[0].data, volumes[0].size, volumes[0].pack);
+    xfree(volumes);
+}
+
+/* Pointer to the start of a data cluster, NULL if the cluster is out of range */
+uint8_t * fatMappedCluster(FATmapped * image, uint16_t cluster) {
+    if( cluster < 2 || cluster >= image->table.num_entries ) return NULL;
+    uint8_t * data = image->volume + fatGetDataspaceLocation(&image->boot, cluster);
+    fill(image, data, fatGetClusterSize(&image->boot));
+    return data;
+}
+
+/* Pointer to the root directory entries */
+uint8_t * fatMappedRoot(FATmapped * image) {
+    return image->volume + fatGetRootStart(&image->boot);
+}
+
+/* Feed the first size bytes of a cluster chain to fn straight from the mapping, contiguous
+ * clusters are passed as one piece. Returns bytes fed, less than size if the chain is broken */
+uint32_t fatStreamMappedChain(FATmapped * image, uint16_t cluster, uint32_t size,
+                              void (*fn)(void * arg, const void * data, size_t size), void * arg) {
+    uint32_t cluster_size = fatGetClusterSize(&image->boot);
+    uint32_t done = 0;
+    uint32_t followed = 0;
+    uint8_t * data;
+
+    while( done < size && cluster <= 0xFF0 && (data = fatMappedCluster(image, cluster)) ) {
+        uint32_t left = size - done;
+        uint32_t max = (left + cluster_size - 1) / cluster_size;
+        if( max > image->table.num_entries - cluster ) max = image->table.num_entries - cluster; //stay in the mapping
+
+        uint16_t run = fatChainRun(&image->table, cluster, max);
+        uint32_t piece = run * cluster_size < left ? run * cluster_size : left;
+        fill(image, data, piece);
+        fn(arg, data, piece);
+
+        done += piece;
+        followed += run;
+        STATS_ADD(clusters_followed, run);
+        if( followed >= image->table.num_entries ) break; //loop in chain
+        cluster = fatTableGet(&image->table, cluster + run - 1);
+    }
+    return done;
+}
+
+/* Visit entries of one directory region. Long names are gathered in lfn, which carries
+ * fragments over from the cluster before. Returns -1 if the walk was stopped,
+ * 0 if the end of directory marker was found, 1 otherwise */
+static int walk_entries(FATmapped * image, uint8_t * entries, uint32_t count, const char * path,
+                        FATlfnbuff * lfn, ADTlinkedlist * subdirs, FATwalkfn fn, void * arg) {
+    uint32_t i;
+    for( i = 0; i < count; i++) {
+        uint8_t * raw = entries + i * FAT_DIRECTORY_SIZE;
+        FATdirectory entry;
+        fatUnpackDirectory(&entry, raw);
+
+        if( entry.filename[0] == FAT_ENTRY_END ) return 0;
+        if( fatLfnAdd(lfn, raw) ) continue; //fragment of the next entry's long name
+        char name[FAT_LFN_NAME_SIZE];
+        size_t long_length = fatLfnTake(lfn, raw, name);
+        if( !fatIsVisibleEntry(&entry) ) continue;
+
+        if( !long_length ) fatFormatName(&entry, name);
+        int path_length = strlen(path);
+        char * entry_path = xmalloc(path_length + 1 + strlen(name) + 1); //room to add / + name
+        strcpy(entry_path, path);
+        entry_path[path_length] = '/';
+        strcpy(entry_path + path_length + 1, name);
+
+        if( fn(image, &entry, entry_path, arg) ) {
+            xfree(entry_path);
+            return -1;
+        }
+
+        if( (entry.attributes & FAT_ATTR_DIRECTORY) && entry.first_logical_cluster > 1 ) { //save directory for recurse
+            walk_dir * sub = xmalloc(sizeof(walk_dir));
+            sub->cluster = entry.first_logical_cluster;
+            sub->path = entry_path;
+
+            ADTlinkednode * node = xmalloc(sizeof(ADTlinkednode));
+            adtInitiateLinkedNode(node, sub);
+            adtAddEndLinkedNode(subdirs, node);
+        } else {
+            xfree(entry_path);
+        }
+    }
+    return 1;
+}
+
+/* Add visible entries of one directory region to the array. Returns 0 at the end of directory marker, 1 otherwise */
+static int collect_entries(uint8_t * entries, uint32_t num, FATdirectory ** list, uint32_t * count, uint32_t * capacity) {
+    uint32_t i;
+    for( i = 0; i < num; i++) {
+        FATdirectory entry;
+        fatUnpackDirectory(&entry, entries + i * FAT_DIRECTORY_SIZE);
+        if( entry.filename[0] == FAT_ENTRY_END ) return 0;
+        if( !fatIsVisibleEntry(&entry) ) continue;
+
+        if( *count == *capacity ) {
+            *capacity *= 2;
+            *list = xrealloc(*list, *capacity * sizeof(FATdirectory));
+        }
+        (*list)[(*count)++] = entry;
+    }
+    return 1;
+}
+
+/* Collect the visible entries of a directory, cluster 0 is the root directory
+ * Returns an array the caller must free, count is set to its length */
+FATdirectory * fatReadMappedDirectory(FATmapped * image, uint16_t cluster, uint32_t * count) {
+    uint32_t capacity = 16;
+    FATdirectory * list = xmalloc(capacity * sizeof(FATdirectory));
+    *count = 0;
+
+    if( cluster == 0 ) {
+        uint32_t root_entries = image->boot.max_root_entries;
+        if( fatGetRootStart(&image->boot) + root_entries * FAT_DIRECTORY_SIZE <= image->volume_size ) {
+            collect_entries(fatMappedRoot(image), root_entries, &list, count, &capacity);
+        }
+        return list;
+    }
+
+    uint32_t entries_per_cluster = fatGetClusterSize(&image->boot) / FAT_DIRECTORY_SIZE;
+    uint32_t followed = 0;
+    uint8_t * entries;
+    while( cluster <= 0xFF0 && (entries = fatMappedCluster(image, cluster)) && followed++ < image->table.num_entries ) {
+        STATS_ADD(clusters_followed, 1);
+        if( !collect_entries(entries, entries_per_cluster, &list, count, &capacity) ) break;
+        cluster = fatTableGet(&image->table, cluster);
+    }
+    return list;
+}
+
+/* Breadth first walk of every directory, calling fn for each visible file and directory
+ * Paths are made of long names where an entry has one */
+void fatWalkMapped(FATmapped * image, FATwalkfn fn, void * arg) {
+    ADTlinkedlist subdirs;
+    adtInitiateLinkedList(&subdirs);
+
+    uint32_t entries_per_cluster = fatGetClusterSize(&image->boot) / FAT_DIRECTORY_SIZE;
+    uint32_t root_entries = image->boot.max_root_entries;
+    int stopped = 0;
+    FATlfnbuff lfn; //reused by every directory
+    fatLfnReset(&lfn);
+
+    if( fatGetRootStart(&image->boot) + root_entries * FAT_DIRECTORY_SIZE <= image->volume_size ) {
+        stopped = walk_entries(image, fatMappedRoot(image), root_entries, "", &lfn, &subdirs, fn, arg) < 0;
+    }
+
+    while( subdirs.num > 0 ) {
+        ADTlinkednode * node = adtPopLinkedNode(&subdirs, 0);
+        walk_dir * curr_dir = node->val;
+
+        uint16_t cluster = curr_dir->cluster;
+        uint32_t followed = 0;
+        uint8_t * entries;
+        fatLfnReset(&lfn);
+        while( !stopped && cluster <= 0xFF0 && (entries = fatMappedCluster(image, cluster))
+                && followed++ < image->table.num_entries ) { //bound guards against loops
+            STATS_ADD(clusters_followed, 1);
+            int ret = walk_entries(image, entries, entries_per_cluster, curr_dir->path, &lfn, &subdirs, fn, arg);
+            if( ret < 0 ) stopped = 1;
+            if( ret <= 0 ) break;
+            cluster = fatTableGet(&image->table, cluster);
+        }
+
+        xfree(curr_dir->path);
+        xfree(curr_dir);
+        xfree(node);
+    }
+}
@@ -0,0 +1,72 @@
+/* Read only memory mapped images
+ * The whole image is mapped once and clusters, directories and the FAT are used
+ * in place, so scans over many images are bounded by how fast pages come in.
+ * Mapped images can be shared by threads since nothing is modified.
+ * A partitioned image is opened as one volume per FAT partition, all over one mapping.
+ * Containers get a private mapping that only the chunks actually touched are inflated into.
+ */
+
+#ifndef _FATMAP_H
+#define _FATMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATpack.h"
+
+/* A mapped image and the decoded boot sector of its volume */
+typedef struct FATmapped{
+    uint8_t * data; //whole mapping
+    size_t size;
+    uint8_t * volume; //start of the FAT volume in the mapping
+    size_t volume_size;
+    uint32_t base; //offset of the volume in the image, offsets from the boot sector are relative to it
+    int partition; //partition number, 0 if the image is a bare volume
+    FATpack * pack; //container the mapping is filled from, NULL for plain images
+    FATboot boot;
+    FATtable table; //fat points into the mapping, must not be set or freed
+}FATmapped;
+
+/* Called for every visible entry found by fatWalkMapped, path is the full path of the entry
+ * made of long names where there are any
+ * Return non zero to stop the walk */
+typedef int (*FATwalkfn)(FATmapped * image, FATdirectory * entry, const char * path, void * arg);
+
+
+/* Map an image read only. Returns NULL with a message if it cannot be mapped or is not FAT12 */
+FATmapped * fatMapImage(const char * name);
+
+/* Unmap an image */
+void fatUnmapImage(FATmapped * image);
+
+/* Map an image read only and open every FAT12 volume in it: the image itself or, if it has
+ * an MBR, each of its partitions. Partitions without a FAT12 volume are skipped with a message
+ * Returns an array of num volumes sharing one mapping, or NULL with a message if there are none
+ * Free with fatUnmapVolumes */
+FATmapped * fatMapVolumes(const char * name, int * num);
+
+/* Unmap the volumes of an image */
+void fatUnmapVolumes(FATmapped * volumes, int num);
+
+/* Pointer to the start of a data cluster, NULL if the cluster is out of range */
+uint8_t * fatMappedCluster(FATmapped * image, uint16_t cluster);
+
+/* Pointer to the root directory entries */
+uint8_t * fatMappedRoot(FATmapped * image);
+
+/* Feed the first size bytes of a cluster chain to fn straight from the mapping, contiguous
+ * clusters are passed as one piece. Returns bytes fed, less than size if the chain is broken */
+uint32_t fatStreamMappedChain(FATmapped * image, uint16_t cluster, uint32_t size,
+                              void (*fn)(void * arg, const void * data, size_t size), void * arg);
+
+/* Collect the visible entries of a directory, cluster 0 is the root directory
+ * Returns an array the caller must free, count is set to its length */
+FATdirectory * fatReadMappedDirectory(FATmapped * image, uint16_t cluster, uint32_t * count);
+
+/* Breadth first walk of every directory, calling fn for each visible file and directory
+ * Paths are made of long names where an entry has one */
+void fatWalkMapped(FATmapped * image, FATwalkfn fn, void * arg);
+
+#endif
@@ -0,0 +1,407 @@
+/* Copy on write overlay images
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "FAToverlay.h"
+#include "FATpack.h"
+#include "FATheaders.h"
+#include "utils.h"
+
+/* Block size used when the base does not start with a usable boot sector */
+#define FAT_OVERLAY_DEFAULT_BLOCK 512
+
+/* Largest run of blocks read or written with one call */
+#define FAT_OVERLAY_MAX_RUN 128
+
+/* Work out where the bitmap, remap table and copied blocks go from the header */
+static void layout(FAToverlay * overlay) {
+    FAToverlayheader * header = &overlay->header;
+    overlay->bitmap_offset = sizeof(FAToverlayheader) + header->base_name_size;
+    overlay->remap_offset = (overlay->bitmap_offset + (header->num_blocks + 7) / 8 + 3) & ~3u;
+    uint32_t end = overlay->remap_offset + header->num_blocks * sizeof(uint32_t);
+    header->data_start = (end + header->block_size - 1) / header->block_size * header->block_size;
+}
+
+/* Returns 1 if block is held in the delta */
+static int is_held(FAToverlay * overlay, uint32_t block) {
+    return (overlay->bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+/* Offset of byte in_block of block in the delta, the block must be held */
+static uint64_t delta_offset(FAToverlay * overlay, uint32_t block, uint32_t in_block) {
+    return overlay->header.data_start + (uint64_t) overlay->remap[block] * overlay->header.block_size + in_block;
+}
+
+/* Returns 1 if the file name is an overlay, 0 otherwise */
+int fatIsOverlay(const char * name) {
+    char magic[8];
+    int fd = open(name, O_RDONLY);
+    if( fd < 0 ) return 0;
+    int is_overlay = read(fd, magic, sizeof(magic)) == sizeof(magic) && !memcmp(magic, FAT_OVERLAY_MAGIC, sizeof(magic));
+    close(fd);
+    return is_overlay;
+}
+
+/* Make an empty overlay called name over the image base_name
+ * Returns 0, or -1 with a message if either file cannot be used */
+int fatCreateOverlay(const char * base_name, const char * name) {
+    if( fatIsOverlay(base_name) ) {
+        printf("%s is an overlay itself, commit it or use its base\n", base_name);
+        return -1;
+    }
+    if( fatIsPack(base_name) ) {
+        printf("%s is compressed, unpack it with diskpack -x first\n", base_name);
+        return -1;
+    }
+
+    char * base_path = realpath(base_name, NULL); //the overlay may be opened from anywhere
+    int base_fd = base_path ? open(base_path, O_RDONLY) : -1;
+    struct stat stats;
+    if( base_fd < 0 || fstat(base_fd, &stats) ) {
+        perror("Opening base image failed:");
+        printf("Name given %s\n", base_name);
+        if( base_path ) free(base_path);
+        if( base_fd >= 0 ) close(base_fd);
+        return -1;
+    }
+
+    uint8_t boot_buff[FAT_BOOT_SIZE];
+    memset(boot_buff, 0, sizeof(boot_buff));
+    ssize_t got = pread(base_fd, boot_buff, sizeof(boot_buff), 0);
+    close(base_fd);
+    FATboot boot;
+    fatUnpackBoot(&boot, boot_buff);
+
+    FAToverlay overlay;
+    FAToverlayheader * header = &overlay.header;
+    memset(header, 0, sizeof(FAToverlayheader));
+    memcpy(header->magic, FAT_OVERLAY_MAGIC, 8);
+    header->block_size = fatGetClusterSize(&boot);
+    if( got < (ssize_t) sizeof(boot_buff) || header->block_size < 512 || header->block_size > 65536
+            || (header->block_size & (header->block_size - 1)) ) {
+        header->block_size = FAT_OVERLAY_DEFAULT_BLOCK;
+    }
+    header->num_blocks = (stats.st_size + header->block_size - 1) / header->block_size;
+    header->base_name_size = strlen(base_path) + 1;
+    header->base_size = stats.st_size;
+    header->base_mtime_sec = stats.st_mtim.tv_sec;
+    header->base_mtime_nsec = stats.st_mtim.tv_nsec;
+    layout(&overlay);
+
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644); //never clobber an image
+    if( fd < 0 ) {
+        perror("Creating overlay failed:");
+        printf("Name given %s\n", name);
+        free(base_path);
+        return -1;
+    }
+    xpwrite(fd, header, sizeof(FAToverlayheader), 0);
+    xpwrite(fd, base_path, header->base_name_size, sizeof(FAToverlayheader));
+    int failed = ftruncate(fd, header->data_start); //bitmap and table read back as zero
+    failed = close(fd) || failed;
+    free(base_path);
+
+    if( failed ) {
+        perror("Creating overlay failed:");
+        unlink(name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Open an overlay, for writing if writable is set. Returns NULL with a message if it cannot
+ * be opened or its base changed since. Free with fatCloseOverlay */
+FAToverlay * fatOpenOverlay(const char * name, int writable) {
+    int fd = open(name, writable ? O_RDWR : O_RDONLY);
+    if( fd < 0 ) {
+        perror("Opening overlay failed:");
+        printf("Name given %s\n", name);
+        return NULL;
+    }
+
+    FAToverlay * overlay = xmalloc(sizeof(FAToverlay));
+    memset(overlay, 0, sizeof(FAToverlay));
+    overlay->delta_fd = fd;
+    overlay->base_fd = -1;
+    overlay->writable = writable;
+    FAToverlayheader * header = &overlay->header;
+
+    if( pread(fd, header, sizeof(FAToverlayheader), 0) != sizeof(FAToverlayheader)
+            || memcmp(header->magic, FAT_OVERLAY_MAGIC, 8) || !header->block_size
+            || !header->base_name_size || header->base_name_size > 4096 ) {
+        printf("%s is not an overlay\n", name);
+        fatCloseOverlay(overlay);
+        return NULL;
+    }
+    uint32_t data_start = header->data_start;
+    layout(overlay);
+    if( data_start != header->data_start ) {
+        printf("%s is not an overlay\n", name);
+        fatCloseOverlay(overlay);
+        return NULL;
+    }
+
+    overlay->base_name = xmalloc(header->base_name_size);
+    uint32_t bitmap_size = (header->num_blocks + 7) / 8;
+    overlay->bitmap = xmalloc(bitmap_size + 1);
+    overlay->remap = xmalloc(header->num_blocks * sizeof(uint32_t) + 1);
+    xpread(fd, overlay->base_name, header->base_name_size, sizeof(FAToverlayheader));
+    xpread(fd, overlay->bitmap, bitmap_size, overlay->bitmap_offset);
+    xpread(fd, overlay->remap, header->num_blocks * sizeof(uint32_t), overlay->remap_offset);
+    overlay->base_name[header->base_name_size - 1] = 0;
+
+    uint32_t block;
+    for( block = 0; block < header->num_blocks; block++) {
+        if( is_held(overlay, block) && overlay->remap[block] >= header->num_used ) {
+            printf("Overlay %s is damaged, block %u points past its data\n", name, block);
+            fatCloseOverlay(overlay);
+            return NULL;
+        }
+    }
+
+    struct stat stats;
+    overlay->base_fd = open(overlay->base_name, O_RDONLY);
+    if( overlay->base_fd < 0 || fstat(overlay->base_fd, &stats) ) {
+        perror("Opening base image failed:");
+        printf("Base of %s is %s\n", name, overlay->base_name);
+        fatCloseOverlay(overlay);
+        return NULL;
+    }
+    if( (uint64_t) stats.st_size != header->base_size || stats.st_mtim.tv_sec != header->base_mtime_sec
+            || stats.st_mtim.tv_nsec != header->base_mtime_nsec ) {
+        printf("Base image %s changed since overlay %s was made\n", overlay->base_name, name);
+        fatCloseOverlay(overlay);
+        return NULL;
+    }
+
+    return overlay;
+}
+
+/* Read up to size bytes of the image at offset. Returns the bytes read, short only at the end */
+size_t fatOverlayRead(FAToverlay * overlay, void * buff, size_t size, uint64_t offset) {
+    uint64_t image_size = overlay->header.base_size;
+    uint32_t block_size = overlay->header.block_size;
+    if( offset >= image_size ) return 0;
+    if( size > image_size - offset ) size = image_size - offset;
+
+    uint8_t * out = buff;
+    size_t done = 0;
+    while( done < size ) { //runs of blocks that are in the same place read with one call
+        uint64_t at = offset + done;
+        uint32_t block = at / block_size;
+        uint32_t in_block = at % block_size;
+        int held = is_held(overlay, block);
+
+        uint32_t run = 1;
+        while( (uint64_t) (block + run) * block_size < offset + size && is_held(overlay, block + run) == held
+                && (!held || overlay->remap[block + run] == overlay->remap[block] + run) ) run++;
+
+        size_t piece = (size_t) run * block_size - in_block;
+        if( piece > size - done ) piece = size - done;
+        if( held ) xpread(overlay->delta_fd, out + done, piece, delta_offset(overlay, block, in_block));
+        else xpread(overlay->base_fd, out + done, piece, at);
+        done += piece;
+    }
+    return size;
+}
+
+/* Copy blocks [block, block + run) into new slots at the end of the delta with piece bytes
+ * of in written at in_block of the first one, then record them in the bitmap and table */
+static void copy_up(FAToverlay * overlay, uint32_t block, uint32_t run, uint32_t in_block, const uint8_t * in, size_t piece) {
+    FAToverlayheader * header = &overlay->header;
+    uint32_t block_size = header->block_size;
+    uint8_t * data = xmalloc((size_t) run * block_size);
+
+    if( in_block || piece < (size_t) run * block_size ) { //edges keep what the base holds
+        memset(data, 0, (size_t) run * block_size);
+        fatOverlayRead(overlay, data, (size_t) run * block_size, (uint64_t) block * block_size);
+    }
+    memcpy(data + in_block, in, piece);
+
+    uint32_t slot = header->num_used;
+    xpwrite(overlay->delta_fd, data, (size_t) run * block_size, header->data_start + (uint64_t) slot * block_size);
+    xfree(data);
+
+    /* Data first, then the count, then the table, so a crash at worst leaks slots */
+    header->num_used += run;
+    xpwrite(overlay->delta_fd, header, sizeof(FAToverlayheader), 0);
+
+    uint32_t i;
+    for( i = 0; i < run; i++) {
+        overlay->remap[block + i] = slot + i;
+        overlay->bitmap[(block + i) / 8] |= 1 << ((block + i) % 8);
+    }
+    xpwrite(overlay->delta_fd, overlay->remap + block, run * sizeof(uint32_t), overlay->remap_offset + block * sizeof(uint32_t));
+    uint32_t first_byte = block / 8;
+    uint32_t last_byte = (block + run - 1) / 8;
+    xpwrite(overlay->delta_fd, overlay->bitmap + first_byte, last_byte - first_byte + 1, overlay->bitmap_offset + first_byte);
+}
+
+/* Write up to size bytes at offset, copying touched blocks into the delta first
+ * Returns the bytes written, short only at the end of the image, or 0 on an error */
+size_t fatOverlayWrite(FAToverlay * overlay, const void * buff, size_t size, uint64_t offset) {
+    uint64_t image_size = overlay->header.base_size;
+    uint32_t block_size = overlay->header.block_size;
+    if( !overlay->writable || offset >= image_size ) return 0;
+    if( size > image_size - offset ) size = image_size - offset;
+
+    const uint8_t * in = buff;
+    size_t done = 0;
+    while( done < size ) {
+        uint64_t at = offset + done;
+        uint32_t block = at / block_size;
+        uint32_t in_block = at % block_size;
+        int held = is_held(overlay, block);
+
+        uint32_t run = 1;
+        while( run < FAT_OVERLAY_MAX_RUN && (uint64_t) (block + run) * block_size < offset + size
+                && is_held(overlay, block + run) == held
+                && (!held || overlay->remap[block + run] == overlay->remap[block] + run) ) run++;
+
+        size_t piece = (size_t) run * block_size - in_block;
+        if( piece > size - done ) piece = size - done;
+        if( held ) xpwrite(overlay->delta_fd, in + done, piece, delta_offset(overlay, block, in_block));
+        else copy_up(overlay, block, run, in_block, in + done, piece);
+        done += piece;
+    }
+    return size;
+}
+
+/* Write every block held in the delta back into the base and empty the overlay
+ * Returns the number of blocks written, or -1 with a message on failure */
+int64_t fatCommitOverlay(FAToverlay * overlay) {
+    FAToverlayheader * header = &overlay->header;
+    uint32_t block_size = header->block_size;
+    if( !overlay->writable ) {
+        printf("Overlay is open read only, cannot commit\n");
+        return -1;
+    }
+
+    int fd = open(overlay->base_name, O_RDWR);
+    if( fd < 0 ) {
+        perror("Opening base image for writing failed:");
+        printf("Base is %s\n", overlay->base_name);
+        return -1;
+    }
+
+    uint8_t * buff = xmalloc(FAT_OVERLAY_MAX_RUN * block_size);
+    int64_t written = 0;
+    uint32_t block = 0;
+    while( block < header->num_blocks ) {
+        if( !is_held(overlay, block) ) {
+            block++;
+            continue;
+        }
+        uint32_t run = 1;
+        while( run < FAT_OVERLAY_MAX_RUN && block + run < header->num_blocks && is_held(overlay, block + run) ) run++;
+
+        uint64_t at = (uint64_t) block * block_size;
+        size_t got = fatOverlayRead(overlay, buff, (size_t) run * block_size, at);
+        xpwrite(fd, buff, got, at);
+        written += run;
+        block += run;
+    }
+    xfree(buff);
+
+    struct stat stats;
+    int failed = fsync(fd) || fstat(fd, &stats);
+    failed = close(fd) || failed;
+    if( failed ) {
+        perror("Writing base image failed:");
+        return -1;
+    }
+
+    /* Empty the delta and take the base as it is now */
+    memset(overlay->bitmap, 0, (header->num_blocks + 7) / 8);
+    memset(overlay->remap, 0, header->num_blocks * sizeof(uint32_t));
+    header->num_used = 0;
+    header->base_mtime_sec = stats.st_mtim.tv_sec;
+    header->base_mtime_nsec = stats.st_mtim.tv_nsec;
+    if( ftruncate(overlay->delta_fd, overlay->bitmap_offset) || ftruncate(overlay->delta_fd, header->data_start) ) {
+        perror("Emptying overlay failed:");
+        return -1;
+    }
+    xpwrite(overlay->delta_fd, header, sizeof(FAToverlayheader), 0);
+
+    return written;
+}
+
+/* Close an overlay */
+void fatCloseOverlay(FAToverlay * overlay) {
+    if( overlay->delta_fd >= 0 ) close(overlay->delta_fd);
+    if( overlay->base_fd >= 0 ) close(overlay->base_fd);
+    if( overlay->base_name ) xfree(overlay->base_name);
+    if( overlay->bitmap ) xfree(overlay->bitmap);
+    if( overlay->remap ) xfree(overlay->remap);
+    xfree(overlay);
+}
+
+/* Stream callbacks for fopencookie, the position is kept in the overlay */
+static ssize_t stream_read(void * cookie, char * buff, size_t size) {
+    FAToverlay * overlay = cookie;
+    size_t got = fatOverlayRead(overlay, buff, size, overlay->position);
+    overlay->position += got;
+    return got;
+}
+
+static ssize_t stream_write(void * cookie, const char * buff, size_t size) {
+    FAToverlay * overlay = cookie;
+    size_t done = fatOverlayWrite(overlay, buff, size, overlay->position);
+    if( !done ) errno = overlay->writable ? ENOSPC : EBADF; //overlays never grow
+    overlay->position += done;
+    return done;
+}
+
+static int stream_seek(void * cookie, off64_t * offset, int whence) {
+    FAToverlay * overlay = cookie;
+    int64_t from = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (int64_t) overlay->position : (int64_t) overlay->header.base_size;
+    if( from + *offset < 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    overlay->position = from + *offset;
+    *offset = overlay->position;
+    return 0;
+}
+
+static int stream_close(void * cookie) {
+    fatCloseOverlay(cookie);
+    return 0;
+}
+
+/* Open an image, an overlay or a container with fopen style mode. An overlay opened with a
+ * read mode gives a stream reading through to its base, with r+ writes go to the delta.
+ * Containers only open for reading. Such streams have no file descriptor, fileno returns -1
+ * Returns NULL on failure like fopen */
+FILE * fatOpenImage(const char * name, const char * mode) {
+    if( mode[0] == 'r' && fatIsPack(name) ) {
+        if( strchr(mode, '+') ) {
+            printf("%s is compressed, unpack it with diskpack -x to write to it\n", name);
+            errno = EROFS;
+            return NULL;
+        }
+        return fatOpenPackStream(name);
+    }
+    if( mode[0] != 'r' || !fatIsOverlay(name) ) return fopen(name, mode);
+
+    FAToverlay * overlay = fatOpenOverlay(name, strchr(mode, '+') != NULL);
+    if( !overlay ) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cookie_io_functions_t functions = {stream_read, stream_write, stream_seek, stream_close};
+    FILE * stream = fopencookie(overlay, mode, functions);
+    if( !stream ) fatCloseOverlay(overlay);
+    return stream;
+}
@@ -0,0 +1,82 @@
+/* Copy on write overlay images
+ * An overlay is a small delta file standing for a read only base image. The base is
+ * split into blocks of its cluster size; a block that was written is copied into the
+ * delta once and found again through an allocation bitmap and a remap table, every
+ * other block is read straight from the base. Making an overlay writes only the header,
+ * so cloning an image per job costs kilobytes. fatOpenImage hands out a stdio stream
+ * over any kind of image so tools do not need to know which one they were given.
+ *
+ * Delta layout: header, base path with its null, bitmap, remap table, then the copied
+ * blocks from data_start on. The bitmap and table start zeroed as a sparse region.
+ */
+
+#ifndef _FATOVERLAY_H
+#define _FATOVERLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define FAT_OVERLAY_MAGIC "FATOVL01"
+
+/* Start of an overlay file */
+typedef struct FAToverlayheader{
+    char magic[8];
+    uint32_t block_size; //bytes per block, the cluster size of the base
+    uint32_t num_blocks; //blocks covering the base
+    uint32_t num_used; //blocks copied into the delta
+    uint32_t base_name_size; //bytes of the base path after the header, with its null
+    uint32_t data_start; //offset of the first copied block, a multiple of block_size
+    uint32_t reserved;
+    uint64_t base_size; //the base must keep this size and modification time
+    int64_t base_mtime_sec;
+    int64_t base_mtime_nsec;
+}FAToverlayheader;
+
+/* An open overlay */
+typedef struct FAToverlay{
+    FAToverlayheader header;
+    char * base_name;
+    int base_fd; //read only unless committing
+    int delta_fd;
+    int writable;
+    uint8_t * bitmap; //bit set for blocks held in the delta
+    uint32_t * remap; //slot in the delta of each block with its bit set
+    uint32_t bitmap_offset; //where the bitmap and table are in the delta
+    uint32_t remap_offset;
+    uint64_t position; //of the stream from fatOpenImage
+}FAToverlay;
+
+
+/* Returns 1 if the file name is an overlay, 0 otherwise */
+int fatIsOverlay(const char * name);
+
+/* Make an empty overlay called name over the image base_name
+ * Returns 0, or -1 with a message if either file cannot be used */
+int fatCreateOverlay(const char * base_name, const char * name);
+
+/* Open an overlay, for writing if writable is set. Returns NULL with a message if it cannot
+ * be opened or its base changed since. Free with fatCloseOverlay */
+FAToverlay * fatOpenOverlay(const char * name, int writable);
+
+/* Read up to size bytes of the image at offset. Returns the bytes read, short only at the end */
+size_t fatOverlayRead(FAToverlay * overlay, void * buff, size_t size, uint64_t offset);
+
+/* Write up to size bytes at offset, copying touched blocks into the delta first
+ * Returns the bytes written, short only at the end of the image, or 0 on an error */
+size_t fatOverlayWrite(FAToverlay * overlay, const void * buff, size_t size, uint64_t offset);
+
+/* Write every block held in the delta back into the base and empty the overlay
+ * Returns the number of blocks written, or -1 with a message on failure */
+int64_t fatCommitOverlay(FAToverlay * overlay);
+
+/* Close an overlay */
+void fatCloseOverlay(FAToverlay * overlay);
+
+/* Open an image, an overlay or a container with fopen style mode. An overlay opened with a
+ * read mode gives a stream reading through to its base, with r+ writes go to the delta.
+ * Containers only open for reading. Such streams have no file descriptor, fileno returns -1
+ * Returns NULL on failure like fopen */
+FILE * fatOpenImage(const char * name, const char * mode);
+
+#endif
@@ -0,0 +1,307 @@
+/* Compressed image containers
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "FATpack.h"
+#include "utils.h"
+
+/* Bytes of image held by chunk, only the last one is short */
+static uint32_t chunk_length(FATpack * pack, uint32_t chunk) {
+    uint64_t start = (uint64_t) chunk * pack->header.chunk_size;
+    uint64_t left = pack->header.image_size - start;
+    return left < pack->header.chunk_size ? left : pack->header.chunk_size;
+}
+
+/* Inflate chunk into out, which holds its length. Aborts if the chunk is damaged */
+static void inflate_chunk(FATpack * pack, uint32_t chunk, uint8_t * out) {
+    uint32_t length = chunk_length(pack, chunk);
+    uint64_t stored = pack->index[chunk + 1] - pack->index[chunk];
+
+    if( stored == length ) { //did not shrink, kept as it is
+        xpread(pack->fd, out, length, pack->index[chunk]);
+    } else {
+        xpread(pack->fd, pack->compressed, stored, pack->index[chunk]);
+        uLongf out_length = length;
+        if( uncompress(out, &out_length, pack->compressed, stored) != Z_OK || out_length != length ) {
+            printf("FATAL: chunk %u of the container is damaged\n", chunk);
+            abort();
+        }
+    }
+    pack->inflated++;
+}
+
+/* Returns 1 if the file name is a container, 0 otherwise */
+int fatIsPack(const char * name) {
+    char magic[8];
+    int fd = open(name, O_RDONLY);
+    if( fd < 0 ) return 0;
+    int is_pack = read(fd, magic, sizeof(magic)) == sizeof(magic) && !memcmp(magic, FAT_PACK_MAGIC, sizeof(magic));
+    close(fd);
+    return is_pack;
+}
+
+/* Compress the image image_name into a new container called name with chunks of chunk_size bytes
+ * Returns the size of the container, or 0 with a message on failure */
+uint64_t fatPackImage(const char * image_name, const char * name, uint32_t chunk_size) {
+    int in_fd = open(image_name, O_RDONLY);
+    struct stat stats;
+    if( in_fd < 0 || fstat(in_fd, &stats) ) {
+        perror("Opening image failed:");
+        printf("Name given %s\n", image_name);
+        if( in_fd >= 0 ) close(in_fd);
+        return 0;
+    }
+
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644); //never clobber an image
+    if( fd < 0 ) {
+        perror("Creating container failed:");
+        printf("Name given %s\n", name);
+        close(in_fd);
+        return 0;
+    }
+
+    FATpackheader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FAT_PACK_MAGIC, 8);
+    header.chunk_size = chunk_size;
+    header.image_size = stats.st_size;
+    header.num_chunks = (header.image_size + chunk_size - 1) / chunk_size;
+
+    uint64_t * index = xmalloc((header.num_chunks + 1) * sizeof(uint64_t));
+    uint8_t * chunk = xmalloc(chunk_size);
+    uLong bound = compressBound(chunk_size);
+    uint8_t * out = xmalloc(bound);
+
+    uint64_t offset = sizeof(FATpackheader);
+    uint32_t i;
+    for( i = 0; i < header.num_chunks; i++) {
+        uint64_t start = (uint64_t) i * chunk_size;
+        uint32_t length = header.image_size - start < chunk_size ? header.image_size - start : chunk_size;
+        xpread(in_fd, chunk, length, start);
+
+        uLongf stored = bound;
+        if( compress2(out, &stored, chunk, length, Z_DEFAULT_COMPRESSION) != Z_OK || stored >= length ) {
+            memcpy(out, chunk, length); //incompressible, a stored size equal to the length marks it
+            stored = length;
+        }
+        index[i] = offset;
+        xpwrite(fd, out, stored, offset);
+        offset += stored;
+    }
+    index[header.num_chunks] = offset;
+    header.index_offset = offset;
+    xpwrite(fd, index, (header.num_chunks + 1) * sizeof(uint64_t), offset);
+    xpwrite(fd, &header, sizeof(header), 0); //last, a container cut short has no magic
+    offset += (header.num_chunks + 1) * sizeof(uint64_t);
+
+    xfree(index);
+    xfree(chunk);
+    xfree(out);
+    close(in_fd);
+    if( close(fd) ) {
+        perror("Writing container failed:");
+        unlink(name);
+        return 0;
+    }
+    return offset;
+}
+
+/* Open a container. Returns NULL with a message if it cannot be read. Free with fatClosePack */
+FATpack * fatOpenPack(const char * name) {
+    int fd = open(name, O_RDONLY);
+    if( fd < 0 ) {
+        perror("Opening container failed:");
+        printf("Name given %s\n", name);
+        return NULL;
+    }
+
+    FATpack * pack = xmalloc(sizeof(FATpack));
+    memset(pack, 0, sizeof(FATpack));
+    pack->fd = fd;
+    FATpackheader * header = &pack->header;
+    struct stat stats;
+
+    if( fstat(fd, &stats) || pread(fd, header, sizeof(FATpackheader), 0) != sizeof(FATpackheader)
+            || memcmp(header->magic, FAT_PACK_MAGIC, 8) || !header->chunk_size || header->chunk_size % 512
+            || header->num_chunks != (header->image_size + header->chunk_size - 1) / header->chunk_size
+            || header->index_offset + (header->num_chunks + 1) * sizeof(uint64_t) != (uint64_t) stats.st_size ) {
+        printf("%s is not a container\n", name);
+        close(fd);
+        xfree(pack);
+        return NULL;
+    }
+
+    pack->index = xmalloc((header->num_chunks + 1) * sizeof(uint64_t));
+    xpread(fd, pack->index, (header->num_chunks + 1) * sizeof(uint64_t), header->index_offset);
+    uLong bound = compressBound(header->chunk_size);
+    uint32_t i;
+    for( i = 0; i < header->num_chunks; i++) {
+        if( pack->index[i] < sizeof(FATpackheader) || pack->index[i + 1] <= pack->index[i]
+                || pack->index[i + 1] - pack->index[i] > bound ) break;
+    }
+    if( i < header->num_chunks || pack->index[header->num_chunks] != header->index_offset ) {
+        printf("Container %s is damaged, its index is out of order\n", name);
+        fatClosePack(pack);
+        return NULL;
+    }
+    pack->compressed = xmalloc(bound);
+
+    pack->capacity = envNumber("FATPACK_CHUNKS", FAT_PACK_DEFAULT_CACHE);
+    if( !pack->capacity ) pack->capacity = 1;
+    pack->slots = xmalloc((size_t) pack->capacity * header->chunk_size);
+    pack->slot_chunk = xmalloc(pack->capacity * sizeof(uint32_t));
+    pack->slot_used = xmalloc(pack->capacity * sizeof(uint64_t));
+    memset(pack->slot_used, 0, pack->capacity * sizeof(uint64_t));
+    pthread_mutex_init(&pack->lock, NULL);
+
+    return pack;
+}
+
+/* Slot holding chunk inflated, inflating it over the least recently used one if needed */
+static uint8_t * get_chunk(FATpack * pack, uint32_t chunk) {
+    uint32_t oldest = 0;
+    uint32_t i;
+    for( i = 0; i < pack->capacity; i++) { //small, a scan is cheaper than a hash
+        if( pack->slot_used[i] && pack->slot_chunk[i] == chunk ) break;
+        if( pack->slot_used[i] < pack->slot_used[oldest] ) oldest = i;
+    }
+
+    uint8_t * data;
+    if( i < pack->capacity ) {
+        data = pack->slots + (size_t) i * pack->header.chunk_size;
+    } else {
+        i = oldest;
+        data = pack->slots + (size_t) i * pack->header.chunk_size;
+        inflate_chunk(pack, chunk, data);
+        pack->slot_chunk[i] = chunk;
+    }
+    pack->slot_used[i] = ++pack->clock;
+    return data;
+}
+
+/* Read up to size bytes of the image at offset through the inflated chunk cache
+ * Returns the bytes read, short only at the end */
+size_t fatPackRead(FATpack * pack, void * buff, size_t size, uint64_t offset) {
+    uint64_t image_size = pack->header.image_size;
+    if( offset >= image_size ) return 0;
+    if( size > image_size - offset ) size = image_size - offset;
+
+    uint8_t * out = buff;
+    size_t done = 0;
+    pthread_mutex_lock(&pack->lock);
+    while( done < size ) {
+        uint64_t at = offset + done;
+        uint32_t chunk = at / pack->header.chunk_size;
+        uint32_t in_chunk = at % pack->header.chunk_size;
+        size_t piece = chunk_length(pack, chunk) - in_chunk;
+        if( piece > size - done ) piece = size - done;
+
+        memcpy(out + done, get_chunk(pack, chunk) + in_chunk, piece);
+        done += piece;
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return size;
+}
+
+/* Reserve an anonymous mapping the size of the image, holding nothing until fatPackFill
+ * inflates chunks into it. It is freed by fatClosePack */
+uint8_t * fatMapPack(FATpack * pack) {
+    if( pack->map ) return pack->map;
+    void * map = mmap(NULL, pack->header.image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if( map == MAP_FAILED ) {
+        perror("Mapping container failed:");
+        return NULL;
+    }
+    pack->map = map;
+    pack->filled = xmalloc(pack->header.num_chunks / 8 + 1);
+    memset(pack->filled, 0, pack->header.num_chunks / 8 + 1);
+    return pack->map;
+}
+
+/* Make size bytes at offset of the mapping hold the image, inflating missing chunks */
+void fatPackFill(FATpack * pack, uint64_t offset, uint64_t size) {
+    uint64_t image_size = pack->header.image_size;
+    if( !size || offset >= image_size ) return;
+    if( size > image_size - offset ) size = image_size - offset;
+
+    uint32_t first = offset / pack->header.chunk_size;
+    uint32_t last = (offset + size - 1) / pack->header.chunk_size;
+    pthread_mutex_lock(&pack->lock);
+    uint32_t chunk;
+    for( chunk = first; chunk <= last; chunk++) {
+        if( (pack->filled[chunk / 8] >> (chunk % 8)) & 1 ) continue;
+        inflate_chunk(pack, chunk, pack->map + (uint64_t) chunk * pack->header.chunk_size);
+        pack->filled[chunk / 8] |= 1 << (chunk % 8);
+    }
+    pthread_mutex_unlock(&pack->lock);
+}
+
+/* Close a container and its mapping */
+void fatClosePack(FATpack * pack) {
+    if( pack->map ) {
+        munmap(pack->map, pack->header.image_size);
+        xfree(pack->filled);
+    }
+    if( pack->slots ) {
+        xfree(pack->slots);
+        xfree(pack->slot_chunk);
+        xfree(pack->slot_used);
+        xfree(pack->compressed);
+        pthread_mutex_destroy(&pack->lock);
+    }
+    xfree(pack->index);
+    close(pack->fd);
+    xfree(pack);
+}
+
+/* Stream callbacks for fopencookie, the position is kept in the container */
+static ssize_t stream_read(void * cookie, char * buff, size_t size) {
+    FATpack * pack = cookie;
+    size_t got = fatPackRead(pack, buff, size, pack->position);
+    pack->position += got;
+    return got;
+}
+
+static int stream_seek(void * cookie, off64_t * offset, int whence) {
+    FATpack * pack = cookie;
+    int64_t from = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (int64_t) pack->position : (int64_t) pack->header.image_size;
+    if( from + *offset < 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+    pack->position = from + *offset;
+    *offset = pack->position;
+    return 0;
+}
+
+static int stream_close(void * cookie) {
+    fatClosePack(cookie);
+    return 0;
+}
+
+/* Open a container as a read only stream, fileno returns -1 on it. Returns NULL on failure */
+FILE * fatOpenPackStream(const char * name) {
+    FATpack * pack = fatOpenPack(name);
+    if( !pack ) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cookie_io_functions_t functions = {stream_read, NULL, stream_seek, stream_close};
+    FILE * stream = fopencookie(pack, "r", functions);
+    if( !stream ) fatClosePack(pack);
+    return stream;
+}
@@ -0,0 +1,87 @@
+/* Compressed image containers
+ * A container holds an image as fixed size chunks compressed one by one with zlib, followed
+ * by an index of where each chunk starts, so any byte range can be read by inflating only
+ * the chunks under it. Streams keep a small least recently used set of inflated chunks;
+ * mapped readers get an anonymous mapping that chunks are inflated into as they are touched.
+ * Containers are read only, diskpack makes them from raw images and turns them back.
+ *
+ * Layout: header, the chunks in order, then num_chunks + 1 offsets, the last being the
+ * index itself. A chunk whose stored size equals its length is kept uncompressed.
+ */
+
+#ifndef _FATPACK_H
+#define _FATPACK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define FAT_PACK_MAGIC "FATPAK01"
+
+/* Bytes per chunk when none is given */
+#define FAT_PACK_DEFAULT_CHUNK (64 * 1024)
+
+/* Inflated chunks kept by a stream when FATPACK_CHUNKS is not set */
+#define FAT_PACK_DEFAULT_CACHE 8
+
+/* Start of a container file */
+typedef struct FATpackheader{
+    char magic[8];
+    uint32_t chunk_size; //bytes of image per chunk, a multiple of 512
+    uint32_t num_chunks;
+    uint64_t image_size;
+    uint64_t index_offset; //where the chunk offsets are
+}FATpackheader;
+
+/* An open container */
+typedef struct FATpack{
+    FATpackheader header;
+    int fd;
+    uint64_t * index; //num_chunks + 1 offsets
+    uint8_t * compressed; //one stored chunk
+
+    /* Inflated chunks for fatPackRead */
+    uint32_t capacity;
+    uint8_t * slots; //capacity chunks
+    uint32_t * slot_chunk;
+    uint64_t * slot_used; //clock value of last use, 0 for an empty slot
+    uint64_t clock;
+
+    /* Mapping filled by fatPackFill */
+    uint8_t * map;
+    uint8_t * filled; //bit set for chunks inflated into map
+    pthread_mutex_t lock; //threads share the mapping
+
+    uint64_t position; //of the stream from fatOpenPackStream
+    uint64_t inflated; //chunks inflated so far
+}FATpack;
+
+
+/* Returns 1 if the file name is a container, 0 otherwise */
+int fatIsPack(const char * name);
+
+/* Compress the image image_name into a new container called name with chunks of chunk_size bytes
+ * Returns the size of the container, or 0 with a message on failure */
+uint64_t fatPackImage(const char * image_name, const char * name, uint32_t chunk_size);
+
+/* Open a container. Returns NULL with a message if it cannot be read. Free with fatClosePack */
+FATpack * fatOpenPack(const char * name);
+
+/* Read up to size bytes of the image at offset through the inflated chunk cache
+ * Returns the bytes read, short only at the end */
+size_t fatPackRead(FATpack * pack, void * buff, size_t size, uint64_t offset);
+
+/* Reserve an anonymous mapping the size of the image, holding nothing until fatPackFill
+ * inflates chunks into it. It is freed by fatClosePack */
+uint8_t * fatMapPack(FATpack * pack);
+
+/* Make size bytes at offset of the mapping hold the image, inflating missing chunks */
+void fatPackFill(FATpack * pack, uint64_t offset, uint64_t size);
+
+/* Close a container and its mapping */
+void fatClosePack(FATpack * pack);
+
+/* Open a container as a read only stream, fileno returns -1 on it. Returns NULL on failure */
+FILE * fatOpenPackStream(const char * name);
+
+#endif
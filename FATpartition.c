@@ -0,0 +1,82 @@
+/* MBR partition tables
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "FATpartition.h"
+
+/* Reads a 32bit little endian value */
+static uint32_t read_uint32(const uint8_t * buff) {
+    return buff[0] | (buff[1] << 8) | (buff[2] << 16) | ((uint32_t) buff[3] << 24);
+}
+
+/* Returns 1 for the types of extended partitions, whose first sector holds another table */
+static int is_extended(uint8_t type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+/* Returns 1 if sector looks like the boot sector of a FAT volume, 0 otherwise */
+int fatIsBootSector(const uint8_t * sector) {
+    if( sector[0] != 0xEB && sector[0] != 0xE9 ) return 0; //starts with a jump
+    uint16_t bytes_per_sector = sector[11] | (sector[12] << 8);
+    uint8_t sectors_per_cluster = sector[13];
+    uint16_t reserved_sectors = sector[14] | (sector[15] << 8);
+    return bytes_per_sector >= 512 && bytes_per_sector <= 4096 && !(bytes_per_sector & (bytes_per_sector - 1))
+            && sectors_per_cluster && !(sectors_per_cluster & (sectors_per_cluster - 1))
+            && reserved_sectors && sector[16]; //at least one fat
+}
+
+/* Add the partition in a table entry, its start relative to first_sector. Returns the new count */
+static int add_partition(const uint8_t * entry, uint32_t first_sector, size_t size, int number, FATpartition * parts, int num) {
+    uint64_t base = ((uint64_t) first_sector + read_uint32(entry + 8)) * FAT_MBR_SECTOR_SIZE;
+    uint64_t length = (uint64_t) read_uint32(entry + 12) * FAT_MBR_SECTOR_SIZE;
+    if( base >= size || base > UINT32_MAX ) return num; //starts past the image
+    if( base + length > size ) length = size - base;
+
+    parts[num].number = number;
+    parts[num].type = entry[4];
+    parts[num].base = base;
+    parts[num].size = length > UINT32_MAX ? UINT32_MAX : length;
+    return num + 1;
+}
+
+/* Read the partition table of an image held in memory into parts, which must hold
+ * FAT_MBR_MAX_PARTITIONS entries. Extended partitions are followed but not listed
+ * load may be NULL, otherwise it is called before every table is read
+ * Returns the number of partitions, 0 if the image is a bare volume or has no table */
+int fatReadPartitions(const uint8_t * image, size_t size, FATpartition * parts, FATloadfn load, void * arg) {
+    if( load && size >= FAT_MBR_SECTOR_SIZE ) load(arg, 0, FAT_MBR_SECTOR_SIZE);
+    if( size < FAT_MBR_SECTOR_SIZE || image[510] != 0x55 || image[511] != 0xAA ) return 0;
+    if( fatIsBootSector(image) ) return 0; //a floppy style volume carries the same signature
+
+    int num = 0;
+    uint32_t extended = 0; //first sector of the extended partition
+    int i;
+    for( i = 0; i < FAT_MBR_ENTRIES; i++) {
+        const uint8_t * entry = image + FAT_MBR_TABLE + i * FAT_MBR_ENTRY_SIZE;
+        if( entry[0] != 0x00 && entry[0] != 0x80 ) return 0; //not a partition table
+        if( !entry[4] ) continue;
+        if( is_extended(entry[4]) ) extended = read_uint32(entry + 8);
+        else num = add_partition(entry, 0, size, i + 1, parts, num);
+    }
+
+    /* Logical partitions, each table starts with one and links to the next table */
+    uint32_t table = extended;
+    int number = FAT_MBR_ENTRIES + 1;
+    while( extended && num < FAT_MBR_MAX_PARTITIONS ) {
+        uint64_t offset = (uint64_t) table * FAT_MBR_SECTOR_SIZE;
+        if( offset + FAT_MBR_SECTOR_SIZE > size ) break;
+        if( load ) load(arg, offset, FAT_MBR_SECTOR_SIZE);
+        const uint8_t * ebr = image + offset;
+        if( ebr[510] != 0x55 || ebr[511] != 0xAA ) break;
+
+        const uint8_t * entry = ebr + FAT_MBR_TABLE;
+        if( entry[4] ) num = add_partition(entry, table, size, number++, parts, num);
+
+        const uint8_t * next = entry + FAT_MBR_ENTRY_SIZE;
+        if( !is_extended(next[4]) || !read_uint32(next + 8) ) break;
+        table = extended + read_uint32(next + 8);
+    }
+    return num;
+}
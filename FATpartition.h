@@ -0,0 +1,42 @@
+/* MBR partition tables
+ * Hard disk images start with a master boot record whose table lists up to four
+ * partitions, one of which may be an extended partition holding a chain of logical
+ * ones. Each FAT partition is a whole volume starting at its own byte offset.
+ */
+
+#ifndef _FATPARTITION_H
+#define _FATPARTITION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FAT_MBR_SECTOR_SIZE 512
+#define FAT_MBR_TABLE 446 //offset of the partition table in the mbr
+#define FAT_MBR_ENTRY_SIZE 16
+#define FAT_MBR_ENTRIES 4
+#define FAT_MBR_MAX_PARTITIONS 64 //primary and logical, bounds a looping chain
+
+/* One partition of an image */
+typedef struct FATpartition{
+    int number; //1 to 4 for primary partitions, 5 on for logical ones
+    uint8_t type; //partition type byte, 0x01 for FAT12
+    uint32_t base; //offset of its first byte in the image
+    uint32_t size; //bytes, cut to what the image holds
+}FATpartition;
+
+
+/* Called with the offset and size of each table before it is read, for images whose
+ * bytes are brought into memory as they are needed */
+typedef void (*FATloadfn)(void * arg, uint64_t offset, uint32_t size);
+
+
+/* Returns 1 if sector looks like the boot sector of a FAT volume, 0 otherwise */
+int fatIsBootSector(const uint8_t * sector);
+
+/* Read the partition table of an image held in memory into parts, which must hold
+ * FAT_MBR_MAX_PARTITIONS entries. Extended partitions are followed but not listed
+ * load may be NULL, otherwise it is called before every table is read
+ * Returns the number of partitions, 0 if the image is a bare volume or has no table */
+int fatReadPartitions(const uint8_t * image, size_t size, FATpartition * parts, FATloadfn load, void * arg);
+
+#endif
@@ -0,0 +1,276 @@
+/* Saved directory tree of an image
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "FATsnapshot.h"
+#include "FATheaders.h"
+#include "FATcache.h"
+#include "digest.h"
+#include "utils.h"
+
+/* Name of the snapshot file of an image, or of one of its partitions if partition is not 0
+ * Caller must free */
+char * fatSnapshotName(const char * image_name, int partition) {
+    char * name = xmalloc(strlen(image_name) + strlen(FAT_SNAPSHOT_SUFFIX) + 16);
+    if( partition ) sprintf(name, "%s.p%d%s", image_name, partition, FAT_SNAPSHOT_SUFFIX);
+    else sprintf(name, "%s%s", image_name, FAT_SNAPSHOT_SUFFIX);
+    return name;
+}
+
+/* Hash of the first fat and the root directory, read through the cache */
+uint64_t fatSnapshotChecksum(FATcache * cache, FATboot * boot) {
+    uint32_t fat_size = boot->sectors_per_fat * boot->bytes_per_sector;
+    uint32_t root_size = boot->max_root_entries * FAT_DIRECTORY_SIZE;
+    uint8_t * buff = xmalloc(fat_size + root_size + 1);
+
+    fatCachePrefetch(cache, fatGetFatStart(boot, 0), fat_size);
+    fatCacheRead(cache, fatGetFatStart(boot, 0), buff, fat_size);
+    fatCachePrefetch(cache, fatGetRootStart(boot), root_size);
+    fatCacheRead(cache, fatGetRootStart(boot), buff + fat_size, root_size);
+
+    DIGESTfast digest;
+    digestFastInit(&digest);
+    digestFastUpdate(&digest, buff, fat_size + root_size);
+
+    xfree(buff);
+    return digestFastFinal(&digest);
+}
+
+/* Start an empty snapshot, the root path "" is at offset 0. Caller must free with fatFreeSnapshot */
+FATsnapshot * fatCreateSnapshot() {
+    FATsnapshot * snapshot = xmalloc(sizeof(FATsnapshot));
+    memset(snapshot, 0, sizeof(FATsnapshot));
+    memcpy(snapshot->header.magic, FAT_SNAPSHOT_MAGIC, 8);
+
+    snapshot->dirs_capacity = 16;
+    snapshot->entries_capacity = 64;
+    snapshot->paths_capacity = 256;
+    snapshot->dirs = xmalloc(snapshot->dirs_capacity * sizeof(FATsnapdir));
+    snapshot->entries = xmalloc(snapshot->entries_capacity * sizeof(FATsnapentry));
+    snapshot->paths = xmalloc(snapshot->paths_capacity);
+    snapshot->paths[0] = 0; //root
+    snapshot->header.paths_size = 1;
+    return snapshot;
+}
+
+/* Make room for size more bytes in the paths table */
+static void reserve_paths(FATsnapshot * snapshot, size_t size) {
+    while( snapshot->header.paths_size + size > snapshot->paths_capacity ) {
+        snapshot->paths_capacity *= 2;
+        snapshot->paths = xrealloc(snapshot->paths, snapshot->paths_capacity);
+    }
+}
+
+/* Store the path parent/name, name is cut at length or its first null
+ * Returns its offset for fatSnapshotAddDir */
+uint32_t fatSnapshotAddPath(FATsnapshot * snapshot, uint32_t parent, const char * name, size_t length) {
+    FATsnapheader * header = &snapshot->header;
+    size_t parent_length = strlen(snapshot->paths + parent);
+    const char * end = memchr(name, 0, length);
+    if( end ) length = end - name;
+
+    reserve_paths(snapshot, parent_length + length + 2);
+
+    uint32_t path = header->paths_size; //built in place, parent is found by offset since paths may have moved
+    char * out = snapshot->paths + path;
+    memcpy(out, snapshot->paths + parent, parent_length);
+    out[parent_length] = '/';
+    memcpy(out + parent_length + 1, name, length);
+    out[parent_length + 1 + length] = 0;
+
+    header->paths_size += parent_length + length + 2;
+    return path;
+}
+
+/* Store a long name of length bytes in the paths table, returns its offset for fatSnapshotAddEntry */
+uint32_t fatSnapshotAddName(FATsnapshot * snapshot, const char * name, size_t length) {
+    reserve_paths(snapshot, length + 1);
+
+    uint32_t offset = snapshot->header.paths_size;
+    memcpy(snapshot->paths + offset, name, length);
+    snapshot->paths[offset + length] = 0;
+    snapshot->header.paths_size += length + 1;
+    return offset;
+}
+
+/* Start the next directory at paths stored with fatSnapshotAddPath, entries added after belong to it */
+void fatSnapshotAddDir(FATsnapshot * snapshot, uint32_t path, uint32_t long_path, uint16_t first_cluster) {
+    FATsnapheader * header = &snapshot->header;
+
+    if( header->num_dirs == snapshot->dirs_capacity ) {
+        snapshot->dirs_capacity *= 2;
+        snapshot->dirs = xrealloc(snapshot->dirs, snapshot->dirs_capacity * sizeof(FATsnapdir));
+    }
+
+    FATsnapdir * dir = &snapshot->dirs[header->num_dirs++];
+    memset(dir, 0, sizeof(FATsnapdir));
+    dir->path = path;
+    dir->long_path = long_path;
+    dir->first_entry = header->num_entries;
+    dir->first_cluster = first_cluster;
+}
+
+/* Add an entry to the last directory started, long_name is 0 or an offset from fatSnapshotAddName */
+void fatSnapshotAddEntry(FATsnapshot * snapshot, FATdirectory * entry, uint32_t long_name) {
+    FATsnapheader * header = &snapshot->header;
+    assert(header->num_dirs);
+
+    if( header->num_entries == snapshot->entries_capacity ) {
+        snapshot->entries_capacity *= 2;
+        snapshot->entries = xrealloc(snapshot->entries, snapshot->entries_capacity * sizeof(FATsnapentry));
+    }
+
+    FATsnapentry * saved = &snapshot->entries[header->num_entries++];
+    memset(saved, 0, sizeof(FATsnapentry)); //padding is written out too
+    saved->long_name = long_name;
+    saved->file_size = entry->file_size;
+    saved->creation_date = entry->creation_date;
+    saved->creation_time = entry->creation_time;
+    saved->first_cluster = entry->first_logical_cluster;
+    saved->attributes = entry->attributes;
+    memcpy(saved->name, entry->filename, 8);
+    memcpy(saved->name + 8, entry->extention, 3);
+
+    snapshot->dirs[header->num_dirs - 1].num_entries++;
+}
+
+/* Path of a directory in the snapshot, with long names if long_names is set */
+const char * fatSnapshotPath(FATsnapshot * snapshot, FATsnapdir * dir, int long_names) {
+    return snapshot->paths + (long_names ? dir->long_path : dir->path);
+}
+
+/* Long name of an entry in the snapshot, NULL if it only has a short name */
+const char * fatSnapshotLongName(FATsnapshot * snapshot, FATsnapentry * entry) {
+    return entry->long_name ? snapshot->paths + entry->long_name : NULL;
+}
+
+/* Write all of size bytes to fd. Returns 0 on success */
+static int write_all(int fd, const void * data, size_t size) {
+    const uint8_t * bytes = data;
+    while( size > 0 ) {
+        ssize_t done = write(fd, bytes, size);
+        if( done <= 0 ) return -1;
+        bytes += done;
+        size -= done;
+    }
+    return 0;
+}
+
+/* Write the snapshot to name, stamped with the checksum and the image stats
+ * Written to a temporary file and renamed, returns 0 on success and -1 if it could not be written */
+int fatSaveSnapshot(FATsnapshot * snapshot, const char * name, uint64_t checksum, struct stat * image) {
+    FATsnapheader * header = &snapshot->header;
+    header->checksum = checksum;
+    header->image_size = image->st_size;
+    header->image_mtime_sec = image->st_mtim.tv_sec;
+    header->image_mtime_nsec = image->st_mtim.tv_nsec;
+
+    char * temp = xmalloc(strlen(name) + 5);
+    strcpy(temp, name);
+    strcat(temp, ".tmp");
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if( fd < 0 ) {
+        xfree(temp);
+        return -1;
+    }
+
+    int failed = write_all(fd, header, sizeof(FATsnapheader))
+                 || write_all(fd, snapshot->dirs, header->num_dirs * sizeof(FATsnapdir))
+                 || write_all(fd, snapshot->entries, header->num_entries * sizeof(FATsnapentry))
+                 || write_all(fd, snapshot->paths, header->paths_size);
+    failed = close(fd) || failed;
+
+    if( failed || rename(temp, name) ) { //never leave a partial snapshot under the real name
+        unlink(temp);
+        failed = 1;
+    }
+    xfree(temp);
+    return failed ? -1 : 0;
+}
+
+/* Map the snapshot in name if it is intact and matches the checksum and image stats
+ * Returns NULL if there is none or it is stale. Caller must free with fatFreeSnapshot */
+FATsnapshot * fatMapSnapshot(const char * name, uint64_t checksum, struct stat * image) {
+    int fd = open(name, O_RDONLY);
+    if( fd < 0 ) return NULL;
+
+    struct stat stats;
+    if( fstat(fd, &stats) || stats.st_size < (off_t) sizeof(FATsnapheader) ) {
+        close(fd);
+        return NULL;
+    }
+
+    void * data = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); //mapping keeps the file
+    if( data == MAP_FAILED ) return NULL;
+
+    FATsnapheader * header = data;
+    uint64_t expected_size = sizeof(FATsnapheader) + (uint64_t) header->num_dirs * sizeof(FATsnapdir)
+                             + (uint64_t) header->num_entries * sizeof(FATsnapentry) + header->paths_size;
+
+    if( memcmp(header->magic, FAT_SNAPSHOT_MAGIC, 8)
+            || expected_size != (uint64_t) stats.st_size
+            || !header->num_dirs
+            || header->checksum != checksum
+            || header->image_size != (uint64_t) image->st_size
+            || header->image_mtime_sec != image->st_mtim.tv_sec
+            || header->image_mtime_nsec != image->st_mtim.tv_nsec ) {
+        munmap(data, stats.st_size);
+        return NULL;
+    }
+
+    FATsnapshot * snapshot = xmalloc(sizeof(FATsnapshot));
+    memset(snapshot, 0, sizeof(FATsnapshot));
+    snapshot->header = *header;
+    snapshot->dirs = (FATsnapdir *) (header + 1);
+    snapshot->entries = (FATsnapentry *) (snapshot->dirs + header->num_dirs);
+    snapshot->paths = (char *) (snapshot->entries + header->num_entries);
+    snapshot->map = data;
+    snapshot->map_size = stats.st_size;
+
+    uint32_t i; //every directory must point inside the file
+    for( i = 0; i < header->num_dirs; i++) {
+        FATsnapdir * dir = &snapshot->dirs[i];
+        if( dir->path >= header->paths_size
+                || memchr(snapshot->paths + dir->path, 0, header->paths_size - dir->path) == NULL
+                || dir->long_path >= header->paths_size
+                || memchr(snapshot->paths + dir->long_path, 0, header->paths_size - dir->long_path) == NULL
+                || dir->first_entry > header->num_entries
+                || dir->num_entries > header->num_entries - dir->first_entry ) {
+            fatFreeSnapshot(snapshot);
+            return NULL;
+        }
+    }
+
+    for( i = 0; i < header->num_entries; i++) { //and every long name
+        FATsnapentry * entry = &snapshot->entries[i];
+        if( entry->long_name >= header->paths_size
+                || memchr(snapshot->paths + entry->long_name, 0, header->paths_size - entry->long_name) == NULL ) {
+            fatFreeSnapshot(snapshot);
+            return NULL;
+        }
+    }
+
+    return snapshot;
+}
+
+/* Free or unmap the snapshot */
+void fatFreeSnapshot(FATsnapshot * snapshot) {
+    if( snapshot->map ) {
+        munmap(snapshot->map, snapshot->map_size);
+    } else {
+        xfree(snapshot->dirs);
+        xfree(snapshot->entries);
+        xfree(snapshot->paths);
+    }
+    xfree(snapshot);
+}
@@ -0,0 +1,112 @@
+/* Saved directory tree of an image
+ * A snapshot holds every directory of an image with its path and first cluster and
+ * the raw fields and long name of its visible entries, in breadth first order. It is kept in a
+ * compact binary file beside the image and mapped back in read only. A snapshot is
+ * only used while the image has the same size and modification time and its FAT and
+ * root directory hash to the value stored, otherwise the tree is walked again.
+ */
+
+#ifndef _FATSNAPSHOT_H
+#define _FATSNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "FATheaders.h"
+#include "FATcache.h"
+
+#define FAT_SNAPSHOT_MAGIC "FATSNAP2"
+
+/* Suffix added to the image name for its snapshot file */
+#define FAT_SNAPSHOT_SUFFIX ".snap"
+
+/* Start of a snapshot file, followed by the dirs, entries and paths arrays */
+typedef struct FATsnapheader{
+    char magic[8];
+    uint32_t num_dirs;
+    uint32_t num_entries;
+    uint32_t paths_size; //bytes of null terminated paths and long names
+    uint32_t reserved;
+    uint64_t checksum; //of the first fat and root directory
+    uint64_t image_size;
+    int64_t image_mtime_sec;
+    int64_t image_mtime_nsec;
+}FATsnapheader;
+
+/* Directory in a snapshot, its entries are entries[first_entry, first_entry + num_entries) */
+typedef struct FATsnapdir{
+    uint32_t path; //offset into paths
+    uint32_t long_path; //same path with long names where there are any
+    uint32_t first_entry;
+    uint32_t num_entries;
+    uint16_t first_cluster; //0 for the root directory
+    uint16_t reserved;
+}FATsnapdir;
+
+/* Visible entry in a snapshot */
+typedef struct FATsnapentry{
+    uint32_t long_name; //offset into paths, 0 if the entry has none
+    uint32_t file_size;
+    uint16_t creation_date;
+    uint16_t creation_time;
+    uint16_t first_cluster;
+    uint8_t attributes;
+    uint8_t name[11]; //filename then extention, space padded
+}FATsnapentry;
+
+/* Snapshot being built by a walk or mapped from its file */
+typedef struct FATsnapshot{
+    FATsnapheader header;
+    FATsnapdir * dirs;
+    FATsnapentry * entries;
+    char * paths;
+    uint32_t dirs_capacity; //0 when mapped
+    uint32_t entries_capacity;
+    uint32_t paths_capacity;
+    void * map; //whole file when mapped, NULL when built
+    size_t map_size;
+}FATsnapshot;
+
+
+/* Name of the snapshot file of an image, or of one of its partitions if partition is not 0
+ * Caller must free */
+char * fatSnapshotName(const char * image_name, int partition);
+
+/* Hash of the first fat and the root directory, read through the cache */
+uint64_t fatSnapshotChecksum(FATcache * cache, FATboot * boot);
+
+/* Start an empty snapshot, the root path "" is at offset 0. Caller must free with fatFreeSnapshot */
+FATsnapshot * fatCreateSnapshot();
+
+/* Store the path parent/name, name is cut at length or its first null
+ * Returns its offset for fatSnapshotAddDir */
+uint32_t fatSnapshotAddPath(FATsnapshot * snapshot, uint32_t parent, const char * name, size_t length);
+
+/* Store a long name of length bytes in the paths table, returns its offset for fatSnapshotAddEntry */
+uint32_t fatSnapshotAddName(FATsnapshot * snapshot, const char * name, size_t length);
+
+/* Start the next directory at paths stored with fatSnapshotAddPath, entries added after belong to it */
+void fatSnapshotAddDir(FATsnapshot * snapshot, uint32_t path, uint32_t long_path, uint16_t first_cluster);
+
+/* Add an entry to the last directory started, long_name is 0 or an offset from fatSnapshotAddName */
+void fatSnapshotAddEntry(FATsnapshot * snapshot, FATdirectory * entry, uint32_t long_name);
+
+/* Path of a directory in the snapshot, with long names if long_names is set */
+const char * fatSnapshotPath(FATsnapshot * snapshot, FATsnapdir * dir, int long_names);
+
+/* Long name of an entry in the snapshot, NULL if it only has a short name */
+const char * fatSnapshotLongName(FATsnapshot * snapshot, FATsnapentry * entry);
+
+/* Write the snapshot to name, stamped with the checksum and the image stats
+ * Written to a temporary file and renamed, returns 0 on success and -1 if it could not be written */
+int fatSaveSnapshot(FATsnapshot * snapshot, const char * name, uint64_t checksum, struct stat * image);
+
+/* Map the snapshot in name if it is intact and matches the checksum and image stats
+ * Returns NULL if there is none or it is stale. Caller must free with fatFreeSnapshot */
+FATsnapshot * fatMapSnapshot(const char * name, uint64_t checksum, struct stat * image);
+
+/* Free or unmap the snapshot */
+void fatFreeSnapshot(FATsnapshot * snapshot);
+
+#endif
@@ -0,0 +1,219 @@
+/* Sparse aware image access
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "FATsparse.h"
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "utils.h"
+
+/* Bytes moved per read/write when copying */
+#define SPARSE_COPY_CHUNK (64 * 1024)
+
+/* Create an empty range list */
+static FATrangelist * new_ranges() {
+    FATrangelist * list = xmalloc(sizeof(FATrangelist));
+    list->num = 0;
+    list->capacity = 16;
+    list->ranges = xmalloc(list->capacity * sizeof(FATrange));
+    return list;
+}
+
+/* Append a range, merging with the last one if they touch */
+static void add_range(FATrangelist * list, uint32_t offset, uint32_t length) {
+    if( !length ) return;
+
+    if( list->num && list->ranges[list->num - 1].offset + list->ranges[list->num - 1].length == offset ) {
+        list->ranges[list->num - 1].length += length;
+        return;
+    }
+
+    if( list->num == list->capacity ) {
+        list->capacity *= 2;
+        list->ranges = xrealloc(list->ranges, list->capacity * sizeof(FATrange));
+    }
+    list->ranges[list->num].offset = offset;
+    list->ranges[list->num].length = length;
+    list->num++;
+}
+
+/* Size of the image file in bytes */
+static uint32_t image_size(FILE * disk) {
+    struct stat stats;
+    if( fstat(fileno(disk), &stats) ) {
+        perror("FATAL: Failed to get stats on disk: ");
+        abort();
+    }
+    return stats.st_size;
+}
+
+/* Ranges of the image file that hold data on the host, found with SEEK_DATA/SEEK_HOLE
+ * If the host cannot report holes the whole file is one range. Caller must free with fatFreeRanges */
+FATrangelist * fatDataRanges(FILE * disk) {
+    FATrangelist * list = new_ranges();
+    int fd = fileno(disk);
+    uint32_t size = image_size(disk);
+
+    fflush(disk); //buffered writes must reach the file before asking where data is
+
+    off_t pos = 0;
+    while( pos < size ) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if( data < 0 ) {
+            if( errno == ENXIO ) break; //only a hole remains
+            list->num = 0; //holes not supported, treat everything as data
+            add_range(list, 0, size);
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if( hole < 0 ) hole = size;
+        add_range(list, data, hole - data);
+        pos = hole;
+    }
+
+    return list;
+}
+
+/* Ranges of the image that the file system uses: boot, fats, root and allocated clusters
+ * Caller must free with fatFreeRanges */
+FATrangelist * fatAllocatedRanges(FATboot * boot, FATtable * table) {
+    FATrangelist * list = new_ranges();
+    uint32_t cluster_size = fatGetClusterSize(boot);
+
+    add_range(list, 0, fatGetDataspaceLocation(boot, 2)); //boot, fats and root
+
+    uint32_t i;
+    for( i = 2; i < table->num_entries; i++) {
+        if( fatTableGet(table, i) ) add_range(list, fatGetDataspaceLocation(boot, i), cluster_size);
+    }
+
+    return list;
+}
+
+/* Ranges in both a and b. Caller must free with fatFreeRanges */
+FATrangelist * fatIntersectRanges(FATrangelist * a, FATrangelist * b) {
+    FATrangelist * list = new_ranges();
+    int i = 0;
+    int j = 0;
+
+    while( i < a->num && j < b->num ) {
+        uint32_t a_end = a->ranges[i].offset + a->ranges[i].length;
+        uint32_t b_end = b->ranges[j].offset + b->ranges[j].length;
+        uint32_t start = a->ranges[i].offset > b->ranges[j].offset ? a->ranges[i].offset : b->ranges[j].offset;
+        uint32_t end = a_end < b_end ? a_end : b_end;
+
+        if( start < end ) add_range(list, start, end - start);
+
+        if( a_end < b_end ) i++;
+        else j++;
+    }
+
+    return list;
+}
+
+/* Total bytes covered by ranges */
+uint32_t fatRangesSize(FATrangelist * list) {
+    uint32_t total = 0;
+    int i;
+    for( i = 0; i < list->num; i++) total += list->ranges[i].length;
+    return total;
+}
+
+/* Free a range list */
+void fatFreeRanges(FATrangelist * list) {
+    xfree(list->ranges);
+    xfree(list);
+}
+
+/* Punch holes over free clusters that still hold data, only whole host blocks are punched
+ * so nothing has to be zeroed. Returns bytes released, data in free clusters is lost */
+uint32_t fatPunchFreeClusters(FILE * disk, FATboot * boot, FATtable * table) {
+    struct stat stats;
+    if( fstat(fileno(disk), &stats) ) {
+        perror("FATAL: Failed to get stats on disk: ");
+        abort();
+    }
+    uint32_t block = stats.st_blksize;
+
+    FATrangelist * free_ranges = new_ranges(); //complement of allocated ranges
+    FATrangelist * allocated = fatAllocatedRanges(boot, table);
+    uint32_t pos = 0;
+    int i;
+    for( i = 0; i < allocated->num; i++) {
+        if( allocated->ranges[i].offset > pos ) add_range(free_ranges, pos, allocated->ranges[i].offset - pos);
+        pos = allocated->ranges[i].offset + allocated->ranges[i].length;
+    }
+    uint32_t end_of_data = fatGetDataspaceLocation(boot, table->num_entries); //trailing sectors past the last cluster are kept
+    if( end_of_data > pos ) add_range(free_ranges, pos, end_of_data - pos);
+
+    FATrangelist * data = fatDataRanges(disk);
+    FATrangelist * punch = fatIntersectRanges(free_ranges, data);
+
+    uint32_t released = 0;
+    for( i = 0; i < punch->num; i++) {
+        uint32_t start = (punch->ranges[i].offset + block - 1) / block * block; //align inwards
+        uint32_t end = (punch->ranges[i].offset + punch->ranges[i].length) / block * block;
+        if( start >= end ) continue;
+
+        if( fallocate(fileno(disk), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) ) {
+            perror("Punching hole failed:");
+            break;
+        }
+        released += end - start;
+    }
+
+    fatFreeRanges(punch);
+    fatFreeRanges(data);
+    fatFreeRanges(allocated);
+    fatFreeRanges(free_ranges);
+
+    return released;
+}
+
+/* Copy an image, reading and writing only allocated ranges that hold data. out is sized to match
+ * and everything else is left as holes. Returns bytes copied */
+uint32_t fatSparseCopy(FILE * disk, FATboot * boot, FATtable * table, FILE * out) {
+    int in_fd = fileno(disk);
+    int out_fd = fileno(out);
+
+    fflush(out);
+    if( ftruncate(out_fd, image_size(disk)) ) {
+        perror("FATAL: Sizing copy failed: ");
+        abort();
+    }
+
+    FATrangelist * allocated = fatAllocatedRanges(boot, table);
+    FATrangelist * data = fatDataRanges(disk);
+    FATrangelist * copy = fatIntersectRanges(allocated, data);
+
+    uint8_t * buff = xmalloc(SPARSE_COPY_CHUNK);
+    uint32_t copied = 0;
+    int i;
+    for( i = 0; i < copy->num; i++) {
+        uint32_t done = 0;
+        while( done < copy->ranges[i].length ) {
+            uint32_t chunk = copy->ranges[i].length - done;
+            if( chunk > SPARSE_COPY_CHUNK ) chunk = SPARSE_COPY_CHUNK;
+            xpread(in_fd, buff, chunk, copy->ranges[i].offset + done);
+            xpwrite(out_fd, buff, chunk, copy->ranges[i].offset + done);
+            done += chunk;
+        }
+        copied += done;
+    }
+
+    xfree(buff);
+    fatFreeRanges(copy);
+    fatFreeRanges(data);
+    fatFreeRanges(allocated);
+
+    return copied;
+}
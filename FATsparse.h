@@ -0,0 +1,54 @@
+/* Sparse aware image access
+ * Combines what the FAT says is in use with what the host file system says
+ * holds data (SEEK_DATA/SEEK_HOLE), so free clusters are never read, copied or stored.
+ */
+
+#ifndef _FATSPARSE_H
+#define _FATSPARSE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+
+/* Range of bytes in the image file */
+typedef struct FATrange{
+    uint32_t offset;
+    uint32_t length;
+}FATrange;
+
+/* Sorted list of ranges */
+typedef struct FATrangelist{
+    FATrange * ranges;
+    int num;
+    int capacity;
+}FATrangelist;
+
+
+/* Ranges of the image file that hold data on the host, found with SEEK_DATA/SEEK_HOLE
+ * If the host cannot report holes the whole file is one range. Caller must free with fatFreeRanges */
+FATrangelist * fatDataRanges(FILE * disk);
+
+/* Ranges of the image that the file system uses: boot, fats, root and allocated clusters
+ * Caller must free with fatFreeRanges */
+FATrangelist * fatAllocatedRanges(FATboot * boot, FATtable * table);
+
+/* Ranges in both a and b. Caller must free with fatFreeRanges */
+FATrangelist * fatIntersectRanges(FATrangelist * a, FATrangelist * b);
+
+/* Total bytes covered by ranges */
+uint32_t fatRangesSize(FATrangelist * list);
+
+/* Free a range list */
+void fatFreeRanges(FATrangelist * list);
+
+/* Punch holes over free clusters that still hold data, only whole host blocks are punched
+ * so nothing has to be zeroed. Returns bytes released, data in free clusters is lost */
+uint32_t fatPunchFreeClusters(FILE * disk, FATboot * boot, FATtable * table);
+
+/* Copy an image, reading and writing only allocated ranges that hold data. out is sized to match
+ * and everything else is left as holes. Returns bytes copied */
+uint32_t fatSparseCopy(FILE * disk, FATboot * boot, FATtable * table, FILE * out);
+
+#endif
@@ -0,0 +1,393 @@
+/* In memory copy of the file allocation table and free space planning
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "FATtable.h"
+#include "FATheaders.h"
+#include "FATcodec.h"
+#include "utils.h"
+
+/* Read the whole first FAT into memory with one read. Caller must free with fatFreeTable */
+FATtable * fatLoadTable(FILE * disk, FATboot * boot) {
+    return fatOpenTable(disk, boot, FAT_TABLE_PRELOAD);
+}
+
+/* Open the first FAT loading it as mode says. Caller must free with fatFreeTable */
+FATtable * fatOpenTable(FILE * disk, FATboot * boot, int mode) {
+    FATtable * table = xmalloc(sizeof(FATtable));
+
+    table->bytes_per_sector = boot->bytes_per_sector;
+    table->size = boot->sectors_per_fat * boot->bytes_per_sector;
+    table->num_entries = fatGetNumClusters(boot) + 2;
+    if( table->num_entries > table->size * 2 / 3 ) table->num_entries = table->size * 2 / 3; //never index past fat
+    table->disk = disk;
+    table->start = fatGetFatStart(boot, 0);
+
+    table->fat = xmalloc(table->size);
+    table->dirty = xmalloc(boot->sectors_per_fat);
+    memset(table->dirty, 0, boot->sectors_per_fat);
+
+    if( mode == FAT_TABLE_AUTO ) {
+        char * env = getenv("FATTABLE_MODE");
+        if( env && !strcmp(env, "lazy") ) mode = FAT_TABLE_LAZY;
+        else if( env && !strcmp(env, "preload") ) mode = FAT_TABLE_PRELOAD;
+        else mode = boot->sectors_per_fat > FAT_TABLE_LAZY_SECTORS ? FAT_TABLE_LAZY : FAT_TABLE_PRELOAD;
+    }
+
+    table->present = xmalloc(boot->sectors_per_fat / 8 + 1); //nothing loaded yet
+    memset(table->present, 0, boot->sectors_per_fat / 8 + 1);
+    if( mode == FAT_TABLE_PRELOAD ) fatTableLoadAll(table);
+
+    return table;
+}
+
+/* Read sectors [first, first + run) of the fat and mark them present */
+static void load_sectors(FATtable * table, uint32_t first, uint32_t run) {
+    xfseek(table->disk, table->start + first * table->bytes_per_sector, SEEK_SET);
+    xfread(table->fat + first * table->bytes_per_sector, table->bytes_per_sector, run, table->disk);
+    STATS_ADD(fat_sectors_loaded, run);
+
+    uint32_t i;
+    for( i = first; i < first + run; i++) table->present[i / 8] |= 1 << (i % 8);
+}
+
+/* Make sure the bytes at offset and offset + 1 are loaded, an entry may straddle two sectors */
+static inline void fault_entry(FATtable * table, uint32_t offset) {
+    uint32_t sector = offset / table->bytes_per_sector;
+    uint32_t last = (offset + 1) / table->bytes_per_sector;
+    if( last >= table->size / table->bytes_per_sector ) last = sector;
+
+    for( ; sector <= last; sector++) {
+        if( table->present[sector / 8] & (1 << (sector % 8)) ) continue;
+        int phase = statsPhase(STATS_PHASE_FAT);
+        load_sectors(table, sector, 1);
+        statsPhase(phase);
+    }
+}
+
+/* Read every sector not loaded yet, runs of missing sectors with one read each */
+void fatTableLoadAll(FATtable * table) {
+    if( !table->present ) return;
+    int phase = statsPhase(STATS_PHASE_FAT);
+
+    uint32_t num_sectors = table->size / table->bytes_per_sector;
+    uint32_t i = 0;
+    while( i < num_sectors ) {
+        if( table->present[i / 8] & (1 << (i % 8)) ) {
+            i++;
+            continue;
+        }
+        uint32_t run = 1;
+        while( i + run < num_sectors && !(table->present[(i + run) / 8] & (1 << ((i + run) % 8))) ) run++;
+        load_sectors(table, i, run);
+        i += run;
+    }
+
+    xfree(table->present); //whole fat loaded, lookups skip the check from now on
+    table->present = NULL;
+    statsPhase(phase);
+}
+
+/* Get the value of an entry in the in memory table */
+uint16_t fatTableGet(FATtable * table, uint16_t index) {
+    uint32_t offset = (index * 12)/8;
+    if( table->present ) fault_entry(table, offset);
+    STATS_ADD(fat_lookups, 1);
+
+    return fat12DecodeBytes(table->fat + offset, index);
+}
+
+/* Set the value of an entry in the in memory table, marks its sectors dirty */
+void fatTableSet(FATtable * table, uint16_t index, uint16_t value) {
+    uint32_t offset = (index * 12)/8;
+    if( table->present ) fault_entry(table, offset); //other nibble must be read before it is written back
+    fat12EncodeBytes(table->fat + offset, index, value);
+
+    table->dirty[offset / table->bytes_per_sector] = 1; //entry may straddle two sectors
+    table->dirty[(offset + 1) / table->bytes_per_sector] = 1;
+}
+
+/* Number of free clusters in the table */
+uint32_t fatTableFreeCount(FATtable * table) {
+    fatTableLoadAll(table); //full scan, one bulk read beats faulting sector by sector
+    STATS_ADD(fat_lookups, table->num_entries - 2);
+    return fat12CountFree(table->fat, 2, table->num_entries);
+}
+
+/* Write all dirty sectors back to every fat copy on disk, runs of dirty sectors are written at once */
+void fatTableFlush(FILE * disk, FATboot * boot, FATtable * table) {
+    uint32_t num_sectors = table->size / table->bytes_per_sector;
+    uint32_t i = 0;
+
+    while( i < num_sectors ) {
+        if( !table->dirty[i] ) {
+            i++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while( i + run < num_sectors && table->dirty[i + run] ) run++;
+
+        int copy;
+        for( copy = 0; copy < boot->num_fats; copy++) { //keep all copies mirrored
+            xfseek(disk, fatGetFatStart(boot, copy) + i * table->bytes_per_sector, SEEK_SET);
+            xfwrite(table->fat + i * table->bytes_per_sector, table->bytes_per_sector, run, disk);
+        }
+
+        memset(table->dirty + i, 0, run);
+        i += run;
+    }
+}
+
+/* Free the table */
+void fatFreeTable(FATtable * table) {
+    xfree(table->fat);
+    xfree(table->dirty);
+    if( table->present ) xfree(table->present);
+    xfree(table);
+}
+
+/* Append a run to the end of the free map */
+static void add_free_extent(FATfreemap * map, uint16_t start, uint16_t length) {
+    if( map->num == map->capacity ) {
+        map->capacity *= 2;
+        map->extents = xrealloc(map->extents, map->capacity * sizeof(FATextent));
+    }
+    map->extents[map->num].start = start;
+    map->extents[map->num].length = length;
+    map->num++;
+    map->free_clusters += length;
+}
+
+/* Build the list of free runs from the table. Caller must free with fatFreeFreeMap */
+FATfreemap * fatBuildFreeMap(FATtable * table) {
+    FATfreemap * map = xmalloc(sizeof(FATfreemap));
+    map->num = 0;
+    map->capacity = 16;
+    map->free_clusters = 0;
+    map->extents = xmalloc(map->capacity * sizeof(FATextent));
+    fatTableLoadAll(table);
+    int phase = statsPhase(STATS_PHASE_FAT);
+
+    uint32_t i = 2;
+    while( (i = fat12FindFree(table->fat, i, table->num_entries)) < table->num_entries ) {
+        uint32_t start = i;
+        i = fat12FindUsed(table->fat, i, table->num_entries);
+        add_free_extent(map, start, i - start);
+    }
+    STATS_ADD(fat_lookups, table->num_entries - 2);
+
+    statsPhase(phase);
+    return map;
+}
+
+/* Allocate a chain of clusters from the free map, linking it in the table and ending it
+ * Takes whole runs lowest first so the chain stays as contiguous as the free space allows
+ * Returns the first cluster or 0 if there is not enough space (nothing is allocated then) */
+uint16_t fatAllocChain(FATfreemap * map, FATtable * table, uint32_t clusters) {
+    if( !clusters || clusters > map->free_clusters ) return 0;
+
+    uint16_t first = 0;
+    uint16_t prev = 0;
+    int used = 0; //whole extents consumed from the front
+
+    while( clusters > 0 ) {
+        FATextent * extent = &map->extents[used];
+        uint16_t take = extent->length <= clusters ? extent->length : clusters;
+
+        uint16_t i;
+        for( i = 0; i < take; i++) {
+            uint16_t cluster = extent->start + i;
+            if( prev ) fatTableSet(table, prev, cluster);
+            if( !first ) first = cluster;
+            prev = cluster;
+        }
+
+        extent->start += take;
+        extent->length -= take;
+        map->free_clusters -= take;
+        clusters -= take;
+        if( !extent->length ) used++;
+    }
+    fatTableSet(table, prev, FAT_END_OF_CHAIN);
+
+    if( used ) { //drop consumed extents
+        memmove(map->extents, map->extents + used, (map->num - used) * sizeof(FATextent));
+        map->num -= used;
+    }
+
+    return first;
+}
+
+/* Allocate a contiguous chain of clusters to carry on a chain ending at last: from the free run
+ * starting right after last if it holds them all, else from the first run that does, else as
+ * fatAllocChain. Returns the first cluster or 0 if there is not enough space */
+uint16_t fatAllocAfter(FATfreemap * map, FATtable * table, uint16_t last, uint32_t clusters) {
+    if( !clusters || clusters > map->free_clusters ) return 0;
+
+    int pick = -1;
+    int i;
+    for( i = 0; i < map->num; i++) {
+        FATextent * extent = &map->extents[i];
+        if( extent->start > last + 1 && pick >= 0 ) break; //runs are sorted, none can follow last now
+        if( extent->length < clusters ) continue;
+        if( extent->start == last + 1 ) {
+            pick = i;
+            break;
+        }
+        if( pick < 0 ) pick = i;
+    }
+    if( pick < 0 ) return fatAllocChain(map, table, clusters); //no single run holds them
+
+    FATextent * extent = &map->extents[pick];
+    uint16_t first = extent->start;
+    uint32_t j;
+    for( j = 0; j + 1 < clusters; j++) fatTableSet(table, first + j, first + j + 1);
+    fatTableSet(table, first + clusters - 1, FAT_END_OF_CHAIN);
+
+    extent->start += clusters;
+    extent->length -= clusters;
+    map->free_clusters -= clusters;
+    if( !extent->length ) {
+        memmove(extent, extent + 1, (map->num - pick - 1) * sizeof(FATextent));
+        map->num--;
+    }
+    return first;
+}
+
+/* Free every cluster of a chain in the table. Returns the number of clusters freed */
+uint32_t fatFreeChain(FATtable * table, uint16_t first) {
+    uint32_t count = 0;
+    uint16_t cluster = first;
+    while( cluster <= 0xFF0 && cluster > 1 && cluster < table->num_entries && count < table->num_entries ) {
+        uint16_t next = fatTableGet(table, cluster);
+        if( !next ) break; //already free, the chain was cut or freed before
+        fatTableSet(table, cluster, 0);
+        count++;
+        cluster = next;
+    }
+    return count;
+}
+
+/* Put a run of free clusters back in the map, merged with the runs it touches */
+void fatFreeMapAdd(FATfreemap * map, uint16_t start, uint16_t length) {
+    if( !length ) return;
+
+    int low = 0; //first extent starting after start
+    int high = map->num;
+    while( low < high ) {
+        int middle = (low + high) / 2;
+        if( map->extents[middle].start < start ) low = middle + 1;
+        else high = middle;
+    }
+
+    map->free_clusters += length;
+    FATextent * before = low > 0 ? &map->extents[low - 1] : NULL;
+    FATextent * after = low < map->num ? &map->extents[low] : NULL;
+    int joins_before = before && before->start + before->length == start;
+    int joins_after = after && start + length == after->start;
+
+    if( joins_before && joins_after ) {
+        before->length += length + after->length;
+        memmove(after, after + 1, (map->num - low - 1) * sizeof(FATextent));
+        map->num--;
+    } else if( joins_before ) {
+        before->length += length;
+    } else if( joins_after ) {
+        after->start = start;
+        after->length += length;
+    } else {
+        if( map->num == map->capacity ) {
+            map->capacity *= 2;
+            map->extents = xrealloc(map->extents, map->capacity * sizeof(FATextent));
+        }
+        memmove(map->extents + low + 1, map->extents + low, (map->num - low) * sizeof(FATextent));
+        map->extents[low].start = start;
+        map->extents[low].length = length;
+        map->num++;
+    }
+}
+
+/* Free every cluster of a chain in the table in one walk, handing each run of consecutive
+ * clusters straight to the map so it can be allocated again. Returns the number of clusters freed */
+uint32_t fatReleaseChain(FATfreemap * map, FATtable * table, uint16_t first) {
+    uint32_t count = 0;
+    uint16_t run_start = 0;
+    uint16_t run_length = 0;
+    uint16_t cluster = first;
+    while( cluster <= 0xFF0 && cluster > 1 && cluster < table->num_entries && count < table->num_entries ) {
+        uint16_t next = fatTableGet(table, cluster);
+        if( !next ) break; //already free, the chain was cut or released before
+        fatTableSet(table, cluster, 0);
+        count++;
+
+        if( run_length && cluster == run_start + run_length ) {
+            run_length++;
+        } else {
+            fatFreeMapAdd(map, run_start, run_length);
+            run_start = cluster;
+            run_length = 1;
+        }
+        cluster = next;
+    }
+    fatFreeMapAdd(map, run_start, run_length);
+    return count;
+}
+
+/* Free the free map */
+void fatFreeFreeMap(FATfreemap * map) {
+    xfree(map->extents);
+    xfree(map);
+}
+
+/* Count the clusters in a chain starting at first */
+uint32_t fatChainLength(FATtable * table, uint16_t first) {
+    uint32_t count = 0;
+    uint16_t cluster = first;
+    while( cluster <= 0xFF0 && cluster > 1 && cluster < table->num_entries && count < table->num_entries ) { //bound guards against loops
+        count++;
+        cluster = fatTableGet(table, cluster);
+    }
+    STATS_ADD(clusters_followed, count);
+    return count;
+}
+
+/* Number of consecutive clusters in the chain starting at cluster, at most max */
+uint16_t fatChainRun(FATtable * table, uint16_t cluster, uint16_t max) {
+    uint16_t run = 1;
+    while( run < max && cluster + run < table->num_entries && fatTableGet(table, cluster + run - 1) == cluster + run ) run++;
+    return run;
+}
+
+/* Split the first max_clusters clusters of a chain into runs of consecutive clusters
+ * Returns an array the caller must free, num is set to its length */
+FATextent * fatChainExtents(FATtable * table, uint16_t first, uint32_t max_clusters, int * num) {
+    int capacity = 8;
+    FATextent * extents = xmalloc(capacity * sizeof(FATextent));
+    *num = 0;
+
+    uint32_t followed = 0;
+    uint16_t cluster = first;
+    while( followed < max_clusters && cluster <= 0xFF0 && cluster > 1 && cluster < table->num_entries ) {
+        uint32_t left = max_clusters - followed;
+        uint16_t run = fatChainRun(table, cluster, left < 0xFFFF ? left : 0xFFFF);
+
+        if( *num == capacity ) {
+            capacity *= 2;
+            extents = xrealloc(extents, capacity * sizeof(FATextent));
+        }
+        extents[*num].start = cluster;
+        extents[*num].length = run;
+        (*num)++;
+
+        followed += run;
+        STATS_ADD(clusters_followed, run);
+        cluster = fatTableGet(table, cluster + run - 1);
+        if( followed >= table->num_entries ) break; //loop in chain
+    }
+    return extents;
+}
@@ -0,0 +1,113 @@
+/* In memory copy of the file allocation table and free space planning
+ * The table is read in with one bulk read, or sector by sector on first
+ * touch for short operations, and only the sectors that were modified
+ * are written back, to every copy of the FAT.
+ */
+
+#ifndef _FATTABLE_H
+#define _FATTABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "FATheaders.h"
+
+/* Decoded entries at or above this value end a cluster chain */
+#define FAT_END_OF_CHAIN 0xFF8
+
+/* Ways of loading the table for fatOpenTable */
+#define FAT_TABLE_PRELOAD 0 //one bulk read up front
+#define FAT_TABLE_LAZY 1 //each sector read on first touch
+#define FAT_TABLE_AUTO 2 //lazy for fats above FAT_TABLE_LAZY_SECTORS, unless FATTABLE_MODE says otherwise
+
+/* Fats with more sectors than this are loaded lazily in auto mode */
+#define FAT_TABLE_LAZY_SECTORS 8
+
+/* In memory FAT, raw 12 bit packed bytes of the first copy */
+typedef struct FATtable{
+    uint8_t * fat; //raw bytes of one fat copy
+    uint32_t size; //size of fat in bytes
+    uint32_t num_entries; //number of usable entries (clusters + 2 reserved)
+    uint16_t bytes_per_sector;
+    uint8_t * dirty; //one flag per fat sector
+    uint8_t * present; //one bit per fat sector, NULL once the whole fat is loaded
+    FILE * disk; //where missing sectors are read from
+    uint32_t start; //offset of the first fat copy
+}FATtable;
+
+/* Run of consecutive clusters */
+typedef struct FATextent{
+    uint16_t start;
+    uint16_t length;
+}FATextent;
+
+/* Sorted list of free runs, built once from the table and consumed by allocations */
+typedef struct FATfreemap{
+    FATextent * extents;
+    int num;
+    int capacity;
+    uint32_t free_clusters; //total of all extents
+}FATfreemap;
+
+
+/* Read the whole first FAT into memory with one read. Caller must free with fatFreeTable */
+FATtable * fatLoadTable(FILE * disk, FATboot * boot);
+
+/* Open the first FAT loading it as mode says. Caller must free with fatFreeTable */
+FATtable * fatOpenTable(FILE * disk, FATboot * boot, int mode);
+
+/* Read every sector not loaded yet, runs of missing sectors with one read each */
+void fatTableLoadAll(FATtable * table);
+
+/* Get the value of an entry in the in memory table */
+uint16_t fatTableGet(FATtable * table, uint16_t index);
+
+/* Set the value of an entry in the in memory table, marks its sectors dirty */
+void fatTableSet(FATtable * table, uint16_t index, uint16_t value);
+
+/* Number of free clusters in the table */
+uint32_t fatTableFreeCount(FATtable * table);
+
+/* Write all dirty sectors back to every fat copy on disk, runs of dirty sectors are written at once */
+void fatTableFlush(FILE * disk, FATboot * boot, FATtable * table);
+
+/* Free the table */
+void fatFreeTable(FATtable * table);
+
+/* Build the list of free runs from the table. Caller must free with fatFreeFreeMap */
+FATfreemap * fatBuildFreeMap(FATtable * table);
+
+/* Allocate a chain of clusters from the free map, linking it in the table and ending it
+ * Takes whole runs lowest first so the chain stays as contiguous as the free space allows
+ * Returns the first cluster or 0 if there is not enough space (nothing is allocated then) */
+uint16_t fatAllocChain(FATfreemap * map, FATtable * table, uint32_t clusters);
+
+/* Allocate a contiguous chain of clusters to carry on a chain ending at last: from the free run
+ * starting right after last if it holds them all, else from the first run that does, else as
+ * fatAllocChain. Returns the first cluster or 0 if there is not enough space */
+uint16_t fatAllocAfter(FATfreemap * map, FATtable * table, uint16_t last, uint32_t clusters);
+
+/* Free every cluster of a chain in the table. Returns the number of clusters freed */
+uint32_t fatFreeChain(FATtable * table, uint16_t first);
+
+/* Put a run of free clusters back in the map, merged with the runs it touches */
+void fatFreeMapAdd(FATfreemap * map, uint16_t start, uint16_t length);
+
+/* Free every cluster of a chain in the table in one walk, handing each run of consecutive
+ * clusters straight to the map so it can be allocated again. Returns the number of clusters freed */
+uint32_t fatReleaseChain(FATfreemap * map, FATtable * table, uint16_t first);
+
+/* Free the free map */
+void fatFreeFreeMap(FATfreemap * map);
+
+/* Count the clusters in a chain starting at first */
+uint32_t fatChainLength(FATtable * table, uint16_t first);
+
+/* Number of consecutive clusters in the chain starting at cluster, at most max */
+uint16_t fatChainRun(FATtable * table, uint16_t cluster, uint16_t max);
+
+/* Split the first max_clusters clusters of a chain into runs of consecutive clusters
+ * Returns an array the caller must free, num is set to its length */
+FATextent * fatChainExtents(FATtable * table, uint16_t first, uint32_t max_clusters, int * num);
+
+#endif
@@ -0,0 +1,253 @@
+/* Content digests for comparing file data
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "digest.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+/* Reads in 64bit little endian from buff */
+static uint64_t read_uint64(const uint8_t * buff) {
+    uint64_t val = 0;
+    int i;
+    for( i = 7; i >= 0; i--) val = (val << 8) | buff[i];
+    return val;
+}
+
+/* Reads in 32bit little endian from buff */
+static uint32_t read_uint32(const uint8_t * buff) {
+    return buff[0] | (buff[1] << 8) | (buff[2] << 16) | ((uint32_t) buff[3] << 24);
+}
+
+static uint64_t rotl64(uint64_t val, int bits) {
+    return (val << bits) | (val >> (64 - bits));
+}
+
+static uint64_t fast_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t fast_merge(uint64_t acc, uint64_t lane) {
+    acc ^= fast_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* Consume one 32 byte stripe */
+static void fast_stripe(DIGESTfast * digest, const uint8_t * stripe) {
+    int i;
+    for( i = 0; i < 4; i++) digest->lanes[i] = fast_round(digest->lanes[i], read_uint64(stripe + 8*i));
+}
+
+/* Start a fast hash */
+void digestFastInit(DIGESTfast * digest) {
+    digest->lanes[0] = PRIME64_1 + PRIME64_2;
+    digest->lanes[1] = PRIME64_2;
+    digest->lanes[2] = 0;
+    digest->lanes[3] = -PRIME64_1;
+    digest->buffered = 0;
+    digest->length = 0;
+}
+
+/* Add data to a fast hash */
+void digestFastUpdate(DIGESTfast * digest, const void * data, size_t size) {
+    const uint8_t * input = data;
+    digest->length += size;
+
+    if( digest->buffered ) { //finish partial stripe first
+        size_t fill = 32 - digest->buffered;
+        if( fill > size ) fill = size;
+        memcpy(digest->buff + digest->buffered, input, fill);
+        digest->buffered += fill;
+        input += fill;
+        size -= fill;
+        if( digest->buffered < 32 ) return;
+        fast_stripe(digest, digest->buff);
+        digest->buffered = 0;
+    }
+
+    while( size >= 32 ) { //whole stripes straight from input
+        fast_stripe(digest, input);
+        input += 32;
+        size -= 32;
+    }
+
+    memcpy(digest->buff, input, size);
+    digest->buffered = size;
+}
+
+/* Finish a fast hash */
+uint64_t digestFastFinal(DIGESTfast * digest) {
+    uint64_t hash;
+
+    if( digest->length >= 32 ) {
+        hash = rotl64(digest->lanes[0], 1) + rotl64(digest->lanes[1], 7) + rotl64(digest->lanes[2], 12) + rotl64(digest->lanes[3], 18);
+        int i;
+        for( i = 0; i < 4; i++) hash = fast_merge(hash, digest->lanes[i]);
+    } else {
+        hash = PRIME64_5; //seed 0
+    }
+    hash += digest->length;
+
+    const uint8_t * tail = digest->buff;
+    uint32_t left = digest->buffered;
+    while( left >= 8 ) {
+        hash ^= fast_round(0, read_uint64(tail));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+        tail += 8;
+        left -= 8;
+    }
+    if( left >= 4 ) {
+        hash ^= (uint64_t) read_uint32(tail) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        tail += 4;
+        left -= 4;
+    }
+    while( left > 0 ) {
+        hash ^= *tail * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+        tail++;
+        left--;
+    }
+
+    hash ^= hash >> 33; //avalanche
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32(uint32_t val, int bits) {
+    return (val >> bits) | (val << (32 - bits));
+}
+
+/* Consume one 64 byte block */
+static void sha256_block(DIGESTsha256 * digest, const uint8_t * block) {
+    uint32_t w[64];
+    int i;
+
+    for( i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[4*i] << 24) | (block[4*i + 1] << 16) | (block[4*i + 2] << 8) | block[4*i + 3];
+    }
+    for( i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i-15], 7) ^ rotr32(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotr32(w[i-2], 17) ^ rotr32(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    uint32_t a = digest->state[0], b = digest->state[1], c = digest->state[2], d = digest->state[3];
+    uint32_t e = digest->state[4], f = digest->state[5], g = digest->state[6], h = digest->state[7];
+
+    for( i = 0; i < 64; i++) {
+        uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    digest->state[0] += a; digest->state[1] += b; digest->state[2] += c; digest->state[3] += d;
+    digest->state[4] += e; digest->state[5] += f; digest->state[6] += g; digest->state[7] += h;
+}
+
+/* Start a SHA-256 */
+void digestSha256Init(DIGESTsha256 * digest) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(digest->state, initial, sizeof(initial));
+    digest->buffered = 0;
+    digest->length = 0;
+}
+
+/* Add data to a SHA-256 */
+void digestSha256Update(DIGESTsha256 * digest, const void * data, size_t size) {
+    const uint8_t * input = data;
+    digest->length += size;
+
+    if( digest->buffered ) {
+        size_t fill = 64 - digest->buffered;
+        if( fill > size ) fill = size;
+        memcpy(digest->buff + digest->buffered, input, fill);
+        digest->buffered += fill;
+        input += fill;
+        size -= fill;
+        if( digest->buffered < 64 ) return;
+        sha256_block(digest, digest->buff);
+        digest->buffered = 0;
+    }
+
+    while( size >= 64 ) {
+        sha256_block(digest, input);
+        input += 64;
+        size -= 64;
+    }
+
+    memcpy(digest->buff, input, size);
+    digest->buffered = size;
+}
+
+/* Finish a SHA-256 into out */
+void digestSha256Final(DIGESTsha256 * digest, uint8_t out[DIGEST_SHA256_SIZE]) {
+    uint64_t bits = digest->length * 8;
+
+    digest->buff[digest->buffered++] = 0x80; //padding starts with a single bit
+    if( digest->buffered > 56 ) {
+        memset(digest->buff + digest->buffered, 0, 64 - digest->buffered);
+        sha256_block(digest, digest->buff);
+        digest->buffered = 0;
+    }
+    memset(digest->buff + digest->buffered, 0, 56 - digest->buffered);
+
+    int i;
+    for( i = 0; i < 8; i++) digest->buff[56 + i] = bits >> (56 - 8*i); //big endian length
+    sha256_block(digest, digest->buff);
+
+    for( i = 0; i < 8; i++) {
+        out[4*i] = digest->state[i] >> 24;
+        out[4*i + 1] = digest->state[i] >> 16;
+        out[4*i + 2] = digest->state[i] >> 8;
+        out[4*i + 3] = digest->state[i];
+    }
+}
+
+/* Format bytes as lower case hex, out must hold 2 * size + 1 bytes */
+void digestToHex(const uint8_t * bytes, size_t size, char * out) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+    for( i = 0; i < size; i++) {
+        out[2*i] = hex[bytes[i] >> 4];
+        out[2*i + 1] = hex[bytes[i] & 0x0F];
+    }
+    out[2*size] = 0;
+}
@@ -0,0 +1,52 @@
+/* Content digests for comparing file data
+ * A fast 64 bit hash (XXH64) for finding candidates and SHA-256 for confirming them.
+ * Both take data in pieces so cluster chains can be hashed without copying.
+ */
+
+#ifndef _DIGEST_H
+#define _DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DIGEST_SHA256_SIZE 32
+
+/* Streaming state of the fast hash */
+typedef struct DIGESTfast{
+    uint64_t lanes[4];
+    uint8_t buff[32]; //partial stripe
+    uint32_t buffered;
+    uint64_t length;
+}DIGESTfast;
+
+/* Streaming state of SHA-256 */
+typedef struct DIGESTsha256{
+    uint32_t state[8];
+    uint8_t buff[64]; //partial block
+    uint32_t buffered;
+    uint64_t length;
+}DIGESTsha256;
+
+
+/* Start a fast hash */
+void digestFastInit(DIGESTfast * digest);
+
+/* Add data to a fast hash */
+void digestFastUpdate(DIGESTfast * digest, const void * data, size_t size);
+
+/* Finish a fast hash */
+uint64_t digestFastFinal(DIGESTfast * digest);
+
+/* Start a SHA-256 */
+void digestSha256Init(DIGESTsha256 * digest);
+
+/* Add data to a SHA-256 */
+void digestSha256Update(DIGESTsha256 * digest, const void * data, size_t size);
+
+/* Finish a SHA-256 into out */
+void digestSha256Final(DIGESTsha256 * digest, uint8_t out[DIGEST_SHA256_SIZE]);
+
+/* Format bytes as lower case hex, out must hold 2 * size + 1 bytes */
+void digestToHex(const uint8_t * bytes, size_t size, char * out);
+
+#endif
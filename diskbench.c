@@ -0,0 +1,419 @@
+/* Implementation of diskbench. Times reading a whole image through each I/O path
+ *
+ * Every directory is loaded and every file is read in full, first with stdio seeks and
+ * reads one cluster at a time like the original tools, then through the queued engine
+ * with blocking pread and with io_uring. The best time of all rounds is reported.
+ * With -f the FAT entry codecs are timed instead, against per entry branching decode.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATcodec.h"
+#include "FATdir.h"
+#include "FATio.h"
+#include "ADTlinkedlist.h"
+#include "utils.h"
+
+/* File found in the image */
+typedef struct bench_file {
+    uint16_t first_cluster;
+    uint32_t size;
+} bench_file;
+
+/* Everything that is read in one round */
+typedef struct bench_set {
+    uint16_t * dirs; //first cluster of every subdirectory
+    int num_dirs;
+    bench_file * files;
+    int num_files;
+    uint64_t bytes; //file bytes
+} bench_set;
+
+/* Result of one path */
+typedef struct bench_result {
+    double best; //seconds
+    uint64_t requests; //reads issued per round
+    uint64_t calls; //system calls per round, engine paths only
+} bench_result;
+
+/* Current time in seconds */
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Append to a growing array */
+void * grow(void * array, int num, int * capacity, size_t size) {
+    if( num < *capacity ) return array;
+    *capacity = *capacity ? *capacity * 2 : 16;
+    return xrealloc(array, *capacity * size);
+}
+
+/* Collect every directory and file with a breadth first walk */
+void collect(FILE * disk, FATboot * boot, FATtable * table, bench_set * set) {
+    int dir_capacity = 0;
+    int file_capacity = 0;
+    set->dirs = NULL;
+    set->files = NULL;
+    set->num_dirs = 0;
+    set->num_files = 0;
+    set->bytes = 0;
+
+    int next = -1; //index of next directory to walk, -1 for root
+    while( next < set->num_dirs ) {
+        FATdirbuff * dir = fatLoadDirectory(disk, boot, table, next < 0 ? 0 : set->dirs[next]);
+        next++;
+
+        uint32_t i;
+        for( i = 0; i < dir->num_entries; i++) {
+            FATdirectory entry;
+            fatUnpackDirectory(&entry, fatDirectoryEntry(dir, i));
+            if( entry.filename[0] == FAT_ENTRY_END ) break;
+            if( !fatIsVisibleEntry(&entry) || entry.first_logical_cluster < 2 ) continue;
+
+            if( entry.attributes & FAT_ATTR_DIRECTORY ) {
+                if( set->num_dirs >= 65536 ) continue; //guards against loops
+                set->dirs = grow(set->dirs, set->num_dirs, &dir_capacity, sizeof(uint16_t));
+                set->dirs[set->num_dirs++] = entry.first_logical_cluster;
+            } else {
+                set->files = grow(set->files, set->num_files, &file_capacity, sizeof(bench_file));
+                set->files[set->num_files].first_cluster = entry.first_logical_cluster;
+                set->files[set->num_files].size = entry.file_size;
+                set->num_files++;
+                set->bytes += entry.file_size;
+            }
+        }
+        fatFreeDirectory(dir);
+    }
+}
+
+/* One round the way the original tools read: seek and read per cluster */
+uint64_t round_stdio(FILE * disk, FATboot * boot, FATtable * table, bench_set * set, uint8_t * buff) {
+    uint64_t requests = 0;
+    uint32_t cluster_size = fatGetClusterSize(boot);
+
+    int i;
+    for( i = -1; i < set->num_dirs; i++) {
+        uint16_t cluster = i < 0 ? 0 : set->dirs[i];
+        if( cluster == 0 ) {
+            xfseek(disk, fatGetRootStart(boot), SEEK_SET);
+            xfread(buff, FAT_DIRECTORY_SIZE, boot->max_root_entries, disk);
+            requests++;
+            continue;
+        }
+        uint32_t followed = 0;
+        while( cluster <= 0xFF0 && cluster > 1 && followed++ < table->num_entries ) {
+            xfseek(disk, fatGetDataspaceLocation(boot, cluster), SEEK_SET);
+            xfread(buff, cluster_size, 1, disk);
+            requests++;
+            cluster = fatTableGet(table, cluster);
+        }
+    }
+
+    for( i = 0; i < set->num_files; i++) {
+        uint16_t cluster = set->files[i].first_cluster;
+        uint32_t left = set->files[i].size;
+        while( left > 0 && cluster <= 0xFF0 && cluster > 1 ) {
+            uint32_t piece = left < cluster_size ? left : cluster_size;
+            xfseek(disk, fatGetDataspaceLocation(boot, cluster), SEEK_SET);
+            xfread(buff, 1, piece, disk);
+            requests++;
+            left -= piece;
+            cluster = fatTableGet(table, cluster);
+        }
+    }
+    return requests;
+}
+
+/* Number of reads fatIoLoadDirectory issues for a directory */
+uint32_t dir_runs(FATdirbuff * dir) {
+    if( !dir->num_clusters ) return 1;
+    uint32_t runs = 1;
+    uint32_t i;
+    for( i = 1; i < dir->num_clusters; i++) {
+        if( dir->clusters[i] != dir->clusters[i - 1] + 1 ) runs++;
+    }
+    return runs;
+}
+
+/* One round through the queued engine: whole directory chains and all extents of each file queued at once */
+uint64_t round_engine(FATio * io, FATboot * boot, FATtable * table, bench_set * set, uint8_t * buff) {
+    uint64_t requests = 0;
+    uint32_t cluster_size = fatGetClusterSize(boot);
+    FATiocompletion done;
+
+    int i;
+    for( i = -1; i < set->num_dirs; i++) {
+        FATdirbuff * dir = fatIoLoadDirectory(io, boot, table, i < 0 ? 0 : set->dirs[i]);
+        requests += dir_runs(dir);
+        fatFreeDirectory(dir);
+    }
+
+    uint32_t fresh = 0; //parts of buff not used yet, after that finished requests hand theirs on
+    for( i = 0; i < set->num_files; i++) {
+        uint32_t size = set->files[i].size;
+        int num;
+        FATextent * extents = fatChainExtents(table, set->files[i].first_cluster, (size + cluster_size - 1) / cluster_size, &num);
+
+        uint32_t done_bytes = 0;
+        int e;
+        for( e = 0; e < num; e++) {
+            uint32_t extent_bytes = extents[e].length * cluster_size;
+            uint32_t offset;
+            for( offset = 0; offset < extent_bytes && done_bytes < size; offset += FAT_IO_MAX_REQUEST) {
+                uint32_t piece = extent_bytes - offset < FAT_IO_MAX_REQUEST ? extent_bytes - offset : FAT_IO_MAX_REQUEST;
+                if( piece > size - done_bytes ) piece = size - done_bytes;
+                uint8_t * target;
+                if( fresh < io->depth ) {
+                    target = buff + (size_t) fresh++ * FAT_IO_MAX_REQUEST;
+                } else {
+                    fatIoSubmit(io);
+                    fatIoComplete(io, &done);
+                    target = done.buff;
+                }
+                fatIoQueueRead(io, target, piece,
+                               fatGetDataspaceLocation(boot, extents[e].start) + offset, NULL);
+                requests++;
+                done_bytes += piece;
+            }
+        }
+        xfree(extents);
+    }
+
+    fatIoSubmit(io);
+    while( fatIoComplete(io, &done) );
+    return requests;
+}
+
+/* Decode the way the tools did before FATcodec: one entry at a time, branching on parity */
+uint16_t branch_decode(const uint8_t * fat, uint32_t index) {
+    const uint8_t * entry = fat + (index * 12)/8;
+    if( index /2 * 2 == index ) { //even uses low nibble of second byte
+        return entry[0] + ((entry[1] & 0x0F) <<8);
+    } else { //odd uses high nibble of first byte
+        return ((entry[0] & 0xF0) >>4) + (entry[1] <<4);
+    }
+}
+
+/* Encode the way the tools did before FATcodec */
+void branch_encode(uint8_t * fat, uint32_t index, uint16_t value) {
+    uint8_t * entry = fat + (index * 12)/8;
+    if( index /2 * 2 == index ) {
+        entry[0] = value & 0x00FF;
+        entry[1] = (entry[1] & 0xF0) | ((value & 0x0F00 ) >>8);
+    } else { //odd case
+        entry[0] = (entry[0] & 0x0F) | (value & 0x000F) << 4;
+        entry[1] = (value & 0x0FF0) >>4;
+    }
+}
+
+/* One pass of a codec operation over the whole fat, old is 1 for the branching version
+ * Returns a value depending on every entry so the pass cannot be dropped */
+uint32_t codec_pass(int op, int old, uint8_t * fat, uint8_t * copy, uint32_t * values, uint32_t end) {
+    uint32_t result = 0;
+    uint32_t i;
+    switch( op ) {
+        case 0: //decode
+            if( old ) {
+                for( i = 2; i < end; i++) values[i] = branch_decode(fat, i);
+            } else {
+                fat12DecodeRange(fat, 2, end, values + 2);
+            }
+            return values[end - 1] + values[end / 2];
+        case 1: //encode
+            if( old ) {
+                for( i = 2; i < end; i++) branch_encode(copy, i, values[i]);
+            } else {
+                fat12EncodeRange(copy, 2, end, values + 2);
+            }
+            return copy[FAT_ENTRY_OFFSET(12, end - 1)];
+        case 2: //count free
+            if( old ) {
+                for( i = 2; i < end; i++) result += !branch_decode(fat, i);
+            } else {
+                result = fat12CountFree(fat, 2, end);
+            }
+            return result;
+        default: //free runs, as the free map is built
+            i = 2;
+            if( old ) {
+                while( i < end ) {
+                    if( branch_decode(fat, i) ) {
+                        i++;
+                        continue;
+                    }
+                    uint32_t start = i;
+                    while( i < end && !branch_decode(fat, i) ) i++;
+                    result += i - start + 1;
+                }
+            } else {
+                while( (i = fat12FindFree(fat, i, end)) < end ) {
+                    uint32_t start = i;
+                    i = fat12FindUsed(fat, i, end);
+                    result += i - start + 1;
+                }
+            }
+            return result;
+    }
+}
+
+/* Time each codec operation over the loaded fat, best of rounds, in nanoseconds per entry */
+void bench_codec(FATtable * table, int rounds) {
+    uint32_t end = table->num_entries;
+    uint8_t * copy = xmalloc(table->size);
+    uint32_t * values = xmalloc(end * sizeof(uint32_t));
+    memcpy(copy, table->fat, table->size);
+    uint32_t passes = 20000000 / end + 1; //enough entries per round to time
+
+    printf("%u entries, %u passes, %d rounds\n", end - 2, passes, rounds);
+    printf("%-10s %12s %12s %8s\n", "operation", "branch ns", "codec ns", "speedup");
+
+    const char * ops[4] = {"decode", "encode", "count", "free runs"};
+    int op;
+    for( op = 0; op < 4; op++) {
+        double best[2] = {-1, -1};
+        uint32_t check[2];
+        int old;
+        for( old = 1; old >= 0; old--) {
+            int r;
+            for( r = 0; r < rounds; r++) {
+                if( op == 1 ) codec_pass(0, 0, table->fat, copy, values, end); //values to encode
+                volatile uint32_t sink = 0;
+                double start = now_seconds();
+                uint32_t p;
+                for( p = 0; p < passes; p++) sink += codec_pass(op, old, table->fat, copy, values, end);
+                double took = (now_seconds() - start) * 1e9 / ((double) passes * (end - 2));
+                if( best[old] < 0 || took < best[old] ) best[old] = took;
+                check[old] = op == 1 ? (uint32_t) memcmp(copy, table->fat, FAT_ENTRY_OFFSET(12, end)) : sink;
+            }
+        }
+        printf("%-10s %12.3f %12.3f %7.2fx%s\n", ops[op], best[1], best[0], best[1] / best[0],
+               check[0] == check[1] ? "" : "  results differ!");
+    }
+
+    xfree(values);
+    xfree(copy);
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    int rounds = 5;
+    uint32_t depth = FAT_IO_DEFAULT_DEPTH;
+    int cold = 0;
+    int codec = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "r:d:cf")) != -1 ) {
+        switch( opt ) {
+            case 'r': rounds = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'c': cold = 1; break;
+            case 'f': codec = 1; break;
+            default:
+                printf("Usage: ./diskbench [-r rounds] [-d depth] [-c] [-f] <disk> \n");
+                return 1;
+        }
+    }
+
+    if( argc - optind != 1 || rounds < 1 || depth < 1 ) {
+        printf("Usage: ./diskbench [-r rounds] [-d depth] [-c] [-f] <disk> \n");
+        printf("  -r rounds per path (5)\n  -d requests in flight for the queued paths (%d)\n", FAT_IO_DEFAULT_DEPTH);
+        printf("  -c drop the image from the page cache before each round\n");
+        printf("  -f time the FAT entry codecs instead of the I/O paths\n");
+        return 1;
+    }
+
+    FILE * disk = fopen(argv[optind],"r");
+    if( !disk) {
+        perror("Opening disk failed:");
+        printf("Name given %s\n",argv[optind]);
+        return 3;
+    }
+
+    FATboot * boot = fatGetBootInfo(disk);
+    FATtable * table = fatLoadTable(disk, boot);
+
+    if( codec ) {
+        bench_codec(table, rounds);
+        fatFreeTable(table);
+        xfree(boot);
+        fclose(disk);
+        return 0;
+    }
+
+    bench_set set;
+    collect(disk, boot, table, &set);
+
+    uint32_t max_dir = boot->max_root_entries * FAT_DIRECTORY_SIZE;
+    if( max_dir < fatGetClusterSize(boot) ) max_dir = fatGetClusterSize(boot);
+    uint8_t * buff = xmalloc((size_t) depth * FAT_IO_MAX_REQUEST + max_dir);
+
+    printf("%d directories, %d files, %llu bytes, %d rounds%s\n", set.num_dirs + 1, set.num_files,
+           (unsigned long long) set.bytes, rounds, cold ? ", cold cache" : "");
+    printf("%-10s %10s %10s %10s %10s\n", "path", "seconds", "MB/s", "requests", "calls");
+
+    const char * paths[3] = {"stdio", "pread", "io_uring"};
+    int p;
+    for( p = 0; p < 3; p++) {
+        bench_result result;
+        result.best = -1;
+        result.calls = 0;
+
+        FATio * io = NULL;
+        if( p > 0 ) {
+            if( p == 1 ) setenv("FATIO_ENGINE", "sync", 1);
+            else unsetenv("FATIO_ENGINE");
+            io = fatOpenIo(fileno(disk), depth);
+            if( p == 2 && !io->uring ) {
+                printf("%-10s not available on this kernel\n", paths[p]);
+                fatCloseIo(io);
+                continue;
+            }
+        }
+
+        int r;
+        for( r = 0; r < rounds; r++) {
+            if( cold ) posix_fadvise(fileno(disk), 0, 0, POSIX_FADV_DONTNEED);
+            uint64_t calls_before = io ? io->submits : 0;
+
+            double start = now_seconds();
+            result.requests = io ? round_engine(io, boot, table, &set, buff) : round_stdio(disk, boot, table, &set, buff);
+            double took = now_seconds() - start;
+
+            if( result.best < 0 || took < result.best ) result.best = took;
+            if( io ) result.calls = io->uring ? io->submits - calls_before : result.requests;
+        }
+
+        if( p == 0 ) {
+            printf("%-10s %10.6f %10.1f %10llu %10s\n", paths[p], result.best, set.bytes / 1e6 / result.best,
+                   (unsigned long long) result.requests, "-");
+        } else {
+            printf("%-10s %10.6f %10.1f %10llu %10llu\n", paths[p], result.best, set.bytes / 1e6 / result.best,
+                   (unsigned long long) result.requests, (unsigned long long) result.calls);
+            fatCloseIo(io);
+        }
+    }
+
+    xfree(buff);
+    if( set.dirs ) xfree(set.dirs); //NULL when there are no subdirectories
+    if( set.files ) xfree(set.files);
+    fatFreeTable(table);
+    xfree(boot);
+    fclose(disk);
+
+    return 0;
+}
@@ -0,0 +1,349 @@
+/* Implementation of diskcp. Copies a file or a whole directory tree from one image into a directory of another
+ *
+ * Both images are open together so nothing goes through the host filesystem. Every
+ * cluster is planned from the destination free map first, which hands out contiguous
+ * runs, then file data moves between the two image files with copy_file_range, one call
+ * for each piece where a source run and a destination run overlap. Names, long names,
+ * times and attributes are kept.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATlfn.h"
+#include "FATindex.h"
+#include "ADTlinkedlist.h"
+#include "FAToverlay.h"
+#include "utils.h"
+
+/* Clusters of new directories buffered before a write is issued */
+#define CP_WRITE_CLUSTERS 128
+
+/* Entry being copied */
+typedef struct cp_node{
+    FATdirectory entry; //as in the source, first cluster replaced once allocated
+    char * long_name; //NULL if it has none
+    uint16_t source_cluster;
+    ADTlinkedlist children; //cp_node values, directories only
+    uint32_t clusters; //clusters taken in the destination
+}cp_node;
+
+/* Both images */
+struct cp_state{
+    FILE * source;
+    FATboot * source_boot;
+    FATtable * source_table;
+    FILE * dest;
+    FATboot * dest_boot;
+    FATtable * dest_table;
+    FATfreemap * map;
+    uint32_t num_entries;
+    uint64_t num_bytes;
+} state;
+
+
+/* Node for the entry at index of a source directory, with everything below it */
+cp_node * scan_node(FATdirbuff * dir, uint32_t index) {
+    cp_node * node = xmalloc(sizeof(cp_node));
+    fatUnpackDirectory(&node->entry, fatDirectoryEntry(dir, index));
+    node->source_cluster = node->entry.first_logical_cluster;
+    node->clusters = 0;
+    adtInitiateLinkedList(&node->children);
+    state.num_entries++;
+
+    char long_name[FAT_LFN_NAME_SIZE];
+    size_t length = fatLfnFind(dir, index, long_name);
+    node->long_name = NULL;
+    if( length ) {
+        node->long_name = xmalloc(length + 1);
+        memcpy(node->long_name, long_name, length + 1);
+    }
+
+    if( !(node->entry.attributes & FAT_ATTR_DIRECTORY) ) {
+        state.num_bytes += node->entry.file_size;
+        return node;
+    }
+
+    node->entry.file_size = 0;
+    FATdirbuff * sub = fatLoadDirectory(state.source, state.source_boot, state.source_table, node->source_cluster);
+    uint32_t i;
+    for( i = 0; i < sub->num_entries; i++) {
+        FATdirectory entry;
+        uint8_t * raw = fatDirectoryEntry(sub, i);
+        if( raw[0] == FAT_ENTRY_END ) break;
+        fatUnpackDirectory(&entry, raw);
+        if( !fatIsVisibleEntry(&entry) ) continue;
+
+        ADTlinkednode * link = xmalloc(sizeof(ADTlinkednode));
+        adtInitiateLinkedNode(link, scan_node(sub, i));
+        adtAddEndLinkedNode(&node->children, link);
+    }
+    fatFreeDirectory(sub);
+    return node;
+}
+
+/* Work out the clusters of node and everything below it in the destination, returns their total */
+uint32_t plan_node(cp_node * node) {
+    uint32_t cluster_size = fatGetClusterSize(state.dest_boot);
+
+    if( !(node->entry.attributes & FAT_ATTR_DIRECTORY) ) {
+        node->clusters = (node->entry.file_size + cluster_size - 1) / cluster_size;
+        return node->clusters;
+    }
+
+    uint32_t entries = 2; //. and ..
+    uint32_t total = 0;
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) {
+        cp_node * child = link->val;
+        entries += 1 + (child->long_name ? fatLfnEntries(child->long_name) : 0);
+        total += plan_node(child);
+    }
+    node->clusters = fatDirectoryClusters(state.dest_boot, entries);
+    return total + node->clusters;
+}
+
+/* Allocate the planned clusters of node and everything below it, cannot fail once planned */
+void allocate_node(cp_node * node) {
+    node->entry.first_logical_cluster = node->clusters ? fatAllocChain(state.map, state.dest_table, node->clusters) : 0;
+    assert(!node->clusters || node->entry.first_logical_cluster);
+
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) allocate_node(link->val);
+}
+
+/* Copy size bytes between the images, inside the kernel unless one is an overlay */
+static void copy_range(uint32_t source_offset, uint32_t dest_offset, uint32_t size) {
+    if( fileno(state.source) >= 0 && fileno(state.dest) >= 0 ) {
+        xcopyrange(fileno(state.source), source_offset, fileno(state.dest), dest_offset, size);
+        return;
+    }
+
+    uint8_t * buff = xmalloc(size);
+    xfseek(state.source, source_offset, SEEK_SET);
+    xfread(buff, 1, size, state.source);
+    xfseek(state.dest, dest_offset, SEEK_SET);
+    xfwrite(buff, 1, size, state.dest);
+    xfree(buff);
+}
+
+/* Copy the data of a file between the images, walking the source and destination runs together */
+void copy_file(cp_node * node) {
+    uint32_t source_size = fatGetClusterSize(state.source_boot);
+    uint32_t dest_size = fatGetClusterSize(state.dest_boot);
+    uint32_t file_size = node->entry.file_size;
+
+    int num_source;
+    int num_dest;
+    FATextent * source = fatChainExtents(state.source_table, node->source_cluster, (file_size + source_size - 1) / source_size, &num_source);
+    FATextent * dest = fatChainExtents(state.dest_table, node->entry.first_logical_cluster, node->clusters, &num_dest);
+
+    int s = 0;
+    int d = 0;
+    uint32_t source_used = 0; //bytes done of the current runs
+    uint32_t dest_used = 0;
+    uint32_t done = 0;
+    while( done < file_size && s < num_source && d < num_dest ) {
+        uint32_t piece = source[s].length * source_size - source_used;
+        if( dest[d].length * dest_size - dest_used < piece ) piece = dest[d].length * dest_size - dest_used;
+        if( file_size - done < piece ) piece = file_size - done;
+
+        copy_range(fatGetDataspaceLocation(state.source_boot, source[s].start) + source_used,
+                   fatGetDataspaceLocation(state.dest_boot, dest[d].start) + dest_used, piece);
+        done += piece;
+        source_used += piece;
+        dest_used += piece;
+
+        if( source_used == source[s].length * source_size ) {
+            s++;
+            source_used = 0;
+        }
+        if( dest_used == dest[d].length * dest_size ) {
+            d++;
+            dest_used = 0;
+        }
+    }
+
+    if( done < file_size ) {
+        printf("Warning corrupted file, not all of %.8s.%.3s copied!\n", node->entry.filename, node->entry.extention);
+    }
+    xfree(source);
+    xfree(dest);
+}
+
+/* Write node and everything below it into the destination, parent is the directory it goes in */
+void copy_node(cp_node * node, FATwriter * writer, uint16_t parent) {
+    if( !(node->entry.attributes & FAT_ATTR_DIRECTORY) ) {
+        if( node->clusters ) copy_file(node);
+        return;
+    }
+
+    uint32_t cluster_size = fatGetClusterSize(state.dest_boot);
+    uint8_t * image = xmalloc(node->clusters * cluster_size);
+    fatInitDirectoryClusters(state.dest_boot, image, node->clusters, node->entry.first_logical_cluster, parent, time(NULL));
+
+    uint32_t index = 2; //after . and ..
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) {
+        cp_node * child = link->val;
+        if( child->long_name ) {
+            fatLfnPack(child->long_name, child->entry.filename, image + index * FAT_DIRECTORY_SIZE);
+            index += fatLfnEntries(child->long_name);
+        }
+        fatPackDirectory(&child->entry, image + index * FAT_DIRECTORY_SIZE);
+        index++;
+    }
+
+    uint32_t i;
+    uint16_t cluster = node->entry.first_logical_cluster;
+    for( i = 0; i < node->clusters; i++) {
+        memcpy(fatWriterSlot(state.dest, state.dest_boot, writer, cluster), image + i * cluster_size, cluster_size);
+        cluster = fatTableGet(state.dest_table, cluster);
+    }
+    xfree(image);
+
+    for( link = node->children.head; link; link = link->next) {
+        copy_node(link->val, writer, node->entry.first_logical_cluster);
+    }
+}
+
+/* Free node and everything below it */
+void free_node(cp_node * node) {
+    while( node->children.num > 0 ) {
+        ADTlinkednode * link = adtPopLinkedNode(&node->children, 0);
+        free_node(link->val);
+        xfree(link);
+    }
+    if( node->long_name ) xfree(node->long_name);
+    xfree(node);
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    if( argc != 4 && argc != 5 ) {
+        printf("Usage: ./diskcp <source disk> <source path> <destination disk> [destination directory] \n");
+        return 1;
+    }
+
+    state.source = fatOpenImage(argv[1],"r");
+    state.dest = fatOpenImage(argv[3],"r+");
+    if( !state.source || !state.dest ) {
+        perror("Aborting: Opening disk failed:");
+        return 3;
+    }
+
+    struct stat source_stats;
+    struct stat dest_stats;
+    stat(argv[1], &source_stats); //by name, overlays have no descriptor
+    stat(argv[3], &dest_stats);
+    if( source_stats.st_dev == dest_stats.st_dev && source_stats.st_ino == dest_stats.st_ino ) {
+        printf("Aborting: Source and destination must be different images\n");
+        return 3;
+    }
+
+    state.source_boot = fatGetBootInfo(state.source);
+    state.source_table = fatLoadTable(state.source, state.source_boot);
+    state.dest_boot = fatGetBootInfo(state.dest);
+    state.dest_table = fatLoadTable(state.dest, state.dest_boot);
+
+    /* Source entry and the tree below it */
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    char * source_path = xmalloc(strlen(argv[2]) + 1);
+    strcpy(source_path, argv[2]);
+    char ** components = xmalloc((strlen(argv[2]) / 2 + 1) * sizeof(char *));
+    int num = fatSplitPath(source_path, components);
+
+    FATdirindex index;
+    FATdirbuff * dir = num ? fatIndexPath(state.source, state.source_boot, state.source_table, components, num - 1, &index) : NULL;
+    int found = dir ? fatIndexFind(&index, components[num - 1]) : -1;
+    if( found < 0 ) {
+        printf("Aborting: Path cannot be found\n");
+        return 7;
+    }
+    cp_node * top = scan_node(dir, found);
+    fatFreeIndex(&index);
+    fatFreeDirectory(dir);
+    xfree(components);
+
+    /* Destination directory */
+    char * dest_path = xmalloc(argc == 5 ? strlen(argv[4]) + 1 : 2);
+    strcpy(dest_path, argc == 5 ? argv[4] : "/");
+    components = xmalloc((strlen(dest_path) / 2 + 1) * sizeof(char *));
+    num = fatSplitPath(dest_path, components);
+    dir = fatIndexPath(state.dest, state.dest_boot, state.dest_table, components, num, &index);
+    if( !dir ) {
+        printf("Aborting: Path cannot be found\n");
+        return 7;
+    }
+    statsPhase(STATS_PHASE_OTHER);
+
+    char short_name[13];
+    fatFormatName(&top->entry, short_name);
+    if( fatIndexFind(&index, short_name) >= 0 || (top->long_name && fatIndexFind(&index, top->long_name) >= 0) ) {
+        printf("File with same name already exists in directory\n");
+        return 2;
+    }
+    if( fatNameSetHas(&index.shorts, top->entry.filename) ) { //only the short name is taken, pick another
+        FATdircompare name;
+        if( !top->long_name || fatMakeShortName(top->long_name, &index.shorts, &name) ) {
+            printf("File with same name already exists in directory\n");
+            return 2;
+        }
+        memcpy(top->entry.filename, name.filename, sizeof(name.filename));
+        memcpy(top->entry.extention, name.extention, sizeof(name.extention));
+    }
+
+    /* Plan every cluster before anything is written */
+    uint32_t needed = plan_node(top);
+    state.map = fatBuildFreeMap(state.dest_table);
+    if( state.map->free_clusters < needed ) {
+        printf("Aborting: Not enough space for files!\n");
+        return 8;
+    }
+    allocate_node(top);
+
+    if( fatIndexInsert(&index, state.dest_boot, state.dest_table, state.map, top->long_name, &top->entry) < 0 ) {
+        printf(dir->first_cluster ? "Aborting: Not enough space for files!\n" : "Aborting: No room left in root directory\n");
+        return 7;
+    }
+
+    /* Data first, then the directory, then the fat */
+    statsPhase(STATS_PHASE_COPY);
+    FATwriter * writer = fatCreateWriter(state.dest_boot, CP_WRITE_CLUSTERS);
+    copy_node(top, writer, dir->first_cluster);
+    fatFreeWriter(state.dest, state.dest_boot, writer);
+    statsPhase(STATS_PHASE_OTHER);
+
+    fatWriteDirectory(state.dest, state.dest_boot, dir);
+    fatTableFlush(state.dest, state.dest_boot, state.dest_table);
+
+    printf("Copied %u entries, %llu bytes using %u clusters\n", state.num_entries, (unsigned long long) state.num_bytes, needed);
+
+    free_node(top);
+    fatFreeIndex(&index);
+    fatFreeDirectory(dir);
+    fatFreeFreeMap(state.map);
+    xfree(components);
+    xfree(dest_path);
+    xfree(source_path);
+    fatFreeTable(state.source_table);
+    fatFreeTable(state.dest_table);
+    xfree(state.source_boot);
+    xfree(state.dest_boot);
+    fclose(state.source);
+    fclose(state.dest);
+
+    return 0;
+}
@@ -0,0 +1,320 @@
+/* Implementation of diskdedup. Finds files with the same content across a set of images
+ *
+ * Images are memory mapped and walked on worker threads, hashing each cluster chain
+ * in place with the fast hash. Files sharing size and fast hash are duplicates, or only
+ * candidates when SHA-256 confirmation is asked for.
+*/
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "FATheaders.h"
+#include "FATmap.h"
+#include "digest.h"
+#include "utils.h"
+
+/* One file found in an image */
+typedef struct file_record {
+    int image; //index into images
+    char * path;
+    uint32_t size;
+    uint16_t first_cluster;
+    uint64_t hash;
+    uint8_t sha[DIGEST_SHA256_SIZE];
+} file_record;
+
+/* Work and results for one image */
+typedef struct image_job {
+    char * name;
+    FATmapped * image;
+    file_record * records;
+    int num;
+    int capacity;
+} image_job;
+
+/* State shared by worker threads */
+typedef struct dedup_state {
+    image_job * jobs;
+    int num_jobs;
+    int next_job;
+    file_record ** candidates; //records needing SHA-256
+    int num_candidates;
+    int next_candidate;
+    pthread_mutex_t lock;
+} dedup_state;
+
+static void feed_fast(void * arg, const void * data, size_t size) {
+    digestFastUpdate(arg, data, size);
+}
+
+static void feed_sha(void * arg, const void * data, size_t size) {
+    digestSha256Update(arg, data, size);
+}
+
+static void feed_file(void * arg, const void * data, size_t size) {
+    xfwrite((void *) data, 1, size, arg);
+}
+
+/* Walk callback, hashes every non empty file */
+int hash_entry(FATmapped * image, FATdirectory * entry, const char * path, void * arg) {
+    image_job * job = arg;
+
+    if( (entry->attributes & FAT_ATTR_DIRECTORY) || !entry->file_size ) return 0;
+
+    DIGESTfast digest;
+    digestFastInit(&digest);
+    if( fatStreamMappedChain(image, entry->first_logical_cluster, entry->file_size, feed_fast, &digest) < entry->file_size ) {
+        printf("Warning: %s:%s has a broken cluster chain, skipped\n", job->name, path);
+        return 0;
+    }
+
+    if( job->num == job->capacity ) {
+        job->capacity = job->capacity ? job->capacity * 2 : 64;
+        job->records = xrealloc(job->records, job->capacity * sizeof(file_record));
+    }
+
+    file_record * record = &job->records[job->num++];
+    record->path = xmalloc(strlen(path) + 1);
+    strcpy(record->path, path);
+    record->size = entry->file_size;
+    record->first_cluster = entry->first_logical_cluster;
+    record->hash = digestFastFinal(&digest);
+    memset(record->sha, 0, sizeof(record->sha));
+
+    return 0;
+}
+
+/* Worker thread, maps and hashes images until none are left */
+void * hash_worker(void * arg) {
+    dedup_state * state = arg;
+
+    while( 1 ) {
+        pthread_mutex_lock(&state->lock);
+        int index = state->next_job++;
+        pthread_mutex_unlock(&state->lock);
+        if( index >= state->num_jobs ) break;
+
+        image_job * job = &state->jobs[index];
+        job->image = fatMapImage(job->name);
+        if( !job->image ) continue;
+
+        fatWalkMapped(job->image, hash_entry, job);
+
+        int i;
+        for( i = 0; i < job->num; i++) job->records[i].image = index;
+    }
+
+    return NULL;
+}
+
+/* Worker thread, confirms candidates with SHA-256 */
+void * sha_worker(void * arg) {
+    dedup_state * state = arg;
+
+    while( 1 ) {
+        pthread_mutex_lock(&state->lock);
+        int index = state->next_candidate++;
+        pthread_mutex_unlock(&state->lock);
+        if( index >= state->num_candidates ) break;
+
+        file_record * record = state->candidates[index];
+        DIGESTsha256 digest;
+        digestSha256Init(&digest);
+        fatStreamMappedChain(state->jobs[record->image].image, record->first_cluster, record->size, feed_sha, &digest);
+        digestSha256Final(&digest, record->sha);
+    }
+
+    return NULL;
+}
+
+/* Run worker on threads and wait for all of them */
+void run_workers(int num_threads, void * (*worker)(void *), dedup_state * state) {
+    pthread_t * threads = xmalloc(num_threads * sizeof(pthread_t));
+    int i;
+    for( i = 0; i < num_threads; i++) {
+        if( pthread_create(&threads[i], NULL, worker, state) ) {
+            perror("FATAL: Creating thread failed: ");
+            abort();
+        }
+    }
+    for( i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    xfree(threads);
+}
+
+/* Order by size then hash then SHA-256 so equal content is adjacent */
+int compare_records(const void * val1, const void * val2) {
+    const file_record * a = *(file_record * const *) val1;
+    const file_record * b = *(file_record * const *) val2;
+
+    if( a->size != b->size ) return a->size < b->size ? -1 : 1;
+    if( a->hash != b->hash ) return a->hash < b->hash ? -1 : 1;
+    return memcmp(a->sha, b->sha, sizeof(a->sha));
+}
+
+/* Name of content in the export store */
+void content_name(file_record * record, int use_sha, char * out) {
+    if( use_sha ) {
+        digestToHex(record->sha, sizeof(record->sha), out);
+    } else {
+        sprintf(out, "%016llx-%u", (unsigned long long) record->hash, record->size);
+    }
+}
+
+void usage() {
+    printf("Usage: ./diskdedup [-s] [-j threads] [-e store directory] <disk> [disk...] \n");
+    printf("  -s confirms duplicates with SHA-256\n");
+    printf("  -e writes every distinct content once into the store, with an index of where it came from\n");
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    int use_sha = 0;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char * store = NULL;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "sj:e:")) != -1 ) {
+        switch( opt ) {
+            case 's': use_sha = 1; break;
+            case 'j': num_threads = atoi(optarg); break;
+            case 'e': store = optarg; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( optind >= argc || num_threads < 1 ) {
+        usage();
+        return 1;
+    }
+
+    dedup_state state;
+    state.num_jobs = argc - optind;
+    state.jobs = xmalloc(state.num_jobs * sizeof(image_job));
+    state.next_job = 0;
+    state.next_candidate = 0;
+    pthread_mutex_init(&state.lock, NULL);
+
+    int i;
+    for( i = 0; i < state.num_jobs; i++) {
+        state.jobs[i].name = argv[optind + i];
+        state.jobs[i].image = NULL;
+        state.jobs[i].records = NULL;
+        state.jobs[i].num = 0;
+        state.jobs[i].capacity = 0;
+    }
+
+    statsPhase(STATS_PHASE_TRAVERSAL); //hashing is done during the walk
+    run_workers(num_threads < state.num_jobs ? num_threads : state.num_jobs, hash_worker, &state);
+    statsPhase(STATS_PHASE_OTHER);
+
+    /* Index of every file, sorted so equal content is adjacent */
+    int num_records = 0;
+    for( i = 0; i < state.num_jobs; i++) num_records += state.jobs[i].num;
+
+    file_record ** index = xmalloc((num_records ? num_records : 1) * sizeof(file_record *));
+    int j;
+    num_records = 0;
+    for( i = 0; i < state.num_jobs; i++) {
+        for( j = 0; j < state.jobs[i].num; j++) index[num_records++] = &state.jobs[i].records[j];
+    }
+    qsort(index, num_records, sizeof(file_record *), compare_records);
+
+    if( use_sha ) { //only files sharing size and fast hash need the slow hash, unless it names store content
+        state.candidates = xmalloc((num_records ? num_records : 1) * sizeof(file_record *));
+        state.num_candidates = 0;
+        for( i = 0; i < num_records; i++) {
+            int same_prev = i > 0 && index[i-1]->size == index[i]->size && index[i-1]->hash == index[i]->hash;
+            int same_next = i + 1 < num_records && index[i+1]->size == index[i]->size && index[i+1]->hash == index[i]->hash;
+            if( same_prev || same_next || store ) state.candidates[state.num_candidates++] = index[i];
+        }
+        statsPhase(STATS_PHASE_COPY);
+        run_workers(num_threads, sha_worker, &state);
+        statsPhase(STATS_PHASE_OTHER);
+        qsort(index, num_records, sizeof(file_record *), compare_records);
+        xfree(state.candidates);
+    }
+
+    FILE * store_index = NULL;
+    if( store ) {
+        if( mkdir(store, 0755) && errno != EEXIST ) {
+            perror("Aborting: Creating store failed:");
+            return 3;
+        }
+        char index_name[FILENAME_MAX];
+        snprintf(index_name, sizeof(index_name), "%s/index.txt", store);
+        store_index = fopen(index_name, "w");
+        if( !store_index ) {
+            perror("Aborting: Creating store index failed:");
+            return 3;
+        }
+    }
+
+    /* Report groups of equal content */
+    uint64_t total_bytes = 0;
+    uint64_t unique_bytes = 0;
+    int num_groups = 0;
+    i = 0;
+    while( i < num_records ) {
+        int end = i + 1;
+        while( end < num_records && compare_records(&index[i], &index[end]) == 0 ) end++;
+
+        total_bytes += (uint64_t) index[i]->size * (end - i);
+        unique_bytes += index[i]->size;
+
+        char name[2 * DIGEST_SHA256_SIZE + 1];
+        content_name(index[i], use_sha, name);
+
+        if( end - i > 1 ) {
+            num_groups++;
+            printf("%d copies of %u bytes %s\n", end - i, index[i]->size, name);
+            for( j = i; j < end; j++) printf("    %s:%s\n", state.jobs[index[j]->image].name, index[j]->path);
+        }
+
+        if( store ) {
+            char content_path[FILENAME_MAX];
+            snprintf(content_path, sizeof(content_path), "%s/%s", store, name);
+            FILE * out = fopen(content_path, "w");
+            if( !out ) {
+                perror("Aborting: Writing store failed:");
+                return 3;
+            }
+            fatStreamMappedChain(state.jobs[index[i]->image].image, index[i]->first_cluster, index[i]->size, feed_file, out);
+            fclose(out);
+            for( j = i; j < end; j++) fprintf(store_index, "%s\t%s\t%s\n", name, state.jobs[index[j]->image].name, index[j]->path);
+        }
+
+        i = end;
+    }
+
+    printf("==================\n");
+    printf("Files: %d\nDuplicate groups: %d\nTotal bytes: %llu\nUnique bytes: %llu\nDuplicate bytes: %llu\n",
+           num_records,
+           num_groups,
+           (unsigned long long) total_bytes,
+           (unsigned long long) unique_bytes,
+           (unsigned long long) (total_bytes - unique_bytes));
+
+    if( store_index ) fclose(store_index);
+
+    for( i = 0; i < state.num_jobs; i++) {
+        for( j = 0; j < state.jobs[i].num; j++) xfree(state.jobs[i].records[j].path);
+        if( state.jobs[i].records ) xfree(state.jobs[i].records);
+        if( state.jobs[i].image ) fatUnmapImage(state.jobs[i].image);
+    }
+    xfree(index);
+    xfree(state.jobs);
+    pthread_mutex_destroy(&state.lock);
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+/* Implementation of diskdiff. Lists what was added, removed and modified between two images
+ *
+ * Directory trees are matched by name and compared on size, modified time and cluster chain.
+ * Data clusters are only read when that metadata leaves the answer open (same size but
+ * a different time or chain) or when a content check is asked for with -c.
+ * A directory held in the same clusters with the same bytes in both images is not matched
+ * entry by entry, only its subdirectories are descended into.
+*/
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "FATheaders.h"
+#include "FATmap.h"
+#include "ADTlinkedlist.h"
+#include "utils.h"
+
+/* Shared state of one comparison */
+typedef struct diff_state {
+    FATmapped * old_image;
+    FATmapped * new_image;
+    int check_content; //compare data even when metadata matches
+    int same_layout; //cluster numbers mean the same thing in both images
+    int same_fat; //fats are byte identical, chains with the same head are equal
+    uint64_t bytes_compared;
+    ADTlinkedlist added; //formatted lines
+    ADTlinkedlist removed;
+    ADTlinkedlist modified;
+} diff_state;
+
+/* Order entries by 8.3 name */
+int compare_names(const void * val1, const void * val2) {
+    const FATdirectory * a = val1;
+    const FATdirectory * b = val2;
+    int ret = memcmp(a->filename, b->filename, sizeof(a->filename));
+    if( ret ) return ret;
+    return memcmp(a->extention, b->extention, sizeof(a->extention));
+}
+
+/* Add a formatted report line to a list */
+void add_line(ADTlinkedlist * list, char type, const char * path, const char * reason) {
+    char * line = xmalloc(strlen(path) + strlen(reason) + 8);
+    sprintf(line, "%c %s%s", type, path, reason);
+
+    ADTlinkednode * node = xmalloc(sizeof(ADTlinkednode));
+    adtInitiateLinkedNode(node, line);
+    adtAddEndLinkedNode(list, node);
+}
+
+/* Returns 1 if both files use the same cluster numbers for their data */
+int same_chain(diff_state * state, FATdirectory * old_entry, FATdirectory * new_entry) {
+    if( !state->same_layout || old_entry->first_logical_cluster != new_entry->first_logical_cluster ) return 0;
+    if( state->same_fat ) return 1;
+
+    uint32_t clusters = (old_entry->file_size + fatGetClusterSize(&state->old_image->boot) - 1) / fatGetClusterSize(&state->old_image->boot);
+    uint16_t old_cluster = old_entry->first_logical_cluster;
+    uint16_t new_cluster = new_entry->first_logical_cluster;
+    uint32_t i;
+    for( i = 1; i < clusters; i++) {
+        if( old_cluster >= state->old_image->table.num_entries || new_cluster >= state->new_image->table.num_entries ) return 0;
+        old_cluster = fatTableGet(&state->old_image->table, old_cluster);
+        new_cluster = fatTableGet(&state->new_image->table, new_cluster);
+        if( old_cluster != new_cluster ) return 0;
+    }
+    return 1;
+}
+
+/* Returns 1 if the data of both files is equal, reading cluster by cluster and stopping at the first difference */
+int same_content(diff_state * state, FATdirectory * old_entry, FATdirectory * new_entry) {
+    if( old_entry->file_size != new_entry->file_size ) return 0;
+
+    uint32_t old_size = fatGetClusterSize(&state->old_image->boot);
+    uint32_t new_size = fatGetClusterSize(&state->new_image->boot);
+    uint16_t old_cluster = old_entry->first_logical_cluster;
+    uint16_t new_cluster = new_entry->first_logical_cluster;
+    uint32_t old_offset = 0; //position inside current clusters
+    uint32_t new_offset = 0;
+    uint32_t remaining = old_entry->file_size;
+
+    while( remaining > 0 ) {
+        uint8_t * old_data = old_cluster <= 0xFF0 ? fatMappedCluster(state->old_image, old_cluster) : NULL;
+        uint8_t * new_data = new_cluster <= 0xFF0 ? fatMappedCluster(state->new_image, new_cluster) : NULL;
+        if( !old_data || !new_data ) return 0; //broken chain
+
+        uint32_t piece = old_size - old_offset < new_size - new_offset ? old_size - old_offset : new_size - new_offset;
+        if( piece > remaining ) piece = remaining;
+
+        state->bytes_compared += piece;
+        if( memcmp(old_data + old_offset, new_data + new_offset, piece) ) return 0;
+
+        remaining -= piece;
+        old_offset += piece;
+        new_offset += piece;
+        if( old_offset == old_size ) {
+            old_cluster = fatTableGet(&state->old_image->table, old_cluster);
+            old_offset = 0;
+        }
+        if( new_offset == new_size ) {
+            new_cluster = fatTableGet(&state->new_image->table, new_cluster);
+            new_offset = 0;
+        }
+    }
+    return 1;
+}
+
+/* Compare two files matched by name */
+void compare_files(diff_state * state, FATdirectory * old_entry, FATdirectory * new_entry, const char * path) {
+    if( old_entry->file_size != new_entry->file_size ) {
+        char reason[64];
+        sprintf(reason, " (size %u -> %u)", old_entry->file_size, new_entry->file_size);
+        add_line(&state->modified, 'F', path, reason);
+        return;
+    }
+
+    int same_time = old_entry->modified_date == new_entry->modified_date && old_entry->modified_time == new_entry->modified_time;
+    int chain = same_chain(state, old_entry, new_entry);
+
+    if( same_time && chain && !state->check_content ) return; //metadata says unchanged, data is not read
+
+    int phase = statsPhase(STATS_PHASE_COPY);
+    int same = same_content(state, old_entry, new_entry);
+    statsPhase(phase);
+
+    if( !same ) {
+        add_line(&state->modified, 'F', path, " (content)");
+    } else if( !same_time ) {
+        add_line(&state->modified, 'F', path, " (time only)");
+    } else if( !chain ) {
+        add_line(&state->modified, 'F', path, " (moved clusters only)");
+    }
+}
+
+/* Returns 1 if two directories sit in the same clusters and hold the same bytes, so every
+ * entry in them matches by name, size, time and first cluster */
+int same_directory(diff_state * state, uint16_t old_cluster, uint16_t new_cluster) {
+    if( !state->same_layout || old_cluster != new_cluster ) return 0;
+
+    if( old_cluster == 0 ) {
+        uint32_t root_size = state->old_image->boot.max_root_entries * FAT_DIRECTORY_SIZE;
+        if( state->new_image->boot.max_root_entries != state->old_image->boot.max_root_entries
+                || fatGetRootStart(&state->old_image->boot) + root_size > state->old_image->volume_size
+                || fatGetRootStart(&state->new_image->boot) + root_size > state->new_image->volume_size ) return 0;
+        return !memcmp(fatMappedRoot(state->old_image), fatMappedRoot(state->new_image), root_size);
+    }
+
+    uint32_t cluster_size = fatGetClusterSize(&state->old_image->boot);
+    uint32_t followed = 0;
+    uint16_t cluster = old_cluster;
+    while( cluster <= 0xFF0 && followed++ < state->old_image->table.num_entries ) { //bound guards against loops
+        uint8_t * old_data = fatMappedCluster(state->old_image, cluster);
+        uint8_t * new_data = fatMappedCluster(state->new_image, cluster);
+        if( !old_data || !new_data || memcmp(old_data, new_data, cluster_size) ) return 0;
+
+        uint16_t next = fatTableGet(&state->old_image->table, cluster);
+        if( next != fatTableGet(&state->new_image->table, cluster) ) return 0;
+        cluster = next;
+    }
+    return 1;
+}
+
+void compare_directories(diff_state * state, uint16_t old_cluster, uint16_t new_cluster, const char * path);
+
+/* Check a directory that is byte for byte the same in both images, only subdirectories and
+ * files whose chains may differ are looked at */
+void check_same_directory(diff_state * state, uint16_t cluster, const char * path) {
+    uint32_t num;
+    FATdirectory * entries = fatReadMappedDirectory(state->old_image, cluster, &num);
+
+    int path_length = strlen(path);
+    char * entry_path = xmalloc(path_length + 1 + 13); //room to add / + name
+
+    uint32_t i;
+    for( i = 0; i < num; i++) {
+        int is_dir = entries[i].attributes & FAT_ATTR_DIRECTORY;
+        if( !is_dir && state->same_fat ) continue; //same entry and same chain
+
+        strcpy(entry_path, path);
+        entry_path[path_length] = '/';
+        fatFormatName(&entries[i], entry_path + path_length + 1);
+        if( is_dir ) {
+            if( entries[i].first_logical_cluster > 1 ) compare_directories(state, entries[i].first_logical_cluster, entries[i].first_logical_cluster, entry_path);
+        } else {
+            compare_files(state, &entries[i], &entries[i], entry_path);
+        }
+    }
+
+    xfree(entry_path);
+    xfree(entries);
+}
+
+/* Compare two directories matched by name, recursing into subdirectories found in both */
+void compare_directories(diff_state * state, uint16_t old_cluster, uint16_t new_cluster, const char * path) {
+    if( !state->check_content && same_directory(state, old_cluster, new_cluster) ) {
+        check_same_directory(state, old_cluster, path);
+        return;
+    }
+
+    uint32_t num_old;
+    uint32_t num_new;
+    FATdirectory * old_entries = fatReadMappedDirectory(state->old_image, old_cluster, &num_old);
+    FATdirectory * new_entries = fatReadMappedDirectory(state->new_image, new_cluster, &num_new);
+    qsort(old_entries, num_old, sizeof(FATdirectory), compare_names);
+    qsort(new_entries, num_new, sizeof(FATdirectory), compare_names);
+
+    int path_length = strlen(path);
+    char * entry_path = xmalloc(path_length + 1 + 13); //room to add / + name
+
+    uint32_t i = 0;
+    uint32_t j = 0;
+    while( i < num_old || j < num_new ) {
+        int order;
+        if( i == num_old ) order = 1;
+        else if( j == num_new ) order = -1;
+        else order = compare_names(&old_entries[i], &new_entries[j]);
+
+        FATdirectory * entry = order <= 0 ? &old_entries[i] : &new_entries[j];
+        strcpy(entry_path, path);
+        entry_path[path_length] = '/';
+        fatFormatName(entry, entry_path + path_length + 1);
+        char type = (entry->attributes & FAT_ATTR_DIRECTORY) ? 'D' : 'F';
+
+        if( order < 0 ) {
+            add_line(&state->removed, type, entry_path, "");
+            i++;
+        } else if( order > 0 ) {
+            add_line(&state->added, type, entry_path, "");
+            j++;
+        } else {
+            int old_dir = old_entries[i].attributes & FAT_ATTR_DIRECTORY;
+            int new_dir = new_entries[j].attributes & FAT_ATTR_DIRECTORY;
+            if( old_dir != new_dir ) {
+                add_line(&state->modified, type, entry_path, old_dir ? " (directory -> file)" : " (file -> directory)");
+            } else if( old_dir ) {
+                if( old_entries[i].first_logical_cluster > 1 && new_entries[j].first_logical_cluster > 1 ) {
+                    compare_directories(state, old_entries[i].first_logical_cluster, new_entries[j].first_logical_cluster, entry_path);
+                }
+            } else {
+                compare_files(state, &old_entries[i], &new_entries[j], entry_path);
+            }
+            i++;
+            j++;
+        }
+    }
+
+    xfree(entry_path);
+    xfree(old_entries);
+    xfree(new_entries);
+}
+
+/* Print and free a list of report lines */
+void print_lines(const char * title, ADTlinkedlist * list) {
+    printf("%s: %d\n==================\n", title, list->num);
+    while( list->num > 0 ) {
+        ADTlinkednode * node = adtPopLinkedNode(list, 0);
+        printf("%s\n", (char *) node->val);
+        xfree(node->val);
+        xfree(node);
+    }
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    diff_state state;
+    state.check_content = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "c")) != -1 ) {
+        switch( opt ) {
+            case 'c': state.check_content = 1; break;
+            default:
+                printf("Usage: ./diskdiff [-c] <old disk> <new disk> \n");
+                return 1;
+        }
+    }
+
+    if( argc - optind != 2 ) {
+        printf("Usage: ./diskdiff [-c] <old disk> <new disk> \n");
+        printf("  -c compares file data even when size, time and clusters match\n");
+        return 1;
+    }
+
+    state.old_image = fatMapImage(argv[optind]);
+    state.new_image = fatMapImage(argv[optind + 1]);
+    if( !state.old_image || !state.new_image ) return 3;
+
+    FATboot * old_boot = &state.old_image->boot;
+    FATboot * new_boot = &state.new_image->boot;
+    state.same_layout = fatGetClusterSize(old_boot) == fatGetClusterSize(new_boot)
+                        && fatGetDataspaceLocation(old_boot, 2) == fatGetDataspaceLocation(new_boot, 2);
+    state.same_fat = state.same_layout && state.old_image->table.size == state.new_image->table.size
+                     && !memcmp(state.old_image->table.fat, state.new_image->table.fat, state.old_image->table.size);
+    state.bytes_compared = 0;
+    adtInitiateLinkedList(&state.added);
+    adtInitiateLinkedList(&state.removed);
+    adtInitiateLinkedList(&state.modified);
+
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    compare_directories(&state, 0, 0, "");
+    statsPhase(STATS_PHASE_OTHER);
+
+    int changes = state.added.num + state.removed.num + state.modified.num;
+    print_lines("Added", &state.added);
+    print_lines("Removed", &state.removed);
+    print_lines("Modified", &state.modified);
+    printf("==================\nData bytes compared: %llu\n", (unsigned long long) state.bytes_compared);
+
+    fatUnmapImage(state.old_image);
+    fatUnmapImage(state.new_image);
+
+    return changes ? 1 : 0; //like diff, 1 when images differ
+}
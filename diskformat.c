@@ -0,0 +1,323 @@
+/* Implementation of diskformat. Creates a new empty FAT12 image, optionally seeded with files from a manifest
+ *
+ * The image file is sized with fallocate (or left sparse) so only the boot sector,
+ * the start of each FAT and the used directory/data clusters are ever written.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATimport.h"
+#include "ADTlinkedlist.h"
+#include "utils.h"
+
+/* FAT12 can address at most this many data clusters */
+#define FAT12_MAX_CLUSTERS 4084
+
+/* Clusters buffered before a write is issued */
+#define FORMAT_WRITE_CLUSTERS 128
+
+#define FORMAT_SECTOR_SIZE 512
+
+/* Fill boot struct for a volume, computing the fat size needed for the resulting clusters
+ * Returns 0 on success, -1 if the geometry cannot be used for FAT12 */
+int compute_geometry(FATboot * boot, uint32_t total_sectors, uint8_t sectors_per_cluster, uint16_t root_entries, const char * label) {
+    memset(boot, 0, sizeof(FATboot));
+
+    boot->ignore0[0] = 0xEB; //jump over boot parameters
+    boot->ignore0[1] = 0x3C;
+    boot->ignore0[2] = 0x90;
+    memcpy(boot->ignore0 + 3, "MSDOS5.0", 8); //OS name
+
+    boot->bytes_per_sector = FORMAT_SECTOR_SIZE;
+    boot->sectors_per_cluster = sectors_per_cluster;
+    boot->reserved_sectors = 1;
+    boot->num_fats = 2;
+    boot->max_root_entries = root_entries;
+    boot->total_sectors = total_sectors;
+    boot->ignore1 = total_sectors <= 2880 ? 0xF0 : 0xF8; //media descriptor, floppy or fixed
+    boot->sectors_per_track = 18;
+    boot->num_heads = 2;
+    boot->boot_signature = 0x29; //extended boot record, volume id/label/type present
+
+    uint32_t volume_id = time(NULL);
+    int i;
+    for( i = 0; i < 4; i++) boot->volume_id[i] = (volume_id >> (8*i)) & 0xFF;
+
+    memset(boot->volume_label, 0x20, sizeof(boot->volume_label));
+    for( i = 0; label[i] && i < (int) sizeof(boot->volume_label); i++) boot->volume_label[i] = toupper((unsigned char) label[i]);
+    memcpy(boot->file_system_type, "FAT12   ", 8);
+
+    /* fat size depends on the number of clusters which depends on the fat size, iterate until stable */
+    uint16_t sectors_per_fat = 1;
+    while( 1 ) {
+        boot->sectors_per_fat = sectors_per_fat;
+        uint32_t meta = boot->reserved_sectors + boot->num_fats * sectors_per_fat + fatGetRootSectors(boot);
+        if( meta >= total_sectors ) return -1;
+
+        uint32_t clusters = fatGetNumClusters(boot);
+        uint32_t fat_bytes = ((clusters + 2) * 3 + 1) / 2; //12 bits per entry
+        uint16_t needed = (fat_bytes + FORMAT_SECTOR_SIZE - 1) / FORMAT_SECTOR_SIZE;
+        if( needed <= sectors_per_fat ) break;
+        sectors_per_fat = needed;
+    }
+
+    uint32_t clusters = fatGetNumClusters(boot);
+    if( clusters < 1 || clusters > FAT12_MAX_CLUSTERS ) return -1;
+
+    return 0;
+}
+
+/* Size the image file without writing zeros. Preallocates when possible so the
+ * image is laid out contiguously, otherwise leaves it sparse */
+void size_image(FILE * disk, uint32_t size, int sparse) {
+    int fd = fileno(disk);
+
+    if( !sparse && fallocate(fd, 0, 0, size) == 0 ) return;
+
+    if( ftruncate(fd, size) ) {
+        perror("FATAL: Sizing image failed: ");
+        abort();
+    }
+}
+
+/* Add manifest entries to the root node. Each line is "<host path> <disk path>",
+ * missing directories on the disk path are created. Returns -1 if the manifest cannot be read */
+int read_manifest(const char * manifest_name, FATimportnode * root) {
+    FILE * manifest = fopen(manifest_name, "r");
+    if( !manifest ) {
+        perror("Opening manifest failed:");
+        return -1;
+    }
+
+    char line[2 * FILENAME_MAX];
+    int line_num = 0;
+    while( fgets(line, sizeof(line), manifest) ) {
+        line_num++;
+
+        if( !strchr(line, '\n') && !feof(manifest) ) { //rest of an overlong line would be read as the next one
+            int c;
+            while( (c = fgetc(manifest)) != '\n' && c != EOF );
+            printf("Warning: Skipping manifest line %d, longer than %d characters\n", line_num, (int) sizeof(line) - 2);
+            continue;
+        }
+
+        char * host_path = strtok(line, " \t\r\n");
+        if( !host_path || host_path[0] == '#' ) continue; //blank or comment
+        char * disk_path = strtok(NULL, " \t\r\n");
+        if( !disk_path ) {
+            printf("Warning: Skipping manifest line %d, no disk path after host path %s\n", line_num, host_path);
+            continue;
+        }
+        char * full_path = xmalloc(strlen(disk_path) + 1); //kept whole for messages
+        strcpy(full_path, disk_path);
+
+        FATimportnode * dir = root;
+        const char * problem = NULL;
+        char * component = strtok(disk_path, "/");
+        char * next;
+        while( component && (next = strtok(NULL, "/")) ) { //every component but the last is a directory
+            FATdircompare name;
+            if( fatParseName(component, &name) ) {
+                problem = "is not a valid 8.3 name";
+                break;
+            }
+
+            FATimportnode * child = fatImportFindChild(dir, &name);
+            if( !child ) {
+                child = fatImportDirectory(&name, time(NULL));
+                fatImportAddChild(dir, child);
+            } else if( !child->is_directory ) {
+                problem = "is a file, not a directory";
+                break;
+            }
+            dir = child;
+            component = next;
+        }
+
+        FATdircompare name;
+        if( !component ) {
+            printf("Warning: Skipping manifest line %d, disk path %s has no file name\n", line_num, full_path);
+        } else if( problem || fatParseName(component, &name) ) {
+            printf("Warning: Skipping manifest line %d, component %s of disk path %s %s\n", line_num, component, full_path,
+                   problem ? problem : "is not a valid 8.3 name");
+        } else {
+            FATimportnode * node = fatImportScan(host_path, component);
+            if( !node ) {
+                printf("Warning: Skipping manifest line %d, host path %s cannot be read\n", line_num, host_path);
+            } else if( fatImportAddChild(dir, node) ) {
+                printf("Warning: Skipping manifest line %d, disk path %s already exists\n", line_num, full_path);
+                fatFreeImportNode(node);
+            }
+        }
+        xfree(full_path);
+    }
+
+    fclose(manifest);
+    return 0;
+}
+
+void usage() {
+    printf("Usage: ./diskformat [-s size in KiB] [-c sectors per cluster] [-r root entries] [-l label] [-S] [-m manifest] <disk> \n");
+    printf("  -S leaves the image sparse instead of preallocating it\n");
+    printf("  -m seeds the image, each manifest line is \"<host path> <disk path>\"\n");
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    uint32_t size_kb = 1440;
+    int sectors_per_cluster = 1;
+    int root_entries = 224;
+    char * label = NULL;
+    char * manifest_name = NULL;
+    int sparse = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "s:c:r:l:m:S")) != -1 ) {
+        switch( opt ) {
+            case 's': size_kb = atoi(optarg); break;
+            case 'c': sectors_per_cluster = atoi(optarg); break;
+            case 'r': root_entries = atoi(optarg); break;
+            case 'l': label = optarg; break;
+            case 'm': manifest_name = optarg; break;
+            case 'S': sparse = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( optind != argc - 1 ) {
+        usage();
+        return 1;
+    }
+
+    if( sectors_per_cluster < 1 || sectors_per_cluster > 128 || (sectors_per_cluster & (sectors_per_cluster - 1)) ) {
+        printf("Aborting: Sectors per cluster must be a power of two up to 128\n");
+        return 4;
+    }
+
+    if( root_entries < 16 || root_entries % (FORMAT_SECTOR_SIZE / FAT_DIRECTORY_SIZE) ) {
+        printf("Aborting: Root entries must be a multiple of %d\n", FORMAT_SECTOR_SIZE / FAT_DIRECTORY_SIZE);
+        return 4;
+    }
+
+    if( label && strlen(label) > 11 ) {
+        printf("Aborting: Label can be at most 11 characters\n");
+        return 4;
+    }
+
+    uint32_t total_sectors = size_kb * 1024 / FORMAT_SECTOR_SIZE;
+    if( total_sectors > 0xFFFF ) {
+        printf("Aborting: Size too large for FAT12\n");
+        return 4;
+    }
+
+    FATboot boot;
+    if( compute_geometry(&boot, total_sectors, sectors_per_cluster, root_entries, label ? label : "NO NAME") ) {
+        printf("Aborting: Cluster count does not fit FAT12, try a different size or cluster size\n");
+        return 4;
+    }
+
+    /* Gather seed files before touching the image */
+    FATdircompare root_name;
+    memset(&root_name, 0x20, sizeof(FATdircompare));
+    FATimportnode * root = fatImportDirectory(&root_name, time(NULL));
+    if( manifest_name && read_manifest(manifest_name, root) ) return 3;
+
+    /* Both fit checks come before the image is opened, so a failed format leaves an existing file alone */
+    if( (label ? 1 : 0) + root->children.num > boot.max_root_entries ) {
+        printf("Aborting: Manifest has too many root directory entries\n");
+        return 7;
+    }
+
+    uint32_t needed = 0;
+    ADTlinkednode * link;
+    for( link = root->children.head; link; link = link->next) {
+        needed += fatImportCount(&boot, link->val);
+    }
+    if( needed > fatGetNumClusters(&boot) ) { //a fresh image has every cluster free
+        printf("Aborting: Not enough space for manifest files!\n");
+        return 8;
+    }
+
+    FILE * disk = fopen(argv[optind], "w+");
+    if( !disk ) {
+        perror("Aborting: Creating disk failed:");
+        return 3;
+    }
+
+    size_image(disk, total_sectors * FORMAT_SECTOR_SIZE, sparse);
+
+    uint8_t sector[FORMAT_SECTOR_SIZE];
+    memset(sector, 0, sizeof(sector));
+    fatPackBoot(&boot, sector);
+    sector[510] = 0x55; //boot sector signature
+    sector[511] = 0xAA;
+    xfseek(disk, 0, SEEK_SET);
+    xfwrite(sector, 1, sizeof(sector), disk);
+
+    /* The rest of the image reads back as zeros, so the fat and root can be loaded as usual */
+    FATtable * table = fatLoadTable(disk, &boot);
+    fatTableSet(table, 0, 0xF00 | boot.ignore1); //reserved entries hold the media descriptor
+    fatTableSet(table, 1, 0xFFF);
+
+    FATdirbuff * root_dir = fatLoadDirectory(disk, &boot, table, 0);
+    uint32_t slot = 0;
+
+    if( label ) { //label entry in root directory
+        FATdirectory entry;
+        FATdircompare label_name;
+        memcpy(label_name.filename, boot.volume_label, 8);
+        memcpy(label_name.extention, boot.volume_label + 8, 3);
+        fatInitEntry(&entry, &label_name, FAT_ATTR_VOLUME, time(NULL));
+        fatPackDirectory(&entry, fatDirectoryEntry(root_dir, slot++));
+    }
+
+    FATfreemap * map = fatBuildFreeMap(table);
+    for( link = root->children.head; link; link = link->next) {
+        fatImportAllocate(map, table, link->val);
+    }
+
+    statsPhase(STATS_PHASE_COPY);
+    FATwriter * writer = fatCreateWriter(&boot, FORMAT_WRITE_CLUSTERS);
+    for( link = root->children.head; link; link = link->next) {
+        FATdirectory entry;
+        fatImportWrite(disk, &boot, table, writer, link->val, 0);
+        fatImportEntry(link->val, &entry);
+        fatPackDirectory(&entry, fatDirectoryEntry(root_dir, slot++));
+    }
+    fatFreeWriter(disk, &boot, writer);
+    statsPhase(STATS_PHASE_OTHER);
+
+    fatWriteDirectory(disk, &boot, root_dir);
+    fatTableFlush(disk, &boot, table);
+
+    printf("Created %s: %u bytes, %u clusters of %u bytes\n",
+           argv[optind],
+           total_sectors * FORMAT_SECTOR_SIZE,
+           fatGetNumClusters(&boot),
+           fatGetClusterSize(&boot));
+
+    fatFreeDirectory(root_dir);
+    fatFreeFreeMap(map);
+    fatFreeTable(table);
+    fatFreeImportNode(root);
+    fclose(disk);
+
+    return 0;
+}
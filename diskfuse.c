@@ -0,0 +1,687 @@
+/* Implementation of diskfuse. Mounts an image read-write with FUSE
+ *
+ * The whole directory tree is read once at mount into a tree of nodes, each directory
+ * keeping its raw entries in memory. The FAT is held in memory, file data is read
+ * through a read-ahead buffer of contiguous clusters, and changed FAT sectors and
+ * directories are written back on fsync, close and unmount instead of on every change.
+ *
+ * Requires libfuse (build with "make diskfuse"). Runs single threaded.
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATio.h"
+#include "ADTlinkedlist.h"
+#include "FAToverlay.h"
+#include "utils.h"
+
+/* Clusters read ahead when a read misses the buffer */
+#define FUSE_READAHEAD_CLUSTERS 32
+
+/* Deepest directory nesting followed when building the tree, deeper directories are built when first looked up */
+#define FUSE_MAX_DEPTH 64
+
+/* Cached file or directory */
+typedef struct fuse_node {
+    FATdirectory entry;
+    struct fuse_node * parent; //NULL for root
+    uint32_t slot; //index of entry in parent directory
+    ADTlinkedlist children; //fuse_node values, directories only
+    FATdirbuff * dir; //raw entries, directories only
+    int dir_dirty;
+    int unbuilt; //children not built yet, dir is loaded
+} fuse_node;
+
+/* State of the mounted image */
+typedef struct fuse_state {
+    FILE * disk;
+    FATboot * boot;
+    FATtable * table;
+    FATfreemap * map; //freed clusters go straight back in
+    fuse_node * root;
+    uint8_t * readahead; //data of consecutive clusters
+    uint16_t readahead_first;
+    uint16_t readahead_count;
+} fuse_state;
+
+static fuse_state state;
+
+/* Create a node for entry stored at slot of parent */
+fuse_node * new_node(FATdirectory * entry, fuse_node * parent, uint32_t slot) {
+    fuse_node * node = xmalloc(sizeof(fuse_node));
+    node->entry = *entry;
+    node->parent = parent;
+    node->slot = slot;
+    node->dir = NULL;
+    node->dir_dirty = 0;
+    node->unbuilt = 0;
+    adtInitiateLinkedList(&node->children);
+
+    if( parent ) {
+        ADTlinkednode * link = xmalloc(sizeof(ADTlinkednode));
+        adtInitiateLinkedNode(link, node);
+        adtAddEndLinkedNode(&parent->children, link);
+    }
+    return node;
+}
+
+/* Cluster of a directory node, 0 for root */
+uint16_t node_cluster(fuse_node * node) {
+    return node->parent ? node->entry.first_logical_cluster : 0;
+}
+
+/* Create nodes for everything below a loaded directory, down to FUSE_MAX_DEPTH levels */
+void build_children(FATio * io, fuse_node * node, int depth) {
+    if( depth >= FUSE_MAX_DEPTH ) {
+        node->unbuilt = 1;
+        return;
+    }
+
+    uint32_t i;
+    for( i = 0; i < node->dir->num_entries; i++) {
+        FATdirectory entry;
+        fatUnpackDirectory(&entry, fatDirectoryEntry(node->dir, i));
+        if( entry.filename[0] == FAT_ENTRY_END ) break;
+        if( !fatIsVisibleEntry(&entry) ) continue;
+
+        fuse_node * child = new_node(&entry, node, i);
+        if( (entry.attributes & FAT_ATTR_DIRECTORY) ) {
+            if( entry.first_logical_cluster < 2 ) { //broken directory, keep it empty
+                child->entry.attributes &= ~FAT_ATTR_DIRECTORY;
+                continue;
+            }
+            child->dir = fatIoLoadDirectory(io, state.boot, state.table, node_cluster(child));
+            build_children(io, child, depth + 1);
+        }
+    }
+}
+
+/* Load a directory and create nodes for everything below it, each chain is read with its runs queued at once */
+void build_tree(FATio * io, fuse_node * node, int depth) {
+    node->dir = fatIoLoadDirectory(io, state.boot, state.table, node_cluster(node));
+    build_children(io, node, depth);
+}
+
+/* Build the children of a directory left unbuilt at FUSE_MAX_DEPTH, so it is never seen empty */
+fuse_node * built(fuse_node * node) {
+    if( node->unbuilt ) {
+        node->unbuilt = 0;
+        FATio * io = fatOpenImageIo(state.disk, 0);
+        build_children(io, node, 0);
+        fatCloseIo(io);
+    }
+    return node;
+}
+
+/* Unlink node from its parent list and free it with everything below */
+void free_node(fuse_node * node) {
+    if( node->parent ) {
+        ADTlinkedlist * siblings = &node->parent->children;
+        int index = 0;
+        ADTlinkednode * link;
+        for( link = siblings->head; link && link->val != node; link = link->next) index++;
+        if( link ) xfree(adtPopLinkedNode(siblings, index));
+        node->parent = NULL;
+    }
+    while( node->children.num > 0 ) free_node(node->children.head->val);
+    if( node->dir ) fatFreeDirectory(node->dir);
+    xfree(node);
+}
+
+/* Find child by 8.3 name */
+fuse_node * find_child(fuse_node * dir, FATdircompare * name) {
+    ADTlinkednode * link;
+    for( link = dir->children.head; link; link = link->next) {
+        fuse_node * child = link->val;
+        if( fatCompareEntries(&child->entry, name) == 0 ) return child;
+    }
+    return NULL;
+}
+
+/* Resolve a path to a node, NULL if missing */
+fuse_node * lookup(const char * path) {
+    fuse_node * node = built(state.root);
+    char component[FILENAME_MAX];
+
+    while( *path ) {
+        while( *path == '/' ) path++;
+        if( !*path ) break;
+
+        int length = 0;
+        while( path[length] && path[length] != '/' ) length++;
+        if( length >= FILENAME_MAX || !node->dir ) return NULL;
+        memcpy(component, path, length);
+        component[length] = 0;
+        path += length;
+
+        FATdircompare name;
+        if( fatParseName(component, &name) ) return NULL;
+        node = find_child(node, &name);
+        if( !node ) return NULL;
+        built(node);
+    }
+    return node;
+}
+
+/* Resolve the parent directory of path and parse the last component
+ * Returns 0 or a negative errno */
+int lookup_parent(const char * path, fuse_node ** parent, FATdircompare * name) {
+    const char * last = strrchr(path, '/');
+    if( !last ) return -ENOENT;
+
+    char * dir_path = xmalloc(last - path + 1);
+    memcpy(dir_path, path, last - path);
+    dir_path[last - path] = 0;
+    *parent = lookup(dir_path);
+    xfree(dir_path);
+
+    if( !*parent || !(*parent)->dir ) return -ENOENT;
+    if( fatParseName(last + 1, name) ) return -EINVAL; //only 8.3 names can be stored
+    return 0;
+}
+
+/* Copy node's entry back into its parent directory */
+void store_entry(fuse_node * node) {
+    fatPackDirectory(&node->entry, fatDirectoryEntry(node->parent->dir, node->slot));
+    node->parent->dir_dirty = 1;
+}
+
+/* Write dirty directories below node */
+void flush_directories(fuse_node * node) {
+    if( node->dir && node->dir_dirty ) {
+        fatWriteDirectory(state.disk, state.boot, node->dir);
+        node->dir_dirty = 0;
+    }
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) flush_directories(link->val);
+}
+
+/* Write back all dirty metadata */
+void flush_all() {
+    flush_directories(state.root);
+    fatTableFlush(state.disk, state.boot, state.table);
+}
+
+/* Cluster number index clusters into the chain, 0 if the chain is shorter */
+uint16_t cluster_at(uint16_t first, uint32_t index) {
+    uint16_t cluster = first;
+    while( index-- > 0 && cluster > 1 && cluster <= 0xFF0 ) cluster = fatTableGet(state.table, cluster);
+    return (cluster > 1 && cluster <= 0xFF0) ? cluster : 0;
+}
+
+/* Pointer to the data of cluster, filling the read-ahead buffer with the contiguous run
+ * starting there when it is not already buffered. want is the number of clusters the file still needs */
+uint8_t * read_cluster(uint16_t cluster, uint32_t want) {
+    uint32_t cluster_size = fatGetClusterSize(state.boot);
+
+    if( cluster < state.readahead_first || cluster >= state.readahead_first + state.readahead_count ) {
+        if( want > FUSE_READAHEAD_CLUSTERS ) want = FUSE_READAHEAD_CLUSTERS;
+        if( want < 1 ) want = 1;
+        uint16_t run = fatChainRun(state.table, cluster, want);
+        fatReadClusters(state.disk, state.boot, cluster, run, state.readahead);
+        state.readahead_first = cluster;
+        state.readahead_count = run;
+    }
+
+    return state.readahead + (cluster - state.readahead_first) * cluster_size;
+}
+
+/* Forget buffered clusters after a write */
+void drop_readahead() {
+    state.readahead_count = 0;
+}
+
+/* Write bytes into a file's chain at offset, the chain must already be long enough */
+void write_chain(fuse_node * node, const uint8_t * data, uint32_t size, uint32_t offset) {
+    uint32_t cluster_size = fatGetClusterSize(state.boot);
+    uint16_t cluster = cluster_at(node->entry.first_logical_cluster, offset / cluster_size);
+    uint32_t in_cluster = offset % cluster_size;
+
+    while( size > 0 && cluster ) {
+        uint32_t piece = cluster_size - in_cluster < size ? cluster_size - in_cluster : size;
+        xfseek(state.disk, fatGetDataspaceLocation(state.boot, cluster) + in_cluster, SEEK_SET);
+        xfwrite((void *) data, 1, piece, state.disk);
+        data += piece;
+        size -= piece;
+        in_cluster = 0;
+        cluster = fatTableGet(state.table, cluster);
+    }
+    drop_readahead();
+}
+
+/* Make a file's chain hold at least size bytes. Returns 0 or -ENOSPC */
+int ensure_clusters(fuse_node * node, uint32_t size) {
+    uint32_t cluster_size = fatGetClusterSize(state.boot);
+    uint32_t needed = (size + cluster_size - 1) / cluster_size;
+    uint32_t have = fatChainLength(state.table, node->entry.first_logical_cluster);
+    if( needed <= have ) return 0;
+
+    uint16_t added = fatAllocChain(state.map, state.table, needed - have);
+    if( !added ) return -ENOSPC;
+
+    if( have == 0 ) {
+        node->entry.first_logical_cluster = added;
+    } else {
+        fatTableSet(state.table, cluster_at(node->entry.first_logical_cluster, have - 1), added);
+    }
+    return 0;
+}
+
+/* Grow a file to size bytes, new bytes read as zero. Returns 0 or -ENOSPC */
+int extend_file(fuse_node * node, uint32_t size) {
+    if( size <= node->entry.file_size ) return 0;
+
+    int ret = ensure_clusters(node, size);
+    if( ret ) return ret;
+
+    uint32_t gap = size - node->entry.file_size;
+    uint8_t * zeros = xmalloc(gap);
+    memset(zeros, 0, gap);
+    write_chain(node, zeros, gap, node->entry.file_size);
+    xfree(zeros);
+
+    node->entry.file_size = size;
+    return 0;
+}
+
+/* Set the modified time of an entry, keeping its creation time */
+void touch_entry(FATdirectory * entry, time_t when) {
+    uint16_t creation_date = entry->creation_date;
+    uint16_t creation_time = entry->creation_time;
+    fatSetEntryTime(entry, when);
+    entry->creation_date = creation_date;
+    entry->creation_time = creation_time;
+}
+
+int fs_getattr(const char * path, struct stat * stats) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+
+    memset(stats, 0, sizeof(struct stat));
+    stats->st_uid = getuid();
+    stats->st_gid = getgid();
+    stats->st_blksize = fatGetClusterSize(state.boot);
+
+    if( node->dir ) {
+        stats->st_mode = S_IFDIR | 0755;
+        stats->st_nlink = 2;
+    } else {
+        stats->st_mode = S_IFREG | ((node->entry.attributes & 0x01) ? 0444 : 0644); //read only attribute
+        stats->st_nlink = 1;
+        stats->st_size = node->entry.file_size;
+        stats->st_blocks = (uint64_t) fatChainLength(state.table, node->entry.first_logical_cluster) * fatGetClusterSize(state.boot) / 512;
+    }
+
+    if( node->parent ) stats->st_mtime = stats->st_ctime = stats->st_atime = fatGetEntryTime(&node->entry);
+    return 0;
+}
+
+int fs_readdir(const char * path, void * buff, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info * info) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( !node->dir ) return -ENOTDIR;
+
+    filler(buff, ".", NULL, 0);
+    filler(buff, "..", NULL, 0);
+
+    ADTlinkednode * link;
+    for( link = node->children.head; link; link = link->next) {
+        char name[13];
+        fatFormatName(&((fuse_node *) link->val)->entry, name);
+        if( filler(buff, name, NULL, 0) ) break;
+    }
+    return 0;
+}
+
+int fs_open(const char * path, struct fuse_file_info * info) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( node->dir ) return -EISDIR;
+    return 0;
+}
+
+int fs_read(const char * path, char * buff, size_t size, off_t offset, struct fuse_file_info * info) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( node->dir ) return -EISDIR;
+
+    if( offset >= node->entry.file_size ) return 0;
+    if( offset + size > node->entry.file_size ) size = node->entry.file_size - offset;
+
+    uint32_t cluster_size = fatGetClusterSize(state.boot);
+    uint32_t total_clusters = (node->entry.file_size + cluster_size - 1) / cluster_size;
+    uint32_t index = offset / cluster_size;
+    uint32_t in_cluster = offset % cluster_size;
+    uint16_t cluster = cluster_at(node->entry.first_logical_cluster, index);
+    size_t done = 0;
+
+    while( done < size && cluster ) {
+        uint32_t piece = cluster_size - in_cluster < size - done ? cluster_size - in_cluster : size - done;
+        memcpy(buff + done, read_cluster(cluster, total_clusters - index) + in_cluster, piece);
+        done += piece;
+        in_cluster = 0;
+        index++;
+        cluster = fatTableGet(state.table, cluster);
+        if( cluster > 0xFF0 || cluster < 2 ) cluster = 0;
+    }
+    return done;
+}
+
+int fs_write(const char * path, const char * buff, size_t size, off_t offset, struct fuse_file_info * info) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( node->dir ) return -EISDIR;
+    if( offset + size > 0xFFFFFFFFULL ) return -EFBIG;
+
+    int ret = extend_file(node, offset); //zero any gap before offset
+    if( !ret ) ret = ensure_clusters(node, offset + size);
+    if( ret ) return ret;
+
+    write_chain(node, (const uint8_t *) buff, size, offset);
+    if( offset + size > node->entry.file_size ) node->entry.file_size = offset + size;
+    touch_entry(&node->entry, time(NULL));
+    store_entry(node);
+    return size;
+}
+
+int fs_truncate(const char * path, off_t size) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( node->dir ) return -EISDIR;
+    if( size > 0xFFFFFFFFLL ) return -EFBIG;
+
+    if( size < node->entry.file_size ) {
+        uint32_t cluster_size = fatGetClusterSize(state.boot);
+        uint32_t keep = (size + cluster_size - 1) / cluster_size;
+        if( keep == 0 ) {
+            fatReleaseChain(state.map, state.table, node->entry.first_logical_cluster);
+            node->entry.first_logical_cluster = 0;
+        } else {
+            uint16_t last = cluster_at(node->entry.first_logical_cluster, keep - 1);
+            uint16_t rest = fatTableGet(state.table, last);
+            fatTableSet(state.table, last, FAT_END_OF_CHAIN);
+            fatReleaseChain(state.map, state.table, rest);
+        }
+        node->entry.file_size = size;
+    } else {
+        int ret = extend_file(node, size);
+        if( ret ) return ret;
+    }
+
+    touch_entry(&node->entry, time(NULL));
+    store_entry(node);
+    return 0;
+}
+
+/* Add a new entry below parent and create its node. Returns the node or NULL if there is no room */
+fuse_node * add_entry(fuse_node * parent, FATdirectory * entry) {
+    int slot = fatInsertEntry(parent->dir, state.boot, state.table, state.map, entry);
+    if( slot < 0 ) return NULL;
+    parent->dir_dirty = 1;
+    return new_node(entry, parent, slot);
+}
+
+int fs_create(const char * path, mode_t mode, struct fuse_file_info * info) {
+    fuse_node * parent;
+    FATdircompare name;
+    int ret = lookup_parent(path, &parent, &name);
+    if( ret ) return ret;
+    if( find_child(parent, &name) ) return -EEXIST;
+
+    FATdirectory entry;
+    fatInitEntry(&entry, &name, FAT_ATTR_ARCHIVE, time(NULL));
+    if( !add_entry(parent, &entry) ) return -ENOSPC;
+    return 0;
+}
+
+int fs_mkdir(const char * path, mode_t mode) {
+    fuse_node * parent;
+    FATdircompare name;
+    int ret = lookup_parent(path, &parent, &name);
+    if( ret ) return ret;
+    if( find_child(parent, &name) ) return -EEXIST;
+
+    uint32_t clusters = fatDirectoryClusters(state.boot, 2); //. and ..
+    uint16_t cluster = fatAllocAfter(state.map, state.table, 0, clusters);
+    if( !cluster ) return -ENOSPC;
+
+    time_t now = time(NULL);
+    uint32_t cluster_size = fatGetClusterSize(state.boot);
+    uint8_t * image = xmalloc(clusters * cluster_size);
+    fatInitDirectoryClusters(state.boot, image, clusters, cluster, node_cluster(parent), now);
+    uint32_t i = 0;
+    uint16_t at = cluster;
+    while( i < clusters ) { //one write per contiguous run
+        uint16_t run = fatChainRun(state.table, at, clusters - i);
+        fatWriteClusters(state.disk, state.boot, at, run, image + i * cluster_size);
+        i += run;
+        at = fatTableGet(state.table, at + run - 1);
+    }
+    xfree(image);
+
+    FATdirectory entry;
+    fatInitEntry(&entry, &name, FAT_ATTR_DIRECTORY, now);
+    entry.first_logical_cluster = cluster;
+
+    fuse_node * node = add_entry(parent, &entry);
+    if( !node ) {
+        fatReleaseChain(state.map, state.table, cluster);
+        return -ENOSPC;
+    }
+    node->dir = fatLoadDirectory(state.disk, state.boot, state.table, cluster);
+    return 0;
+}
+
+/* Remove a file or empty directory */
+int remove_node(fuse_node * node) {
+    fatReleaseChain(state.map, state.table, node->entry.first_logical_cluster);
+    fatDeleteEntry(node->parent->dir, node->slot);
+    node->parent->dir_dirty = 1;
+    drop_readahead();
+    free_node(node);
+    return 0;
+}
+
+int fs_unlink(const char * path) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( node->dir ) return -EISDIR;
+    return remove_node(node);
+}
+
+int fs_rmdir(const char * path) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( !node->dir ) return -ENOTDIR;
+    if( !node->parent ) return -EBUSY;
+    if( node->children.num > 0 ) return -ENOTEMPTY;
+    return remove_node(node);
+}
+
+int fs_rename(const char * from, const char * to) {
+    fuse_node * node = lookup(from);
+    if( !node ) return -ENOENT;
+    if( !node->parent ) return -EBUSY;
+
+    fuse_node * parent;
+    FATdircompare name;
+    int ret = lookup_parent(to, &parent, &name);
+    if( ret ) return ret;
+
+    fuse_node * ancestor;
+    for( ancestor = parent; ancestor; ancestor = ancestor->parent) {
+        if( ancestor == node ) return -EINVAL; //directory into itself
+    }
+
+    fuse_node * existing = find_child(parent, &name);
+    if( existing == node ) return 0;
+    if( existing ) {
+        if( existing->dir || node->dir ) return -EEXIST;
+        remove_node(existing);
+    }
+
+    FATdirectory entry = node->entry;
+    memcpy(entry.filename, name.filename, sizeof(entry.filename));
+    memcpy(entry.extention, name.extention, sizeof(entry.extention));
+
+    int slot = fatInsertEntry(parent->dir, state.boot, state.table, state.map, &entry);
+    if( slot < 0 ) return -ENOSPC;
+    parent->dir_dirty = 1;
+
+    fatDeleteEntry(node->parent->dir, node->slot);
+    node->parent->dir_dirty = 1;
+
+    if( node->dir && node->parent != parent ) { //.. follows the move
+        FATdirectory dotdot;
+        fatUnpackDirectory(&dotdot, fatDirectoryEntry(node->dir, 1));
+        if( dotdot.filename[0] == '.' && dotdot.filename[1] == '.' ) {
+            dotdot.first_logical_cluster = node_cluster(parent);
+            fatPackDirectory(&dotdot, fatDirectoryEntry(node->dir, 1));
+            node->dir_dirty = 1;
+        }
+    }
+
+    /* Move the node without rebuilding what is below it */
+    ADTlinkedlist children = node->children;
+    FATdirbuff * dir = node->dir;
+    int dir_dirty = node->dir_dirty;
+    adtInitiateLinkedList(&node->children);
+    node->dir = NULL;
+    free_node(node);
+
+    fuse_node * moved = new_node(&entry, parent, slot);
+    moved->children = children;
+    moved->dir = dir;
+    moved->dir_dirty = dir_dirty;
+    ADTlinkednode * link;
+    for( link = children.head; link; link = link->next) ((fuse_node *) link->val)->parent = moved;
+
+    return 0;
+}
+
+int fs_utimens(const char * path, const struct timespec times[2]) {
+    fuse_node * node = lookup(path);
+    if( !node ) return -ENOENT;
+    if( !node->parent ) return 0; //root has no entry
+
+    touch_entry(&node->entry, times[1].tv_sec);
+    store_entry(node);
+    return 0;
+}
+
+int fs_statfs(const char * path, struct statvfs * stats) {
+    memset(stats, 0, sizeof(struct statvfs));
+    stats->f_bsize = fatGetClusterSize(state.boot);
+    stats->f_frsize = fatGetClusterSize(state.boot);
+    stats->f_blocks = fatGetNumClusters(state.boot);
+    stats->f_bfree = state.map->free_clusters;
+    stats->f_bavail = stats->f_bfree;
+    stats->f_namemax = 12;
+    return 0;
+}
+
+int fs_fsync(const char * path, int datasync, struct fuse_file_info * info) {
+    flush_all();
+    return 0;
+}
+
+int fs_release(const char * path, struct fuse_file_info * info) {
+    flush_all();
+    return 0;
+}
+
+void fs_destroy(void * data) {
+    flush_all();
+}
+
+static struct fuse_operations operations = {
+    .getattr = fs_getattr,
+    .readdir = fs_readdir,
+    .open = fs_open,
+    .read = fs_read,
+    .write = fs_write,
+    .truncate = fs_truncate,
+    .create = fs_create,
+    .mkdir = fs_mkdir,
+    .unlink = fs_unlink,
+    .rmdir = fs_rmdir,
+    .rename = fs_rename,
+    .utimens = fs_utimens,
+    .statfs = fs_statfs,
+    .fsync = fs_fsync,
+    .release = fs_release,
+    .destroy = fs_destroy,
+};
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    if( argc < 3 ) {
+        printf("Usage: ./diskfuse <disk> <mount point> [fuse options] \n");
+        return 1;
+    }
+
+    state.disk = fatOpenImage(argv[1],"r+");
+    if( !state.disk) {
+        perror("Aborting: Opening disk failed:");
+        return 3;
+    }
+    setvbuf(state.disk, NULL, _IONBF, 0); //all caching is done here, keep stdio out of the way
+
+    state.boot = fatGetBootInfo(state.disk);
+    state.table = fatLoadTable(state.disk, state.boot);
+    state.map = fatBuildFreeMap(state.table);
+    state.readahead = xmalloc(FUSE_READAHEAD_CLUSTERS * fatGetClusterSize(state.boot));
+    state.readahead_count = 0;
+    state.readahead_first = 0;
+
+    FATdirectory root_entry;
+    memset(&root_entry, 0, sizeof(FATdirectory));
+    root_entry.attributes = FAT_ATTR_DIRECTORY;
+    state.root = new_node(&root_entry, NULL, 0);
+    FATio * io = fatOpenImageIo(state.disk, 0);
+    int phase = statsPhase(STATS_PHASE_TRAVERSAL);
+    build_tree(io, state.root, 0);
+    statsPhase(phase);
+    fatCloseIo(io);
+
+    /* Single threaded, and unlink must really remove since hidden names cannot be stored as 8.3 */
+    char ** fuse_argv = xmalloc((argc + 4) * sizeof(char *));
+    int fuse_argc = 0;
+    fuse_argv[fuse_argc++] = argv[0];
+    int i;
+    for( i = 2; i < argc; i++) fuse_argv[fuse_argc++] = argv[i];
+    fuse_argv[fuse_argc++] = "-s";
+    fuse_argv[fuse_argc++] = "-o";
+    fuse_argv[fuse_argc++] = "hard_remove";
+    fuse_argv[fuse_argc] = NULL;
+
+    int ret = fuse_main(fuse_argc, fuse_argv, &operations, NULL);
+
+    xfree(fuse_argv);
+    free_node(state.root);
+    xfree(state.readahead);
+    fatFreeFreeMap(state.map);
+    fatFreeTable(state.table);
+    xfree(state.boot);
+    fclose(state.disk);
+
+    return ret;
+}
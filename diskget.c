@@ -1,5 +1,7 @@
-/* 
- * Implementation of diskget. Searches whole filesystem for file
+/*
+ * Implementation of diskget. Searches whole filesystem for files
+ * by their short name or, ignoring case, their long name, or takes
+ * every file, and extracts them all in one pipelined pass
 */
 
 #include <stdio.h>
@@ -9,184 +11,312 @@
 #include <stdlib.h>
 #include <regex.h>
 #include <ctype.h>
+#include <errno.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "FATheaders.h"
+#include "FATcache.h"
+#include "FATtable.h"
+#include "FATio.h"
+#include "FATlfn.h"
+#include "FATextract.h"
 #include "ADTlinkedlist.h"
+#include "FAToverlay.h"
 #include "utils.h"
 
+/* One name asked for */
+typedef struct get_name {
+    const char * name;
+    FATdircompare expected_dir;
+    int is_short; //name is a valid 8.3 name, otherwise it can only be a long name
+    FATextractfile * file; //set once found
+} get_name;
+
+/* Directory waiting to be searched */
+typedef struct get_dir {
+    uint16_t cluster;
+    char * path; //path on the disk, including own name, "" for the root
+} get_dir;
+
+/* What is being searched for and where it goes */
+typedef struct get_state {
+    get_name * names;
+    int num_names;
+    int num_found;
+    int all; //take every file, keeping the tree
+    const char * out_dir; //NULL for the current directory
+    FATextract * extract;
+    FATtable * table;
+} get_state;
+
+void usage() {
+    printf("Usage: ./diskget [-j threads] [-d directory] <disk> <filename> [filename...] \n");
+    printf("       ./diskget [-j threads] [-d directory] -a <disk> \n");
+    printf("  -a extracts every file, recreating the directory tree\n");
+    printf("  -d writes into directory instead of the current one\n");
+    printf("  -j sets the number of writer threads, default %d\n", FAT_EXTRACT_DEFAULT_THREADS);
+}
+
+/* Where path on the disk goes on the host. Caller must free */
+char * host_path(get_state * state, const char * path) {
+    const char * dir = state->out_dir ? state->out_dir : ".";
+    if( !state->all && !state->out_dir ) dir = ""; //name same as input, with whatever the case
+    char * out = xmalloc(strlen(dir) + 1 + strlen(path) + 1);
+    sprintf(out, "%s%s%s", dir, *dir && path[0] != '/' ? "/" : "", path);
+    return out;
+}
 
-/* Check next file entry for file, if matches sets entry to result
+/* Check the file entry at offset against what is searched for, adding matches to the extraction
+ * path is that of the directory being read, LFN entries are gathered in lfn
  * Returns 0 if end of disk, 1 otherwise */
-int search_next_entry(FILE * disk, ADTlinkedlist * subdirs, FATdircompare * expected_dir, FATdirectory ** entry) {
+int search_next_entry(FATcache * cache, uint32_t offset, ADTlinkedlist * subdirs, const char * path, get_state * state, FATlfnbuff * lfn) {
 
     uint8_t dir_buff[FAT_DIRECTORY_SIZE];
     FATdirectory dir_entry;
+    char long_name[FAT_LFN_NAME_SIZE];
 
-    xfread(dir_buff, FAT_DIRECTORY_SIZE,1, disk);
+    fatCacheRead(cache, offset, dir_buff, FAT_DIRECTORY_SIZE);
     fatUnpackDirectory(&dir_entry,dir_buff);
 
     if( dir_entry.filename[0] == 0x00 ) return 0; //end of directory case
+    if( fatLfnAdd(lfn, dir_buff) ) return 1; //fragment of the next entry's long name
+    size_t long_length = fatLfnTake(lfn, dir_buff, long_name);
 
-    if( dir_entry.filename[0] !=  0xEF
+    if( dir_entry.filename[0] != FAT_ENTRY_DELETED
             && dir_entry.filename[0] != '.'
-            && dir_entry.first_logical_cluster > 1
+            && (dir_entry.first_logical_cluster > 1 || (!dir_entry.file_size && !(dir_entry.attributes & 0x10))) //empty files have no cluster
             && dir_entry.attributes != 0x0F //not all bits est
             && !(dir_entry.attributes & 0x08)) { //not system
 
+        char name[FAT_LFN_NAME_SIZE];
+        if( long_length ) strcpy(name, long_name);
+        else fatFormatName(&dir_entry, name);
+        char * entry_path = xmalloc(strlen(path) + 1 + strlen(name) + 1);
+        sprintf(entry_path, "%s/%s", path, name);
+
         if( dir_entry.attributes & 0x10) { //save directory for recurse
+            if( state->all ) {
+                char * dir_path = host_path(state, entry_path);
+                if( mkdir(dir_path, 0755) && errno != EEXIST ) {
+                    perror("Failed to create directory");
+                    printf("Name given %s\n", dir_path);
+                }
+                xfree(dir_path);
+            }
             ADTlinkednode * node = xmalloc(sizeof(ADTlinkednode));
-            FATdirectory * subdir = xmalloc(sizeof(FATdirectory));
-            memcpy(subdir,&dir_entry,sizeof(FATdirectory));
+            get_dir * subdir = xmalloc(sizeof(get_dir));
+            subdir->cluster = dir_entry.first_logical_cluster;
+            subdir->path = entry_path;
             adtInitiateLinkedNode(node, subdir);
             adtAddEndLinkedNode(subdirs, node);
-        } else if( fatCompareEntries(&dir_entry,expected_dir) == 0) {
-            *entry = xmalloc(sizeof(FATdirectory));
-            memcpy(*entry,&dir_entry,sizeof(FATdirectory));
+            return 1;
         }
+
+        if( state->all ) {
+            char * out = host_path(state, entry_path);
+            fatExtractAddChain(state->extract, state->table, out, dir_entry.first_logical_cluster, dir_entry.file_size);
+            xfree(out);
+        }
+
+        int i;
+        for( i = 0; i < state->num_names && !state->all; i++) {
+            get_name * wanted = &state->names[i];
+            if( wanted->file ) continue; //first match wins, like a single search
+            if( (wanted->is_short && fatCompareEntries(&dir_entry,&wanted->expected_dir) == 0)
+                    || (long_length && !strcasecmp(long_name, wanted->name)) ) {
+                char * out = host_path(state, wanted->name);
+                wanted->file = fatExtractAddChain(state->extract, state->table, out, dir_entry.first_logical_cluster, dir_entry.file_size);
+                state->num_found++;
+                xfree(out);
+            }
+        }
+        xfree(entry_path);
     }
 
     return 1;
 }
 
+/* Returns 1 once every name asked for was found */
+int search_done(get_state * state) {
+    return !state->all && state->num_found == state->num_names;
+}
+
+/* Fill in what a name is compared against. Returns 0 if it cannot be a file name */
+int parse_name(get_name * wanted, regex_t * preg) {
+    regmatch_t matches[3];
+    wanted->is_short = regexec(preg,wanted->name,3, matches,0) == 0;
+    wanted->file = NULL;
+    if( !wanted->is_short ) return fatLfnEntries(wanted->name) > 0;
+
+    const char * name = wanted->name;
+    FATdircompare * expected_dir = &wanted->expected_dir;
+    int i;
+    for( i = 0; i < matches[1].rm_eo - matches[1].rm_so; i++ ) expected_dir->filename[i] = toupper(name[matches[1].rm_so + i]);
+    for( i = matches[1].rm_eo - matches[1].rm_so; i < 8; i++) expected_dir->filename[i] = 0x20; //pad with 0x20
+
+    for( i = 0; i < matches[2].rm_eo - matches[2].rm_so; i++ ) expected_dir->extention[i] = toupper(name[matches[2].rm_so + i]);
+    for( i = matches[2].rm_eo - matches[2].rm_so; i < 3; i++) expected_dir->extention[i] = 0x20; //pad with 0x20
+    return 1;
+}
+
 
 int main(int argc, char * argv[]) {
 
-    if( argc != 3 ) {
-        printf("Usage: ./diskget <disk> <filename> \n");
+    statsArgs(&argc, argv);
+
+    get_state state;
+    memset(&state, 0, sizeof(get_state));
+    uint32_t num_threads = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "aj:d:")) != -1 ) {
+        switch( opt ) {
+            case 'a': state.all = 1; break;
+            case 'j': num_threads = atoi(optarg); break;
+            case 'd': state.out_dir = optarg; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( state.all ? argc - optind != 1 : argc - optind < 2 ) {
+        usage();
         return 1;
     }
 
-    FILE * disk = fopen(argv[1],"r");
+    FILE * disk = fatOpenImage(argv[optind],"r");
     if( !disk) {
         perror("Opening disk failed:");
         return 3;
     }
 
     regex_t preg;
-    regmatch_t matches[3];
-
     char * pattern = "^([[:alpha:][:digit:]]{1,10}).?([[:alpha:][:digit:]]{0,3})$";
     if( regcomp(&preg, pattern,REG_EXTENDED) ) {
         printf("Compiling regex failed!");
         return 5;
     }
 
-    if( regexec(&preg,argv[2],3, matches,0) ) {
-        printf("Invalid name\nThe name of file was %s\n",argv[2]);
-        return 4;
+    state.num_names = argc - optind - 1;
+    state.names = xmalloc((state.num_names + 1) * sizeof(get_name));
+    int i;
+    for( i = 0; i < state.num_names; i++) {
+        state.names[i].name = argv[optind + 1 + i];
+        if( !parse_name(&state.names[i], &preg) ) {
+            printf("Invalid name\nThe name of file was %s\n",state.names[i].name);
+            regfree(&preg);
+            return 4;
+        }
     }
-
     regfree(&preg);
 
-    FATdircompare expected_dir;
-
-    int i;
-    for( i = 0; i < matches[1].rm_eo - matches[1].rm_so; i++ ) expected_dir.filename[i] = toupper(argv[2][matches[1].rm_so + i]);
-    for( i = matches[1].rm_eo - matches[1].rm_so; i < 8; i++) expected_dir.filename[i] = 0x20; //pad with 0x20
-
-    for( i = 0; i < matches[2].rm_eo - matches[2].rm_so; i++ ) expected_dir.extention[i] = toupper(argv[2][matches[2].rm_so + i]);
-    for( i = matches[2].rm_eo - matches[2].rm_so; i < 3; i++) expected_dir.extention[i] = 0x20; //pad with 0x20
-
+    if( state.out_dir && mkdir(state.out_dir, 0755) && errno != EEXIST ) {
+        perror("Aborting: Failed to create output directory");
+        return 3;
+    }
 
     FATboot * boot = fatGetBootInfo(disk);
+    FATcache * cache = fatCreateDefaultCache(disk, boot);
+    state.table = fatOpenTable(disk, boot, FAT_TABLE_AUTO); //only the sectors holding wanted chains are needed
+    state.extract = fatCreateExtract(boot, num_threads);
 
     ADTlinkedlist subdirs;
     adtInitiateLinkedList(&subdirs); //for directories to recurse... in order traversal
 
+    FATlfnbuff lfn; //reset for every directory
 
-    xfseek(disk, fatGetRootStart(boot),SEEK_SET); //start of root
-
-    FATdirectory * entry = NULL;
-
-    /* Perform a traversal of filesystem untill file is found or all places are searched */
+    /* Perform a traversal of filesystem untill every file is found or all places are searched */
 
     /* Root directory search */
-    int entries_read;
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    uint32_t entries_read;
+    fatLfnReset(&lfn);
+    fatCachePrefetch(cache, fatGetRootStart(boot), boot->max_root_entries * FAT_DIRECTORY_SIZE);
     for( entries_read=0; entries_read <  boot->max_root_entries; entries_read++) {
-        if( search_next_entry(disk,&subdirs,&expected_dir,&entry) != 1 || entry ) {
+        if( search_next_entry(cache, fatGetRootStart(boot) + entries_read * FAT_DIRECTORY_SIZE, &subdirs, "", &state, &lfn) != 1 || search_done(&state) ) {
             break;
         }
     }
 
     /* Subdirectory search */
-    while( subdirs.num > 0 && !entry ) {
+    while( subdirs.num > 0 && !search_done(&state) ) {
 
         ADTlinkednode * node = adtPopLinkedNode(&subdirs,0);
-        FATdirectory * curr_dir = node->val;
-        uint16_t curr_logical_cluster = curr_dir->first_logical_cluster;
+        get_dir * curr_dir = node->val;
+        uint16_t curr_logical_cluster = curr_dir->cluster;
+        fatLfnReset(&lfn);
 
         while( curr_logical_cluster <= 0xFF0 && curr_logical_cluster > 0) { //iterate through all FAT entries
 
-            xfseek(disk, fatGetDataspaceLocation(boot,curr_logical_cluster),SEEK_SET); //go to logical cluster
+            uint32_t location = fatGetDataspaceLocation(boot,curr_logical_cluster); //go to logical cluster
+            fatCacheChainAhead(cache, boot, curr_logical_cluster);
 
-            for( entries_read=0; entries_read < boot->bytes_per_sector/FAT_DIRECTORY_SIZE ; entries_read++) { //read all entries in cluster
-                if( search_next_entry(disk,&subdirs,&expected_dir,&entry) != 1 || entry ) {
+            for( entries_read=0; entries_read < fatGetClusterSize(boot)/FAT_DIRECTORY_SIZE ; entries_read++) { //read all entries in cluster
+                if( search_next_entry(cache, location + entries_read * FAT_DIRECTORY_SIZE, &subdirs, curr_dir->path, &state, &lfn) != 1 || search_done(&state) ) {
                     goto break_dir_search;
                 }
             }
 
-            curr_logical_cluster = fatGetFatEntry(disk,boot,curr_logical_cluster); //update entry to next value
+            STATS_ADD(clusters_followed, 1);
+            curr_logical_cluster = fatCacheGetFatEntry(cache,boot,curr_logical_cluster); //update entry to next value
 
         }
 
 
 break_dir_search:
-        xfree(node);
+        xfree(curr_dir->path);
         xfree(curr_dir);
+        xfree(node);
 
     }
 
-    while(subdirs.num > 0 ) { //cleanup queue in case file is found
+    while(subdirs.num > 0 ) { //cleanup queue in case every file is found
         ADTlinkednode * node = adtPopLinkedNode(&subdirs,0);
-        xfree(node->val);
+        get_dir * curr_dir = node->val;
+        xfree(curr_dir->path);
+        xfree(curr_dir);
         xfree(node);
     }
 
-    if( entry ) {
-        FILE * out = fopen(argv[2],"w"); //name same as input, with whatever the case
-        if(!out){
-            perror("Aborting: Failed to open output file for result");
-        }
-
-        uint16_t curr_logical_cluster = entry->first_logical_cluster;
-        uint32_t file_size = entry->file_size;
-        uint32_t num_read = 0;
-        uint8_t * file_buff = xmalloc(boot->bytes_per_sector);
-
-
-        while(curr_logical_cluster <= 0xFF0 && curr_logical_cluster > 0 && num_read < file_size) { /* Copy all of file into new file */
-
-            xfseek(disk, fatGetDataspaceLocation(boot,curr_logical_cluster),SEEK_SET); //go to logical cluster
-
-            int to_read;
-            if( file_size - num_read >=  boot->bytes_per_sector ) {
-                to_read = boot->bytes_per_sector;
-            } else {
-                to_read = file_size - num_read;
-            }
-
-            num_read += xfread(file_buff, 1, to_read,disk);
-
-            fwrite(file_buff, 1, to_read, out);
+    /* One reader queues every extent, writer threads create and fill the host files */
+    statsPhase(STATS_PHASE_COPY);
+    FATio * io = fatOpenImageIo(disk, 0);
+    uint32_t written = fatRunExtract(state.extract, io);
+    if( fatStatsMode == 1 ) {
+        fprintf(stderr, "IO engine: %s, %u files, %u writers, %llu system calls\n", fatIoEngineName(io),
+                state.extract->num_files, state.extract->num_threads, (unsigned long long) io->submits);
+    }
+    fatCloseIo(io);
 
-            curr_logical_cluster = fatGetFatEntry(disk,boot,curr_logical_cluster);
+    uint32_t f;
+    for( f = 0; f < state.extract->num_files; f++) {
+        FATextractfile * file = state.extract->files[f];
+        if( file->available < file->size ) {
+            printf("Warning corrupted file %s, not all entries retrieved!\n", file->host_path);
         }
+    }
 
-        xfree(file_buff);
-
-        if( num_read < file_size) {
-            printf("Warning corrupted file, not all entries retrieved!\n");
+    if( state.all ) {
+        printf("Extracted %u of %u files, %llu bytes\n", written, state.extract->num_files, (unsigned long long) state.extract->bytes);
+    }
+    for( i = 0; i < state.num_names; i++) {
+        if( state.names[i].file && !state.names[i].file->failed ) {
+            printf("File extracted as %s\n",state.names[i].file->host_path);
+        } else if( !state.names[i].file ) {
+            printf("File not found\n");
+            printf("The name of file was %s\n",state.names[i].name);
         }
-        
-        printf("File extracted as %s\n",argv[2]);
-
-    } else {
-        printf("File not found\n");
-        printf("The name of file was %s\n",argv[2]);
     }
+    statsPhase(STATS_PHASE_OTHER);
 
-    if(entry) xfree(entry);
-
+    if( fatStatsMode == 1 ) fatPrintCacheStats(cache, stderr);
+    fatFreeExtract(state.extract);
+    fatFreeTable(state.table);
+    fatFreeCache(cache);
+    xfree(state.names);
     xfree(boot);
     fclose(disk);
 
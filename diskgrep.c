@@ -0,0 +1,244 @@
+/* Implementation of diskgrep. Finds the files of an image holding any of a set of byte
+ * patterns, reading cluster chains straight from the mapped image without extracting them.
+ *
+ * Note: only files reachable from the root are searched, deleted and free clusters are not.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "FATheaders.h"
+#include "FATmap.h"
+#include "match.h"
+#include "utils.h"
+
+/* Where a pattern was found */
+typedef struct grep_hit {
+    uint64_t offset;
+    int pattern;
+} grep_hit;
+
+/* One file to search */
+typedef struct grep_file {
+    FATmapped * volume;
+    char * path;
+    uint16_t first_cluster;
+    uint32_t size;
+    grep_hit * hits;
+    uint32_t num_hits;
+    uint32_t capacity;
+    int broken; //chain ended before the file did
+} grep_file;
+
+/* State shared by worker threads */
+typedef struct grep_state {
+    MATCHset set;
+    grep_file * files;
+    uint32_t num_files;
+    uint32_t capacity;
+    uint32_t next_file;
+    pthread_mutex_t lock;
+} grep_state;
+
+void usage() {
+    printf("Usage: ./diskgrep [-l] [-x] [-j threads] <disk> <pattern> [pattern...] \n");
+    printf("  -l prints only the paths of files that match\n");
+    printf("  -x takes patterns as hex bytes, like 4D5A or 50:4B:03:04\n");
+    printf("  Exits with 0 if any file matched and 1 if none did\n");
+}
+
+/* Turn a hex pattern into bytes, colons and spaces between bytes are skipped
+ * Returns the number of bytes, 0 if it is not valid hex */
+size_t parse_hex(const char * text, uint8_t * out) {
+    size_t length = 0;
+    while( *text ) {
+        if( *text == ':' || *text == ' ' ) {
+            text++;
+            continue;
+        }
+        if( !isxdigit((unsigned char) text[0]) || !isxdigit((unsigned char) text[1]) ) return 0;
+        char byte[3] = {text[0], text[1], 0};
+        out[length++] = strtoul(byte, NULL, 16);
+        text += 2;
+    }
+    return length;
+}
+
+/* Walk callback, keeps every non empty file */
+int add_file(FATmapped * image, FATdirectory * entry, const char * path, void * arg) {
+    grep_state * state = arg;
+    if( (entry->attributes & FAT_ATTR_DIRECTORY) || !entry->file_size ) return 0;
+
+    if( state->num_files == state->capacity ) {
+        state->capacity = state->capacity ? state->capacity * 2 : 64;
+        state->files = xrealloc(state->files, state->capacity * sizeof(grep_file));
+    }
+    grep_file * file = &state->files[state->num_files++];
+    memset(file, 0, sizeof(grep_file));
+    file->volume = image;
+    file->path = xmalloc(strlen(path) + 1);
+    strcpy(file->path, path);
+    file->first_cluster = entry->first_logical_cluster;
+    file->size = entry->file_size;
+    return 0;
+}
+
+static void found(void * arg, int pattern, uint64_t offset) {
+    grep_file * file = arg;
+    if( file->num_hits == file->capacity ) {
+        file->capacity = file->capacity ? file->capacity * 2 : 8;
+        file->hits = xrealloc(file->hits, file->capacity * sizeof(grep_hit));
+    }
+    file->hits[file->num_hits].offset = offset;
+    file->hits[file->num_hits].pattern = pattern;
+    file->num_hits++;
+}
+
+static void feed(void * arg, const void * data, size_t size) {
+    matchFeed(arg, data, size);
+}
+
+static int compare_hits(const void * a, const void * b) {
+    const grep_hit * x = a;
+    const grep_hit * y = b;
+    if( x->offset != y->offset ) return x->offset < y->offset ? -1 : 1;
+    return x->pattern - y->pattern;
+}
+
+/* Worker thread, streams files through the matcher until none are left */
+void * grep_worker(void * arg) {
+    grep_state * state = arg;
+
+    while( 1 ) {
+        pthread_mutex_lock(&state->lock);
+        uint32_t index = state->next_file++;
+        pthread_mutex_unlock(&state->lock);
+        if( index >= state->num_files ) break;
+
+        grep_file * file = &state->files[index];
+        MATCHstream stream;
+        matchStreamInit(&stream, &state->set, found, file);
+        file->broken = fatStreamMappedChain(file->volume, file->first_cluster, file->size, feed, &stream) < file->size;
+        matchStreamFree(&stream);
+        if( file->num_hits > 1 ) qsort(file->hits, file->num_hits, sizeof(grep_hit), compare_hits); //patterns are found one after another
+    }
+
+    return NULL;
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    int list_only = 0;
+    int hex = 0;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while( (opt = getopt(argc, argv, "lxj:")) != -1 ) {
+        switch( opt ) {
+            case 'l': list_only = 1; break;
+            case 'x': hex = 1; break;
+            case 'j': num_threads = atoi(optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( argc - optind < 2 || num_threads < 1 ) {
+        usage();
+        return 1;
+    }
+
+    /* Patterns as bytes */
+    int num_patterns = argc - optind - 1;
+    char ** texts = argv + optind + 1;
+    uint8_t ** patterns = xmalloc(num_patterns * sizeof(uint8_t *));
+    size_t * lengths = xmalloc(num_patterns * sizeof(size_t));
+    int i;
+    for( i = 0; i < num_patterns; i++) {
+        patterns[i] = xmalloc(strlen(texts[i]) + 1);
+        lengths[i] = hex ? parse_hex(texts[i], patterns[i]) : strlen(texts[i]);
+        if( !hex ) memcpy(patterns[i], texts[i], lengths[i]);
+        if( !lengths[i] ) {
+            printf("Invalid pattern\nThe pattern was \"%s\"\n", texts[i]);
+            return 4;
+        }
+    }
+
+    int num_volumes;
+    FATmapped * volumes = fatMapVolumes(argv[optind], &num_volumes);
+    if( !volumes ) return 3;
+
+    grep_state state;
+    memset(&state, 0, sizeof(grep_state));
+    matchInit(&state.set, (const uint8_t * const *) patterns, lengths, num_patterns);
+    pthread_mutex_init(&state.lock, NULL);
+
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    uint32_t * first_file = xmalloc((num_volumes + 1) * sizeof(uint32_t)); //files of each volume
+    int v;
+    for( v = 0; v < num_volumes; v++) {
+        first_file[v] = state.num_files;
+        fatWalkMapped(&volumes[v], add_file, &state);
+    }
+    first_file[num_volumes] = state.num_files;
+
+    /* Files are spread over the threads, which only share the read only mapping */
+    statsPhase(STATS_PHASE_COPY);
+    if( (uint32_t) num_threads > state.num_files ) num_threads = state.num_files ? state.num_files : 1;
+    pthread_t * threads = xmalloc(num_threads * sizeof(pthread_t));
+    for( i = 0; i < num_threads; i++) {
+        if( pthread_create(&threads[i], NULL, grep_worker, &state) ) {
+            perror("FATAL: Creating thread failed: ");
+            abort();
+        }
+    }
+    for( i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    statsPhase(STATS_PHASE_OTHER);
+
+    /* Report in walk order */
+    uint32_t matched = 0;
+    for( v = 0; v < num_volumes; v++) {
+        if( volumes[v].partition ) {
+            if( v ) printf("\n");
+            printf("Partition %d, starting at byte %u\n==================\n", volumes[v].partition, volumes[v].base);
+        }
+
+        uint32_t f;
+        for( f = first_file[v]; f < first_file[v + 1]; f++) {
+            grep_file * file = &state.files[f];
+            if( file->broken ) printf("Warning: %s has a broken cluster chain, searched what was reachable\n", file->path);
+            if( file->num_hits ) matched++;
+
+            if( list_only && file->num_hits ) printf("%s\n", file->path);
+            uint32_t h;
+            for( h = 0; h < file->num_hits && !list_only; h++) {
+                printf("%s:%llu:%s\n", file->path, (unsigned long long) file->hits[h].offset, texts[file->hits[h].pattern]);
+            }
+        }
+    }
+
+    uint32_t f;
+    for( f = 0; f < state.num_files; f++) {
+        xfree(state.files[f].path);
+        if( state.files[f].hits ) xfree(state.files[f].hits);
+    }
+    if( state.files ) xfree(state.files);
+    for( i = 0; i < num_patterns; i++) xfree(patterns[i]);
+    xfree(patterns);
+    xfree(lengths);
+    xfree(first_file);
+    xfree(threads);
+    matchFree(&state.set);
+    pthread_mutex_destroy(&state.lock);
+    fatUnmapVolumes(volumes, num_volumes);
+
+    return matched ? 0 : 1; //like grep, so scripts can test for a match
+}
@@ -0,0 +1,130 @@
+/* Implementation of diskimport. Mirrors a linux directory tree into a directory of the file system
+ * Every cluster is planned from one free map before anything is written, so an import
+ * either fits completely or leaves the disk untouched.
+*/
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATimport.h"
+#include "ADTlinkedlist.h"
+#include "FAToverlay.h"
+#include "utils.h"
+
+/* Clusters buffered before a write is issued */
+#define IMPORT_WRITE_CLUSTERS 128
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    if( argc != 3 && argc != 4 ) {
+        printf("Usage: ./diskimport <disk> <host directory> [disk directory] \n");
+        return 1;
+    }
+
+    FILE * disk = fatOpenImage(argv[1],"r+");
+    if( !disk) {
+        perror("Aborting: Opening disk failed:");
+        return 3;
+    }
+
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    FATimportnode * top = fatImportScan(argv[2], NULL);
+    statsPhase(STATS_PHASE_OTHER);
+    if( !top || !top->is_directory ) {
+        printf("Aborting: %s is not a readable directory\n", argv[2]);
+        return 3;
+    }
+
+    FATboot * boot = fatGetBootInfo(disk);
+    FATtable * table = fatLoadTable(disk, boot);
+
+    uint16_t target_cluster;
+    if( fatResolveDirectory(disk, boot, table, argc == 4 ? argv[3] : "/", &target_cluster) ) {
+        printf("Aborting: Path cannot be found\n");
+        return 7;
+    }
+
+    FATdirbuff * target = fatLoadDirectory(disk, boot, table, target_cluster);
+
+    /* Names must not already exist in the target directory */
+    ADTlinkednode * link;
+    for( link = top->children.head; link; link = link->next) {
+        FATimportnode * child = link->val;
+        if( fatFindEntry(target, &child->name) >= 0 ) {
+            printf("Aborting: %s already exists in directory\n", child->host_path);
+            return 2;
+        }
+    }
+
+    /* Plan space: everything below plus room in the target directory */
+    uint32_t needed = 0;
+    for( link = top->children.head; link; link = link->next) {
+        needed += fatImportCount(boot, link->val);
+    }
+
+    uint32_t free_entries = fatCountFreeEntries(target);
+    uint32_t grow_clusters = 0;
+    if( free_entries < (uint32_t) top->children.num ) {
+        if( target_cluster == 0 ) {
+            printf("Aborting: No room left in root directory\n");
+            return 7;
+        }
+        uint32_t entries_per_cluster = fatGetClusterSize(boot) / FAT_DIRECTORY_SIZE;
+        grow_clusters = (top->children.num - free_entries + entries_per_cluster - 1) / entries_per_cluster;
+    }
+
+    FATfreemap * map = fatBuildFreeMap(table);
+    if( map->free_clusters < needed + grow_clusters ) {
+        printf("Aborting: Not enough space for files!\n");
+        return 8;
+    }
+
+    if( grow_clusters ) {
+        fatExtendDirectory(target, boot, table, map, grow_clusters, needed); //data still has to fit
+    }
+
+    for( link = top->children.head; link; link = link->next) {
+        fatImportAllocate(map, table, link->val); //cannot fail, space was checked above
+    }
+
+    /* Write data in allocation order, then directory entries, then the fat */
+    statsPhase(STATS_PHASE_COPY);
+    FATwriter * writer = fatCreateWriter(boot, IMPORT_WRITE_CLUSTERS);
+    for( link = top->children.head; link; link = link->next) {
+        fatImportWrite(disk, boot, table, writer, link->val, target_cluster);
+    }
+    fatFreeWriter(disk, boot, writer);
+    statsPhase(STATS_PHASE_OTHER);
+
+    int slot = 0;
+    for( link = top->children.head; link; link = link->next) {
+        FATdirectory entry;
+        fatImportEntry(link->val, &entry);
+        slot = fatFindFreeEntry(target, slot);
+        assert(slot >= 0);
+        fatPackDirectory(&entry, fatDirectoryEntry(target, slot));
+    }
+    fatWriteDirectory(disk, boot, target);
+    fatTableFlush(disk, boot, table);
+
+    uint32_t entries = 0; //everything written, not only the top level
+    for( link = top->children.head; link; link = link->next) entries += fatImportEntries(link->val);
+    printf("Imported %u entries using %u clusters\n", entries, needed + grow_clusters);
+
+    fatFreeDirectory(target);
+    fatFreeFreeMap(map);
+    fatFreeTable(table);
+    fatFreeImportNode(top);
+    xfree(boot);
+    fclose(disk);
+
+    return 0;
+}
@@ -1,5 +1,8 @@
 /*
  * Implementation of diskinfo. Prints stats from spec.
+ *
+ * The image is mapped read only. A hard disk image with an MBR is reported per FAT
+ * partition, each walked on its own thread through its own cache over the shared mapping.
 */
 
 #include <stdio.h>
@@ -7,25 +10,28 @@
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "FATheaders.h"
+#include "FATcache.h"
+#include "FATmap.h"
 #include "ADTlinkedlist.h"
 #include "utils.h"
 
-/* Count next directory entry from disk if its valid and not a subdirectory
+/* Count the directory entry at offset if its valid and not a subdirectory
  * Adds subdirs to the subdirs list
  * Returns 0 if end of disk, 1 otherwise */
-int count_next_entry(FILE * disk, ADTlinkedlist * subdirs, int * num_files) {
+int count_next_entry(FATcache * cache, uint32_t offset, ADTlinkedlist * subdirs, int * num_files) {
 
     uint8_t dir_buff[FAT_DIRECTORY_SIZE];
     FATdirectory dir_entry;
 
-    xfread(dir_buff, FAT_DIRECTORY_SIZE,1, disk);
+    fatCacheRead(cache, offset, dir_buff, FAT_DIRECTORY_SIZE);
     fatUnpackDirectory(&dir_entry,dir_buff);
 
     if( dir_entry.filename[0] == 0x00 ) return 0; //end of directory case
 
-    if( dir_entry.filename[0] !=  0xEF
+    if( dir_entry.filename[0] != FAT_ENTRY_DELETED
             && dir_entry.filename[0] != '.'
             && dir_entry.first_logical_cluster > 1
             && dir_entry.attributes != 0x0F //not all bit set
@@ -45,67 +51,57 @@ int count_next_entry(FILE * disk, ADTlinkedlist * subdirs, int * num_files) {
     return 1;
 }
 
-int main(int argc, char * argv[]) {
-
-    if( argc != 2 ) {
-        printf("Usage: ./diskinfo <diskname> \n");
-        return 2;
-    }
-
-    FILE * disk = fopen(argv[1],"r");
-    if( !disk) {
-        perror("Opening disk failed:");
-        printf("Name given %s\n",argv[1]);
-        return 3;
-    }
-
-    FATboot * boot = fatGetBootInfo(disk);
+/* What is printed for one volume, filled by its thread */
+typedef struct info_job {
+    FATmapped * volume;
+    FATcache * cache;
+    char os_name[9];
+    char disk_label[12];
+    uint32_t free_clusters;
+    int num_files;
+} info_job;
 
-    uint32_t count = fatGetFreeSpace(disk,boot);
+/* Thread body, gathers everything printed about one volume */
+void * info_volume(void * arg) {
+    info_job * job = arg;
+    FATboot * boot = &job->volume->boot;
+    FATcache * cache = fatCreateMappedCache(job->volume->volume, job->volume->volume_size, boot);
+    fatCacheSetPack(cache, job->volume->pack, job->volume->base);
+    job->cache = cache;
 
-    char os_name[9];
-    memcpy(os_name,boot->ignore0 + 3,8);
-    os_name[8] = 0;
+    job->free_clusters = fatCacheCountFree(cache, boot);
 
-    char disk_label[12];
+    memcpy(job->os_name,boot->ignore0 + 3,8);
+    job->os_name[8] = 0;
 
     uint8_t dir_buff[FAT_DIRECTORY_SIZE];
     FATdirectory dir_entry;
 
-    int entries_read; //get volume label from root directory if it exisits
-    xfseek(disk, fatGetRootStart(boot),SEEK_SET);
+    uint32_t entries_read; //get volume label from root directory if it exisits
+    fatCachePrefetch(cache, fatGetRootStart(boot), boot->max_root_entries * FAT_DIRECTORY_SIZE);
     for( entries_read=0; entries_read <  boot->max_root_entries; entries_read++) { //root directory entries
-        xfread(dir_buff, FAT_DIRECTORY_SIZE,1, disk);
+        fatCacheRead(cache, fatGetRootStart(boot) + entries_read * FAT_DIRECTORY_SIZE, dir_buff, FAT_DIRECTORY_SIZE);
         fatUnpackDirectory(&dir_entry,dir_buff);
         if( dir_entry.attributes != 0x0F && dir_entry.attributes & 0x08 ) break; //based on examples, must be explicitiry 0x08
     }
 
     if(  dir_entry.attributes != 0x0F && dir_entry.attributes & 0x08 ) { //use label from boot
-        memcpy(disk_label, dir_entry.filename,11);
+        memcpy(job->disk_label, dir_entry.filename,11);
     } else { //if found use label from root directory
-        memcpy(disk_label, boot->volume_label,11);
+        memcpy(job->disk_label, boot->volume_label,11);
     }
-    disk_label[11] = 0;
-
-    printf("OS Name: %.8s\nLabel of disk: %.11s\nTotal size of the disk: %u bytes\nFree size of the disk: %u bytes\n", 
-           os_name,
-           disk_label,
-           boot->total_sectors*512,
-           count*512);
-
-    printf("==================\n");
+    job->disk_label[11] = 0;
 
 
     ADTlinkedlist subdirs;
     adtInitiateLinkedList(&subdirs); //for directories in order traversal
 
 
-    xfseek(disk, fatGetRootStart(boot),SEEK_SET);
     /* Traversal of whole file system*/
-    int num_files = 0;
+    job->num_files = 0;
 
     for( entries_read=0; entries_read <  boot->max_root_entries; entries_read++) { //root directory entries
-        if(!count_next_entry(disk,&subdirs,&num_files)) break;
+        if(!count_next_entry(cache, fatGetRootStart(boot) + entries_read * FAT_DIRECTORY_SIZE, &subdirs, &job->num_files)) break;
     }
 
 
@@ -116,12 +112,14 @@ int main(int argc, char * argv[]) {
 
         while( curr_logical_cluster <= 0xFF0 && curr_logical_cluster > 0) { //iterate through all FAT entries
 
-            xfseek(disk, fatGetDataspaceLocation(boot,curr_logical_cluster),SEEK_SET);
+            uint32_t location = fatGetDataspaceLocation(boot,curr_logical_cluster);
+            fatCacheChainAhead(cache, boot, curr_logical_cluster);
 
-            for( entries_read=0; entries_read < boot->bytes_per_sector/FAT_DIRECTORY_SIZE ; entries_read++) { //read all entries in cluster
-                if(!count_next_entry(disk,&subdirs,&num_files)) goto break_dir_count;
+            for( entries_read=0; entries_read < fatGetClusterSize(boot)/FAT_DIRECTORY_SIZE ; entries_read++) { //read all entries in cluster
+                if(!count_next_entry(cache, location + entries_read * FAT_DIRECTORY_SIZE, &subdirs, &job->num_files)) goto break_dir_count;
             }
-            curr_logical_cluster = fatGetFatEntry(disk,boot,curr_logical_cluster); //update entry to next value
+            STATS_ADD(clusters_followed, 1);
+            curr_logical_cluster = fatCacheGetFatEntry(cache,boot,curr_logical_cluster); //update entry to next value
 
         }
 
@@ -132,14 +130,65 @@ break_dir_count:
 
     }
 
-    printf("The number of files in the disk: %u\n\n",num_files);
-    printf("==================\n");
-    printf("Number of FAT copies: %u\n",boot->num_fats);
-    printf("Sectors per FAT: %u\n",boot->sectors_per_fat);
+    return NULL;
+}
 
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    if( argc != 2 ) {
+        printf("Usage: ./diskinfo <diskname> \n");
+        return 2;
+    }
+
+    int num_volumes;
+    FATmapped * volumes = fatMapVolumes(argv[1], &num_volumes);
+    if( !volumes ) return 3;
+
+    /* One thread per volume, they only share the read only mapping */
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    info_job * jobs = xmalloc(num_volumes * sizeof(info_job));
+    pthread_t * threads = xmalloc(num_volumes * sizeof(pthread_t));
+    int v;
+    for( v = 0; v < num_volumes; v++) {
+        jobs[v].volume = &volumes[v];
+        if( pthread_create(&threads[v], NULL, info_volume, &jobs[v]) ) {
+            perror("FATAL: Creating thread failed: ");
+            abort();
+        }
+    }
+    for( v = 0; v < num_volumes; v++) pthread_join(threads[v], NULL);
+    statsPhase(STATS_PHASE_OTHER);
+
+    for( v = 0; v < num_volumes; v++) {
+        info_job * job = &jobs[v];
+        FATboot * boot = &job->volume->boot;
+
+        if( job->volume->partition ) {
+            if( v ) printf("\n");
+            printf("Partition %d, starting at byte %u\n==================\n", job->volume->partition, job->volume->base);
+        }
+
+        printf("OS Name: %.8s\nLabel of disk: %.11s\nTotal size of the disk: %u bytes\nFree size of the disk: %u bytes\n",
+               job->os_name,
+               job->disk_label,
+               boot->total_sectors*boot->bytes_per_sector,
+               job->free_clusters*fatGetClusterSize(boot));
+
+        printf("==================\n");
+        printf("The number of files in the disk: %u\n\n",job->num_files);
+        printf("==================\n");
+        printf("Number of FAT copies: %u\n",boot->num_fats);
+        printf("Sectors per FAT: %u\n",boot->sectors_per_fat);
+
+        if( fatStatsMode == 1 ) fatPrintCacheStats(job->cache, stderr);
+        fatFreeCache(job->cache);
+    }
 
-    xfree(boot);
-    fclose(disk);
+    xfree(threads);
+    xfree(jobs);
+    fatUnmapVolumes(volumes, num_volumes);
 
     return 0;
 
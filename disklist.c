@@ -1,5 +1,13 @@
 /* 
  * Implementation of disklist for listing files
+ * The tree is kept in a snapshot beside the image, so listing an unchanged image
+ * again prints from the snapshot without walking any directory. FATSNAPSHOT=off
+ * always walks and leaves no snapshot behind. Besides the text layout the listing
+ * can be written as NDJSON, one object per entry, or as CSV with a header row.
+ * Long names are always in the NDJSON and CSV listings, the text layout only shows
+ * them with -l, after the short name and in paths.
+ * A hard disk image with an MBR is listed per FAT partition. Each partition is walked
+ * on its own thread over one read only mapping and has its own snapshot.
 */
 
 #include <stdio.h>
@@ -7,72 +15,75 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "FATheaders.h"
+#include "FATcache.h"
+#include "FATmap.h"
+#include "FATsnapshot.h"
+#include "FATlfn.h"
+#include "writer.h"
 #include "ADTlinkedlist.h"
 #include "utils.h"
 
 
 
+/* Output layouts */
+#define LIST_TEXT 0
+#define LIST_NDJSON 1
+#define LIST_CSV 2
+
 /* Information needed for printing path and its entries */
 typedef struct subdir_info {
-    FATdirectory * directory;
-    char * path; //path, including own name
+    uint16_t first_cluster;
+    uint32_t path; //offset of path in the snapshot, including own name
+    uint32_t long_path; //same with long names
 } subdir_info;
 
 
-/* Reads next directory entry from disk using current disk position
+/* Reads the directory entry at offset through the cache into the snapshot
+ * LFN entries are gathered in lfn, one buffer per directory
  * Adds subdirs to subdir list
  * Returns 0 if end of disk, 1 otherwise */
-int parse_next_entry(FILE * disk, ADTlinkedlist * subdirs, char * curr_path) {
+int parse_next_entry(FATcache * cache, uint32_t offset, ADTlinkedlist * subdirs, subdir_info * curr_dir, FATsnapshot * snapshot, FATlfnbuff * lfn) {
 
     uint8_t dir_buff[FAT_DIRECTORY_SIZE];
     FATdirectory dir_entry;
+    char long_name[FAT_LFN_NAME_SIZE];
 
-    xfread(dir_buff, FAT_DIRECTORY_SIZE,1, disk);
+    fatCacheRead(cache, offset, dir_buff, FAT_DIRECTORY_SIZE);
     fatUnpackDirectory(&dir_entry,dir_buff);
 
     if( dir_entry.filename[0] == 0x00 ) return 0; //end of directory case
+    if( fatLfnAdd(lfn, dir_buff) ) return 1; //fragment of the next entry's long name
+    size_t long_length = fatLfnTake(lfn, dir_buff, long_name);
 
-    if( dir_entry.filename[0] !=  0xEF
+    if( dir_entry.filename[0] != FAT_ENTRY_DELETED
             && dir_entry.filename[0] != '.'
             && dir_entry.first_logical_cluster > 1
             && dir_entry.attributes != 0x0F //not all bit set
             && !(dir_entry.attributes & 0x08) ) { //not system
 
-        char name[13]; //format filename for printing with null termination
-        memcpy(name, dir_entry.filename,8);
-        name[8] = '.';
-        memcpy(name + 9, dir_entry.extention,3);
-        name[12] = 0;
-
-        printf("%c %10u %-s %u-%u-%0u %02u:%02u  \n",
-               (dir_entry.attributes & 0x10) ? 'D':'F',
-               dir_entry.file_size,
-               name,
-               1980 + ((dir_entry.creation_date & 0xFE00) >>9), //year //AS defined by examples
-               ((dir_entry.creation_date & 0x01E0) >>5), //month
-               (dir_entry.creation_date & 0x001F), //day
-               (dir_entry.creation_time & 0xF800) >>11, //hour
-               (dir_entry.creation_time & 0x07E0) >>5 //minute
-              );
+        fatSnapshotAddEntry(snapshot, &dir_entry, long_length ? fatSnapshotAddName(snapshot, long_name, long_length) : 0);
 
         if( dir_entry.attributes & 0x10) { //save directory for recurse
             ADTlinkednode * node = xmalloc(sizeof(ADTlinkednode));
             subdir_info * sub_info = xmalloc(sizeof(subdir_info));
 
-            int curr_path_length = strlen(curr_path);
-            char * path = xmalloc(curr_path_length + 1 + strlen(name) + 1); //room to add name + /
-            strcpy(path,curr_path);
-            path[curr_path_length] = '/';
-            strcpy(path + curr_path_length + 1,name);
-
-            FATdirectory * subdir = xmalloc(sizeof(FATdirectory));
-            memcpy(subdir,&dir_entry,sizeof(FATdirectory));
-
-            sub_info->directory = subdir;
-            sub_info->path = path;
+            char name[12]; //filename as shown in paths
+            memcpy(name, dir_entry.filename,8);
+            name[8] = '.';
+            memcpy(name + 9, dir_entry.extention,3);
+
+            sub_info->first_cluster = dir_entry.first_logical_cluster;
+            sub_info->path = fatSnapshotAddPath(snapshot, curr_dir->path, name, sizeof(name)); //built in the snapshot's path table
+            if( long_length ) {
+                sub_info->long_path = fatSnapshotAddPath(snapshot, curr_dir->long_path, long_name, long_length);
+            } else {
+                sub_info->long_path = fatSnapshotAddPath(snapshot, curr_dir->long_path, name, sizeof(name));
+            }
 
             adtInitiateLinkedNode(node, sub_info);
             adtAddEndLinkedNode(subdirs, node);
@@ -83,35 +94,25 @@ int parse_next_entry(FILE * disk, ADTlinkedlist * subdirs, char * curr_path) {
 }
 
 
-int main(int argc, char * argv[]) {
-
-    if( argc != 2 ) {
-        printf("Usage: ./disklist <diskname> \n");
-        return 2;
-    }
-
-    FILE * disk = fopen(argv[1],"r");
-    if( !disk) {
-        perror("Opening disk failed:");
-        printf("Name given %s\n",argv[1]);
-        return 3;
-    }
+/* Walk the whole tree breadth first into a new snapshot */
+FATsnapshot * walk_tree(FATcache * cache, FATboot * boot) {
 
-    FATboot * boot = fatGetBootInfo(disk);
+    FATsnapshot * snapshot = fatCreateSnapshot();
 
     ADTlinkedlist subdirs;
     adtInitiateLinkedList(&subdirs); //for directories to recurse
+    FATlfnbuff lfn; //reused by every directory
+    subdir_info root = {0, 0, 0};
 
     /* Perform an inorder traversal of all directories */
 
-    xfseek(disk, fatGetRootStart(boot),SEEK_SET);
-
-    printf("/ \n==================\n");
-
     /* Root directory entries */
+    fatSnapshotAddDir(snapshot, 0, 0, 0);
+    fatLfnReset(&lfn);
     uint32_t entries_read;
+    fatCachePrefetch(cache, fatGetRootStart(boot), boot->max_root_entries * FAT_DIRECTORY_SIZE);
     for( entries_read=0; entries_read <  boot->max_root_entries; entries_read++) {
-        if( !parse_next_entry(disk,&subdirs,"") ) break;
+        if( !parse_next_entry(cache, fatGetRootStart(boot) + entries_read * FAT_DIRECTORY_SIZE, &subdirs, &root, snapshot, &lfn) ) break;
     }
 
     /* Now all Subdirectory entries */
@@ -119,34 +120,315 @@ int main(int argc, char * argv[]) {
 
         ADTlinkednode * node = adtPopLinkedNode(&subdirs,0);
         subdir_info * curr_dir = node->val;
-        uint16_t curr_logical_cluster = curr_dir->directory->first_logical_cluster;
+        uint16_t curr_logical_cluster = curr_dir->first_cluster;
 
-        printf("%s \n==================\n", curr_dir->path);
+        fatSnapshotAddDir(snapshot, curr_dir->path, curr_dir->long_path, curr_logical_cluster);
+        fatLfnReset(&lfn);
 
 
         while( curr_logical_cluster <= 0xFF0 && curr_logical_cluster > 0) { //iterate through all FAT entries
 
-            xfseek(disk, fatGetDataspaceLocation(boot,curr_logical_cluster),SEEK_SET); //go to logical cluster
+            uint32_t location = fatGetDataspaceLocation(boot,curr_logical_cluster); //go to logical cluster
+            fatCacheChainAhead(cache, boot, curr_logical_cluster);
 
-            for( entries_read=0; entries_read < boot->bytes_per_sector/FAT_DIRECTORY_SIZE ; entries_read++) { //read all entries in cluster
-                if( !parse_next_entry(disk,&subdirs,curr_dir->path) ) goto break_dir_search;
+            for( entries_read=0; entries_read < fatGetClusterSize(boot)/FAT_DIRECTORY_SIZE ; entries_read++) { //read all entries in cluster
+                if( !parse_next_entry(cache, location + entries_read * FAT_DIRECTORY_SIZE, &subdirs, curr_dir, snapshot, &lfn) ) goto break_dir_search;
 
             }
 
-            curr_logical_cluster = fatGetFatEntry(disk,boot,curr_logical_cluster); //update entry to next value
+            STATS_ADD(clusters_followed, 1);
+            curr_logical_cluster = fatCacheGetFatEntry(cache,boot,curr_logical_cluster); //update entry to next value
         }
 
 break_dir_search:
         xfree(node);
-        xfree(curr_dir->directory);
-        xfree(curr_dir->path);
         xfree(curr_dir);
 
     }
 
+    return snapshot;
+}
+
+/* Length of a space padded name field, also cut at a null like printf would */
+size_t name_length(const uint8_t * name, size_t size, int trim) {
+    const uint8_t * end = memchr(name, 0, size);
+    size_t length = end ? (size_t) (end - name) : size;
+    while( trim && length > 0 && name[length - 1] == ' ' ) length--;
+    return length;
+}
+
+/* Add the entry's name without padding, with a dot only if there is an extention */
+void write_short_name(WRITERbuff * out, FATsnapentry * entry, void (*field)(WRITERbuff *, const void *, size_t)) {
+    char name[12];
+    size_t length = name_length(entry->name, 8, 1);
+    memcpy(name, entry->name, length);
+    size_t extention = name_length(entry->name + 8, 3, 1);
+    if( extention ) {
+        name[length++] = '.';
+        memcpy(name + length, entry->name + 8, extention);
+        length += extention;
+    }
+    field(out, name, length);
+}
+
+/* Copy path into clean with each 8.3 component unpadded like write_short_name, "/" for the root
+ * clean is reused between directories and grown when needed */
+const char * clean_path(const char * path, char ** clean, size_t * capacity) {
+    size_t length = strlen(path);
+    if( length + 2 > *capacity ) {
+        *capacity = length + 2;
+        *clean = xrealloc(*clean, *capacity);
+    }
+    if( !length ) return "/";
+
+    char * out = *clean;
+    while( *path ) {
+        path++; //every component starts with /
+        const char * end = strchr(path, '/');
+        size_t size = end ? (size_t) (end - path) : strlen(path);
+        *out++ = '/';
+        if( size == 12 && path[8] == '.' ) { //padded name.ext
+            size_t name = name_length((const uint8_t *) path, 8, 1);
+            size_t extention = name_length((const uint8_t *) path + 9, 3, 1);
+            memcpy(out, path, name);
+            out += name;
+            if( extention ) {
+                *out++ = '.';
+                memcpy(out, path + 9, extention);
+                out += extention;
+            }
+        } else {
+            memcpy(out, path, size);
+            out += size;
+        }
+        path += size;
+    }
+    *out = 0;
+    return *clean;
+}
+
+/* Add the creation date as YYYY-MM-DD and time as HH:MM, separated by sep */
+void write_iso_date(WRITERbuff * out, FATsnapentry * entry, char sep) {
+    writerUnsigned(out, 1980 + ((entry->creation_date & 0xFE00) >>9), 4, '0');
+    writerChar(out, '-');
+    writerUnsigned(out, (entry->creation_date & 0x01E0) >>5, 2, '0');
+    writerChar(out, '-');
+    writerUnsigned(out, entry->creation_date & 0x001F, 2, '0');
+    writerChar(out, sep);
+    writerUnsigned(out, (entry->creation_time & 0xF800) >>11, 2, '0');
+    writerChar(out, ':');
+    writerUnsigned(out, (entry->creation_time & 0x07E0) >>5, 2, '0');
+}
+
+/* One entry in the original text layout, a long name goes at the end of the line */
+void write_text_entry(WRITERbuff * out, FATsnapentry * entry, const char * long_name) {
+    writerChar(out, (entry->attributes & 0x10) ? 'D':'F');
+    writerChar(out, ' ');
+    writerUnsigned(out, entry->file_size, 10, ' ');
+    writerChar(out, ' ');
+    writerBytes(out, entry->name, name_length(entry->name, 8, 0));
+    writerChar(out, '.');
+    writerBytes(out, entry->name + 8, name_length(entry->name + 8, 3, 0));
+    writerChar(out, ' ');
+    writerUnsigned(out, 1980 + ((entry->creation_date & 0xFE00) >>9), 0, ' '); //year //AS defined by examples
+    writerChar(out, '-');
+    writerUnsigned(out, (entry->creation_date & 0x01E0) >>5, 0, ' '); //month
+    writerChar(out, '-');
+    writerUnsigned(out, entry->creation_date & 0x001F, 0, ' '); //day
+    writerChar(out, ' ');
+    writerUnsigned(out, (entry->creation_time & 0xF800) >>11, 2, '0'); //hour
+    writerChar(out, ':');
+    writerUnsigned(out, (entry->creation_time & 0x07E0) >>5, 2, '0'); //minute
+    writerString(out, "  ");
+    if( long_name ) writerString(out, long_name);
+    writerChar(out, '\n');
+}
+
+/* One entry as a JSON object on its own line, name is the long name if there is one
+ * partition is only added when it is not 0 */
+void write_json_entry(WRITERbuff * out, FATsnapentry * entry, const char * long_name, const char * dir_path, int partition) {
+    writerChar(out, '{');
+    if( partition ) {
+        writerString(out, "\"partition\":");
+        writerUnsigned(out, partition, 0, ' ');
+        writerChar(out, ',');
+    }
+    writerString(out, "\"dir\":");
+    writerJsonString(out, dir_path, strlen(dir_path));
+    writerString(out, ",\"name\":");
+    if( long_name ) writerJsonString(out, long_name, strlen(long_name));
+    else write_short_name(out, entry, writerJsonString);
+    writerString(out, ",\"short\":");
+    write_short_name(out, entry, writerJsonString);
+    writerString(out, (entry->attributes & 0x10) ? ",\"type\":\"D\",\"size\":" : ",\"type\":\"F\",\"size\":");
+    writerUnsigned(out, entry->file_size, 0, ' ');
+    writerString(out, ",\"created\":\"");
+    write_iso_date(out, entry, 'T');
+    writerString(out, "\",\"cluster\":");
+    writerUnsigned(out, entry->first_cluster, 0, ' ');
+    writerString(out, "}\n");
+}
+
+/* One entry as a CSV row, name is the long name if there is one
+ * partition is only added when it is not 0 */
+void write_csv_entry(WRITERbuff * out, FATsnapentry * entry, const char * long_name, const char * dir_path, int partition) {
+    if( partition ) {
+        writerUnsigned(out, partition, 0, ' ');
+        writerChar(out, ',');
+    }
+    writerCsvField(out, dir_path, strlen(dir_path));
+    writerChar(out, ',');
+    if( long_name ) writerCsvField(out, long_name, strlen(long_name));
+    else write_short_name(out, entry, writerCsvField);
+    writerChar(out, ',');
+    write_short_name(out, entry, writerCsvField);
+    writerString(out, (entry->attributes & 0x10) ? ",D," : ",F,");
+    writerUnsigned(out, entry->file_size, 0, ' ');
+    writerChar(out, ',');
+    write_iso_date(out, entry, ' ');
+    writerChar(out, ',');
+    writerUnsigned(out, entry->first_cluster, 0, ' ');
+    writerChar(out, '\n');
+}
+
+/* Print every directory of the snapshot in the given layout through one reused buffer
+ * The text layout shows long names only if long_names is set. Machine layouts carry
+ * partition in every entry unless it is 0, the CSV header is left to the caller */
+void print_snapshot(FATsnapshot * snapshot, int format, int long_names, int partition) {
+    WRITERbuff out;
+    fflush(stdout); //anything printf buffered goes first
+    writerInit(&out, fileno(stdout), 0);
+
+    char * clean = NULL; //unpadded path of the directory for the machine layouts
+    size_t clean_capacity = 0;
+
+    uint32_t d;
+    for( d = 0; d < snapshot->header.num_dirs; d++) {
+        FATsnapdir * dir = &snapshot->dirs[d];
+        const char * path = fatSnapshotPath(snapshot, dir, long_names || format != LIST_TEXT);
+
+        if( format == LIST_TEXT ) {
+            writerString(&out, d ? path : "/");
+            writerString(&out, " \n==================\n");
+        } else {
+            path = clean_path(path, &clean, &clean_capacity);
+        }
+
+        uint32_t i;
+        for( i = dir->first_entry; i < dir->first_entry + dir->num_entries; i++) {
+            FATsnapentry * entry = &snapshot->entries[i];
+            const char * long_name = fatSnapshotLongName(snapshot, entry);
+            if( format == LIST_NDJSON ) write_json_entry(&out, entry, long_name, path, partition);
+            else if( format == LIST_CSV ) write_csv_entry(&out, entry, long_name, path, partition);
+            else write_text_entry(&out, entry, long_names ? long_name : NULL);
+        }
+    }
+
+    if( clean ) xfree(clean);
+    writerFree(&out);
+}
+
+
+/* Listing of one volume, filled by its thread */
+typedef struct list_job {
+    FATmapped * volume;
+    FATcache * cache;
+    FATsnapshot * snapshot;
+    char * snapshot_name;
+    struct stat * image_stats;
+    int use_snapshot;
+    int from_snapshot;
+} list_job;
+
+/* Thread body, maps the volume's snapshot or walks the volume and saves a new one */
+void * list_volume(void * arg) {
+    list_job * job = arg;
+    FATboot * boot = &job->volume->boot;
+    job->cache = fatCreateMappedCache(job->volume->volume, job->volume->volume_size, boot);
+    fatCacheSetPack(job->cache, job->volume->pack, job->volume->base);
+
+    uint64_t checksum = fatSnapshotChecksum(job->cache, boot);
+    job->snapshot = job->use_snapshot ? fatMapSnapshot(job->snapshot_name, checksum, job->image_stats) : NULL;
+    job->from_snapshot = job->snapshot != NULL;
+
+    if( !job->snapshot ) { //missing or stale, walk the image and keep the result for next time
+        job->snapshot = walk_tree(job->cache, boot);
+        if( job->use_snapshot ) fatSaveSnapshot(job->snapshot, job->snapshot_name, checksum, job->image_stats);
+    }
+    return NULL;
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    int format = LIST_TEXT;
+    int long_names = 0;
+    int opt;
+    while( (opt = getopt(argc, argv, "f:l")) != -1 ) {
+        if( opt == 'l' ) long_names = 1;
+        else if( opt == 'f' && !strcmp(optarg, "text") ) format = LIST_TEXT;
+        else if( opt == 'f' && !strcmp(optarg, "ndjson") ) format = LIST_NDJSON;
+        else if( opt == 'f' && !strcmp(optarg, "csv") ) format = LIST_CSV;
+        else format = -1;
+    }
+
+    if( argc - optind != 1 || format < 0 ) {
+        printf("Usage: ./disklist [-l] [-f text|ndjson|csv] <diskname> \n");
+        return 2;
+    }
+    char * disk_name = argv[optind];
+
+    int num_volumes;
+    FATmapped * volumes = fatMapVolumes(disk_name, &num_volumes);
+    if( !volumes ) return 3;
+
+    char * env = getenv("FATSNAPSHOT");
+    int use_snapshot = !env || strcmp(env, "off");
+    struct stat image_stats;
+    stat(disk_name, &image_stats);
+
+    /* One thread per volume, they only share the read only mapping */
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    list_job * jobs = xmalloc(num_volumes * sizeof(list_job));
+    pthread_t * threads = xmalloc(num_volumes * sizeof(pthread_t));
+    int v;
+    for( v = 0; v < num_volumes; v++) {
+        jobs[v].volume = &volumes[v];
+        jobs[v].snapshot_name = fatSnapshotName(disk_name, volumes[v].partition);
+        jobs[v].image_stats = &image_stats;
+        jobs[v].use_snapshot = use_snapshot;
+        if( pthread_create(&threads[v], NULL, list_volume, &jobs[v]) ) {
+            perror("FATAL: Creating thread failed: ");
+            abort();
+        }
+    }
+    for( v = 0; v < num_volumes; v++) pthread_join(threads[v], NULL);
+    statsPhase(STATS_PHASE_OTHER);
+
+    if( format == LIST_CSV ) {
+        printf(volumes[0].partition ? "partition,dir,name,short,type,size,created,cluster\n" : "dir,name,short,type,size,created,cluster\n");
+    }
+    for( v = 0; v < num_volumes; v++) {
+        list_job * job = &jobs[v];
+        if( job->volume->partition && format == LIST_TEXT ) {
+            if( v ) printf("\n");
+            printf("Partition %d, starting at byte %u\n==================\n", job->volume->partition, job->volume->base);
+        }
+        print_snapshot(job->snapshot, format, long_names, job->volume->partition);
+
+        if( fatStatsMode == 1 ) {
+            if( job->from_snapshot ) fprintf(stderr, "Listed from snapshot %s\n", job->snapshot_name);
+            fatPrintCacheStats(job->cache, stderr);
+        }
+        fatFreeSnapshot(job->snapshot);
+        xfree(job->snapshot_name);
+        fatFreeCache(job->cache);
+    }
 
-    xfree(boot);
-    fclose(disk);
+    xfree(threads);
+    xfree(jobs);
+    fatUnmapVolumes(volumes, num_volumes);
 
     return 0;
 }
@@ -0,0 +1,184 @@
+/* Implementation of diskmv. Moves or renames a file or directory inside the file system
+ *
+ * Only directory entries are rewritten: the entry goes into the target directory (which
+ * grows if it is full), the old one and its long name are deleted, and a moved directory
+ * gets its .. entry pointed at the new parent. No data cluster is read or written, so
+ * the cost does not depend on the size of what is moved.
+*/
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATlfn.h"
+#include "FATindex.h"
+#include "FAToverlay.h"
+#include "utils.h"
+
+/* Returns 1 if the directory at cluster is dir or lies somewhere below it, following .. up to the root */
+int is_below(FILE * disk, FATboot * boot, uint16_t cluster, uint16_t dir) {
+    uint8_t raw[FAT_DIRECTORY_SIZE];
+    FATdirectory entry;
+    uint32_t depth;
+    for( depth = 0; cluster > 1 && depth < 0xFFF; depth++) { //depth bounds a loop in a corrupt image
+        if( cluster == dir ) return 1;
+        xfseek(disk, fatGetDataspaceLocation(boot, cluster) + FAT_DIRECTORY_SIZE, SEEK_SET);
+        xfread(raw, FAT_DIRECTORY_SIZE, 1, disk);
+        fatUnpackDirectory(&entry, raw);
+        cluster = entry.first_logical_cluster;
+    }
+    return 0;
+}
+
+/* Point the .. entry of the directory at cluster to parent, 0 for the root */
+void set_parent(FILE * disk, FATboot * boot, uint16_t cluster, uint16_t parent) {
+    uint8_t raw[FAT_DIRECTORY_SIZE];
+    FATdirectory entry;
+    uint32_t location = fatGetDataspaceLocation(boot, cluster) + FAT_DIRECTORY_SIZE; //second entry of the first cluster
+
+    xfseek(disk, location, SEEK_SET);
+    xfread(raw, FAT_DIRECTORY_SIZE, 1, disk);
+    fatUnpackDirectory(&entry, raw);
+    if( entry.filename[0] != '.' || entry.filename[1] != '.' ) return; //no .. to fix
+
+    entry.first_logical_cluster = parent;
+    fatPackDirectory(&entry, raw);
+    xfseek(disk, location, SEEK_SET);
+    xfwrite(raw, FAT_DIRECTORY_SIZE, 1, disk);
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    if( argc != 4 ) {
+        printf("Usage: ./diskmv <disk> <source path> <destination path> \n");
+        printf("  If the destination is a directory the entry keeps its name, otherwise it is renamed\n");
+        return 1;
+    }
+
+    FILE * disk = fatOpenImage(argv[1],"r+");
+    if( !disk) {
+        perror("Aborting: Opening disk failed:");
+        return 3;
+    }
+
+    FATboot * boot = fatGetBootInfo(disk);
+    FATtable * table = fatLoadTable(disk, boot);
+
+    /* Entry to move */
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    char * source_path = xmalloc(strlen(argv[2]) + 1);
+    strcpy(source_path, argv[2]);
+    char ** source_components = xmalloc((strlen(argv[2]) / 2 + 1) * sizeof(char *));
+    int source_num = fatSplitPath(source_path, source_components);
+
+    FATdirindex source_index;
+    FATdirbuff * source_dir = source_num ? fatIndexPath(disk, boot, table, source_components, source_num - 1, &source_index) : NULL;
+    int source_slot = source_dir ? fatIndexFind(&source_index, source_components[source_num - 1]) : -1;
+    if( source_slot < 0 ) {
+        printf("Aborting: Path cannot be found\n");
+        return 7;
+    }
+
+    FATdirectory entry;
+    fatUnpackDirectory(&entry, fatDirectoryEntry(source_dir, source_slot));
+    char long_name[FAT_LFN_NAME_SIZE];
+    int had_long = fatLfnFind(source_dir, source_slot, long_name) > 0;
+    if( !had_long ) fatFormatName(&entry, long_name);
+
+    /* Target directory and name, into the destination if it is a directory, else as its last component */
+    char * dest_path = xmalloc(strlen(argv[3]) + 1);
+    strcpy(dest_path, argv[3]);
+    char ** dest_components = xmalloc((strlen(argv[3]) / 2 + 1) * sizeof(char *));
+    int dest_num = fatSplitPath(dest_path, dest_components);
+
+    const char * name = long_name;
+    FATdirindex dest_index;
+    FATdirbuff * dest_dir = fatIndexPath(disk, boot, table, dest_components, dest_num, &dest_index);
+    if( !dest_dir && dest_num > 0 ) {
+        name = dest_components[dest_num - 1];
+        dest_dir = fatIndexPath(disk, boot, table, dest_components, dest_num - 1, &dest_index);
+    }
+    if( !dest_dir ) {
+        printf("Aborting: Path cannot be found\n");
+        return 7;
+    }
+    statsPhase(STATS_PHASE_OTHER);
+
+    FATdirindex * target = &dest_index;
+    int same_dir = dest_dir->first_cluster == source_dir->first_cluster;
+    if( same_dir ) { //one buffer for both sides so neither write undoes the other
+        fatFreeIndex(&dest_index);
+        fatFreeDirectory(dest_dir);
+        dest_dir = source_dir;
+        target = &source_index;
+    }
+
+    if( (entry.attributes & FAT_ATTR_DIRECTORY) && is_below(disk, boot, dest_dir->first_cluster, entry.first_logical_cluster) ) {
+        printf("Aborting: Cannot move a directory into itself\n");
+        return 7;
+    }
+
+    int existing = fatIndexFind(target, name);
+    if( existing >= 0 && !(same_dir && existing == source_slot) ) { //a change of case is not a clash
+        printf("File with same name already exists in directory\n");
+        return 2;
+    }
+
+    /* New name, long if it is not 8.3 or was long before and stays the same */
+    FATdircompare new_name;
+    int same_entry = same_dir && existing == source_slot; //its own short name is no clash
+    int is_short = fatParseName(name, &new_name) == 0;
+    if( is_short ) {
+        int clash = fatNameSetFind(&target->shorts, (uint8_t *) &new_name);
+        if( clash >= 0 && clash != source_slot ) is_short = 0;
+    }
+    int is_long = !is_short || (had_long && name == long_name);
+    if( !is_short && same_entry && fatLfnEntries(name) ) { //a change of case keeps the short name
+        memcpy(new_name.filename, entry.filename, sizeof(new_name.filename));
+        memcpy(new_name.extention, entry.extention, sizeof(new_name.extention));
+    }
+    else if( !is_short && (!fatLfnEntries(name) || fatMakeShortName(name, &target->shorts, &new_name)) ) {
+        printf("Aborting invalid path format provided!\n");
+        return 3;
+    }
+    memcpy(entry.filename, new_name.filename, sizeof(new_name.filename));
+    memcpy(entry.extention, new_name.extention, sizeof(new_name.extention));
+
+    /* New entry first, so a failed write leaves the entry in its old place rather than nowhere */
+    FATfreemap * map = fatBuildFreeMap(table);
+    if( fatIndexInsert(target, boot, table, map, is_long ? name : NULL, &entry) < 0 ) {
+        printf(dest_dir->first_cluster ? "Aborting: Not enough space for entry!\n" : "Aborting: No room left in root directory\n");
+        return 7;
+    }
+    fatWriteDirectory(disk, boot, dest_dir);
+    fatTableFlush(disk, boot, table); //only if the directory grew
+
+    fatDeleteLongEntry(source_dir, source_slot);
+    fatWriteDirectory(disk, boot, source_dir);
+
+    if( (entry.attributes & FAT_ATTR_DIRECTORY) && !same_dir ) set_parent(disk, boot, entry.first_logical_cluster, dest_dir->first_cluster);
+
+    if( !same_dir ) {
+        fatFreeIndex(&dest_index);
+        fatFreeDirectory(dest_dir);
+    }
+    fatFreeIndex(&source_index);
+    fatFreeDirectory(source_dir);
+    fatFreeFreeMap(map);
+    fatFreeTable(table);
+    xfree(dest_components);
+    xfree(dest_path);
+    xfree(source_components);
+    xfree(source_path);
+    xfree(boot);
+    fclose(disk);
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* Implementation of diskoverlay. Makes copy on write overlays of an image, shows what
+ * an overlay holds, and commits one back into its base.
+ *
+ * Note: committing writes into the base, every other overlay of it then refuses to open.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "FAToverlay.h"
+#include "utils.h"
+
+void usage() {
+    printf("Usage: ./diskoverlay <base disk> <overlay> \n");
+    printf("       ./diskoverlay -i <overlay> \n");
+    printf("       ./diskoverlay -c <overlay> \n");
+    printf("  -i shows the base of an overlay and how much it holds\n");
+    printf("  -c writes what an overlay holds into its base and empties it\n");
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    int info = 0;
+    int commit = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "ic")) != -1 ) {
+        switch( opt ) {
+            case 'i': info = 1; break;
+            case 'c': commit = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( argc - optind != ((info || commit) ? 1 : 2) || (info && commit) ) {
+        usage();
+        return 1;
+    }
+
+    if( !info && !commit ) {
+        if( fatCreateOverlay(argv[optind], argv[optind + 1]) ) {
+            printf("Aborting: Overlay not made\n");
+            return 3;
+        }
+        return 0;
+    }
+
+    if( !fatIsOverlay(argv[optind]) ) {
+        printf("Aborting: %s is not an overlay\n", argv[optind]);
+        return 3;
+    }
+    FAToverlay * overlay = fatOpenOverlay(argv[optind], commit);
+    if( !overlay ) {
+        printf("Aborting: Opening overlay failed\n");
+        return 3;
+    }
+
+    if( info ) {
+        FAToverlayheader * header = &overlay->header;
+        struct stat stats;
+        uint64_t stored = stat(argv[optind], &stats) ? 0 : (uint64_t) stats.st_blocks * 512;
+        printf("Base image: %s\n", overlay->base_name);
+        printf("Image size: %llu bytes\n", (unsigned long long) header->base_size);
+        printf("Block size: %u bytes\n", header->block_size);
+        printf("Blocks copied: %u of %u\n", header->num_used, header->num_blocks);
+        printf("Bytes stored on host: %llu\n", (unsigned long long) stored);
+        fatCloseOverlay(overlay);
+        return 0;
+    }
+
+    int64_t written = fatCommitOverlay(overlay);
+    fatCloseOverlay(overlay);
+    if( written < 0 ) {
+        printf("Aborting: Commit failed\n");
+        return 3;
+    }
+    printf("Committed %lld blocks\n", (long long) written);
+    return 0;
+}
@@ -0,0 +1,104 @@
+/* Implementation of diskpack. Compresses an image into a container the other tools read
+ * in place, and turns a container back into a raw image.
+ *
+ * Note: containers are read only, writing tools need the image unpacked first.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "FATpack.h"
+#include "utils.h"
+
+void usage() {
+    printf("Usage: ./diskpack [-s chunk size in KiB] <disk> <container> \n");
+    printf("       ./diskpack -x <container> <disk> \n");
+    printf("  -s sets how much of the image each compressed chunk holds, default 64\n");
+    printf("  -x unpacks a container into a new raw image\n");
+}
+
+/* Write the image held by a container into a new file, leaving runs of zeros as holes
+ * Returns 0, or 3 with a message on failure */
+int unpack(const char * pack_name, const char * name) {
+    FATpack * pack = fatOpenPack(pack_name);
+    if( !pack ) return 3;
+
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if( fd < 0 ) {
+        perror("Aborting: Creating disk failed:");
+        printf("Name given %s\n", name);
+        fatClosePack(pack);
+        return 3;
+    }
+
+    uint32_t chunk_size = pack->header.chunk_size;
+    uint8_t * buff = xmalloc(chunk_size);
+    uint8_t * zeros = xmalloc(chunk_size);
+    memset(zeros, 0, chunk_size);
+
+    uint64_t offset = 0;
+    size_t got;
+    while( (got = fatPackRead(pack, buff, chunk_size, offset)) > 0 ) {
+        if( memcmp(buff, zeros, got) ) xpwrite(fd, buff, got, offset);
+        offset += got;
+    }
+    int failed = ftruncate(fd, offset);
+    failed = close(fd) || failed;
+    printf("Unpacked %llu bytes from %u chunks\n", (unsigned long long) offset, pack->header.num_chunks);
+
+    xfree(buff);
+    xfree(zeros);
+    fatClosePack(pack);
+    if( failed ) {
+        perror("Aborting: Writing disk failed:");
+        return 3;
+    }
+    return 0;
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    uint32_t chunk_size = FAT_PACK_DEFAULT_CHUNK;
+    int extract = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "s:x")) != -1 ) {
+        switch( opt ) {
+            case 's': chunk_size = strtoul(optarg, NULL, 10) * 1024; break;
+            case 'x': extract = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( argc - optind != 2 || !chunk_size || chunk_size > 16 * 1024 * 1024 ) {
+        usage();
+        return 1;
+    }
+
+    if( extract ) return unpack(argv[optind], argv[optind + 1]);
+
+    if( fatIsPack(argv[optind]) ) {
+        printf("Aborting: %s is already a container\n", argv[optind]);
+        return 3;
+    }
+    uint64_t packed = fatPackImage(argv[optind], argv[optind + 1], chunk_size);
+    if( !packed ) {
+        printf("Aborting: Container not made\n");
+        return 3;
+    }
+
+    FATpack * pack = fatOpenPack(argv[optind + 1]);
+    if( !pack ) return 3;
+    printf("Packed %llu bytes into %llu bytes in %u chunks\n", (unsigned long long) pack->header.image_size,
+           (unsigned long long) packed, pack->header.num_chunks);
+    fatClosePack(pack);
+    return 0;
+}
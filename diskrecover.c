@@ -0,0 +1,622 @@
+/* Implementation of diskrecover. Lists deleted files and what of them can still be read back,
+ * and carves files of known types out of unallocated clusters
+ *
+ * A deleted entry keeps its first cluster and size but its chain is gone from the FAT, so the
+ * file is rebuilt the way it was most likely allocated: from its first cluster on, taking every
+ * cluster that is still free. A deleted directory is followed the same way while the free
+ * clusters after its first still hold directory entries. Deleted LFN entries lost their sequence
+ * numbers with their first byte, so a deleted long name is put back together by position and
+ * checked against its short entry. Carving looks for known headers at the start of free clusters
+ * and ends each file at its type's end marker, or where the free run stops.
+ *
+ * Note: only bare volumes are handled, not partitioned images.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "FATheaders.h"
+#include "FATmap.h"
+#include "FATlfn.h"
+#include "FATio.h"
+#include "FATextract.h"
+#include "FAToverlay.h"
+#include "ADTlinkedlist.h"
+#include "match.h"
+#include "utils.h"
+
+/* Free clusters are checked for headers this many at a time by each thread */
+#define CARVE_BLOCK 256
+
+/* Known file type */
+typedef struct carve_type {
+    const char * extension;
+    const char * header;
+    size_t header_length;
+    const char * footer;
+    size_t footer_length;
+    int last; //file ends at the last footer in the run rather than the first
+    uint32_t trailer; //bytes after the footer that still belong to the file
+} carve_type;
+
+static const carve_type carve_types[] = {
+    {"jpg", "\xFF\xD8\xFF", 3, "\xFF\xD9", 2, 1, 0},
+    {"png", "\x89PNG\r\n\x1A\n", 8, "IEND\xAE\x42\x60\x82", 8, 0, 0},
+    {"gif", "GIF8", 4, "\x00\x3B", 2, 1, 0},
+    {"pdf", "%PDF-", 5, "%%EOF", 5, 1, 0},
+    {"zip", "PK\x03\x04", 4, "PK\x05\x06", 4, 1, 18}, //end of central directory without a comment
+};
+#define NUM_CARVE_TYPES (int) (sizeof(carve_types) / sizeof(carve_type))
+
+/* Deleted file found in a directory */
+typedef struct lost_file {
+    char * path;
+    uint16_t first_cluster;
+    uint32_t size;
+    FATextent * extents; //runs it was rebuilt from, NULL if none
+    int num_extents;
+    uint32_t clusters; //clusters rebuilt
+    const char * status;
+} lost_file;
+
+/* File carved from unallocated clusters */
+typedef struct carved_file {
+    int type; //index into carve_types
+    uint16_t start;
+    uint16_t length; //clusters of the free run it can span
+    uint32_t size;
+    int ended; //end marker found
+} carved_file;
+
+/* Directory waiting to be looked through */
+typedef struct lost_dir {
+    uint16_t cluster;
+    char * path;
+    int deleted; //its chain is gone, free clusters after the first are read while they hold entries
+    uint8_t * fragments[FAT_LFN_MAX_ENTRIES]; //LFN entries since the last short entry, in the mapping
+    int num_fragments;
+} lost_dir;
+
+/* State shared by worker threads */
+typedef struct recover_state {
+    FATmapped * image;
+    uint8_t * used; //per cluster, allocated or taken by a rebuilt file
+    uint8_t * heads; //per cluster, carve type + 1 of a header at its start
+    uint32_t num_blocks;
+    uint32_t next_block;
+    lost_file * lost;
+    int num_lost;
+    int lost_capacity;
+    carved_file * carved;
+    int num_carved;
+    int carved_capacity;
+    int next_carved;
+    MATCHset footers[NUM_CARVE_TYPES];
+    pthread_mutex_t lock;
+} recover_state;
+
+void usage() {
+    printf("Usage: ./diskrecover [-n] [-j threads] [-d directory] <disk> \n");
+    printf("  -d writes what can be recovered into directory, otherwise it is only listed\n");
+    printf("  -n does not carve unallocated clusters\n");
+    printf("  -j sets the number of threads scanning free clusters, default the number of cores\n");
+}
+
+/* Start of a cluster if it lies whole inside the volume, NULL otherwise */
+uint8_t * cluster_data(FATmapped * image, uint16_t cluster) {
+    uint32_t cluster_size = fatGetClusterSize(&image->boot);
+    if( cluster < 2 || fatGetDataspaceLocation(&image->boot, cluster) + cluster_size > image->volume_size ) return NULL;
+    return fatMappedCluster(image, cluster);
+}
+
+/* Returns 1 if a free cluster still starts with the . entry of a directory */
+int looks_like_directory(recover_state * state, uint16_t cluster) {
+    if( cluster >= state->image->table.num_entries || state->used[cluster] ) return 0;
+    uint8_t * data = cluster_data(state->image, cluster);
+    return data && data[0] == '.' && data[1] == ' ' && (data[11] & FAT_ATTR_DIRECTORY);
+}
+
+/* Returns 1 if a free cluster could carry on a deleted directory: it starts with an entry
+ * and every entry up to the end marker looks like one */
+int looks_like_entries(recover_state * state, uint8_t * data) {
+    uint32_t count = fatGetClusterSize(&state->image->boot) / FAT_DIRECTORY_SIZE;
+    if( data[0] == FAT_ENTRY_END ) return 0;
+
+    uint32_t i;
+    for( i = 0; i < count; i++) {
+        uint8_t * raw = data + i * FAT_DIRECTORY_SIZE;
+        if( raw[0] == FAT_ENTRY_END ) return 1;
+        if( raw[11] & 0xC0 ) return 0; //attribute bits that are never set
+        if( raw[11] == FAT_ATTR_LFN ) continue;
+
+        int j;
+        for( j = 1; j < 11; j++) {
+            if( raw[j] < 0x20 ) return 0;
+        }
+        if( raw[0] < 0x20 && raw[0] != 0x05 ) return 0; //0x05 stands for a leading 0xE5
+        if( (uint32_t) (raw[26] | raw[27] << 8) >= state->image->table.num_entries ) return 0;
+    }
+    return 1;
+}
+
+/* Next cluster of a deleted directory: the first free one after cluster, if it still holds
+ * directory entries. It is taken so it is not carved. Returns 0 if there is none */
+uint16_t next_directory_cluster(recover_state * state, uint16_t cluster) {
+    uint32_t num_clusters = state->image->table.num_entries;
+    uint32_t next;
+    for( next = cluster + 1; next < num_clusters && state->used[next]; next++);
+    uint8_t * data = next < num_clusters ? cluster_data(state->image, next) : NULL;
+    if( !data || !looks_like_entries(state, data) ) return 0;
+
+    state->used[next] = 1;
+    return next;
+}
+
+/* Returns 1 if c can be a character of a short name */
+int short_name_char(uint8_t c) {
+    return c > 0x20 && c != FAT_ENTRY_DELETED && !islower(c) && !strchr("\"*+,./:;<=>?[\\]|", c);
+}
+
+/* Keep an LFN entry until the short entry it belongs to shows up, the oldest goes when full */
+void add_fragment(lost_dir * dir, uint8_t * raw) {
+    if( dir->num_fragments == FAT_LFN_MAX_ENTRIES ) {
+        memmove(dir->fragments, dir->fragments + 1, (FAT_LFN_MAX_ENTRIES - 1) * sizeof(uint8_t *));
+        dir->num_fragments--;
+    }
+    dir->fragments[dir->num_fragments++] = raw;
+}
+
+/* Long name of a live short entry raw into name from the LFN entries before it
+ * Returns its length, 0 if it has none */
+size_t live_long_name(lost_dir * dir, const uint8_t * raw, char * name) {
+    FATlfnbuff lfn;
+    fatLfnReset(&lfn);
+    int i;
+    for( i = 0; i < dir->num_fragments; i++) fatLfnAdd(&lfn, dir->fragments[i]);
+    return fatLfnTake(&lfn, raw, name);
+}
+
+/* Long name of a deleted short entry raw into name from the deleted LFN entries just before it
+ * Their sequence numbers are gone, so they are numbered by position, and the first byte of the
+ * short name is the only one giving their checksum. That byte is put in first, which is left
+ * alone if there is no long name. Returns the length of the name, 0 if it has none */
+size_t deleted_long_name(lost_dir * dir, const uint8_t * raw, char * name, uint8_t * first) {
+    if( !dir->num_fragments ) return 0;
+    uint8_t checksum = dir->fragments[dir->num_fragments - 1][13];
+    int count = 0; //fragments back from the short entry with the same checksum
+    while( count < dir->num_fragments ) {
+        uint8_t * fragment = dir->fragments[dir->num_fragments - 1 - count];
+        if( fragment[0] != FAT_ENTRY_DELETED || fragment[13] != checksum ) break;
+        count++;
+    }
+    if( !count ) return 0;
+
+    uint8_t short_name[11];
+    memcpy(short_name, raw, sizeof(short_name));
+    int c;
+    for( c = 0; c < 256; c++) {
+        short_name[0] = c;
+        if( fatLfnChecksum(short_name) == checksum ) break;
+    }
+    if( !short_name_char(short_name[0]) ) return 0;
+
+    /* Stored last fragment first, so the one furthest back is the last */
+    FATlfnbuff lfn;
+    fatLfnReset(&lfn);
+    int i;
+    for( i = count; i > 0; i--) {
+        uint8_t fragment[FAT_DIRECTORY_SIZE];
+        memcpy(fragment, dir->fragments[dir->num_fragments - i], FAT_DIRECTORY_SIZE);
+        fragment[0] = i | (i == count ? FAT_LFN_LAST : 0);
+        fatLfnAdd(&lfn, fragment);
+    }
+    for( i = 0; i < (count - 1) * FAT_LFN_CHARS; i++) {
+        if( !lfn.chars[i] || lfn.chars[i] == 0xFFFF ) return 0; //name ended before the last fragment
+    }
+
+    size_t length = fatLfnTake(&lfn, short_name, name);
+    const char * start = name;
+    while( *start == '.' || *start == ' ' ) start++;
+    if( !length || (isalnum((unsigned char) *start) && toupper((unsigned char) *start) != short_name[0]) ) return 0; //short names start like their long name
+    *first = short_name[0];
+    return length;
+}
+
+/* Rebuild the clusters of a deleted file: its first cluster and the free ones after it */
+void rebuild(recover_state * state, lost_file * lost) {
+    uint32_t cluster_size = fatGetClusterSize(&state->image->boot);
+    uint32_t num_clusters = state->image->table.num_entries;
+    uint32_t needed = (lost->size + cluster_size - 1) / cluster_size;
+
+    if( !lost->size ) {
+        lost->status = "empty";
+        return;
+    }
+    if( lost->first_cluster < 2 || lost->first_cluster >= num_clusters ) {
+        lost->status = "no valid first cluster";
+        return;
+    }
+    if( state->used[lost->first_cluster] ) {
+        lost->status = "overwritten";
+        return;
+    }
+
+    lost->extents = xmalloc(needed * sizeof(FATextent));
+    uint32_t cluster;
+    for( cluster = lost->first_cluster; lost->clusters < needed && cluster < num_clusters; cluster++) {
+        if( state->used[cluster] ) continue;
+        state->used[cluster] = 1; //not handed to another file or carved
+        lost->clusters++;
+
+        FATextent * last = lost->num_extents ? &lost->extents[lost->num_extents - 1] : NULL;
+        if( last && last->start + last->length == cluster ) {
+            last->length++;
+        } else {
+            lost->extents[lost->num_extents].start = cluster;
+            lost->extents[lost->num_extents].length = 1;
+            lost->num_extents++;
+        }
+    }
+    lost->status = lost->clusters < needed ? "partial" : "recoverable";
+}
+
+/* Look through raw entries of one directory region, rebuilding deleted files and queueing
+ * subdirectories, deleted ones too while their first cluster is intact. Entries are named by
+ * their long names where those can be read back
+ * Returns 0 at the end of directory marker, 1 otherwise */
+int scan_entries(recover_state * state, uint8_t * entries, uint32_t count, lost_dir * dir, ADTlinkedlist * subdirs) {
+    uint32_t i;
+    for( i = 0; i < count; i++) {
+        uint8_t * raw = entries + i * FAT_DIRECTORY_SIZE;
+        if( raw[0] == FAT_ENTRY_END ) return 0;
+        if( raw[11] == FAT_ATTR_LFN ) {
+            add_fragment(dir, raw);
+            continue;
+        }
+
+        FATdirectory entry;
+        fatUnpackDirectory(&entry, raw);
+        char name[FAT_LFN_NAME_SIZE];
+        FATdirectory shown = entry;
+        size_t long_length = 0;
+        if( raw[0] == FAT_ENTRY_DELETED ) {
+            shown.filename[0] = '_'; //first letter is lost unless the long name gives it back
+            long_length = deleted_long_name(dir, raw, name, shown.filename);
+        } else {
+            long_length = live_long_name(dir, raw, name);
+        }
+        dir->num_fragments = 0;
+
+        if( (entry.attributes & FAT_ATTR_VOLUME) || raw[0] == '.' ) continue;
+        int deleted = dir->deleted || raw[0] == FAT_ENTRY_DELETED;
+
+        if( !long_length ) fatFormatName(&shown, name);
+        char * path = xmalloc(strlen(dir->path) + 1 + strlen(name) + 1);
+        sprintf(path, "%s/%s", dir->path, name);
+
+        if( entry.attributes & FAT_ATTR_DIRECTORY ) {
+            uint16_t cluster = entry.first_logical_cluster;
+            if( cluster > 1 && (!deleted || looks_like_directory(state, cluster)) ) {
+                if( deleted ) state->used[cluster] = 1; //read once, never carved
+                lost_dir * sub = xmalloc(sizeof(lost_dir));
+                sub->cluster = cluster;
+                sub->path = path;
+                sub->deleted = deleted;
+                sub->num_fragments = 0;
+
+                ADTlinkednode * node = xmalloc(sizeof(ADTlinkednode));
+                adtInitiateLinkedNode(node, sub);
+                adtAddEndLinkedNode(subdirs, node);
+            } else {
+                xfree(path);
+            }
+        } else if( deleted ) {
+            if( state->num_lost == state->lost_capacity ) {
+                state->lost_capacity = state->lost_capacity ? state->lost_capacity * 2 : 16;
+                state->lost = xrealloc(state->lost, state->lost_capacity * sizeof(lost_file));
+            }
+            lost_file * lost = &state->lost[state->num_lost++];
+            memset(lost, 0, sizeof(lost_file));
+            lost->path = path;
+            lost->first_cluster = entry.first_logical_cluster;
+            lost->size = entry.file_size;
+            rebuild(state, lost); //in walk order, earlier entries get the clusters first
+        } else {
+            xfree(path);
+        }
+    }
+    return 1;
+}
+
+/* Breadth first walk of every directory, live and deleted, for deleted files */
+void find_lost(recover_state * state) {
+    FATmapped * image = state->image;
+    ADTlinkedlist subdirs;
+    adtInitiateLinkedList(&subdirs);
+
+    lost_dir root;
+    memset(&root, 0, sizeof(lost_dir));
+    root.path = "";
+    uint32_t root_entries = image->boot.max_root_entries;
+    if( fatGetRootStart(&image->boot) + root_entries * FAT_DIRECTORY_SIZE <= image->volume_size ) {
+        scan_entries(state, fatMappedRoot(image), root_entries, &root, &subdirs);
+    }
+
+    uint32_t entries_per_cluster = fatGetClusterSize(&image->boot) / FAT_DIRECTORY_SIZE;
+    while( subdirs.num > 0 ) {
+        ADTlinkednode * node = adtPopLinkedNode(&subdirs, 0);
+        lost_dir * dir = node->val;
+
+        uint16_t cluster = dir->cluster;
+        uint32_t followed = 0;
+        uint8_t * entries;
+        while( cluster <= 0xFF0 && (entries = cluster_data(image, cluster)) && followed++ < image->table.num_entries ) {
+            STATS_ADD(clusters_followed, 1);
+            if( !scan_entries(state, entries, entries_per_cluster, dir, &subdirs) ) break;
+            if( !dir->deleted ) {
+                cluster = fatTableGet(&image->table, cluster);
+            } else if( !(cluster = next_directory_cluster(state, cluster)) ) {
+                printf("Warning: The rest of deleted directory %s cannot be found, only %u clusters of it were scanned\n", dir->path, followed);
+            }
+        }
+
+        xfree(dir->path);
+        xfree(dir);
+        xfree(node);
+    }
+}
+
+/* Worker thread, marks free clusters starting with a known header */
+void * head_worker(void * arg) {
+    recover_state * state = arg;
+    uint32_t num_clusters = state->image->table.num_entries;
+
+    while( 1 ) {
+        pthread_mutex_lock(&state->lock);
+        uint32_t block = state->next_block++;
+        pthread_mutex_unlock(&state->lock);
+        if( block >= state->num_blocks ) break;
+
+        uint32_t cluster;
+        uint32_t end = 2 + (block + 1) * CARVE_BLOCK < num_clusters ? 2 + (block + 1) * CARVE_BLOCK : num_clusters;
+        for( cluster = 2 + block * CARVE_BLOCK; cluster < end; cluster++) {
+            if( state->used[cluster] ) continue;
+            uint8_t * data = cluster_data(state->image, cluster);
+            if( !data ) continue;
+
+            int t;
+            for( t = 0; t < NUM_CARVE_TYPES; t++) {
+                if( !memcmp(data, carve_types[t].header, carve_types[t].header_length) ) {
+                    state->heads[cluster] = t + 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void found_end(void * arg, int pattern, uint64_t offset) {
+    (void) pattern; //each set holds only the footer of its own type
+    carved_file * carved = arg;
+    const carve_type * type = &carve_types[carved->type];
+    if( carved->ended && !type->last ) return;
+    carved->size = offset + type->footer_length + type->trailer;
+    carved->ended = 1;
+}
+
+/* Worker thread, searches each carved run for the end marker of its type */
+void * end_worker(void * arg) {
+    recover_state * state = arg;
+    uint32_t cluster_size = fatGetClusterSize(&state->image->boot);
+
+    while( 1 ) {
+        pthread_mutex_lock(&state->lock);
+        int index = state->next_carved++;
+        pthread_mutex_unlock(&state->lock);
+        if( index >= state->num_carved ) break;
+
+        carved_file * carved = &state->carved[index];
+        uint32_t run_size = carved->length * cluster_size;
+        //clusters of a run follow each other in the mapping, and were all filled by the header scan
+        matchScan(&state->footers[carved->type], cluster_data(state->image, carved->start), run_size, 0, found_end, carved);
+        if( !carved->ended || carved->size > run_size ) carved->size = run_size;
+    }
+
+    return NULL;
+}
+
+/* Run worker on threads and wait for all of them */
+void run_workers(int num_threads, void * (*worker)(void *), recover_state * state) {
+    pthread_t * threads = xmalloc(num_threads * sizeof(pthread_t));
+    int i;
+    for( i = 0; i < num_threads; i++) {
+        if( pthread_create(&threads[i], NULL, worker, state) ) {
+            perror("FATAL: Creating thread failed: ");
+            abort();
+        }
+    }
+    for( i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    xfree(threads);
+}
+
+/* Find files in free clusters, headers and ends are searched for in parallel */
+void carve(recover_state * state, int num_threads) {
+    uint32_t num_clusters = state->image->table.num_entries;
+    state->heads = xmalloc(num_clusters);
+    memset(state->heads, 0, num_clusters);
+    state->num_blocks = (num_clusters - 2 + CARVE_BLOCK - 1) / CARVE_BLOCK;
+    run_workers(num_threads, head_worker, state);
+
+    /* A file may run until the next header or used cluster */
+    uint32_t cluster;
+    for( cluster = 2; cluster < num_clusters; cluster++) {
+        if( !state->heads[cluster] ) continue;
+
+        uint32_t length = 1;
+        while( cluster + length < num_clusters && !state->used[cluster + length] && !state->heads[cluster + length]
+                && cluster_data(state->image, cluster + length) ) length++;
+
+        if( state->num_carved == state->carved_capacity ) {
+            state->carved_capacity = state->carved_capacity ? state->carved_capacity * 2 : 16;
+            state->carved = xrealloc(state->carved, state->carved_capacity * sizeof(carved_file));
+        }
+        carved_file * carved = &state->carved[state->num_carved++];
+        memset(carved, 0, sizeof(carved_file));
+        carved->type = state->heads[cluster] - 1;
+        carved->start = cluster;
+        carved->length = length;
+    }
+
+    run_workers(num_threads, end_worker, state);
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    const char * out_dir = NULL;
+    int carving = 1;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while( (opt = getopt(argc, argv, "nj:d:")) != -1 ) {
+        switch( opt ) {
+            case 'n': carving = 0; break;
+            case 'j': num_threads = atoi(optarg); break;
+            case 'd': out_dir = optarg; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( argc - optind != 1 || num_threads < 1 ) {
+        usage();
+        return 1;
+    }
+
+    FATmapped * image = fatMapImage(argv[optind]);
+    if( !image ) return 3;
+
+    recover_state state;
+    memset(&state, 0, sizeof(recover_state));
+    state.image = image;
+    pthread_mutex_init(&state.lock, NULL);
+
+    /* Clusters in use now can hold nothing lost */
+    statsPhase(STATS_PHASE_FAT);
+    uint32_t num_clusters = image->table.num_entries;
+    state.used = xmalloc(num_clusters);
+    uint32_t cluster;
+    for( cluster = 0; cluster < num_clusters; cluster++) state.used[cluster] = cluster < 2 || fatTableGet(&image->table, cluster) != 0;
+
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    find_lost(&state);
+
+    statsPhase(STATS_PHASE_COPY);
+    int t;
+    for( t = 0; t < NUM_CARVE_TYPES; t++) {
+        const uint8_t * footer = (const uint8_t *) carve_types[t].footer;
+        matchInit(&state.footers[t], &footer, &carve_types[t].footer_length, 1);
+    }
+    if( carving ) carve(&state, num_threads);
+    statsPhase(STATS_PHASE_OTHER);
+
+    printf("Deleted files\n==================\n");
+    int i;
+    for( i = 0; i < state.num_lost; i++) {
+        lost_file * lost = &state.lost[i];
+        printf("%s %u bytes, cluster %u, %s", lost->path, lost->size, lost->first_cluster, lost->status);
+        if( lost->extents && lost->clusters * fatGetClusterSize(&image->boot) < lost->size ) {
+            printf(", %u of %u clusters", lost->clusters, (lost->size + fatGetClusterSize(&image->boot) - 1) / fatGetClusterSize(&image->boot));
+        }
+        printf("\n");
+    }
+    if( carving ) {
+        printf("\nCarved files\n==================\n");
+        for( i = 0; i < state.num_carved; i++) {
+            carved_file * carved = &state.carved[i];
+            printf("%s %u bytes, cluster %u%s\n", carve_types[carved->type].extension, carved->size, carved->start,
+                   carved->ended ? "" : ", no end found");
+        }
+    }
+
+    /* Everything found goes out through one bulk extraction */
+    if( out_dir ) {
+        if( mkdir(out_dir, 0755) && errno != EEXIST ) {
+            perror("Aborting: Failed to create output directory");
+            return 3;
+        }
+
+        FILE * disk = fatOpenImage(argv[optind], "r");
+        if( !disk ) {
+            perror("Opening disk failed:");
+            return 3;
+        }
+        FATboot * boot = fatGetBootInfo(disk);
+        FATextract * extract = fatCreateExtract(boot, 0);
+        uint32_t cluster_size = fatGetClusterSize(boot);
+
+        for( i = 0; i < state.num_lost; i++) {
+            lost_file * lost = &state.lost[i];
+            if( !lost->extents && lost->size ) continue; //empty files are still created
+            const char * name = strrchr(lost->path, '/') + 1;
+            char * host_path = xmalloc(strlen(out_dir) + 16 + strlen(name));
+            sprintf(host_path, "%s/%u-%s", out_dir, lost->first_cluster, name); //first cluster keeps names apart
+            fatExtractAdd(extract, host_path, lost->extents, lost->num_extents, lost->size);
+            lost->extents = NULL; //owned by the extraction now
+            xfree(host_path);
+        }
+        for( i = 0; i < state.num_carved; i++) {
+            carved_file * carved = &state.carved[i];
+            FATextent * extent = xmalloc(sizeof(FATextent));
+            extent->start = carved->start;
+            extent->length = (carved->size + cluster_size - 1) / cluster_size;
+            char * host_path = xmalloc(strlen(out_dir) + 32);
+            sprintf(host_path, "%s/carved-%u.%s", out_dir, carved->start, carve_types[carved->type].extension);
+            fatExtractAdd(extract, host_path, extent, 1, carved->size);
+            xfree(host_path);
+        }
+
+        statsPhase(STATS_PHASE_COPY);
+        FATio * io = fatOpenImageIo(disk, 0);
+        uint32_t written = fatRunExtract(extract, io);
+        fatCloseIo(io);
+        statsPhase(STATS_PHASE_OTHER);
+
+        for( i = 0; i < (int) extract->num_files; i++) {
+            FATextractfile * file = extract->files[i];
+            if( file->available < file->size ) {
+                printf("Warning partly recovered file %s, only %u of %u bytes retrieved!\n", file->host_path, file->available, file->size);
+            }
+        }
+        printf("\nRecovered %u of %u files, %llu bytes\n", written, extract->num_files, (unsigned long long) extract->bytes);
+
+        fatFreeExtract(extract);
+        xfree(boot);
+        fclose(disk);
+    }
+
+    for( i = 0; i < state.num_lost; i++) {
+        xfree(state.lost[i].path);
+        if( state.lost[i].extents ) xfree(state.lost[i].extents);
+    }
+    if( state.lost ) xfree(state.lost);
+    if( state.carved ) xfree(state.carved);
+    if( state.heads ) xfree(state.heads);
+    for( t = 0; t < NUM_CARVE_TYPES; t++) matchFree(&state.footers[t]);
+    xfree(state.used);
+    pthread_mutex_destroy(&state.lock);
+    fatUnmapImage(image);
+
+    return 0;
+}
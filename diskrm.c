@@ -0,0 +1,227 @@
+/* Implementation of diskrm. Removes files and directories from the file system
+ *
+ * Every component of a path may be a glob, matched ignoring case against long and
+ * short names. Directories are only removed with -r, together with everything below
+ * them. Each directory is loaded and written back once however many paths touch it,
+ * freed chains are cleared in the FAT held in memory, and only the FAT sectors that changed
+ * are written, to every FAT copy.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fnmatch.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATdir.h"
+#include "FATlfn.h"
+#include "ADTlinkedlist.h"
+#include "FAToverlay.h"
+#include "utils.h"
+
+/* A directory loaded during the run */
+typedef struct rm_dir{
+    FATdirbuff * dir;
+    int dirty; //entries were deleted
+    int removed; //its clusters were freed, never written back
+}rm_dir;
+
+/* Everything one run works on */
+struct rm_state{
+    FILE * disk;
+    FATboot * boot;
+    FATtable * table;
+    ADTlinkedlist dirs; //rm_dir values
+    int recursive;
+    int skipped; //a directory matched without -r
+    uint32_t removed_entries;
+    uint32_t freed_clusters;
+} state;
+
+
+/* Directory starting at cluster, loaded on first use */
+rm_dir * get_dir(uint16_t cluster) {
+    ADTlinkednode * link;
+    for( link = state.dirs.head; link; link = link->next) {
+        rm_dir * loaded = link->val;
+        if( loaded->dir->first_cluster == cluster ) return loaded;
+    }
+
+    rm_dir * loaded = xmalloc(sizeof(rm_dir));
+    loaded->dir = fatLoadDirectory(state.disk, state.boot, state.table, cluster);
+    loaded->dirty = 0;
+    loaded->removed = 0;
+
+    ADTlinkednode * node = xmalloc(sizeof(ADTlinkednode));
+    adtInitiateLinkedNode(node, loaded);
+    adtAddEndLinkedNode(&state.dirs, node);
+    return loaded;
+}
+
+/* Free everything below the directory at cluster, its own chain is left to the caller
+ * Clusters below 2 are refused, 0 would load the root directory and free all of it */
+void remove_tree(uint16_t cluster) {
+    if( cluster < 2 ) return; //corrupt entry, there is nothing below it to free
+    rm_dir * doomed = get_dir(cluster);
+    if( doomed->removed ) return; //already gone, or a loop in a corrupt image
+    doomed->removed = 1;
+
+    FATdirectory entry;
+    uint32_t i;
+    for( i = 0; i < doomed->dir->num_entries; i++) {
+        uint8_t * raw = fatDirectoryEntry(doomed->dir, i);
+        if( raw[0] == FAT_ENTRY_END ) break;
+        fatUnpackDirectory(&entry, raw);
+        if( !fatIsVisibleEntry(&entry) ) continue;
+
+        if( entry.attributes & FAT_ATTR_DIRECTORY ) remove_tree(entry.first_logical_cluster);
+        state.freed_clusters += fatFreeChain(state.table, entry.first_logical_cluster);
+        state.removed_entries++;
+    }
+}
+
+/* Remove the entry at index of parent, shown is its path for messages
+ * Returns 0 if it was removed, -1 if it was skipped */
+int remove_entry(rm_dir * parent, uint32_t index, const char * shown) {
+    FATdirectory entry;
+    fatUnpackDirectory(&entry, fatDirectoryEntry(parent->dir, index));
+
+    if( entry.attributes & FAT_ATTR_DIRECTORY ) {
+        if( !state.recursive ) {
+            printf("Warning: Skipping %s, it is a directory (use -r)\n", shown);
+            state.skipped = 1;
+            return -1;
+        }
+        remove_tree(entry.first_logical_cluster);
+    }
+
+    state.freed_clusters += fatFreeChain(state.table, entry.first_logical_cluster);
+    state.removed_entries++;
+    fatDeleteLongEntry(parent->dir, index); //with its long name
+    parent->dirty = 1;
+    return 0;
+}
+
+/* Remove everything in parent matching the remaining path components
+ * Returns the number of entries matched */
+uint32_t remove_path(rm_dir * parent, char ** components, int num, const char * shown) {
+    FATlfnbuff lfn;
+    char long_name[FAT_LFN_NAME_SIZE];
+    char short_name[13];
+    FATdirectory entry;
+    uint32_t matched = 0;
+    if( parent->removed ) return 0; //went with an earlier path
+    fatLfnReset(&lfn);
+
+    uint32_t i;
+    for( i = 0; i < parent->dir->num_entries; i++) {
+        uint8_t * raw = fatDirectoryEntry(parent->dir, i);
+        if( raw[0] == FAT_ENTRY_END ) break;
+        if( fatLfnAdd(&lfn, raw) ) continue;
+
+        size_t length = fatLfnTake(&lfn, raw, long_name);
+        fatUnpackDirectory(&entry, raw);
+        if( !fatIsVisibleEntry(&entry) ) continue;
+
+        fatFormatName(&entry, short_name);
+        if( fnmatch(components[0], short_name, FNM_CASEFOLD)
+                && (!length || fnmatch(components[0], long_name, FNM_CASEFOLD)) ) continue;
+
+        if( num > 1 ) { //an inner component, only directories lead anywhere
+            if( (entry.attributes & FAT_ATTR_DIRECTORY) && entry.first_logical_cluster > 1 ) { //0 would be the root
+                matched += remove_path(get_dir(entry.first_logical_cluster), components + 1, num - 1, shown);
+            }
+        } else {
+            matched++;
+            remove_entry(parent, i, shown);
+        }
+    }
+    return matched;
+}
+
+void usage() {
+    printf("Usage: ./diskrm [-r] <disk> <path> [path ...]\n");
+    printf("  Paths are absolute, like /SUB/FILE.TXT, and may use * ? [] in any component\n");
+    printf("  -r removes directories and everything below them\n");
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    int opt;
+    while( (opt = getopt(argc, argv, "r")) != -1 ) {
+        switch( opt ) {
+            case 'r': state.recursive = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( argc - optind < 2 ) {
+        usage();
+        return 1;
+    }
+
+    state.disk = fatOpenImage(argv[optind],"r+");
+    if( !state.disk) {
+        perror("Aborting: Opening disk failed:");
+        return 3;
+    }
+
+    state.boot = fatGetBootInfo(state.disk);
+    state.table = fatLoadTable(state.disk, state.boot);
+    adtInitiateLinkedList(&state.dirs);
+
+    statsPhase(STATS_PHASE_TRAVERSAL);
+    int missing = 0;
+    int p;
+    for( p = optind + 1; p < argc; p++) {
+        char * path_copy = xmalloc(strlen(argv[p]) + 1);
+        strcpy(path_copy, argv[p]);
+
+        char ** components = xmalloc((strlen(argv[p]) / 2 + 1) * sizeof(char *)); //at most every other character starts one
+        int num = 0;
+        char * save = NULL;
+        char * part;
+        for( part = strtok_r(path_copy, "/", &save); part; part = strtok_r(NULL, "/", &save)) components[num++] = part;
+
+        if( !num ) {
+            printf("Warning: Skipping %s, the root directory cannot be removed\n", argv[p]);
+            missing = 1;
+        } else if( !remove_path(get_dir(0), components, num, argv[p]) ) {
+            printf("Warning: No match for %s\n", argv[p]);
+            missing = 1;
+        }
+
+        xfree(components);
+        xfree(path_copy);
+    }
+    statsPhase(STATS_PHASE_OTHER);
+
+    /* Directories first, then the fat, so a failed write never leaves entries pointing at free clusters */
+    while( state.dirs.num > 0 ) {
+        ADTlinkednode * node = adtPopLinkedNode(&state.dirs, 0);
+        rm_dir * loaded = node->val;
+        if( loaded->dirty && !loaded->removed ) fatWriteDirectory(state.disk, state.boot, loaded->dir);
+        fatFreeDirectory(loaded->dir);
+        xfree(loaded);
+        xfree(node);
+    }
+    fatTableFlush(state.disk, state.boot, state.table);
+
+    printf("Removed %u entries, freed %u clusters, %u clusters free\n", state.removed_entries, state.freed_clusters, fatTableFreeCount(state.table));
+
+    fatFreeTable(state.table);
+    xfree(state.boot);
+    fclose(state.disk);
+
+    return missing || state.skipped ? 7 : 0;
+}
@@ -0,0 +1,112 @@
+/* Implementation of disktrim. Releases host storage behind free clusters, or makes a sparse copy
+ * of an image that moves only allocated data.
+ *
+ * Note: trimming zeros free clusters, deleted files can no longer be recovered afterwards.
+*/
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "FATheaders.h"
+#include "FATtable.h"
+#include "FATsparse.h"
+#include "FAToverlay.h"
+#include "FATpack.h"
+#include "utils.h"
+
+void usage() {
+    printf("Usage: ./disktrim [-n] <disk> \n");
+    printf("       ./disktrim -c <disk> <copy> \n");
+    printf("  -n only reports how much could be released\n");
+    printf("  -c copies only allocated data into a new sparse image\n");
+}
+
+/* Bytes actually stored on the host for a file */
+uint64_t stored_bytes(FILE * file) {
+    struct stat stats;
+    fflush(file);
+    if( fstat(fileno(file), &stats) ) return 0;
+    return (uint64_t) stats.st_blocks * 512; //st_blocks is always in 512 byte units
+}
+
+int main(int argc, char * argv[]) {
+
+    statsArgs(&argc, argv);
+
+    int report_only = 0;
+    int copy = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "nc")) != -1 ) {
+        switch( opt ) {
+            case 'n': report_only = 1; break;
+            case 'c': copy = 1; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if( argc - optind != (copy ? 2 : 1) || (copy && report_only) ) {
+        usage();
+        return 1;
+    }
+
+    if( fatIsOverlay(argv[optind]) ) { //holes in the delta would not free base blocks
+        printf("Aborting: %s is an overlay, commit it first\n", argv[optind]);
+        return 3;
+    }
+    if( fatIsPack(argv[optind]) ) {
+        printf("Aborting: %s is compressed, unpack it first\n", argv[optind]);
+        return 3;
+    }
+
+    FILE * disk = fopen(argv[optind], (copy || report_only) ? "r" : "r+");
+    if( !disk) {
+        perror("Opening disk failed:");
+        printf("Name given %s\n",argv[optind]);
+        return 3;
+    }
+
+    FATboot * boot = fatGetBootInfo(disk);
+    FATtable * table = fatLoadTable(disk, boot);
+
+    FATrangelist * allocated = fatAllocatedRanges(boot, table);
+    FATrangelist * data = fatDataRanges(disk);
+    FATrangelist * live = fatIntersectRanges(allocated, data);
+
+    printf("Allocated bytes: %u\n", fatRangesSize(allocated));
+    printf("Bytes holding data on host: %u\n", fatRangesSize(data));
+    printf("Bytes stored on host: %llu\n", (unsigned long long) stored_bytes(disk));
+    printf("Free bytes holding data: %u\n", fatRangesSize(data) - fatRangesSize(live));
+
+    statsPhase(STATS_PHASE_COPY);
+    if( copy ) {
+        FILE * out = fopen(argv[optind + 1], "w");
+        if( !out ) {
+            perror("Aborting: Opening copy failed:");
+            return 3;
+        }
+        uint32_t copied = fatSparseCopy(disk, boot, table, out);
+        printf("Copied %u bytes to %s, stored %llu bytes\n", copied, argv[optind + 1], (unsigned long long) stored_bytes(out));
+        fclose(out);
+    } else if( !report_only ) {
+        uint32_t released = fatPunchFreeClusters(disk, boot, table);
+        printf("Released %u bytes, stored %llu bytes\n", released, (unsigned long long) stored_bytes(disk));
+    }
+
+    statsPhase(STATS_PHASE_OTHER);
+    fatFreeRanges(live);
+    fatFreeRanges(data);
+    fatFreeRanges(allocated);
+    fatFreeTable(table);
+    xfree(boot);
+    fclose(disk);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+/* Searching data for several byte patterns
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "match.h"
+#include "utils.h"
+
+/* Copy num patterns of the given lengths, none empty, into set. Free with matchFree */
+void matchInit(MATCHset * set, const uint8_t * const * patterns, const size_t * lengths, int num) {
+    set->patterns = xmalloc(num * sizeof(uint8_t *));
+    set->lengths = xmalloc(num * sizeof(size_t));
+    set->num = num;
+    set->max_length = 0;
+
+    int i;
+    for( i = 0; i < num; i++) {
+        set->patterns[i] = xmalloc(lengths[i]);
+        memcpy(set->patterns[i], patterns[i], lengths[i]);
+        set->lengths[i] = lengths[i];
+        if( lengths[i] > set->max_length ) set->max_length = lengths[i];
+    }
+}
+
+/* Free the patterns of a set */
+void matchFree(MATCHset * set) {
+    int i;
+    for( i = 0; i < set->num; i++) xfree(set->patterns[i]);
+    xfree(set->patterns);
+    xfree(set->lengths);
+}
+
+/* Returns 1 if the pattern sits at data, whose first and last bytes already agree */
+static int verify(const uint8_t * data, const uint8_t * pattern, size_t length) {
+    return length <= 2 || !memcmp(data + 1, pattern + 1, length - 2);
+}
+
+/* Call found for every match of one pattern inside data */
+static void scan_pattern(MATCHset * set, int p, const uint8_t * data, size_t size, uint64_t base, MATCHfn found, void * arg) {
+    const uint8_t * pattern = set->patterns[p];
+    size_t length = set->lengths[p];
+    if( size < length ) return;
+    size_t last = size - length; //last position a match can start at
+    size_t i = 0;
+
+#ifdef __SSE2__
+    /* 16 candidate starts at a time, the first and last bytes must both agree */
+    __m128i first_byte = _mm_set1_epi8(pattern[0]);
+    __m128i last_byte = _mm_set1_epi8(pattern[length - 1]);
+    for( ; i + 16 <= last + 1; i += 16) {
+        __m128i starts = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i ends = _mm_loadu_si128((const __m128i *) (data + i + length - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(starts, first_byte), _mm_cmpeq_epi8(ends, last_byte)));
+        while( mask ) {
+            int bit = __builtin_ctz(mask);
+            if( verify(data + i + bit, pattern, length) ) found(arg, p, base + i + bit);
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for( ; i <= last; i++) { //what is left over, or everything without SSE2
+        const uint8_t * at = memchr(data + i, pattern[0], last + 1 - i);
+        if( !at ) break;
+        i = at - data;
+        if( data[i + length - 1] == pattern[length - 1] && verify(at, pattern, length) ) found(arg, p, base + i);
+    }
+}
+
+/* Call found for every match that lies entirely inside size bytes of data, base is
+ * the stream offset of data */
+void matchScan(MATCHset * set, const uint8_t * data, size_t size, uint64_t base, MATCHfn found, void * arg) {
+    int p;
+    for( p = 0; p < set->num; p++) scan_pattern(set, p, data, size, base, found, arg);
+}
+
+/* Start searching a stream with set, found is called for every match once */
+void matchStreamInit(MATCHstream * stream, MATCHset * set, MATCHfn found, void * arg) {
+    stream->set = set;
+    stream->carry = xmalloc(set->max_length);
+    stream->carried = 0;
+    stream->join = xmalloc(set->max_length * 2);
+    stream->offset = 0;
+    stream->found = found;
+    stream->arg = arg;
+}
+
+/* Passes on matches in the join that start in the carry and end past it, the others
+ * were found before or will be found in the piece itself */
+static void found_in_join(void * arg, int pattern, uint64_t offset) {
+    MATCHstream * stream = arg;
+    uint64_t carry_end = stream->offset;
+    if( offset < carry_end && offset + stream->set->lengths[pattern] > carry_end ) stream->found(stream->arg, pattern, offset);
+}
+
+/* Search the next size bytes of the stream */
+void matchFeed(MATCHstream * stream, const void * data, size_t size) {
+    size_t keep = stream->set->max_length - 1;
+
+    if( stream->carried && size ) { //matches across the boundary
+        size_t head = size < keep ? size : keep;
+        memcpy(stream->join, stream->carry, stream->carried);
+        memcpy(stream->join + stream->carried, data, head);
+        matchScan(stream->set, stream->join, stream->carried + head, stream->offset - stream->carried, found_in_join, stream);
+    }
+    matchScan(stream->set, data, size, stream->offset, stream->found, stream->arg);
+
+    /* Keep the last bytes, some of which may still come from the old carry */
+    if( size >= keep ) {
+        memcpy(stream->carry, (const uint8_t *) data + size - keep, keep);
+        stream->carried = keep;
+    } else {
+        size_t old = stream->carried + size > keep ? keep - size : stream->carried;
+        memmove(stream->carry, stream->carry + stream->carried - old, old);
+        memcpy(stream->carry + old, data, size);
+        stream->carried = old + size;
+    }
+    stream->offset += size;
+}
+
+/* Free a stream */
+void matchStreamFree(MATCHstream * stream) {
+    xfree(stream->carry);
+    xfree(stream->join);
+}
@@ -0,0 +1,56 @@
+/* Searching data for several byte patterns
+ * Each pattern is found by comparing its first and last bytes against 16 positions at
+ * once with SSE2, only positions where both agree are compared in full. Data is taken in
+ * pieces so cluster chains can be searched without copying; the last bytes of a piece are
+ * kept so matches that start in one piece and end in the next are still found.
+ */
+
+#ifndef _MATCH_H
+#define _MATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Patterns searched for together */
+typedef struct MATCHset{
+    uint8_t ** patterns;
+    size_t * lengths;
+    int num;
+    size_t max_length;
+}MATCHset;
+
+/* Called for every match, offset is where it starts in the stream */
+typedef void (*MATCHfn)(void * arg, int pattern, uint64_t offset);
+
+/* Streaming state of one search */
+typedef struct MATCHstream{
+    MATCHset * set;
+    uint8_t * carry; //last max_length - 1 bytes seen
+    size_t carried;
+    uint8_t * join; //carry followed by the start of the next piece
+    uint64_t offset; //of the next piece in the stream
+    MATCHfn found;
+    void * arg;
+}MATCHstream;
+
+
+/* Copy num patterns of the given lengths, none empty, into set. Free with matchFree */
+void matchInit(MATCHset * set, const uint8_t * const * patterns, const size_t * lengths, int num);
+
+/* Free the patterns of a set */
+void matchFree(MATCHset * set);
+
+/* Call found for every match that lies entirely inside size bytes of data, base is
+ * the stream offset of data */
+void matchScan(MATCHset * set, const uint8_t * data, size_t size, uint64_t base, MATCHfn found, void * arg);
+
+/* Start searching a stream with set, found is called for every match once */
+void matchStreamInit(MATCHstream * stream, MATCHset * set, MATCHfn found, void * arg);
+
+/* Search the next size bytes of the stream */
+void matchFeed(MATCHstream * stream, const void * data, size_t size);
+
+/* Free a stream */
+void matchStreamFree(MATCHstream * stream);
+
+#endif
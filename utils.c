@@ -5,16 +5,30 @@
  * insufficient for a library
  * */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
 
 #include "utils.h"
 
+FATstats fatStats;
+int fatStatsMode = 0;
+
+static int current_phase = STATS_PHASE_OTHER;
+static double phase_start;
+
 /* Malloc wrapper to track allocations. Aborts program on failure */
 void * xmalloc(size_t size) {
     assert(size);
     void * tmp = malloc(size);
+    STATS_ADD(allocations, 1);
+    STATS_ADD(allocated_bytes, size);
     if(!tmp) {
         perror("FATAL: A malloc failed: ");
         abort();
@@ -26,6 +40,8 @@ void * xmalloc(size_t size) {
 void * xrealloc(void * ptr, size_t size) {
     assert(size);
     void * tmp = realloc(ptr,size);
+    STATS_ADD(allocations, 1);
+    STATS_ADD(allocated_bytes, size);
     if(!tmp) {
         perror("FATAL: A realloc failed: ");
         abort();
@@ -41,6 +57,7 @@ void xfree(void * ptr) {
 
 /* Wrapper for xseek, aborts if seek fails */
 void xfseek(FILE *stream, long offset, int whence) {
+    STATS_ADD(seeks, 1);
     if( fseek(stream,offset, whence) ) {
         perror("FATAL: a seek failed: ");
         abort();
@@ -55,6 +72,8 @@ size_t xfread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
         perror("FATAL: Read got no bytes:");
         abort();
     }
+    STATS_ADD(reads, 1);
+    STATS_ADD(read_bytes, read * size);
     return read;
 }
 
@@ -65,5 +84,155 @@ size_t xfwrite(void *ptr, size_t size, size_t nmemb, FILE *stream) {
         perror("FATAL: Writing wrote no bytes:");
         abort();
     }
+    STATS_ADD(writes, 1);
+    STATS_ADD(write_bytes, read * size);
     return read;
 }
+
+/* Wrapper for pread, aborts unless all bytes are read */
+size_t xpread(int fd, void *ptr, size_t size, off_t offset) {
+    size_t done = 0;
+    while( done < size ) { //pread may return short counts
+        ssize_t got = pread(fd, (char *) ptr + done, size - done, offset + done);
+        if( got <= 0 ) {
+            perror("FATAL: Read got no bytes:");
+            abort();
+        }
+        done += got;
+        STATS_ADD(reads, 1);
+    }
+    STATS_ADD(read_bytes, size);
+    return done;
+}
+
+/* Wrapper for pwrite, aborts unless all bytes are written */
+size_t xpwrite(int fd, const void *ptr, size_t size, off_t offset) {
+    size_t done = 0;
+    while( done < size ) {
+        ssize_t put = pwrite(fd, (const char *) ptr + done, size - done, offset + done);
+        if( put <= 0 ) {
+            perror("FATAL: Writing wrote no bytes:");
+            abort();
+        }
+        done += put;
+        STATS_ADD(writes, 1);
+    }
+    STATS_ADD(write_bytes, size);
+    return done;
+}
+
+/* Copy size bytes from one file to another inside the kernel with copy_file_range, or with
+ * pread and pwrite where it is not supported. Aborts unless all bytes are copied */
+size_t xcopyrange(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t size) {
+    size_t done = 0;
+    while( done < size ) {
+        loff_t in = in_offset + done;
+        loff_t out = out_offset + done;
+        ssize_t copied = copy_file_range(in_fd, &in, out_fd, &out, size - done, 0);
+        if( copied <= 0 ) break; //not supported here, or nothing more to read
+        done += copied;
+        STATS_ADD(writes, 1);
+    }
+    STATS_ADD(write_bytes, done);
+
+    if( done < size ) { //through user space for whatever is left
+        uint8_t * buff = xmalloc(size - done);
+        xpread(in_fd, buff, size - done, in_offset + done);
+        xpwrite(out_fd, buff, size - done, out_offset + done);
+        xfree(buff);
+    }
+    return size;
+}
+
+/* Read a positive number from the environment, fallback if unset or invalid */
+uint32_t envNumber(const char * name, uint32_t fallback) {
+    const char * value = getenv(name);
+    if( !value || !*value ) return fallback;
+    char * end;
+    long number = strtol(value, &end, 10);
+    if( *end || number < 0 ) return fallback;
+    return number;
+}
+
+/* Seconds on a clock that never goes back */
+static double stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print the report when the program exits */
+static void stats_at_exit() {
+    statsReport(stderr);
+}
+
+/* Take --stats or --stats=json out of the arguments and turn counting on
+ * The report is printed to stderr when the program exits */
+void statsArgs(int * argc, char * argv[]) {
+    int i;
+    int kept = 1;
+    for( i = 1; i < *argc; i++) {
+        if( !strcmp(argv[i], "--stats") ) {
+            fatStatsMode = 1;
+        } else if( !strcmp(argv[i], "--stats=json") ) {
+            fatStatsMode = 2;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    *argc = kept;
+    argv[kept] = NULL;
+
+    if( fatStatsMode ) {
+        memset(&fatStats, 0, sizeof(FATstats));
+        phase_start = stats_now();
+        atexit(stats_at_exit);
+    }
+}
+
+/* Charge time from now on to phase. Returns the phase that was running so it can be restored */
+int statsPhase(int phase) {
+    int previous = current_phase;
+    if( !fatStatsMode || phase == previous ) return previous;
+
+    double now = stats_now();
+    fatStats.phase_seconds[previous] += now - phase_start;
+    phase_start = now;
+    current_phase = phase;
+    return previous;
+}
+
+/* Print all counters, as text or json depending on the flag given */
+void statsReport(FILE * stream) {
+    if( !fatStatsMode ) return;
+    double now = stats_now(); //charge the running phase up to now
+    fatStats.phase_seconds[current_phase] += now - phase_start;
+    phase_start = now;
+
+    const char * names[] = {"seeks", "reads", "read_bytes", "writes", "write_bytes", "fat_lookups", "entries_decoded",
+                            "clusters_followed", "allocations", "allocated_bytes", "cache_hits", "cache_misses", "queued_io",
+                            "fat_sectors_loaded"};
+    uint64_t values[] = {fatStats.seeks, fatStats.reads, fatStats.read_bytes, fatStats.writes, fatStats.write_bytes,
+                         fatStats.fat_lookups, fatStats.entries_decoded, fatStats.clusters_followed, fatStats.allocations,
+                         fatStats.allocated_bytes, fatStats.cache_hits, fatStats.cache_misses, fatStats.queued_io,
+                         fatStats.fat_sectors_loaded};
+    const char * phases[] = {"other", "boot", "fat", "traversal", "copy"};
+    int num = sizeof(values) / sizeof(values[0]);
+    int i;
+
+    if( fatStatsMode == 2 ) {
+        fprintf(stream, "{");
+        for( i = 0; i < num; i++) fprintf(stream, "\"%s\": %llu, ", names[i], (unsigned long long) values[i]);
+        fprintf(stream, "\"phase_seconds\": {");
+        for( i = 0; i < STATS_PHASES; i++) fprintf(stream, "%s\"%s\": %.6f", i ? ", " : "", phases[i], fatStats.phase_seconds[i]);
+        fprintf(stream, "}}\n");
+        return;
+    }
+
+    fprintf(stream, "==================\nStats\n");
+#ifdef FAT_NO_STATS
+    fprintf(stream, "Counters were compiled out with FAT_NO_STATS, only phase times are kept\n");
+#endif
+    for( i = 0; i < num; i++) fprintf(stream, "%-18s %llu\n", names[i], (unsigned long long) values[i]);
+    for( i = 0; i < STATS_PHASES; i++) fprintf(stream, "%-18s %.6f s\n", phases[i], fatStats.phase_seconds[i]);
+}
@@ -9,6 +9,50 @@
 #define _UTILS_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Phases that time is charged to, each moment belongs to exactly one */
+enum {
+    STATS_PHASE_OTHER,
+    STATS_PHASE_BOOT, //boot sector parse
+    STATS_PHASE_FAT, //reading and scanning the fat
+    STATS_PHASE_TRAVERSAL, //walking directories
+    STATS_PHASE_COPY, //moving file data
+    STATS_PHASES
+};
+
+/* Counters reported by --stats */
+typedef struct FATstats{
+    uint64_t seeks;
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t fat_lookups;
+    uint64_t entries_decoded;
+    uint64_t clusters_followed;
+    uint64_t allocations;
+    uint64_t allocated_bytes;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t queued_io;
+    uint64_t fat_sectors_loaded;
+    double phase_seconds[STATS_PHASES];
+}FATstats;
+
+extern FATstats fatStats;
+extern int fatStatsMode; //0 off, 1 text, 2 json
+
+/* Count into a stats field. A single untaken branch when --stats is not given,
+ * nothing at all when built with -DFAT_NO_STATS */
+#ifdef FAT_NO_STATS
+#define STATS_ADD(field, n) ((void) 0)
+#else
+#define STATS_ADD(field, n) do { \
+        if( __builtin_expect(fatStatsMode, 0) ) __atomic_fetch_add(&fatStats.field, (n), __ATOMIC_RELAXED); \
+    } while(0)
+#endif
 
 /* Malloc wrapper to track allocations. Aborts program on failure */
 void * xmalloc(size_t size);
@@ -28,4 +72,27 @@ size_t xfread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 /* Wrapper for fwrite, aborts if write does not write expected tokens */
 size_t xfwrite(void *ptr, size_t size, size_t nmemb, FILE *stream);
 
+/* Wrapper for pread, aborts unless all bytes are read */
+size_t xpread(int fd, void *ptr, size_t size, off_t offset);
+
+/* Wrapper for pwrite, aborts unless all bytes are written */
+size_t xpwrite(int fd, const void *ptr, size_t size, off_t offset);
+
+/* Copy size bytes from one file to another inside the kernel with copy_file_range, or with
+ * pread and pwrite where it is not supported. Aborts unless all bytes are copied */
+size_t xcopyrange(int in_fd, off_t in_offset, int out_fd, off_t out_offset, size_t size);
+
+/* Read a positive number from the environment, fallback if unset or invalid */
+uint32_t envNumber(const char * name, uint32_t fallback);
+
+/* Take --stats or --stats=json out of the arguments and turn counting on
+ * The report is printed to stderr when the program exits */
+void statsArgs(int * argc, char * argv[]);
+
+/* Charge time from now on to phase. Returns the phase that was running so it can be restored */
+int statsPhase(int phase);
+
+/* Print all counters, as text or json depending on the flag given */
+void statsReport(FILE * stream);
+
 #endif
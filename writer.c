@@ -0,0 +1,151 @@
+/* Buffered output without stdio
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "writer.h"
+#include "utils.h"
+
+/* Start writing to fd through a buffer of size bytes, 0 for the default */
+void writerInit(WRITERbuff * writer, int fd, size_t size) {
+    writer->fd = fd;
+    writer->size = size ? size : WRITER_DEFAULT_SIZE;
+    writer->buff = xmalloc(writer->size);
+    writer->used = 0;
+}
+
+/* Write out everything buffered */
+void writerFlush(WRITERbuff * writer) {
+    size_t done = 0;
+    while( done < writer->used ) { //write may return short counts
+        ssize_t put = write(writer->fd, writer->buff + done, writer->used - done);
+        if( put <= 0 ) {
+            perror("FATAL: Writing wrote no bytes:");
+            abort();
+        }
+        done += put;
+        STATS_ADD(writes, 1);
+    }
+    STATS_ADD(write_bytes, writer->used);
+    writer->used = 0;
+}
+
+/* Flush and free the buffer */
+void writerFree(WRITERbuff * writer) {
+    writerFlush(writer);
+    xfree(writer->buff);
+}
+
+/* Add length bytes */
+void writerBytes(WRITERbuff * writer, const void * data, size_t length) {
+    const char * bytes = data;
+    while( length > 0 ) {
+        if( writer->used == writer->size ) writerFlush(writer);
+        size_t piece = writer->size - writer->used < length ? writer->size - writer->used : length;
+        memcpy(writer->buff + writer->used, bytes, piece);
+        writer->used += piece;
+        bytes += piece;
+        length -= piece;
+    }
+}
+
+/* Add a null terminated string */
+void writerString(WRITERbuff * writer, const char * string) {
+    writerBytes(writer, string, strlen(string));
+}
+
+/* Add one character */
+void writerChar(WRITERbuff * writer, char c) {
+    if( writer->used == writer->size ) writerFlush(writer);
+    writer->buff[writer->used++] = c;
+}
+
+/* Add a number in decimal, padded on the left with pad up to width characters */
+void writerUnsigned(WRITERbuff * writer, uint64_t value, int width, char pad) {
+    char digits[24];
+    int start = sizeof(digits);
+
+    do { //digits from the end
+        digits[--start] = '0' + value % 10;
+        value /= 10;
+    } while( value );
+
+    while( (int) sizeof(digits) - start < width && start > 0 ) digits[--start] = pad;
+    writerBytes(writer, digits + start, sizeof(digits) - start);
+}
+
+/* Length of the valid UTF-8 sequence starting a multi byte character at bytes, 0 if it is not one
+ * Overlong forms, surrogates and code points past U+10FFFF are not valid */
+static size_t utf8_length(const uint8_t * bytes, size_t left) {
+    size_t length;
+    uint8_t min = 0x80, max = 0xBF; //allowed range of the second byte
+    if( bytes[0] >= 0xC2 && bytes[0] <= 0xDF ) length = 2;
+    else if( bytes[0] >= 0xE0 && bytes[0] <= 0xEF ) length = 3;
+    else if( bytes[0] >= 0xF0 && bytes[0] <= 0xF4 ) length = 4;
+    else return 0;
+
+    if( bytes[0] == 0xE0 ) min = 0xA0;
+    else if( bytes[0] == 0xED ) max = 0x9F;
+    else if( bytes[0] == 0xF0 ) min = 0x90;
+    else if( bytes[0] == 0xF4 ) max = 0x8F;
+
+    if( left < length || bytes[1] < min || bytes[1] > max ) return 0;
+    size_t i;
+    for( i = 2; i < length; i++) {
+        if( (bytes[i] & 0xC0) != 0x80 ) return 0;
+    }
+    return length;
+}
+
+/* Add length bytes as a JSON string with quotes. Valid UTF-8 is written as it is, other bytes
+ * above 0x7F are taken as Latin-1 so the output is always valid JSON */
+void writerJsonString(WRITERbuff * writer, const void * data, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t * bytes = data;
+
+    writerChar(writer, '"');
+    size_t i;
+    for( i = 0; i < length; i++) {
+        uint8_t c = bytes[i];
+        size_t sequence;
+        if( c == '"' || c == '\\' ) {
+            writerChar(writer, '\\');
+            writerChar(writer, c);
+        } else if( c >= 0x80 && (sequence = utf8_length(bytes + i, length - i)) ) {
+            writerBytes(writer, bytes + i, sequence);
+            i += sequence - 1;
+        } else if( c < 0x20 || c > 0x7E ) { //control and stray bytes as \u00XX
+            char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F]};
+            writerBytes(writer, escape, 6);
+        } else {
+            writerChar(writer, c);
+        }
+    }
+    writerChar(writer, '"');
+}
+
+/* Add length bytes as a CSV field, quoted only if it holds a comma, quote or line break */
+void writerCsvField(WRITERbuff * writer, const void * data, size_t length) {
+    const char * bytes = data;
+    size_t i;
+    int quote = 0;
+    for( i = 0; i < length; i++) {
+        if( bytes[i] == ',' || bytes[i] == '"' || bytes[i] == '\n' || bytes[i] == '\r' ) quote = 1;
+    }
+
+    if( !quote ) {
+        writerBytes(writer, data, length);
+        return;
+    }
+
+    writerChar(writer, '"');
+    for( i = 0; i < length; i++) {
+        if( bytes[i] == '"' ) writerChar(writer, '"'); //quotes are doubled
+        writerChar(writer, bytes[i]);
+    }
+    writerChar(writer, '"');
+}
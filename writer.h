@@ -0,0 +1,53 @@
+/* Buffered output without stdio
+ * Text is gathered in one large buffer that is reused and handed to write() only when
+ * it fills up or is flushed. Numbers are formatted by hand, and strings can be escaped
+ * for JSON or quoted for CSV on the way in. Failed writes abort like the x wrappers.
+ */
+
+#ifndef _WRITER_H
+#define _WRITER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Buffer size when none is given */
+#define WRITER_DEFAULT_SIZE (256 * 1024)
+
+/* Output buffer over one file descriptor */
+typedef struct WRITERbuff{
+    int fd;
+    char * buff;
+    size_t size;
+    size_t used;
+}WRITERbuff;
+
+
+/* Start writing to fd through a buffer of size bytes, 0 for the default */
+void writerInit(WRITERbuff * writer, int fd, size_t size);
+
+/* Write out everything buffered */
+void writerFlush(WRITERbuff * writer);
+
+/* Flush and free the buffer */
+void writerFree(WRITERbuff * writer);
+
+/* Add length bytes */
+void writerBytes(WRITERbuff * writer, const void * data, size_t length);
+
+/* Add a null terminated string */
+void writerString(WRITERbuff * writer, const char * string);
+
+/* Add one character */
+void writerChar(WRITERbuff * writer, char c);
+
+/* Add a number in decimal, padded on the left with pad up to width characters */
+void writerUnsigned(WRITERbuff * writer, uint64_t value, int width, char pad);
+
+/* Add length bytes as a JSON string with quotes. Valid UTF-8 is written as it is, other bytes
+ * above 0x7F are taken as Latin-1 so the output is always valid JSON */
+void writerJsonString(WRITERbuff * writer, const void * data, size_t length);
+
+/* Add length bytes as a CSV field, quoted only if it holds a comma, quote or line break */
+void writerCsvField(WRITERbuff * writer, const void * data, size_t length);
+
+#endif